@@ -30,6 +30,7 @@
 # elif defined _MSC_VER
 #   include "strlcpy.h"
 #   define access(p,m)       _access((p),(m))
+#   define stricmp(s1,s2)    _stricmp((s1),(s2))
 # endif
 #elif defined __linux__
 # include <alloca.h>
@@ -39,6 +40,10 @@
 # include <sys/stat.h>
 # include <sys/time.h>
 #endif
+
+#if defined __linux__ || defined __FreeBSD__ || defined __APPLE__
+#  define stricmp(s1,s2)  strcasecmp((s1),(s2))
+#endif
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -138,7 +143,11 @@ static void usage(const char *invalid_option)
   printf("Usage: bmprofile [options] [filename]\n\n"
          "Options:\n"
          "-f=value  Font size to use (value must be 8 or larger).\n"
-         "-h        This help.\n\n"
+         "-h        This help.\n"
+         "-l=path   Replay a recording from a file, instead of capturing the samples\n"
+         "          from a debug probe; replay is at full speed.\n"
+         "-L=path   Like -l, but replay in real time.\n"
+         "-r=path   Record the raw SWO data to a file, for replay with -l or -L.\n\n"
          "filename  Path to the ELF file to profile (must contain debug info).\n"
          "-v        Show version information.\n");
 }
@@ -174,6 +183,7 @@ enum {
   TAB_CONFIGURATION,
   TAB_PROFILE,
   TAB_STATUS,
+  TAB_COMPARE,
   /* --- */
   TAB_COUNT
 };
@@ -186,6 +196,19 @@ enum {
 enum {
   VIEW_TOP,
   VIEW_FUNCTION,
+  VIEW_HISTORY,                 /**< function profile over time */
+  VIEW_DIFF,                    /**< difference between two profiles */
+};
+
+enum {
+  BINSET_FUNCTIONS,             /**< bins in the sample map for the functions */
+  BINSET_LINES,                 /**< bins for the source lines in the source view */
+};
+
+enum {
+  DIFF_LIVE,                    /**< the current profile */
+  DIFF_HISTORY,                 /**< a time range from the history */
+  DIFF_FILE,                    /**< a profile loaded from a CSV file */
 };
 
 typedef struct tagFUNCTIONINFO {
@@ -206,6 +229,59 @@ typedef struct tagLINEINFO {
   char percentage[16];          /**< pre-formatted string */
 } LINEINFO;
 
+#define HISTORY_WINDOWS 240     /* number of time windows kept in the history */
+#define HISTORY_ENTRIES 16384   /* number of function counts kept in the history (all windows together) */
+#define HISTORY_ROWS    32      /* max. number of functions in the history view */
+
+typedef struct tagHISTORYENTRY {
+  unsigned func;                /**< index in the function list */
+  unsigned count;               /**< number of samples in the window */
+} HISTORYENTRY;
+
+typedef struct tagHISTORYWINDOW {
+  unsigned long seqnr;          /**< sequence number of the window (since the last reset) */
+  unsigned total;               /**< all samples in the window (including the samples outside the functions) */
+  unsigned first;               /**< index of the first entry in the entry pool */
+  unsigned numentries;          /**< functions with samples in the window, sorted on function index */
+} HISTORYWINDOW;
+
+typedef struct tagPROFILEHISTORY {
+  HISTORYWINDOW *windows;       /**< ring buffer with the windows */
+  unsigned head;                /**< index of the oldest window in the ring */
+  unsigned count;               /**< number of windows in the ring */
+  HISTORYENTRY *entries;        /**< ring buffer with the function counts of all windows */
+  unsigned maxentries;          /**< size of the entry pool */
+  unsigned entryhead;           /**< index of the first entry of the oldest window */
+  unsigned numentries;          /**< number of entries in use (all windows) */
+  unsigned long seqnr;          /**< sequence number for the next window */
+  unsigned long mark;           /**< sequence number of the first window after the mark (0 = no mark) */
+  unsigned *prevcounts;         /**< function counts at the end of the previous window */
+  unsigned prevtotal;           /**< total samples at the end of the previous window */
+  unsigned numfunctions;        /**< size of the prevcounts array */
+  unsigned rows[HISTORY_ROWS];  /**< functions shown in the history view (index in the function list) */
+  unsigned numrows;
+} PROFILEHISTORY;
+
+typedef struct tagNAMEDCOUNT {
+  const char *name;
+  unsigned count;
+} NAMEDCOUNT;
+
+typedef struct tagPROFILESNAPSHOT {
+  NAMEDCOUNT *list;             /**< sample counts per function name, sorted on name (names are allocated) */
+  unsigned count;
+  unsigned total;
+  char path[_MAX_PATH];         /**< file that the profile was loaded from */
+} PROFILESNAPSHOT;
+
+typedef struct tagDIFFINFO {
+  const char *name;             /**< function name (allocated) */
+  double ratio_a;               /**< fraction of the samples in the baseline */
+  double ratio_b;               /**< fraction of the samples in the compared profile */
+  double bar;                   /**< scaled difference (-1.0 to 1.0) */
+  char percentage[16];          /**< pre-formatted string */
+} DIFFINFO;
+
 typedef struct tagAPPSTATE {
   int curstate;                 /**< current state */
   int probe;                    /**< selected debug probe (index) */
@@ -243,9 +319,12 @@ typedef struct tagAPPSTATE {
   int accumulate;               /**< accumulate all samples since start of a run */
   char ELFfile[_MAX_PATH];      /**< ELF file for symbol/address look-up */
   char ParamFile[_MAX_PATH];    /**< debug parameters for the ELF file */
-  unsigned long code_base;      /**< low address of code range of the ELF file */
-  unsigned long code_top;       /**< top address */
-  unsigned *sample_map;         /**< array containing sample counts */
+  char loopbackfile[_MAX_PATH]; /**< recording to replay (instead of capturing from a probe) */
+  bool loopback_realtime;       /**< whether to replay the recording in real time (instead of full speed) */
+  char recordfile[_MAX_PATH];   /**< file to record the raw SWO data in */
+  SAMPLEMAP *sample_map;        /**< sample counts, for the executable segments of the ELF file */
+  bool funcbins;                /**< whether the function bins are set in the sample map */
+  bool linebins;                /**< whether the source line bins are set in the sample map */
   unsigned sample_unknown;      /**< samples that fall outside the ELF file address range */
   unsigned total_samples;       /**< total number of samples collected */
   unsigned overflow;            /**< number of overflow packets reported */
@@ -257,6 +336,11 @@ typedef struct tagAPPSTATE {
   uint32_t source_addr_low;     /**< source view: lowest code address of interest */
   uint32_t source_addr_high;    /**< source view: highest code address of interest */
   unsigned *addr2line;          /**< source view: address-to-linenumber map */
+  PROFILEHISTORY history;       /**< history view: function profile per refresh interval */
+  int diff_source[2];           /**< difference view: source of the baseline and the compared profile */
+  PROFILESNAPSHOT diff_file[2]; /**< difference view: profiles loaded from file */
+  DIFFINFO *diffrows;           /**< difference view: rows sorted on the difference */
+  unsigned numdiffrows;
   bool help_popup;              /**< whether "help" popup is active */
 } APPSTATE;
 
@@ -394,6 +478,83 @@ static void probe_set_options(APPSTATE *state)
   }
 }
 
+static void profile_clearsource(APPSTATE *state)
+{
+  assert(state != NULL);
+  if (state->sourcelines != NULL) {
+    for (unsigned idx = 0; idx < state->numlines; idx++) {
+      assert(state->sourcelines[idx].text != NULL);
+      if (state->sourcelines[idx].text != NULL)
+        free((void*)state->sourcelines[idx].text);
+    }
+    free((void*)state->sourcelines);
+    state->sourcelines = NULL;
+  }
+  if (state->addr2line != NULL) {
+    free((void*)state->addr2line);
+    state->addr2line = NULL;
+  }
+  state->numlines = 0;
+  state->source_addr_low = 0;
+  state->source_addr_high = 0;
+  if (state->linebins && state->sample_map != NULL)
+    samplemap_setbins(state->sample_map, BINSET_LINES, NULL, 0, 0);
+  state->linebins = false;
+}
+
+/** history_window() returns the window at the given position in the ring,
+ *  where position 0 is the oldest window.
+ */
+static const HISTORYWINDOW *history_window(const PROFILEHISTORY *history, unsigned pos)
+{
+  assert(history != NULL && history->windows != NULL);
+  assert(pos < history->count);
+  return &history->windows[(history->head + pos) % HISTORY_WINDOWS];
+}
+
+/** history_entry() returns an entry of a window, where the entries of all
+ *  windows are in a shared ring buffer.
+ */
+static const HISTORYENTRY *history_entry(const PROFILEHISTORY *history, const HISTORYWINDOW *window, unsigned idx)
+{
+  assert(history != NULL && history->entries != NULL && history->maxentries > 0);
+  assert(window != NULL && idx < window->numentries);
+  return &history->entries[(window->first + idx) % history->maxentries];
+}
+
+static unsigned history_count(const PROFILEHISTORY *history, const HISTORYWINDOW *window, unsigned func)
+{
+  assert(window != NULL);
+  /* the entries are sorted on function index */
+  unsigned low = 0, high = window->numentries;
+  while (low < high) {
+    unsigned mid = low + (high - low) / 2;
+    const HISTORYENTRY *entry = history_entry(history, window, mid);
+    if (entry->func == func)
+      return entry->count;
+    if (entry->func < func)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return 0;
+}
+
+static struct nk_color heat_colour(double ratio)
+{
+  /* blend from the background colour to yellow, with more contrast at the
+     low end (a function that takes 10% of the time should stand out) */
+  struct nk_color low = COLOUR_BG0;
+  struct nk_color high = COLOUR_BG_YELLOW;
+  if (ratio > 1.0)
+    ratio = 1.0;
+  double f = ratio * (2.0 - ratio);
+  f = f * (2.0 - f);
+  return nk_rgb((int)(low.r + (high.r - low.r) * f),
+                (int)(low.g + (high.g - low.g) * f),
+                (int)(low.b + (high.b - low.b) * f));
+}
+
 static void profile_graph(struct nk_context *ctx, const char *id, APPSTATE *state, float rowheight, nk_flags widget_flags)
 {
   assert(ctx != NULL);
@@ -441,6 +602,84 @@ static void profile_graph(struct nk_context *ctx, const char *id, APPSTATE *stat
         nk_layout_row_end(ctx);
         linecount += 1;
       }
+    } else if (state->view == VIEW_HISTORY) {
+      const PROFILEHISTORY *history = &state->history;
+      float stripwidth = 2 * graphwidth;
+      float cellwidth = stripwidth / HISTORY_WINDOWS;
+      if (history->numrows == 0) {
+        nk_layout_row_dynamic(ctx, rowheight, 1);
+        nk_label_colored(ctx, "No history yet, start a profiling run", NK_TEXT_LEFT, COLOUR_FG_YELLOW);
+      }
+      for (unsigned idx = 0; idx < history->numrows; idx++) {
+        unsigned fidx = history->rows[idx];
+        assert(fidx < state->numfunctions);
+        nk_layout_row_begin(ctx, NK_STATIC, rowheight, 2);
+        if (lineheight < 0.1) {
+          struct nk_rect rcline = nk_layout_widget_bounds(ctx);
+          lineheight = rcline.h;
+        }
+        /* draw the heat strip, the most recent window is at the right */
+        nk_layout_row_push(ctx, stripwidth);
+        struct nk_rect rc = nk_widget_bounds(ctx);
+        nk_spacing(ctx, 1);
+        for (unsigned pos = 0; pos < history->count; pos++) {
+          const HISTORYWINDOW *window = history_window(history, pos);
+          unsigned count = history_count(history, window, fidx);
+          if (count == 0 || window->total == 0)
+            continue;
+          struct nk_rect rccell = nk_rect(rc.x + rc.w - (history->count - pos) * cellwidth, rc.y, cellwidth, rc.h);
+          nk_fill_rect(&win->buffer, rccell, 0.0f, heat_colour((double)count / window->total));
+        }
+        if (history->mark > 0 && history->count > 0) {
+          const HISTORYWINDOW *oldest = history_window(history, 0);
+          if (history->mark >= oldest->seqnr && history->mark <= oldest->seqnr + history->count) {
+            float x = rc.x + rc.w - (oldest->seqnr + history->count - history->mark) * cellwidth;
+            nk_stroke_line(&win->buffer, x, rc.y, x, rc.y + rc.h, 1.0f, COLOUR_FG_CYAN);
+          }
+        }
+        /* print function name (get the width for the text first) */
+        const char *name = state->functionlist[fidx].name;
+        int len = strlen(name);
+        assert(font != NULL && font->width != NULL);
+        int textwidth = (int)font->width(font->userdata, font->height, name, len) + 10;
+        nk_layout_row_push(ctx, (float)textwidth);
+        nk_text(ctx, name, len, NK_TEXT_LEFT);
+        nk_layout_row_end(ctx);
+        linecount += 1;
+      }
+    } else if (state->view == VIEW_DIFF) {
+      if (state->numdiffrows == 0) {
+        nk_layout_row_dynamic(ctx, rowheight, 1);
+        nk_label_colored(ctx, "No profiles to compare, set a mark or load a profile (Compare panel)", NK_TEXT_LEFT, COLOUR_FG_YELLOW);
+      }
+      for (unsigned idx = 0; idx < state->numdiffrows; idx++) {
+        const DIFFINFO *diff = &state->diffrows[idx];
+        nk_layout_row_begin(ctx, NK_STATIC, rowheight, 2);
+        if (lineheight < 0.1) {
+          struct nk_rect rcline = nk_layout_widget_bounds(ctx);
+          lineheight = rcline.h;
+        }
+        /* draw bar from the centre: to the right (red) for an increase, to
+           the left (green) for a decrease */
+        nk_layout_row_push(ctx, graphwidth);
+        struct nk_rect rc = nk_widget_bounds(ctx);
+        assert(diff->bar >= -1.0 && diff->bar <= 1.0);
+        float half = rc.w / 2;
+        if (diff->bar >= 0.0)
+          nk_fill_rect(&win->buffer, nk_rect(rc.x + half, rc.y, half * diff->bar, rc.h), 0.0f, COLOUR_BG_RED);
+        else
+          nk_fill_rect(&win->buffer, nk_rect(rc.x + half * (1.0 + diff->bar), rc.y, -half * diff->bar, rc.h), 0.0f, COLOUR_BG_GREEN);
+        nk_label(ctx, diff->percentage, NK_TEXT_RIGHT);
+        /* print function name (get the width for the text first) */
+        const char *name = diff->name;
+        int len = strlen(name);
+        assert(font != NULL && font->width != NULL);
+        int textwidth = (int)font->width(font->userdata, font->height, name, len) + 10;
+        nk_layout_row_push(ctx, (float)textwidth);
+        nk_text(ctx, name, len, NK_TEXT_LEFT);
+        nk_layout_row_end(ctx);
+        linecount += 1;
+      }
     } else {
       assert(state->view == VIEW_FUNCTION);
       for (unsigned idx = 0; idx < state->numlines; idx++) {
@@ -481,26 +720,16 @@ static void profile_graph(struct nk_context *ctx, const char *id, APPSTATE *stat
     unsigned xscroll, yscroll;
     nk_group_get_scroll(ctx, id, &xscroll, &yscroll);
     int row = (int)(((mouse->pos.y - rcwidget.y) + yscroll) / lineheight);
-    if (row < linecount) {
+    if (row < linecount && (state->view == VIEW_HISTORY || state->view == VIEW_DIFF)) {
+      if (state->view == VIEW_HISTORY)
+        nk_tooltip(ctx, "Time runs from left to right, one column per refresh interval");
+      else
+        nk_tooltip(ctx, "Red: more samples than in the baseline; green: fewer samples");
+    } else if (row < linecount) {
       if (nk_input_mouse_clicked(&ctx->input, NK_BUTTON_LEFT, rcwidget)) {
         /* clear source-code data (regardless of whether moving into the source
            code view or returning to the function list */
-        if (state->sourcelines != NULL) {
-          for (unsigned idx = 0; idx < state->numlines; idx++) {
-            assert(state->sourcelines[idx].text != NULL);
-            if (state->sourcelines[idx].text != NULL)
-              free((void*)state->sourcelines[idx].text);
-          }
-          free((void*)state->sourcelines);
-          state->sourcelines = NULL;
-        }
-        if (state->addr2line != NULL) {
-          free((void*)state->addr2line);
-          state->addr2line = NULL;
-        }
-        state->numlines = 0;
-        state->source_addr_low = 0;
-        state->source_addr_high = 0;
+        profile_clearsource(state);
         /* toggle view */
         state->view = (state->view == VIEW_TOP) ? VIEW_FUNCTION : VIEW_TOP;
         if (state->view == VIEW_FUNCTION) {
@@ -513,7 +742,7 @@ static void profile_graph(struct nk_context *ctx, const char *id, APPSTATE *stat
           uint32_t addr_range = (state->source_addr_high - state->source_addr_low) / ADDRESS_ALIGN;
           assert(addr_range > 0);
           if (addr_range > 0)
-            state->addr2line = (unsigned*)malloc(addr_range * sizeof(unsigned));
+            state->addr2line = (unsigned*)calloc(addr_range, sizeof(unsigned));
           if (state->addr2line != NULL) {
             for (uint32_t addr = state->source_addr_low; addr < state->source_addr_high; addr += ADDRESS_ALIGN) {
               const DWARF_LINEENTRY *lineinfo = dwarf_line_from_address(&dwarf_linetable, addr);
@@ -586,11 +815,13 @@ static void profile_graph(struct nk_context *ctx, const char *id, APPSTATE *stat
   }
 }
 
+static void history_resync(PROFILEHISTORY *history);
+
 static void profile_reset(APPSTATE *state, bool samples)
 {
-  if (samples && state->sample_map != NULL) {
-    unsigned count = (state->code_top - state->code_base) / ADDRESS_ALIGN + 1;
-    memset(state->sample_map, 0, count * sizeof(unsigned));
+  if (samples) {
+    samplemap_clear(state->sample_map);
+    history_resync(&state->history);
   }
 
   if (state->view == VIEW_TOP && state->functionlist != NULL) {
@@ -612,106 +843,662 @@ static void profile_reset(APPSTATE *state, bool samples)
   }
 }
 
-static bool profile_save(const char *filename, APPSTATE *state)
+/** profile_functionbins() returns the address ranges of all functions, as an
+ *  allocated array that is sorted on address and without overlaps. When
+ *  functions overlap, the first one gets the overlapping range.
+ */
+static SAMPLEBIN *profile_functionbins(const APPSTATE *state, unsigned *count)
 {
-  FILE *fp = fopen(filename, "wt");
-  if (fp == NULL)
+  assert(state != NULL);
+  assert(count != NULL);
+  *count = 0;
+  if (state->functionlist == NULL || state->numfunctions == 0)
+    return NULL;
+  SAMPLEBIN *bins = (SAMPLEBIN*)malloc(state->numfunctions * sizeof(SAMPLEBIN));
+  if (bins == NULL)
+    return NULL;
+  unsigned num = 0;
+  for (unsigned idx = 0; idx < state->numfunctions; idx++) {
+    uint32_t low = state->functionlist[idx].addr_low;
+    uint32_t high = state->functionlist[idx].addr_high;
+    if (num > 0 && bins[num - 1].high > low)
+      low = bins[num - 1].high; /* overlapping functions: the first one gets the samples */
+    if (low >= high)
+      continue;
+    bins[num].low = low;
+    bins[num].high = high;
+    bins[num].id = idx;
+    num += 1;
+  }
+  *count = num;
+  return bins;
+}
+
+typedef struct tagPROFILEENTRY {
+  uint32_t address;
+  unsigned samples;
+  int func;                     /**< index in the function list, -1 if outside any function */
+  int line;                     /**< source line number, 0 if unknown */
+  int file;                     /**< index in the file table, -1 if unknown */
+} PROFILEENTRY;
+
+typedef struct tagPROFILETABLE {
+  PROFILEENTRY *entries;        /**< all sampled addresses, sorted on address */
+  unsigned count;
+  unsigned total;               /**< sum of the samples in all entries */
+  const char **paths;           /**< the DWARF file table, as an array */
+  unsigned numpaths;
+} PROFILETABLE;
+
+static void profile_table_clear(PROFILETABLE *table)
+{
+  assert(table != NULL);
+  if (table->entries != NULL)
+    free((void*)table->entries);
+  if (table->paths != NULL)
+    free((void*)table->paths);
+  memset(table, 0, sizeof(PROFILETABLE));
+}
+
+static const char *profile_table_path(const PROFILETABLE *table, int file)
+{
+  assert(table != NULL);
+  if (file < 0 || (unsigned)file >= table->numpaths || table->paths[file] == NULL)
+    return "";
+  return table->paths[file];
+}
+
+/** profile_table_build() collects the sampled addresses with their function,
+ *  source file and line number. The sample map returns the addresses in
+ *  ascending order, and the function ranges and the DWARF line table are
+ *  sorted on address too, so the look-ups are a single merge pass (instead of
+ *  a search per address).
+ */
+static bool profile_table_build(const APPSTATE *state, PROFILETABLE *table)
+{
+  assert(state != NULL);
+  assert(table != NULL);
+  memset(table, 0, sizeof(PROFILETABLE));
+  if (state->sample_map == NULL)
+    return true;
+
+  /* file table, for direct indexing */
+  for (const DWARF_PATHLIST *file = dwarf_filetable.next; file != NULL; file = file->next)
+    table->numpaths += 1;
+  if (table->numpaths > 0) {
+    table->paths = (const char**)malloc(table->numpaths * sizeof(char*));
+    if (table->paths == NULL) {
+      profile_table_clear(table);
+      return false;
+    }
+    unsigned idx = 0;
+    for (const DWARF_PATHLIST *file = dwarf_filetable.next; file != NULL; file = file->next)
+      table->paths[idx++] = file->name;
+  }
+
+  unsigned size = 0;
+  SAMPLEITER iter = { 0, 0 };
+  uint32_t addr;
+  unsigned samples;
+  while (samplemap_next(state->sample_map, &iter, &addr, &samples))
+    size += 1;
+  if (size == 0)
+    return true;
+  table->entries = (PROFILEENTRY*)malloc(size * sizeof(PROFILEENTRY));
+  unsigned numbins;
+  SAMPLEBIN *bins = profile_functionbins(state, &numbins);
+  if (table->entries == NULL || (bins == NULL && state->numfunctions > 0)) {
+    if (bins != NULL)
+      free((void*)bins);
+    profile_table_clear(table);
     return false;
+  }
+
+  const DWARF_LINEENTRY *lines = dwarf_linetable.table;
+  unsigned numlines = (lines != NULL) ? dwarf_linetable.entries : 0;
+  unsigned bin_idx = 0;
+  unsigned line_idx = 0;
+  iter.segment = 0;
+  iter.index = 0;
+  while (table->count < size && samplemap_next(state->sample_map, &iter, &addr, &samples)) {
+    PROFILEENTRY *entry = &table->entries[table->count++];
+    entry->address = addr;
+    entry->samples = samples;
+    entry->func = -1;
+    entry->line = 0;
+    entry->file = -1;
+    table->total += samples;
+    while (bin_idx < numbins && bins[bin_idx].high <= addr)
+      bin_idx++;
+    if (bin_idx >= numbins || addr < bins[bin_idx].low)
+      continue; /* not in any function */
+    entry->func = bins[bin_idx].id;
+    /* same match as dwarf_line_from_address(): the last entry at or below the
+       address, but the first one when there are several at that address */
+    while (line_idx + 1 < numlines && lines[line_idx + 1].address <= addr)
+      line_idx++;
+    if (line_idx < numlines && lines[line_idx].address <= addr) {
+      unsigned idx = line_idx;
+      while (idx > 0 && lines[idx - 1].address >= addr)
+        idx--;
+      entry->line = lines[idx].line;
+      entry->file = lines[idx].fileindex;
+    }
+  }
+
+  if (bins != NULL)
+    free((void*)bins);
+  return true;
+}
+
+static bool profile_save_csv(FILE *fp, const APPSTATE *state, const PROFILETABLE *table)
+{
   fprintf(fp, "Address,Samples,Function,Source,Line\n");
-  if (state->sample_map != NULL) {
-    unsigned *sample_map = state->sample_map;
-    unsigned count = (state->code_top - state->code_base) / ADDRESS_ALIGN;
-    uint32_t code_base = state->code_base;
-    for (unsigned idx = 0; idx < count; idx++) {
-      if (sample_map[idx] == 0)
-        continue;
-      uint32_t addr = Index2Address(idx, code_base);
-
-      /* get function (binary search) */
-      FUNCTIONINFO *functionlist = state->functionlist;
-      unsigned numfunctions = state->numfunctions;
-      unsigned func_idx;
-      unsigned low = 0;
-      unsigned high = numfunctions - 1;
-      while (low <= high) {
-        func_idx = low + (high - low) / 2;
-        if (functionlist[func_idx].addr_low <= addr && addr < functionlist[func_idx].addr_high)
-          break;
-        assert(functionlist[func_idx].addr_low < addr || functionlist[func_idx].addr_high >= addr);
-        if (functionlist[func_idx].addr_low < addr)
-          low = func_idx + 1;
-        else
-          high = func_idx - 1;
-      }
+  for (unsigned idx = 0; idx < table->count; idx++) {
+    const PROFILEENTRY *entry = &table->entries[idx];
+    const char *name = (entry->func >= 0) ? state->functionlist[entry->func].name : "";
+    fprintf(fp, "%lx,%u,\"%s\",\"%s\",%d\n", (unsigned long)entry->address, entry->samples,
+            name, profile_table_path(table, entry->file), entry->line);
+  }
+  return true;
+}
 
-      const char *name = "";
-      int linenr = 0;
-      const char *path = "";
-      if (addr >= functionlist[func_idx].addr_low && addr < functionlist[func_idx].addr_high) {
-        name = functionlist[func_idx].name;
-        /* get line number & file path */
-        const DWARF_LINEENTRY *lineinfo = dwarf_line_from_address(&dwarf_linetable, addr);
-        if (lineinfo != NULL) {
-          linenr = lineinfo->line;
-          const char *p = dwarf_path_from_fileindex(&dwarf_filetable, lineinfo->fileindex);
-          if (p != NULL)
-            path = p;
-        }
+typedef struct tagPBUFFER {
+  unsigned char *data;
+  size_t length;
+  size_t size;
+  bool error;                   /**< set on a memory allocation failure */
+} PBUFFER;
+
+static bool pb_reserve(PBUFFER *pb, size_t extra)
+{
+  assert(pb != NULL);
+  if (pb->error)
+    return false;
+  if (pb->length + extra > pb->size) {
+    size_t newsize = (pb->size == 0) ? 256 : pb->size;
+    while (newsize < pb->length + extra)
+      newsize *= 2;
+    unsigned char *data = (unsigned char*)realloc(pb->data, newsize);
+    if (data == NULL) {
+      pb->error = true;
+      return false;
+    }
+    pb->data = data;
+    pb->size = newsize;
+  }
+  return true;
+}
+
+static void pb_varint(PBUFFER *pb, uint64_t value)
+{
+  if (!pb_reserve(pb, 10))
+    return;
+  while (value >= 0x80) {
+    pb->data[pb->length++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  pb->data[pb->length++] = (unsigned char)value;
+}
+
+static void pb_uint(PBUFFER *pb, unsigned field, uint64_t value)
+{
+  pb_varint(pb, (uint64_t)field << 3);  /* wire type 0 = varint */
+  pb_varint(pb, value);
+}
+
+static void pb_bytes(PBUFFER *pb, unsigned field, const void *data, size_t length)
+{
+  pb_varint(pb, ((uint64_t)field << 3) | 2);  /* wire type 2 = length-delimited */
+  pb_varint(pb, length);
+  if (length > 0 && pb_reserve(pb, length)) {
+    memcpy(pb->data + pb->length, data, length);
+    pb->length += length;
+  }
+}
+
+/** pb_message() appends the sub-message as a field, and resets the buffer of
+ *  the sub-message, so that it can be re-used for the next one.
+ */
+static void pb_message(PBUFFER *pb, unsigned field, PBUFFER *sub)
+{
+  if (sub->error)
+    pb->error = true;
+  pb_bytes(pb, field, sub->data, sub->length);
+  sub->length = 0;
+}
+
+typedef struct tagSTRINGPOOL {
+  const char **strings;         /**< strings in order of insertion (index 0 is always "") */
+  unsigned count;
+  unsigned *slots;              /**< hash table: index in the strings array + 1 (0 = free) */
+  unsigned size;                /**< size of the hash table, always a power of 2 */
+  bool error;
+} STRINGPOOL;
+
+static uint32_t stringpool_hash(const char *str)
+{
+  uint32_t hash = 2166136261u;  /* FNV-1a */
+  while (*str != '\0')
+    hash = (hash ^ (unsigned char)*str++) * 16777619u;
+  return hash;
+}
+
+/** stringpool_index() returns the index of the string in the pool, adding it
+ *  if it is not yet present. The pool does not copy the string.
+ */
+static unsigned stringpool_index(STRINGPOOL *pool, const char *str)
+{
+  assert(pool != NULL);
+  assert(str != NULL);
+  if (pool->error)
+    return 0;
+  if (2 * (pool->count + 1) > pool->size) {
+    /* grow the string array and the hash table */
+    unsigned newsize = (pool->size == 0) ? 256 : 2 * pool->size;
+    const char **strings = (const char**)realloc(pool->strings, newsize * sizeof(char*));
+    unsigned *slots = (unsigned*)calloc(newsize, sizeof(unsigned));
+    if (strings == NULL || slots == NULL) {
+      if (strings != NULL)
+        pool->strings = strings;
+      if (slots != NULL)
+        free((void*)slots);
+      pool->error = true;
+      return 0;
+    }
+    pool->strings = strings;
+    for (unsigned idx = 0; idx < pool->count; idx++) {
+      unsigned slot = stringpool_hash(pool->strings[idx]) & (newsize - 1);
+      while (slots[slot] != 0)
+        slot = (slot + 1) & (newsize - 1);
+      slots[slot] = idx + 1;
+    }
+    if (pool->slots != NULL)
+      free((void*)pool->slots);
+    pool->slots = slots;
+    pool->size = newsize;
+  }
+  unsigned slot = stringpool_hash(str) & (pool->size - 1);
+  while (pool->slots[slot] != 0) {
+    if (strcmp(pool->strings[pool->slots[slot] - 1], str) == 0)
+      return pool->slots[slot] - 1;
+    slot = (slot + 1) & (pool->size - 1);
+  }
+  pool->strings[pool->count] = str;
+  pool->slots[slot] = ++pool->count;
+  return pool->count - 1;
+}
+
+static void stringpool_clear(STRINGPOOL *pool)
+{
+  assert(pool != NULL);
+  if (pool->strings != NULL)
+    free((void*)pool->strings);
+  if (pool->slots != NULL)
+    free((void*)pool->slots);
+  memset(pool, 0, sizeof(STRINGPOOL));
+}
+
+/** profile_save_pprof() writes the profile in the (uncompressed) protocol
+ *  buffer format of pprof. Every sampled address is a location, with a line
+ *  that refers to its function; functions and strings are stored once.
+ */
+static bool profile_save_pprof(FILE *fp, const APPSTATE *state, const PROFILETABLE *table)
+{
+  PBUFFER pb, sub, subline;
+  memset(&pb, 0, sizeof pb);
+  memset(&sub, 0, sizeof sub);
+  memset(&subline, 0, sizeof subline);
+  STRINGPOOL pool;
+  memset(&pool, 0, sizeof pool);
+  stringpool_index(&pool, "");  /* string 0 must be the empty string */
+
+  /* Profile.sample_type (1) and Profile.period_type (11) */
+  pb_uint(&sub, 1, stringpool_index(&pool, "samples"));
+  pb_uint(&sub, 2, stringpool_index(&pool, "count"));
+  pb_message(&pb, 1, &sub);
+  if (state->actual_freq > 0) {
+    pb_uint(&sub, 1, stringpool_index(&pool, "cpu"));
+    pb_uint(&sub, 2, stringpool_index(&pool, "nanoseconds"));
+    pb_message(&pb, 11, &sub);
+    pb_uint(&pb, 12, 1000000000u / state->actual_freq);
+  }
+
+  /* Profile.sample (2): one per location, location ids start at 1 */
+  for (unsigned idx = 0; idx < table->count; idx++) {
+    pb_uint(&sub, 1, idx + 1);
+    pb_uint(&sub, 2, table->entries[idx].samples);
+    pb_message(&pb, 2, &sub);
+  }
+
+  /* Profile.mapping (3): the ELF file */
+  if (table->count > 0) {
+    pb_uint(&sub, 1, 1);
+    pb_uint(&sub, 2, table->entries[0].address);
+    pb_uint(&sub, 3, (uint64_t)table->entries[table->count - 1].address + 1);
+    pb_uint(&sub, 5, stringpool_index(&pool, state->ELFfile));
+    pb_uint(&sub, 7, 1);  /* has_functions */
+    pb_uint(&sub, 8, 1);  /* has_filenames */
+    pb_uint(&sub, 9, 1);  /* has_line_numbers */
+    pb_message(&pb, 3, &sub);
+  }
+
+  /* Profile.location (4), function ids are the function index + 1 */
+  for (unsigned idx = 0; idx < table->count; idx++) {
+    const PROFILEENTRY *entry = &table->entries[idx];
+    pb_uint(&sub, 1, idx + 1);
+    pb_uint(&sub, 2, 1);
+    pb_uint(&sub, 3, entry->address);
+    if (entry->func >= 0) {
+      pb_uint(&subline, 1, (uint64_t)entry->func + 1);
+      pb_uint(&subline, 2, entry->line);
+      pb_message(&sub, 4, &subline);
+    }
+    pb_message(&pb, 4, &sub);
+  }
+
+  /* Profile.function (5), only the functions that have samples */
+  int prev_func = -1;
+  for (unsigned idx = 0; idx < table->count; idx++) {
+    int func = table->entries[idx].func;
+    if (func < 0 || func == prev_func)
+      continue; /* the entries of a function are consecutive */
+    prev_func = func;
+    const FUNCTIONINFO *info = &state->functionlist[func];
+    unsigned name = stringpool_index(&pool, info->name);
+    pb_uint(&sub, 1, (uint64_t)func + 1);
+    pb_uint(&sub, 2, name);
+    pb_uint(&sub, 3, name);
+    pb_uint(&sub, 4, stringpool_index(&pool, profile_table_path(table, info->fileindex)));
+    pb_uint(&sub, 5, info->line_low);
+    pb_message(&pb, 5, &sub);
+  }
+
+  /* Profile.string_table (6) */
+  for (unsigned idx = 0; idx < pool.count; idx++)
+    pb_bytes(&pb, 6, pool.strings[idx], strlen(pool.strings[idx]));
+
+  bool result = !pb.error && !sub.error && !subline.error && !pool.error;
+  if (result)
+    result = (fwrite(pb.data, 1, pb.length, fp) == pb.length);
+  stringpool_clear(&pool);
+  if (pb.data != NULL)
+    free((void*)pb.data);
+  if (sub.data != NULL)
+    free((void*)sub.data);
+  if (subline.data != NULL)
+    free((void*)subline.data);
+  return result;
+}
+
+/** profile_save_callgrind() writes the profile in the callgrind format (for
+ *  KCachegrind and similar tools), with the cost per address and line. The
+ *  file and function names use name compression.
+ */
+static bool profile_save_callgrind(FILE *fp, const APPSTATE *state, const PROFILETABLE *table)
+{
+  fprintf(fp, "# callgrind format\n");
+  fprintf(fp, "version: 1\n");
+  fprintf(fp, "creator: BlackMagic Profiler\n");
+  fprintf(fp, "cmd: %s\n", state->ELFfile);
+  fprintf(fp, "positions: instr line\n");
+  fprintf(fp, "events: Samples\n");
+  fprintf(fp, "summary: %u\n\n", table->total);
+  fprintf(fp, "ob=(1) %s\n", state->ELFfile);
+
+  /* file ids are the file index + 2 (1 is for "unknown"), function ids are
+     the function index + 2 (1 is for code outside all functions) */
+  unsigned char *seen = (unsigned char*)calloc(table->numpaths + state->numfunctions + 2, 1);
+  if (seen == NULL)
+    return false;
+  unsigned char *seen_file = seen;
+  unsigned char *seen_func = seen + table->numpaths + 1;
+  int cur_func = -2;
+  int cur_file = -2;
+  for (unsigned idx = 0; idx < table->count; idx++) {
+    const PROFILEENTRY *entry = &table->entries[idx];
+    int file = (entry->file >= 0 && (unsigned)entry->file < table->numpaths) ? entry->file : -1;
+    if (entry->func != cur_func) {
+      /* the file of a function is the file of its first line with samples */
+      cur_func = entry->func;
+      cur_file = file;
+      if (seen_file[file + 1]) {
+        fprintf(fp, "fl=(%d)\n", file + 2);
+      } else {
+        fprintf(fp, "fl=(%d) %s\n", file + 2, (file >= 0) ? profile_table_path(table, file) : "???");
+        seen_file[file + 1] = 1;
+      }
+      if (seen_func[cur_func + 1]) {
+        fprintf(fp, "fn=(%d)\n", cur_func + 2);
+      } else {
+        fprintf(fp, "fn=(%d) %s\n", cur_func + 2, (cur_func >= 0) ? state->functionlist[cur_func].name : "(other)");
+        seen_func[cur_func + 1] = 1;
+      }
+    } else if (file != cur_file) {
+      /* inlined code from another file */
+      cur_file = file;
+      if (seen_file[file + 1]) {
+        fprintf(fp, "fi=(%d)\n", file + 2);
+      } else {
+        fprintf(fp, "fi=(%d) %s\n", file + 2, (file >= 0) ? profile_table_path(table, file) : "???");
+        seen_file[file + 1] = 1;
       }
+    }
+    fprintf(fp, "0x%lx %d %u\n", (unsigned long)entry->address, entry->line, entry->samples);
+  }
+  free((void*)seen);
+  return true;
+}
+
+static void json_string(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+  for ( ; *str != '\0'; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < ' ')
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+/** profile_save_speedscope() writes the profile in the JSON format of
+ *  speedscope. The samples carry no call stacks, so each function is a frame
+ *  with the samples in that function as its weight.
+ */
+static bool profile_save_speedscope(FILE *fp, const APPSTATE *state, const PROFILETABLE *table)
+{
+  /* sum the samples per function (the last slot is for code outside all
+     functions) */
+  unsigned numfunctions = state->numfunctions;
+  unsigned *counts = (unsigned*)calloc(numfunctions + 1, sizeof(unsigned));
+  if (counts == NULL)
+    return false;
+  for (unsigned idx = 0; idx < table->count; idx++) {
+    const PROFILEENTRY *entry = &table->entries[idx];
+    counts[(entry->func >= 0) ? (unsigned)entry->func : numfunctions] += entry->samples;
+  }
 
-      fprintf(fp, "%lx,%u,\"%s\",\"%s\",%d\n", (unsigned long)addr, sample_map[idx], name, path, linenr);
+  const char *basename = strrchr(state->ELFfile, DIRSEP_CHAR);
+  basename = (basename != NULL) ? basename + 1 : state->ELFfile;
+  fprintf(fp, "{\"$schema\":\"https://www.speedscope.app/file-format-schema.json\",\n");
+  fprintf(fp, "\"exporter\":\"BlackMagic Profiler\",\"name\":");
+  json_string(fp, basename);
+  fprintf(fp, ",\n\"shared\":{\"frames\":[\n");
+  unsigned numframes = 0;
+  for (unsigned idx = 0; idx <= numfunctions; idx++) {
+    if (counts[idx] == 0)
+      continue;
+    if (numframes++ > 0)
+      fprintf(fp, ",\n");
+    if (idx < numfunctions) {
+      const FUNCTIONINFO *info = &state->functionlist[idx];
+      fprintf(fp, "{\"name\":");
+      json_string(fp, info->name);
+      fprintf(fp, ",\"file\":");
+      json_string(fp, profile_table_path(table, info->fileindex));
+      fprintf(fp, ",\"line\":%d}", info->line_low);
+    } else {
+      fprintf(fp, "{\"name\":\"(other)\"}");
     }
   }
-  fclose(fp);
+  fprintf(fp, "\n]},\n\"profiles\":[{\"type\":\"sampled\",\"name\":");
+  json_string(fp, basename);
+  fprintf(fp, ",\"unit\":\"none\",\"startValue\":0,\"endValue\":%u,\n\"samples\":[", table->total);
+  for (unsigned frame = 0; frame < numframes; frame++)
+    fprintf(fp, "%s[%u]", (frame > 0) ? "," : "", frame);
+  fprintf(fp, "],\n\"weights\":[");
+  numframes = 0;
+  for (unsigned idx = 0; idx <= numfunctions; idx++)
+    if (counts[idx] > 0)
+      fprintf(fp, "%s%u", (numframes++ > 0) ? "," : "", counts[idx]);
+  fprintf(fp, "]}]}\n");
+  free((void*)counts);
   return true;
 }
 
+enum {
+  EXPORT_CSV,
+  EXPORT_PPROF,
+  EXPORT_CALLGRIND,
+  EXPORT_SPEEDSCOPE,
+};
+
+/** profile_format() returns the export format from the file name: .pb or
+ *  .pprof for pprof, .json for speedscope, and callgrind.out.* or .callgrind
+ *  for callgrind. Any other name is saved as CSV.
+ */
+static int profile_format(const char *filename)
+{
+  assert(filename != NULL);
+  const char *basename = strrchr(filename, DIRSEP_CHAR);
+  basename = (basename != NULL) ? basename + 1 : filename;
+  const char *ext = strrchr(basename, '.');
+  if (ext != NULL && (stricmp(ext, ".pb") == 0 || stricmp(ext, ".pprof") == 0))
+    return EXPORT_PPROF;
+  if (ext != NULL && stricmp(ext, ".json") == 0)
+    return EXPORT_SPEEDSCOPE;
+  if (strncmp(basename, "callgrind.out", 13) == 0 || (ext != NULL && stricmp(ext, ".callgrind") == 0))
+    return EXPORT_CALLGRIND;
+  return EXPORT_CSV;
+}
+
+static bool profile_save(const char *filename, APPSTATE *state)
+{
+  PROFILETABLE table;
+  if (!profile_table_build(state, &table))
+    return false;
+  int format = profile_format(filename);
+  FILE *fp = fopen(filename, (format == EXPORT_PPROF) ? "wb" : "wt");
+  if (fp == NULL) {
+    profile_table_clear(&table);
+    return false;
+  }
+  bool result;
+  switch (format) {
+  case EXPORT_PPROF:
+    result = profile_save_pprof(fp, state, &table);
+    break;
+  case EXPORT_CALLGRIND:
+    result = profile_save_callgrind(fp, state, &table);
+    break;
+  case EXPORT_SPEEDSCOPE:
+    result = profile_save_speedscope(fp, state, &table);
+    break;
+  default:
+    result = profile_save_csv(fp, state, &table);
+  }
+  if (fclose(fp) != 0)
+    result = false;
+  profile_table_clear(&table);
+  return result;
+}
+
+/** profile_setbins() sets the address ranges in the sample map for either
+ *  the functions or the source lines of the function in the source view. The
+ *  sample map then attributes each sample to its function and line as it
+ *  comes in.
+ */
+static bool profile_setbins(APPSTATE *state, int set)
+{
+  assert(state != NULL);
+  assert(set == BINSET_FUNCTIONS || set == BINSET_LINES);
+  if (state->sample_map == NULL)
+    return false;
+  if (set == BINSET_FUNCTIONS)
+    state->funcbins = true;
+  else
+    state->linebins = true;
+
+  SAMPLEBIN *bins = NULL;
+  unsigned count = 0;
+  unsigned numids = 0;
+  if (set == BINSET_FUNCTIONS) {
+    bins = profile_functionbins(state, &count);
+    if (bins != NULL)
+      numids = state->numfunctions;
+  } else if (set == BINSET_LINES && state->sourcelines != NULL && state->numlines > 0 && state->addr2line != NULL) {
+    /* a bin for each run of addresses that map to the same source line */
+    unsigned addr_range = Address2Index(state->source_addr_high, state->source_addr_low);
+    bins = (SAMPLEBIN*)malloc(addr_range * sizeof(SAMPLEBIN));
+    if (bins != NULL) {
+      unsigned first_line = state->sourcelines[0].linenr;
+      for (unsigned idx = 0; idx < addr_range; idx++) {
+        unsigned line_idx = state->addr2line[idx] - first_line;
+        if (line_idx >= state->numlines)
+          continue;
+        uint32_t addr = Index2Address(idx, state->source_addr_low);
+        if (count > 0 && bins[count - 1].id == line_idx && bins[count - 1].high == addr) {
+          bins[count - 1].high = addr + ADDRESS_ALIGN;
+        } else {
+          bins[count].low = addr;
+          bins[count].high = addr + ADDRESS_ALIGN;
+          bins[count].id = line_idx;
+          count += 1;
+        }
+      }
+      numids = state->numlines;
+    }
+  }
+
+  /* an empty list removes the bins (the array holds no valid entries then) */
+  bool result = samplemap_setbins(state->sample_map, set, (count > 0) ? bins : NULL, count, numids);
+  if (bins != NULL)
+    free((void*)bins);
+  return result;
+}
+
+/** profile_functioncounts() returns the sample counts of all functions, and
+ *  updates the total number of samples and the samples outside any function.
+ */
+static const unsigned *profile_functioncounts(APPSTATE *state)
+{
+  assert(state != NULL && state->sample_map != NULL);
+  if (!state->funcbins)
+    profile_setbins(state, BINSET_FUNCTIONS);
+  unsigned unbinned;
+  const unsigned *counts = samplemap_bincounts(state->sample_map, BINSET_FUNCTIONS, &unbinned);
+  state->total_samples = samplemap_total(state->sample_map);
+  if (counts != NULL)
+    state->sample_unknown = unbinned + samplemap_unknown(state->sample_map);
+  else
+    state->sample_unknown = state->total_samples;
+  return counts;
+}
+
 static void profile_graph_top(APPSTATE *state)
 {
   if (state->sample_map != NULL && state->functionlist != NULL && state->numfunctions > 0) {
-    /* clear functions counts */
+    /* copy the function counts, which the sample map keeps up to date */
     FUNCTIONINFO *functionlist = state->functionlist;
     unsigned numfunctions = state->numfunctions;
+    const unsigned *counts = profile_functioncounts(state);
     for (unsigned idx = 0; idx < numfunctions; idx++)
-      functionlist[idx].count = 0;
-    state->sample_unknown = 0;
-
-    /* accumulate function counts from sample map */
-    unsigned total_samples = 0;
-    unsigned *sample_map = state->sample_map;
-    unsigned count = (state->code_top - state->code_base) / ADDRESS_ALIGN;
-    uint32_t code_base = state->code_base;
-    unsigned func_idx = 0;
-    for (unsigned idx = 0; idx < count; idx++) {
-      if (sample_map[idx] == 0)
-        continue;
-      uint32_t addr = Index2Address(idx, code_base);
-      if (addr < functionlist[func_idx].addr_low || addr >= functionlist[func_idx].addr_high) {
-        /* use binary search to find the function */
-        unsigned low = 0;
-        unsigned high = numfunctions - 1;
-        while (low <= high) {
-          func_idx = low + (high - low) / 2;
-          if (functionlist[func_idx].addr_low <= addr && addr < functionlist[func_idx].addr_high)
-            break;
-          assert(functionlist[func_idx].addr_low < addr || functionlist[func_idx].addr_high >= addr);
-          if (functionlist[func_idx].addr_low < addr)
-            low = func_idx + 1;
-          else
-            high = func_idx - 1;
-        }
-      }
-      if (functionlist[func_idx].addr_low <= addr && addr < functionlist[func_idx].addr_high)
-        functionlist[func_idx].count += sample_map[idx];
-      else
-        state->sample_unknown += sample_map[idx];
-      total_samples += sample_map[idx];
-    }
-
-    /* all samples beyond the ELF file address range are collected in this slot */
-    state->sample_unknown += sample_map[count];
-    total_samples += sample_map[count];
-    state->total_samples = total_samples;
+      functionlist[idx].count = (counts != NULL) ? counts[idx] : 0;
+    unsigned total_samples = state->total_samples;
 
     /* calculate scaling factors */
     if (total_samples > 0) {
@@ -736,11 +1523,23 @@ static void profile_graph_top(APPSTATE *state)
       }
     }
 
+    /* move the functions that have samples to the front (keeping the order
+       of both groups), then sort only those; this gives the same order as
+       sorting the complete list, because the sort is stable */
+    unsigned *functionorder = state->functionorder;
+    unsigned numactive = 0;
+    for (unsigned i = 0; i < numfunctions; i++) {
+      unsigned key = functionorder[i];
+      if (functionlist[key].count > 0) {
+        memmove(functionorder + numactive + 1, functionorder + numactive, (i - numactive) * sizeof(unsigned));
+        functionorder[numactive++] = key;
+      }
+    }
+
     /* sort the functions using "insertion sort"; this is classified as an
        inefficient sort, but it is quite efficient if the list is already
        (nearly) sorted */
-    unsigned *functionorder = state->functionorder;
-    for (unsigned i = 1; i < numfunctions; i++) {
+    for (unsigned i = 1; i < numactive; i++) {
       unsigned key = functionorder[i];
       assert(key < numfunctions);
       unsigned long key_samples = functionlist[key].count;
@@ -755,36 +1554,18 @@ static void profile_graph_top(APPSTATE *state)
 static void profile_graph_source(APPSTATE *state)
 {
   if (state->sample_map != NULL && state->sourcelines != NULL && state->numlines > 0 && state->addr2line != NULL) {
-    /* clear line counts */
-    LINEINFO *sourcelines = state->sourcelines;
-    unsigned numlines = state->numlines;
-    for (unsigned idx = 0; idx < numlines; idx++)
-      sourcelines[idx].count = 0;
+    if (!state->linebins)
+      profile_setbins(state, BINSET_LINES);
 
-    /* accumulate function counts from sample map */
-    unsigned total_samples = 0;
-    unsigned *sample_map = state->sample_map;
-    unsigned count = (state->code_top - state->code_base) / ADDRESS_ALIGN;
-    uint32_t code_base = state->code_base;
-    uint32_t addr_low = state->source_addr_low;
-    uint32_t addr_high = state->source_addr_high;
-    unsigned *addr2line = state->addr2line;
+    /* copy the line counts, which the sample map keeps up to date */
+    LINEINFO *sourcelines = state->sourcelines;
     unsigned line_count = state->numlines;
-    unsigned first_line = sourcelines[0].linenr;
-    for (unsigned idx = 0; idx < count; idx++) {
-      if (sample_map[idx] == 0)
-        continue;
-      total_samples += sample_map[idx];
-      uint32_t addr = Index2Address(idx, code_base);
-      if (addr < addr_low || addr >= addr_high)
-        continue;
-      unsigned addr_idx = Address2Index(addr, addr_low);
-      unsigned line_idx = addr2line[addr_idx] - first_line;
-      if (line_idx < line_count)
-        sourcelines[line_idx].count += sample_map[idx];
-    }
+    const unsigned *counts = samplemap_bincounts(state->sample_map, BINSET_LINES, NULL);
+    for (unsigned idx = 0; idx < line_count; idx++)
+      sourcelines[idx].count = (counts != NULL) ? counts[idx] : 0;
+    unsigned total_samples = samplemap_total(state->sample_map) - samplemap_unknown(state->sample_map);
     state->total_samples = total_samples;
-    state->sample_unknown = sample_map[count];
+    state->sample_unknown = samplemap_unknown(state->sample_map);
 
     /* calculate scaling factors */
     if (total_samples > 0) {
@@ -811,6 +1592,437 @@ static void profile_graph_source(APPSTATE *state)
   }
 }
 
+static void history_reset(PROFILEHISTORY *history)
+{
+  assert(history != NULL);
+  history->head = 0;
+  history->count = 0;
+  history->entryhead = 0;
+  history->numentries = 0;
+  history->seqnr = 1;
+  history->mark = 0;
+  history->numrows = 0;
+  history_resync(history);
+}
+
+/** history_resync() must be called when the sample map is cleared, so that
+ *  the next window starts counting from zero.
+ */
+static void history_resync(PROFILEHISTORY *history)
+{
+  assert(history != NULL);
+  history->prevtotal = 0;
+  if (history->prevcounts != NULL)
+    memset(history->prevcounts, 0, history->numfunctions * sizeof(unsigned));
+}
+
+static void history_clear(PROFILEHISTORY *history)
+{
+  assert(history != NULL);
+  if (history->windows != NULL)
+    free((void*)history->windows);
+  if (history->entries != NULL)
+    free((void*)history->entries);
+  if (history->prevcounts != NULL)
+    free((void*)history->prevcounts);
+  memset(history, 0, sizeof(PROFILEHISTORY));
+}
+
+/** history_record() adds a window to the history, with the samples that
+ *  came in since the previous window. All functions with samples in the window
+ *  are stored. Both the windows and the function counts are kept in rings of
+ *  a fixed size, so that the memory use is bounded regardless of the duration
+ *  of the capture; the oldest windows are dropped when either ring is full.
+ */
+static void history_record(APPSTATE *state)
+{
+  assert(state != NULL);
+  PROFILEHISTORY *history = &state->history;
+  if (state->sample_map == NULL || state->functionlist == NULL || state->numfunctions == 0)
+    return;
+  if (!state->funcbins)
+    profile_setbins(state, BINSET_FUNCTIONS);
+  const unsigned *counts = samplemap_bincounts(state->sample_map, BINSET_FUNCTIONS, NULL);
+  if (counts == NULL)
+    return;
+
+  if (history->windows == NULL) {
+    history->windows = (HISTORYWINDOW*)malloc(HISTORY_WINDOWS * sizeof(HISTORYWINDOW));
+    if (history->windows == NULL)
+      return;
+    history_reset(history);
+  }
+  if (history->prevcounts == NULL || history->numfunctions != state->numfunctions) {
+    /* the function list changed, the function indices in the history are
+       no longer valid */
+    if (history->prevcounts != NULL)
+      free((void*)history->prevcounts);
+    if (history->entries != NULL)
+      free((void*)history->entries);
+    /* the entry pool must at least hold a window in which all functions have
+       samples */
+    history->maxentries = (state->numfunctions > HISTORY_ENTRIES) ? state->numfunctions : HISTORY_ENTRIES;
+    history->entries = (HISTORYENTRY*)malloc(history->maxentries * sizeof(HISTORYENTRY));
+    history->prevcounts = (unsigned*)calloc(state->numfunctions, sizeof(unsigned));
+    if (history->entries == NULL || history->prevcounts == NULL) {
+      if (history->entries != NULL)
+        free((void*)history->entries);
+      if (history->prevcounts != NULL)
+        free((void*)history->prevcounts);
+      history->entries = NULL;
+      history->prevcounts = NULL;
+    }
+    history->numfunctions = (history->prevcounts != NULL) ? state->numfunctions : 0;
+    history_reset(history);
+    if (history->prevcounts == NULL)
+      return;
+  }
+
+  /* count the functions with samples in this window, then drop the oldest
+     windows until both the window and its entries fit */
+  unsigned numentries = 0;
+  for (unsigned idx = 0; idx < state->numfunctions; idx++)
+    if (counts[idx] != history->prevcounts[idx])
+      numentries++;
+  assert(numentries <= history->maxentries);
+  while (history->count > 0 && (history->count == HISTORY_WINDOWS || history->numentries + numentries > history->maxentries)) {
+    assert(history->numentries >= history->windows[history->head].numentries);
+    history->numentries -= history->windows[history->head].numentries;
+    history->head = (history->head + 1) % HISTORY_WINDOWS;
+    history->count -= 1;
+    if (history->count > 0)
+      history->entryhead = history->windows[history->head].first;
+  }
+
+  assert(history->count < HISTORY_WINDOWS);
+  HISTORYWINDOW *window = &history->windows[(history->head + history->count) % HISTORY_WINDOWS];
+  history->count += 1;
+  unsigned tail = (history->entryhead + history->numentries) % history->maxentries;
+  unsigned total = samplemap_total(state->sample_map);
+  window->seqnr = history->seqnr++;
+  window->total = (total >= history->prevtotal) ? total - history->prevtotal : total;
+  window->first = tail;
+  window->numentries = 0;
+  history->prevtotal = total;
+  for (unsigned idx = 0; idx < state->numfunctions; idx++) {
+    unsigned delta = (counts[idx] >= history->prevcounts[idx]) ? counts[idx] - history->prevcounts[idx] : counts[idx];
+    history->prevcounts[idx] = counts[idx];
+    if (delta == 0)
+      continue;
+    assert(window->numentries < numentries);
+    HISTORYENTRY *entry = &history->entries[tail];
+    entry->func = idx;
+    entry->count = delta;
+    tail = (tail + 1) % history->maxentries;
+    window->numentries += 1;
+    history->numentries += 1;
+  }
+}
+
+static void profile_graph_history(APPSTATE *state)
+{
+  assert(state != NULL);
+  PROFILEHISTORY *history = &state->history;
+  if (state->sample_map != NULL)
+    profile_functioncounts(state);  /* for the status panel */
+  history->numrows = 0;
+  if (history->windows == NULL || history->count == 0 || state->numfunctions == 0)
+    return;
+
+  /* select the functions with the most samples over the complete history */
+  unsigned *sums = (unsigned*)calloc(state->numfunctions, sizeof(unsigned));
+  if (sums == NULL)
+    return;
+  for (unsigned pos = 0; pos < history->count; pos++) {
+    const HISTORYWINDOW *window = history_window(history, pos);
+    for (unsigned idx = 0; idx < window->numentries; idx++) {
+      const HISTORYENTRY *entry = history_entry(history, window, idx);
+      assert(entry->func < state->numfunctions);
+      sums[entry->func] += entry->count;
+    }
+  }
+  for (unsigned func = 0; func < state->numfunctions; func++) {
+    if (sums[func] == 0)
+      continue;
+    unsigned pos = history->numrows;
+    if (pos == HISTORY_ROWS) {
+      if (sums[func] <= sums[history->rows[pos - 1]])
+        continue;
+      pos -= 1;
+    } else {
+      history->numrows += 1;
+    }
+    while (pos > 0 && sums[history->rows[pos - 1]] < sums[func]) {
+      history->rows[pos] = history->rows[pos - 1];
+      pos--;
+    }
+    history->rows[pos] = func;
+  }
+  free((void*)sums);
+}
+
+static int compare_namedcount(const void *a, const void *b)
+{
+  return strcmp(((const NAMEDCOUNT*)a)->name, ((const NAMEDCOUNT*)b)->name);
+}
+
+/** namedcount_collapse() sorts the list on name and sums the counts of
+ *  entries with the same name. It returns the new size of the list.
+ */
+static unsigned namedcount_collapse(NAMEDCOUNT *list, unsigned count, bool owned)
+{
+  if (count == 0)
+    return 0;
+  assert(list != NULL);
+  qsort((void*)list, count, sizeof(NAMEDCOUNT), compare_namedcount);
+  unsigned dest = 0;
+  for (unsigned idx = 1; idx < count; idx++) {
+    if (strcmp(list[idx].name, list[dest].name) == 0) {
+      list[dest].count += list[idx].count;
+      if (owned)
+        free((void*)list[idx].name);
+    } else {
+      list[++dest] = list[idx];
+    }
+  }
+  return dest + 1;
+}
+
+static void snapshot_clear(PROFILESNAPSHOT *snapshot)
+{
+  assert(snapshot != NULL);
+  if (snapshot->list != NULL) {
+    for (unsigned idx = 0; idx < snapshot->count; idx++)
+      free((void*)snapshot->list[idx].name);
+    free((void*)snapshot->list);
+  }
+  memset(snapshot, 0, sizeof(PROFILESNAPSHOT));
+}
+
+/** snapshot_load() loads a profile that was saved with profile_save(). The
+ *  samples are summed per function name, so that the profiles of different
+ *  builds of the firmware can be compared.
+ */
+static bool snapshot_load(const char *filename, PROFILESNAPSHOT *snapshot)
+{
+  assert(filename != NULL);
+  assert(snapshot != NULL);
+  snapshot_clear(snapshot);
+  FILE *fp = fopen(filename, "rt");
+  if (fp == NULL)
+    return false;
+
+  unsigned size = 0;
+  bool ok = true;
+  char line[512];
+  while (fgets(line, sizeof line, fp) != NULL) {
+    unsigned long addr;
+    unsigned samples;
+    int len;
+    if (sscanf(line, "%lx,%u,%n", &addr, &samples, &len) != 2 || line[len] != '"')
+      continue; /* header line, or not a valid line */
+    char *name = line + len + 1;
+    char *ptr = strchr(name, '"');
+    if (ptr == NULL)
+      continue;
+    *ptr = '\0';
+    if (snapshot->count >= size) {
+      unsigned newsize = (size == 0) ? 256 : 2 * size;
+      NAMEDCOUNT *list = (NAMEDCOUNT*)realloc(snapshot->list, newsize * sizeof(NAMEDCOUNT));
+      if (list == NULL) {
+        ok = false;
+        break;
+      }
+      snapshot->list = list;
+      size = newsize;
+    }
+    snapshot->list[snapshot->count].name = strdup((*name != '\0') ? name : "(other)");
+    if (snapshot->list[snapshot->count].name == NULL) {
+      ok = false;
+      break;
+    }
+    snapshot->list[snapshot->count].count = samples;
+    snapshot->count += 1;
+    snapshot->total += samples;
+  }
+  fclose(fp);
+
+  if (!ok || snapshot->count == 0) {
+    snapshot_clear(snapshot);
+    return false;
+  }
+  snapshot->count = namedcount_collapse(snapshot->list, snapshot->count, true);
+  strlcpy(snapshot->path, filename, sizearray(snapshot->path));
+  return true;
+}
+
+static void diff_clear(APPSTATE *state)
+{
+  assert(state != NULL);
+  if (state->diffrows != NULL) {
+    for (unsigned idx = 0; idx < state->numdiffrows; idx++)
+      free((void*)state->diffrows[idx].name);
+    free((void*)state->diffrows);
+    state->diffrows = NULL;
+  }
+  state->numdiffrows = 0;
+}
+
+/** diff_collect() returns the sample counts per function for one side of
+ *  the comparison (0 = baseline, 1 = compared profile). The names in the
+ *  list are not allocated.
+ */
+static unsigned diff_collect(APPSTATE *state, int side, NAMEDCOUNT **list, unsigned *total)
+{
+  assert(state != NULL);
+  assert(side == 0 || side == 1);
+  assert(list != NULL && total != NULL);
+  *list = NULL;
+  *total = 0;
+
+  if (state->diff_source[side] == DIFF_FILE) {
+    const PROFILESNAPSHOT *snapshot = &state->diff_file[side];
+    if (snapshot->count == 0)
+      return 0;
+    *list = (NAMEDCOUNT*)malloc(snapshot->count * sizeof(NAMEDCOUNT));
+    if (*list == NULL)
+      return 0;
+    memcpy(*list, snapshot->list, snapshot->count * sizeof(NAMEDCOUNT));
+    *total = snapshot->total;
+    return snapshot->count;
+  }
+
+  if (state->functionlist == NULL || state->numfunctions == 0 || state->sample_map == NULL)
+    return 0;
+  unsigned numfunctions = state->numfunctions;
+  unsigned *counts = (unsigned*)calloc(numfunctions + 1, sizeof(unsigned)); /* +1 for samples outside the functions */
+  if (counts == NULL)
+    return 0;
+  if (state->diff_source[side] == DIFF_LIVE) {
+    const unsigned *live = profile_functioncounts(state);
+    if (live != NULL) {
+      memcpy(counts, live, numfunctions * sizeof(unsigned));
+      counts[numfunctions] = state->sample_unknown;
+      *total = state->total_samples;
+    }
+  } else {
+    /* the baseline is the time range before the mark, the compared profile
+       is the range from the mark (or all windows if there is no mark) */
+    assert(state->diff_source[side] == DIFF_HISTORY);
+    const PROFILEHISTORY *history = &state->history;
+    for (unsigned pos = 0; pos < history->count; pos++) {
+      const HISTORYWINDOW *window = history_window(history, pos);
+      bool before = (history->mark > 0 && window->seqnr < history->mark);
+      if (before != (side == 0))
+        continue;
+      unsigned sum = 0;
+      for (unsigned idx = 0; idx < window->numentries; idx++) {
+        const HISTORYENTRY *entry = history_entry(history, window, idx);
+        assert(entry->func < numfunctions);
+        counts[entry->func] += entry->count;
+        sum += entry->count;
+      }
+      counts[numfunctions] += window->total - sum;
+      *total += window->total;
+    }
+  }
+
+  unsigned count = 0;
+  for (unsigned idx = 0; idx <= numfunctions; idx++)
+    if (counts[idx] > 0)
+      count++;
+  if (count > 0)
+    *list = (NAMEDCOUNT*)malloc(count * sizeof(NAMEDCOUNT));
+  if (*list != NULL) {
+    count = 0;
+    for (unsigned idx = 0; idx <= numfunctions; idx++) {
+      if (counts[idx] > 0) {
+        (*list)[count].name = (idx < numfunctions) ? state->functionlist[idx].name : "(other)";
+        (*list)[count].count = counts[idx];
+        count++;
+      }
+    }
+  } else {
+    count = 0;
+  }
+  free((void*)counts);
+  return count;
+}
+
+static int compare_diff(const void *a, const void *b)
+{
+  const DIFFINFO *d1 = (const DIFFINFO*)a;
+  const DIFFINFO *d2 = (const DIFFINFO*)b;
+  double delta1 = d1->ratio_b - d1->ratio_a;
+  double delta2 = d2->ratio_b - d2->ratio_a;
+  if (delta1 < 0.0)
+    delta1 = -delta1;
+  if (delta2 < 0.0)
+    delta2 = -delta2;
+  if (delta1 != delta2)
+    return (delta1 < delta2) ? 1 : -1;
+  return strcmp(d1->name, d2->name);
+}
+
+static void profile_graph_diff(APPSTATE *state)
+{
+  assert(state != NULL);
+  diff_clear(state);
+  if (state->sample_map != NULL)
+    profile_functioncounts(state);  /* for the status panel */
+
+  NAMEDCOUNT *list_a, *list_b;
+  unsigned total_a, total_b;
+  unsigned count_a = diff_collect(state, 0, &list_a, &total_a);
+  unsigned count_b = diff_collect(state, 1, &list_b, &total_b);
+  count_a = namedcount_collapse(list_a, count_a, false);
+  count_b = namedcount_collapse(list_b, count_b, false);
+
+  if (total_a > 0 && total_b > 0)
+    state->diffrows = (DIFFINFO*)malloc((count_a + count_b) * sizeof(DIFFINFO));
+  if (state->diffrows != NULL) {
+    /* merge the two lists (both are sorted on name) */
+    unsigned idx_a = 0, idx_b = 0;
+    double peak = 0.0;
+    while (idx_a < count_a || idx_b < count_b) {
+      int cmp;
+      if (idx_a >= count_a)
+        cmp = 1;
+      else if (idx_b >= count_b)
+        cmp = -1;
+      else
+        cmp = strcmp(list_a[idx_a].name, list_b[idx_b].name);
+      DIFFINFO *diff = &state->diffrows[state->numdiffrows];
+      diff->ratio_a = (cmp <= 0) ? (double)list_a[idx_a].count / total_a : 0.0;
+      diff->ratio_b = (cmp >= 0) ? (double)list_b[idx_b].count / total_b : 0.0;
+      diff->name = strdup((cmp <= 0) ? list_a[idx_a].name : list_b[idx_b].name);
+      if (cmp <= 0)
+        idx_a++;
+      if (cmp >= 0)
+        idx_b++;
+      if (diff->name == NULL)
+        continue;
+      double delta = diff->ratio_b - diff->ratio_a;
+      sprintf(diff->percentage, "%+5.1f%%  ", 100.0 * delta);
+      if (delta < 0.0)
+        delta = -delta;
+      if (delta > peak)
+        peak = delta;
+      state->numdiffrows += 1;
+    }
+    for (unsigned idx = 0; idx < state->numdiffrows; idx++) {
+      DIFFINFO *diff = &state->diffrows[idx];
+      diff->bar = (peak > 0.0) ? (diff->ratio_b - diff->ratio_a) / peak : 0.0;
+    }
+    qsort((void*)state->diffrows, state->numdiffrows, sizeof(DIFFINFO), compare_diff);
+  }
+
+  if (list_a != NULL)
+    free((void*)list_a);
+  if (list_b != NULL)
+    free((void*)list_b);
+}
+
 static void clear_functions(APPSTATE *state)
 {
   assert(state != NULL);
@@ -825,6 +2037,81 @@ static void clear_functions(APPSTATE *state)
     state->functionorder = NULL;
   }
   state->numfunctions = 0;
+  diff_clear(state);
+  state->history.numrows = 0;
+}
+
+/* cache for demangled names, so that a name that appears several times in
+   the ELF symbol table (such as a static function in an anonymous namespace
+   that is in several modules) is demangled only once */
+typedef struct tagDEMANGLECACHE {
+  const char **mangled;         /* key (points into the ELF symbol table) */
+  char **plain;                 /* demangled name (NULL if not mangled) */
+  unsigned size;                /* always a power of 2 */
+} DEMANGLECACHE;
+
+static bool demangle_cache_init(DEMANGLECACHE *cache, unsigned count)
+{
+  assert(cache != NULL);
+  cache->size = 16;
+  while (cache->size < 2 * count)
+    cache->size *= 2;
+  cache->mangled = (const char**)calloc(cache->size, sizeof(char*));
+  cache->plain = (char**)calloc(cache->size, sizeof(char*));
+  return cache->mangled != NULL && cache->plain != NULL;
+}
+
+static void demangle_cache_clear(DEMANGLECACHE *cache)
+{
+  assert(cache != NULL);
+  if (cache->plain != NULL) {
+    for (unsigned idx = 0; idx < cache->size; idx++)
+      if (cache->plain[idx] != NULL)
+        free((void*)cache->plain[idx]);
+    free((void*)cache->plain);
+  }
+  if (cache->mangled != NULL)
+    free((void*)cache->mangled);
+  memset(cache, 0, sizeof(DEMANGLECACHE));
+}
+
+/** demangle_cached() returns the demangled name of a symbol, or the name
+ *  itself if it is not a mangled name. The returned string is owned by the
+ *  cache (or by the caller, if it is the input name).
+ */
+static const char *demangle_cached(DEMANGLECACHE *cache, const char *name)
+{
+  assert(cache != NULL && cache->mangled != NULL);
+  assert(name != NULL);
+  if (name[0] != '_' || name[1] != 'Z')
+    return name;  /* not a mangled name, skip the cache */
+
+  uint32_t hash = 2166136261u;  /* FNV-1a */
+  for (const char *ptr = name; *ptr != '\0'; ptr++)
+    hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+  unsigned idx = hash & (cache->size - 1);
+  while (cache->mangled[idx] != NULL) {
+    if (strcmp(cache->mangled[idx], name) == 0)
+      return (cache->plain[idx] != NULL) ? cache->plain[idx] : name;
+    idx = (idx + 1) & (cache->size - 1);
+  }
+
+  char plain[256];
+  cache->mangled[idx] = name;
+  if (demangle(plain, sizearray(plain), name))
+    cache->plain[idx] = strdup(plain);
+  return (cache->plain[idx] != NULL) ? cache->plain[idx] : name;
+}
+
+static int compare_elf_address(const void *a, const void *b)
+{
+  const ELF_SYMBOL *sym1 = *(const ELF_SYMBOL**)a;
+  const ELF_SYMBOL *sym2 = *(const ELF_SYMBOL**)b;
+  unsigned long addr1 = sym1->address & ~1;
+  unsigned long addr2 = sym2->address & ~1;
+  if (addr1 != addr2)
+    return (addr1 > addr2) ? 1 : -1;
+  return (sym1 > sym2) - (sym1 < sym2); /* keep the order of the ELF symbol table */
 }
 
 static bool collect_functions(APPSTATE *state)
@@ -832,13 +2119,15 @@ static bool collect_functions(APPSTATE *state)
   assert(state != NULL);
   clear_functions(state);
 
-  /* count & collect the function symbols from the DWARF info */
+  /* count & collect the function symbols from the DWARF info (sorted on
+     address) */
   unsigned dwarf_count = dwarf_collect_functions_in_file(&dwarf_symboltable, -1, DWARF_SORT_ADDRESS, NULL, 0);
   if (dwarf_count == 0)
     return false;
   const DWARF_SYMBOLLIST **dwarf_list = (const DWARF_SYMBOLLIST**)malloc(dwarf_count * sizeof(DWARF_SYMBOLLIST*));
-  if (dwarf_list != NULL)
-    dwarf_collect_functions_in_file(&dwarf_symboltable, -1, DWARF_SORT_ADDRESS, dwarf_list, dwarf_count);
+  if (dwarf_list == NULL)
+    return false;
+  dwarf_collect_functions_in_file(&dwarf_symboltable, -1, DWARF_SORT_ADDRESS, dwarf_list, dwarf_count);
 
   /* count & collect the function symbols in the ELF symbol table */
   unsigned elf_count = 0;
@@ -854,71 +2143,70 @@ static bool collect_functions(APPSTATE *state)
     fclose(fp_elf);
   }
 
-  /* use the DWARF info as the primary table, but walk through the ELF symbols
-     to find any functions that are not present in the DWARF table */
-  state->numfunctions = dwarf_count;
+  /* make a list of the ELF function symbols, sorted on address */
+  unsigned elf_funccount = 0;
+  const ELF_SYMBOL **elf_funcs = NULL;
   if (elf_list != NULL) {
-    assert(elf_count > 0);
-    for (unsigned elf_idx = 0; elf_idx < elf_count; elf_idx++) {
-      if (!elf_list[elf_idx].is_func)
-        continue;
-      /* functions are always on even addresses, but the ELF symbol table uses
-         the low bit to indicate a Thumb function; this is irrelevant here, so
-         the low bit is cleared */
-      unsigned long addr = elf_list[elf_idx].address & ~1;
-      unsigned dwarf_idx;
-      for (dwarf_idx = 0; dwarf_idx < dwarf_count && dwarf_list[dwarf_idx]->code_addr != addr; dwarf_idx++)
-        {}
-      if (dwarf_idx >= dwarf_count)
-        state->numfunctions += 1; /* found a function in the ELF table that is not in the DWARF table */
-      else
-        elf_list[elf_idx].is_func = 0;  /* clear flag, to make the loop for inserting the symbols easier */
+    elf_funcs = (const ELF_SYMBOL**)malloc(elf_count * sizeof(ELF_SYMBOL*));
+    if (elf_funcs != NULL) {
+      for (unsigned idx = 0; idx < elf_count; idx++)
+        if (elf_list[idx].is_func)
+          elf_funcs[elf_funccount++] = &elf_list[idx];
+      qsort((void*)elf_funcs, elf_funccount, sizeof(ELF_SYMBOL*), compare_elf_address);
     }
   }
 
+  /* use the DWARF info as the primary table, but walk through the ELF symbols
+     to find any functions that are not present in the DWARF table; since both
+     lists are sorted on address, this is a single pass over both lists
+     (functions are always on even addresses, but the ELF symbol table uses
+     the low bit to indicate a Thumb function; this is irrelevant here, so
+     the low bit is cleared) */
+  state->numfunctions = dwarf_count;
+  unsigned dwarf_idx = 0;
+  for (unsigned idx = 0; idx < elf_funccount; idx++) {
+    unsigned long addr = elf_funcs[idx]->address & ~1;
+    while (dwarf_idx < dwarf_count && dwarf_list[dwarf_idx]->code_addr < addr)
+      dwarf_idx++;
+    if (dwarf_idx < dwarf_count && dwarf_list[dwarf_idx]->code_addr == addr)
+      elf_funcs[idx] = NULL;    /* already in the DWARF table, drop it */
+    else
+      state->numfunctions += 1; /* found a function in the ELF table that is not in the DWARF table */
+  }
+
   /* allocate memory for the merged tables from DWARF and ELF */
   state->functionlist = (FUNCTIONINFO*)malloc(state->numfunctions * sizeof(FUNCTIONINFO));
   state->functionorder = (unsigned*)malloc(state->numfunctions * sizeof(unsigned));
+  DEMANGLECACHE cache;
+  bool cache_ok = demangle_cache_init(&cache, elf_funccount);
 
-  if (state->functionlist != NULL && state->functionorder != NULL) {
+  if (state->functionlist != NULL && state->functionorder != NULL && cache_ok) {
     memset(state->functionlist, 0, state->numfunctions * sizeof(FUNCTIONINFO));
-    memset(state->functionorder, 0, state->numfunctions * sizeof(unsigned));
-    /* the DWARF list is already sorted on address, copy relevant fields */
-    for (unsigned idx = 0; idx < dwarf_count; idx++) {
-      state->functionlist[idx].name = strdup(dwarf_list[idx]->name);
-      state->functionlist[idx].addr_low = dwarf_list[idx]->code_addr;
-      state->functionlist[idx].addr_high = dwarf_list[idx]->code_addr + dwarf_list[idx]->code_range;
-      state->functionlist[idx].line_low = dwarf_list[idx]->line;
-      state->functionlist[idx].line_high = dwarf_list[idx]->line_limit;
-      state->functionlist[idx].fileindex = dwarf_list[idx]->fileindex;
-    }
-    /* add functions from the ELF symbol table */
-    if (elf_list != NULL) {
-      assert(elf_count > 0);
-      for (unsigned elf_idx = 0; elf_idx < elf_count; elf_idx++) {
-        if (!elf_list[elf_idx].is_func)
-          continue; /* all functions that are also in the DWARF table had this flag cleared, see above */
-        unsigned long addr = elf_list[elf_idx].address & ~1;
-        /* find insertion point */
-        unsigned pos;
-        for (pos = 0; state->functionlist[pos].name != NULL && state->functionlist[pos].addr_low < addr; pos++)
-          {}
-        assert(pos < state->numfunctions);
-        if (state->functionlist[pos].name != NULL) {
-          unsigned count = state->numfunctions - (pos + 1);
-          memmove(&state->functionlist[pos + 1], &state->functionlist[pos], count * sizeof(FUNCTIONINFO));
-        }
-        char plain[256];
-        if (!demangle(plain, sizearray(plain), elf_list[elf_idx].name))
-          strlcpy(plain, elf_list[elf_idx].name, sizearray(plain));
-        state->functionlist[pos].name = strdup(plain);
-        state->functionlist[pos].addr_low = elf_list[elf_idx].address;
-        state->functionlist[pos].addr_high = elf_list[elf_idx].address + elf_list[elf_idx].size;
-        state->functionlist[pos].line_low = 0;
-        state->functionlist[pos].line_high = 0;
-        state->functionlist[pos].fileindex = 0;
+    /* merge the two lists, both are sorted on address */
+    unsigned elf_idx = 0;
+    dwarf_idx = 0;
+    for (unsigned pos = 0; pos < state->numfunctions; pos++) {
+      while (elf_idx < elf_funccount && elf_funcs[elf_idx] == NULL)
+        elf_idx++;
+      FUNCTIONINFO *func = &state->functionlist[pos];
+      if (elf_idx >= elf_funccount
+          || (dwarf_idx < dwarf_count && dwarf_list[dwarf_idx]->code_addr < (elf_funcs[elf_idx]->address & ~1)))
+      {
+        const DWARF_SYMBOLLIST *sym = dwarf_list[dwarf_idx++];
+        func->name = strdup(sym->name);
+        func->addr_low = sym->code_addr;
+        func->addr_high = sym->code_addr + sym->code_range;
+        func->line_low = sym->line;
+        func->line_high = sym->line_limit;
+        func->fileindex = sym->fileindex;
+      } else {
+        const ELF_SYMBOL *sym = elf_funcs[elf_idx++];
+        func->name = strdup(demangle_cached(&cache, sym->name));
+        func->addr_low = sym->address & ~1;
+        func->addr_high = (sym->address & ~1) + sym->size;
       }
     }
+    assert(dwarf_idx == dwarf_count);
     /* create an initial sort order */
     for (unsigned idx = 0; idx < state->numfunctions; idx++)
       state->functionorder[idx] = idx;
@@ -931,9 +2219,12 @@ static bool collect_functions(APPSTATE *state)
       free((void*)state->functionorder);
       state->functionorder = NULL;
     }
+    state->numfunctions = 0;
   }
-  if (dwarf_list != NULL)
-    free((void*)dwarf_list);
+  demangle_cache_clear(&cache);
+  free((void*)dwarf_list);
+  if (elf_funcs != NULL)
+    free((void*)elf_funcs);
   if (elf_list != NULL) {
     elf_clear_symbols(elf_list, elf_count);
     free((void*)elf_list);
@@ -1139,6 +2430,108 @@ static void panel_profile(struct nk_context *ctx, APPSTATE *state,
     checkbox_tooltip(ctx, "Accumulate samples", &state->accumulate, NK_TEXT_LEFT,
                      "Accumulate all samples since starting a profiling run");
 
+    static const char *graph_strings[] = { "Functions", "History", "Difference" };
+    static const int graph_views[] = { VIEW_TOP, VIEW_HISTORY, VIEW_DIFF };
+    int graph = 0;
+    for (int idx = 0; idx < NK_LEN(graph_views); idx++)
+      if (graph_views[idx] == state->view)
+        graph = idx;
+    nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(7));
+    nk_label(ctx, "Graph", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_push(ctx, VALUE_WIDTH(7));
+    struct nk_rect bounds = nk_widget_bounds(ctx);
+    result = nk_combo(ctx, graph_strings, NK_LEN(graph_strings), graph,
+                      (int)COMBOROW_CY, nk_vec2(bounds.w, 4.5*ROW_HEIGHT));
+    if (result != graph) {
+      if (state->view == VIEW_FUNCTION)
+        profile_clearsource(state);
+      state->view = graph_views[result];
+      state->refresh_tstamp = 0.0;  /* force refresh */
+    }
+    nk_layout_row_end(ctx);
+
+    nk_tree_state_pop(ctx);
+  }
+# undef LABEL_WIDTH
+# undef VALUE_WIDTH
+}
+
+static void panel_compare(struct nk_context *ctx, APPSTATE *state,
+                          enum nk_collapse_states tab_states[TAB_COUNT],
+                          float panel_width)
+{
+# define LABEL_WIDTH(n) ((n) * opt_fontsize)
+# define VALUE_WIDTH(n) (panel_width - LABEL_WIDTH(n) - 26)
+
+  if (nk_tree_state_push(ctx, NK_TREE_TAB, "Compare", &tab_states[TAB_COMPARE], NULL)) {
+    static const char *baseline_strings[] = { "Before mark", "Profile file" };
+    static const int baseline_sources[] = { DIFF_HISTORY, DIFF_FILE };
+    static const char *compare_strings[] = { "After mark", "Live", "Profile file" };
+    static const int compare_sources[] = { DIFF_HISTORY, DIFF_LIVE, DIFF_FILE };
+    static const char *side_labels[] = { "Baseline", "Compare" };
+    static const char *side_tips[] = { "Profile that is the reference", "Profile that is compared to the baseline" };
+    for (int side = 0; side < 2; side++) {
+      const char **strings = (side == 0) ? baseline_strings : compare_strings;
+      const int *sources = (side == 0) ? baseline_sources : compare_sources;
+      int count = (side == 0) ? NK_LEN(baseline_strings) : NK_LEN(compare_strings);
+      int sel = 0;
+      for (int idx = 0; idx < count; idx++)
+        if (sources[idx] == state->diff_source[side])
+          sel = idx;
+      nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 2);
+      nk_layout_row_push(ctx, LABEL_WIDTH(5));
+      label_tooltip(ctx, side_labels[side], NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, side_tips[side]);
+      nk_layout_row_push(ctx, VALUE_WIDTH(5));
+      struct nk_rect bounds = nk_widget_bounds(ctx);
+      sel = nk_combo(ctx, strings, count, sel, (int)COMBOROW_CY, nk_vec2(bounds.w, 4.5*ROW_HEIGHT));
+      state->diff_source[side] = sources[sel];
+      nk_layout_row_end(ctx);
+
+      if (state->diff_source[side] == DIFF_FILE) {
+        PROFILESNAPSHOT *snapshot = &state->diff_file[side];
+        nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 3);
+        nk_layout_row_push(ctx, LABEL_WIDTH(5));
+        nk_spacing(ctx, 1);
+        nk_layout_row_push(ctx, VALUE_WIDTH(5) - BROWSEBTN_WIDTH - 5);
+        if (snapshot->count > 0) {
+          const char *basename = strrchr(snapshot->path, DIRSEP_CHAR);
+          basename = (basename != NULL) ? basename + 1 : snapshot->path;
+          label_tooltip(ctx, basename, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, snapshot->path);
+        } else {
+          nk_label(ctx, "(no file loaded)", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+        }
+        nk_layout_row_push(ctx, BROWSEBTN_WIDTH);
+        if (button_symbol_tooltip(ctx, NK_SYMBOL_TRIPLE_DOT, NK_KEY_NONE, nk_true, "Load a profile that was saved to a CSV file")) {
+          nk_input_clear_mousebuttons(ctx);
+          osdialog_filters *filters = osdialog_filters_parse("CSV files:csv;All files:*");
+          char *fname = osdialog_file(OSDIALOG_OPEN, "Load profile", NULL, snapshot->path, filters);
+          osdialog_filters_free(filters);
+          if (fname != NULL) {
+            snapshot_load(fname, snapshot);
+            free(fname);
+            state->refresh_tstamp = 0.0;  /* force refresh */
+          }
+        }
+        nk_layout_row_end(ctx);
+      }
+    }
+
+    nk_layout_row_begin(ctx, NK_STATIC, ROW_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(5));
+    if (button_tooltip(ctx, "Mark", NK_KEY_NONE, nk_true, "Split the history in a range before and after this moment")) {
+      state->history.mark = state->history.seqnr;
+      state->refresh_tstamp = 0.0;  /* force refresh */
+    }
+    nk_layout_row_push(ctx, VALUE_WIDTH(5));
+    char valuestr[40];
+    if (state->history.mark > 0 && state->history.seqnr >= state->history.mark)
+      sprintf(valuestr, "%lu windows after mark", state->history.seqnr - state->history.mark);
+    else
+      strcpy(valuestr, "no mark set");
+    nk_label(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_end(ctx);
+
     nk_tree_state_pop(ctx);
   }
 # undef LABEL_WIDTH
@@ -1210,12 +2603,13 @@ static void button_bar(struct nk_context *ctx, APPSTATE *state)
 
   if (nk_button_label(ctx, "Clear")) {
     profile_reset(state, true);
+    history_reset(&state->history);
     state->capture_tstamp = get_timestamp();
   }
 
   if (nk_button_label(ctx, "Save") || nk_input_is_key_pressed(&ctx->input, NK_KEY_SAVE)) {
-    osdialog_filters *filters = osdialog_filters_parse("CSV files:csv;All files:*");
-    char *fname = osdialog_file(OSDIALOG_SAVE, "Save to CSV file", NULL, NULL, filters);
+    osdialog_filters *filters = osdialog_filters_parse("CSV files:csv;pprof profiles:pb,pprof;Callgrind files:callgrind;Speedscope files:json;All files:*");
+    char *fname = osdialog_file(OSDIALOG_SAVE, "Save profile", NULL, NULL, filters);
     osdialog_filters_free(filters);
     if (fname != NULL) {
       /* copy to local path, so that default extension can be appended */
@@ -1225,7 +2619,8 @@ static void button_bar(struct nk_context *ctx, APPSTATE *state)
       const char *ext;
       if ((ext = strrchr(path, '.')) == NULL || strchr(ext, DIRSEP_CHAR) != NULL)
         strlcat(path, ".csv", sizearray(path)); /* default extension .csv */
-      profile_save(path, state);
+      if (!profile_save(path, state))
+        tracelog_statusmsg(TRACESTATMSG_BMP, "Failed to save the profile.", BMPSTAT_NOTICE);
     }
   }
 
@@ -1244,6 +2639,14 @@ static void handle_stateaction(APPSTATE *state)
     dwarf_cleanup(&dwarf_linetable, &dwarf_symboltable, &dwarf_filetable);
     tracelog_statusclear();
     tracelog_statusmsg(TRACESTATMSG_BMP, "Initializing...", BMPSTAT_SUCCESS);
+    if (strlen(state->loopbackfile) > 0) {
+      /* replay from a file: no debug probe is involved, but the ELF file must
+         still be loaded */
+      state->firstrun = true;
+      state->dwarf_loaded = false;
+      state->curstate = STATE_LOAD_DWARF;
+      break;
+    }
     state->connected = bmp_connect(state->probe, (state->probe == state->netprobe) ? state->IPaddr : NULL);
     state->firstrun = true;
     state->dwarf_loaded = false;
@@ -1278,7 +2681,7 @@ static void handle_stateaction(APPSTATE *state)
     }
     break;
   case STATE_LOAD_DWARF:
-    if (!state->attached) {
+    if (!state->attached && strlen(state->loopbackfile) == 0) {
       state->curstate = STATE_IDLE;
       break;
     }
@@ -1289,9 +2692,13 @@ static void handle_stateaction(APPSTATE *state)
     } else {
       FILE *fp = fopen(state->ELFfile, "rb");
       if (fp != NULL) {
-        /* get range of all code sections */
-        state->code_base = state->code_top = 0;
-        for (int segm = 0; ; segm++) {
+        /* register the ranges of all code segments in the sample map */
+        samplemap_destroy(state->sample_map);
+        state->sample_map = samplemap_create();
+        state->funcbins = false;
+        state->linebins = false;
+        bool map_ok = (state->sample_map != NULL);
+        for (int segm = 0; map_ok; segm++) {
           unsigned long vaddr, memsize;
           int type, flags;
           int err = elf_segment_by_index(fp, segm, &type, &flags, NULL, NULL, &vaddr, NULL, &memsize);
@@ -1299,25 +2706,14 @@ static void handle_stateaction(APPSTATE *state)
             break;
           if (type == ELF_PT_LOAD && (flags & ELF_PF_X) != 0) {
             /* only handle loadable segments that are executable */
-            if (state->code_base == 0 && state->code_top == 0) {
-              state->code_base = vaddr;
-              state->code_top = vaddr + memsize;
-            } else {
-              unsigned long top = vaddr + memsize;
-              if (vaddr < state->code_base)
-                state->code_base = vaddr;
-              if (top > state->code_top)
-                state->code_top = vaddr;
-            }
+            map_ok = samplemap_addrange(state->sample_map, (uint32_t)vaddr, (uint32_t)(vaddr + memsize));
           }
         }
-        /* allocate memory for sample map */
-        unsigned count = (state->code_top - state->code_base) / ADDRESS_ALIGN + 1;  /* +1 for out-of-range samples */
-        state->sample_map = (unsigned*)malloc(count * sizeof(unsigned));
-        if (state->sample_map != NULL)
-          memset(state->sample_map, 0, count * sizeof(unsigned));
-        else
+        if (!map_ok) {
+          samplemap_destroy(state->sample_map);
+          state->sample_map = NULL;
           tracelog_statusmsg(TRACESTATMSG_BMP, "Memory allocation error.", BMPSTAT_NOTICE);
+        }
         /* load dwarf */
         int address_size;
         if (dwarf_read(fp, &dwarf_linetable, &dwarf_symboltable, &dwarf_filetable, &address_size))
@@ -1330,7 +2726,13 @@ static void handle_stateaction(APPSTATE *state)
       }
     }
     profile_reset(state, true);
-    state->curstate = state->dwarf_loaded ? STATE_INIT_TARGET : STATE_IDLE;
+    history_reset(&state->history);
+    if (!state->dwarf_loaded)
+      state->curstate = STATE_IDLE;
+    else if (strlen(state->loopbackfile) > 0)
+      state->curstate = STATE_RUN;  /* no target to initialize on replay */
+    else
+      state->curstate = STATE_INIT_TARGET;
     break;
   case STATE_INIT_TARGET:
     if (state->init_target) {
@@ -1396,6 +2798,21 @@ static void handle_stateaction(APPSTATE *state)
     break;
   case STATE_RUN:
     tracelog_statusclear();
+    if (strlen(state->loopbackfile) > 0) {
+      profile_reset(state, true);
+      state->trace_status = trace_initloopback(state->loopbackfile, state->loopback_realtime ? state->bitrate : 0, true);
+      if (state->trace_status == TRACESTAT_OK) {
+        char msg[_MAX_PATH + 20];
+        snprintf(msg, sizearray(msg), "Replaying %s", state->loopbackfile);
+        tracelog_statusmsg(TRACESTATMSG_BMP, msg, BMPSTAT_SUCCESS);
+      } else {
+        tracelog_statusmsg(TRACESTATMSG_BMP, "Failed to open the recording.", BMPSTAT_NOTICE);
+      }
+      state->capture_tstamp = get_timestamp();
+      state->actual_freq = state->samplingfreq;
+      state->curstate = (state->trace_status == TRACESTAT_OK) ? STATE_RUNNING : STATE_IDLE;
+      break;
+    }
     if (state->init_target && !state->init_done) {
       state->curstate = STATE_INIT_TARGET;
       break;
@@ -1403,6 +2820,17 @@ static void handle_stateaction(APPSTATE *state)
     profile_reset(state, true);
     state->trace_status = trace_init(state->trace_endpoint, (state->probe == state->netprobe) ? state->IPaddr : NULL);
     state->curstate = (state->trace_status == TRACESTAT_OK) ? STATE_RUNNING : STATE_IDLE;
+    if (state->trace_status == TRACESTAT_OK && strlen(state->recordfile) > 0 && !trace_recordactive()) {
+      /* a recording runs from the first profiling run until exit */
+      TRACERECORDING info;
+      info.bitrate = (state->swomode == MODE_ASYNC) ? state->bitrate : 0;
+      info.datasize = 0;
+      info.tsdlhash = 0;
+      if (!trace_recordstart(state->recordfile, &info)) {
+        tracelog_statusmsg(TRACESTATMSG_BMP, "Failed to create the recording file.", BMPSTAT_NOTICE);
+        state->recordfile[0] = '\0';   /* do not retry */
+      }
+    }
     if (state->firstrun) {
       state->capture_tstamp = get_timestamp();
       state->actual_freq = state->samplingfreq;
@@ -1438,6 +2866,8 @@ int main(int argc, char *argv[])
   appstate.init_bmp = nk_true;
   appstate.connect_srst = nk_false;
   appstate.view = VIEW_TOP;
+  appstate.diff_source[0] = DIFF_HISTORY;
+  appstate.diff_source[1] = DIFF_HISTORY;
 
 # if defined FORTIFY
     Fortify_SetOutputFunc(Fortify_OutputFunc);
@@ -1492,6 +2922,22 @@ int main(int argc, char *argv[])
             strlcpy(opt_fontmono, mono, sizearray(opt_fontmono));
         }
         break;
+      case 'l':
+      case 'L':
+        ptr = &argv[idx][2];
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        if (access(ptr, 0) == 0) {
+          strlcpy(appstate.loopbackfile, ptr, sizearray(appstate.loopbackfile));
+          appstate.loopback_realtime = (argv[idx][1] == 'L');
+        }
+        break;
+      case 'r':
+        ptr = &argv[idx][2];
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        strlcpy(appstate.recordfile, ptr, sizearray(appstate.recordfile));
+        break;
       case 'v':
         version();
         return EXIT_SUCCESS;
@@ -1567,22 +3013,27 @@ int main(int argc, char *argv[])
 
         /* profile graph */
         int events = traceprofile_process(appstate.curstate == STATE_RUNNING, appstate.sample_map,
-                                          appstate.code_base, appstate.code_top,
                                           &appstate.overflow);
         waitidle = (events == 0);
         /* if interval has passed, make copy of data for the graph */
         double tstamp = get_timestamp();
         if (tstamp - appstate.refresh_tstamp >= appstate.refreshrate && appstate.sample_map != NULL) {
           appstate.refresh_tstamp = tstamp;
+          if (appstate.curstate == STATE_RUNNING)
+            history_record(&appstate);
           if (appstate.view == VIEW_TOP)
             profile_graph_top(&appstate);
-          else
+          else if (appstate.view == VIEW_FUNCTION)
             profile_graph_source(&appstate);
+          else if (appstate.view == VIEW_HISTORY)
+            profile_graph_history(&appstate);
+          else
+            profile_graph_diff(&appstate);
           double freq = appstate.total_samples / (tstamp - appstate.capture_tstamp);
           appstate.actual_freq = (appstate.actual_freq + (unsigned long)(freq + 0.5)) / 2;
           if (appstate.curstate == STATE_RUNNING && !appstate.accumulate) {
-            unsigned count = (appstate.code_top - appstate.code_base) / ADDRESS_ALIGN + 1;
-            memset(appstate.sample_map, 0, count * sizeof(unsigned));
+            samplemap_clear(appstate.sample_map);
+            history_resync(&appstate.history);
             appstate.capture_tstamp = tstamp;
           }
         }
@@ -1600,6 +3051,7 @@ int main(int argc, char *argv[])
         panel_options(ctx, &appstate, tab_states, nk_hsplitter_colwidth(&splitter_hor, 1));
         panel_profile(ctx, &appstate, tab_states, nk_hsplitter_colwidth(&splitter_hor, 1));
         panel_status(ctx, &appstate, tab_states, nk_hsplitter_colwidth(&splitter_hor, 1));
+        panel_compare(ctx, &appstate, tab_states, nk_hsplitter_colwidth(&splitter_hor, 1));
         nk_group_end(ctx);
       }
 
@@ -1630,9 +3082,14 @@ int main(int argc, char *argv[])
   ini_puts("Session", "recent", appstate.ELFfile, txtConfigFile);
 
   clear_functions(&appstate);
+  history_clear(&appstate.history);
+  snapshot_clear(&appstate.diff_file[0]);
+  snapshot_clear(&appstate.diff_file[1]);
+  samplemap_destroy(appstate.sample_map);
   clear_probelist(appstate.probelist, appstate.netprobe);
   if (appstate.monitor_cmds != NULL)
     free((void*)appstate.monitor_cmds);
+  trace_recordstop();
   trace_close();
   guidriver_close();
   tracestring_clear();
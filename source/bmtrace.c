@@ -51,6 +51,7 @@
 #include "bmp-script.h"
 #include "bmp-scan.h"
 #include "bmp-support.h"
+#include "c11threads.h"
 #include "demangle.h"
 #include "dwarf.h"
 #include "elf.h"
@@ -165,6 +166,10 @@ static void usage(const char *invalid_option)
          "Options:\n"
          "-f=value  Font size to use (value must be 8 or larger).\n"
          "-h        This help.\n"
+         "-l=path   Replay a recording or raw SWO data from a file, instead of capturing\n"
+         "          it from a debug probe (loopback test); replay is at full speed.\n"
+         "-L=path   Like -l, but replay in real time.\n"
+         "-r=path   Record the raw SWO data to a file, for replay with -l or -L.\n"
          "-t=path   Path to the TSDL metadata file to use.\n"
          "-v        Show version information.\n");
 }
@@ -228,6 +233,11 @@ typedef struct tagAPPSTATE {
   bool reload_format;           /**< whether to reload the TSDL file */
   char TSDLfile[_MAX_PATH];     /**< CTF decoding, message file */
   char ELFfile[_MAX_PATH];      /**< ELF file for symbol/address look-up */
+  char loopbackfile[_MAX_PATH]; /**< file with raw SWO data to replay (instead of capturing from a probe) */
+  char savefile[_MAX_PATH];     /**< file that is being saved in the background (empty if none) */
+  TRACEHEALTH health;           /**< most recent sample of the capture & decoding statistics */
+  bool loopback_realtime;       /**< whether to replay the loopback file in real time (instead of full speed) */
+  char recordfile[_MAX_PATH];   /**< file to record the raw SWO data in */
   int severity;                 /**< severity level (CTF decoding) */
   TRACEFILTER *filterlist;      /**< filter expressions */
   int filtercount;              /**< count of valid entries in filterlist */
@@ -237,6 +247,7 @@ typedef struct tagAPPSTATE {
   int cur_chan_edit;            /**< channel info currently being edited (-1 if none) */
   char chan_str[64];            /**< edit string for channel currently being edited */
   int cur_match_line;           /**< current line matched in "find" function, or the timeline click position (-1 if not active) */
+  unsigned long long evicted;   /**< lines evicted from the trace store (line numbers shift down) */
   int find_popup;               /**< whether "find" popup is active (plus match state) */
   char findtext[128];           /**< search text (keywords) */
   bool help_popup;              /**< whether "help" popup is active */
@@ -609,10 +620,12 @@ static void panel_options(struct nk_context *ctx, APPSTATE *state,
     int result = state->datasize;
     state->datasize = nk_combo(ctx, datasize_strings, NK_LEN(datasize_strings), state->datasize, (int)opt_fontsize, nk_vec2(VALUE_WIDTH,5.5*opt_fontsize));
     if (state->datasize != result) {
+      tracestring_lock();
       trace_setdatasize((state->datasize == 3) ? 4 : (short)state->datasize);
       tracestring_clear();
       trace_overflowerrors(true);
       ctf_decode_reset();
+      tracestring_unlock();
       state->trace_count = 0;
       state->overflow = 0;
       if (state->trace_status == TRACESTAT_OK)
@@ -717,6 +730,85 @@ static void panel_status(struct nk_context *ctx, APPSTATE *state,
     label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, "SWO packet errors.\nVerify 'Data size' setting.");
     nk_layout_row_end(ctx);
 
+    TRACEQUEUESTATS qstats;
+    trace_queuestats(&qstats, false);
+    char tiptext[100];
+    nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(8));
+    nk_label(ctx, "Queue peak", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_push(ctx, VALUE_WIDTH(8));
+    sprintf(valuestr, "%u%%", (unsigned)((qstats.highwater * 100 + qstats.size - 1) / qstats.size));
+    snprintf(tiptext, sizearray(tiptext), "Maximum fill level of the packet queue (%lu KiB).\n%lu packets dropped.",
+             (unsigned long)(qstats.size / 1024), qstats.dropped);
+    label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, tiptext);
+    nk_layout_row_end(ctx);
+
+    const TRACEHEALTH *health = &state->health;
+    nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(8));
+    nk_label(ctx, "Input rate", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_push(ctx, VALUE_WIDTH(8));
+    sprintf(valuestr, "%.1f kB/s", health->inputrate / 1000.0);
+    snprintf(tiptext, sizearray(tiptext), "Data received from the probe.\n%lu failed reads, %lu reconnections.",
+             health->captureerrors, health->reconnects);
+    label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, tiptext);
+    nk_layout_row_end(ctx);
+
+    nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(8));
+    nk_label(ctx, "Queue fill", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_push(ctx, VALUE_WIDTH(8));
+    sprintf(valuestr, "%u%%", (unsigned)((qstats.fill * 100 + qstats.size - 1) / qstats.size));
+    label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, "Current fill level of the packet queue.");
+    nk_layout_row_end(ctx);
+
+    nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(8));
+    nk_label(ctx, "Latency", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_push(ctx, VALUE_WIDTH(8));
+    sprintf(valuestr, "%.1f ms", health->latency * 1000.0);
+    snprintf(tiptext, sizearray(tiptext), "Average time between capture and decoding.\nMaximum %.1f ms.", health->maxlatency * 1000.0);
+    label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, tiptext);
+    nk_layout_row_end(ctx);
+
+    nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+    nk_layout_row_push(ctx, LABEL_WIDTH(8));
+    nk_label(ctx, "Decoder load", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+    nk_layout_row_push(ctx, VALUE_WIDTH(8));
+    sprintf(valuestr, "%.1f%%", health->decodeload * 100.0);
+    snprintf(tiptext, sizearray(tiptext), "Fraction of the time spent decoding.\nPer frame: decode %.2f ms, render %.2f ms.",
+             health->framedecode * 1000.0, health->framerender * 1000.0);
+    label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, tiptext);
+    nk_layout_row_end(ctx);
+
+    for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+      if (health->packetrate[chan] <= 0.0 && health->ctferrors[chan] == 0)
+        continue;
+      char label[32];
+      sprintf(label, "Channel %d", chan);
+      nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+      nk_layout_row_push(ctx, LABEL_WIDTH(8));
+      nk_label(ctx, label, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+      nk_layout_row_push(ctx, VALUE_WIDTH(8));
+      sprintf(valuestr, "%.1f kB/s", health->byterate[chan] / 1000.0);
+      snprintf(tiptext, sizearray(tiptext), "%.0f packets/s.\n%lu CTF decoding errors.",
+               health->packetrate[chan], health->ctferrors[chan]);
+      label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, tiptext);
+      nk_layout_row_end(ctx);
+    }
+
+    bool complete;
+    int hits = tracestring_findcount(&complete);
+    if (hits >= 0) {
+      nk_layout_row_begin(ctx, NK_STATIC, LINE_HEIGHT, 2);
+      nk_layout_row_push(ctx, LABEL_WIDTH(8));
+      nk_label(ctx, "Search hits", NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE);
+      nk_layout_row_push(ctx, VALUE_WIDTH(8));
+      sprintf(valuestr, complete ? "%d" : "%d...", hits);
+      label_tooltip(ctx, valuestr, NK_TEXT_ALIGN_LEFT | NK_TEXT_ALIGN_MIDDLE, "Number of lines that match the search text.");
+      nk_layout_row_end(ctx);
+    }
+
     nk_tree_state_pop(ctx);
   }
 # undef LABEL_WIDTH
@@ -919,6 +1011,19 @@ static void channel_options(struct nk_context *ctx, APPSTATE *state,
 
 static void button_bar(struct nk_context *ctx, APPSTATE *state)
 {
+  if (state->savefile[0] != '\0') {
+    bool done;
+    int count = tracestring_savestatus(&done);
+    if (done) {
+      if (count <= 0) {
+        char msg[_MAX_PATH + 50];
+        snprintf(msg, sizearray(msg), "Failed writing to %s.", state->savefile);
+        nk_msgbox(ctx, msg, "Notice");
+      }
+      state->savefile[0] = '\0';
+    }
+  }
+
   nk_layout_row(ctx, NK_DYNAMIC, ROW_HEIGHT, 6, nk_ratio(6, 1.0/6.0, 1.0/6.0, 1.0/6.0, 1.0/6.0, 1.0/6.0, 1.0/6.0));
   const char *caption;
   if (state->trace_running) {
@@ -936,8 +1041,10 @@ static void button_bar(struct nk_context *ctx, APPSTATE *state)
     state->overflow = 0;
     if (state->tracedata_from_file) {
       state->tracedata_from_file = false;
+      tracestring_lock();
       tracestring_clear();
       ctf_decode_reset();
+      tracestring_unlock();
       tracestring_findbookmark(BK_CLEAR);
       state->trace_count = 0;
       state->cur_match_line = -1;
@@ -949,10 +1056,12 @@ static void button_bar(struct nk_context *ctx, APPSTATE *state)
     }
   }
   if (nk_button_label(ctx, "Clear")) {
+    tracestring_lock();
     tracestring_clear();
     trace_overflowerrors(true);
     state->overflow = 0;
     ctf_decode_reset();
+    tracestring_unlock();
     tracestring_findbookmark(BK_CLEAR);
     state->trace_count = 0;
     state->cur_match_line = -1;
@@ -961,7 +1070,9 @@ static void button_bar(struct nk_context *ctx, APPSTATE *state)
   if (nk_button_label(ctx, "Search") || nk_input_is_key_pressed(&ctx->input, NK_KEY_FIND))
     state->find_popup = 1;
   if (nk_button_label(ctx, "Save") || nk_input_is_key_pressed(&ctx->input, NK_KEY_SAVE)) {
-    if (tracestring_isempty()) {
+    if (state->savefile[0] != '\0') {
+      nk_msgbox(ctx, "The trace data is still being saved.", "Notice");
+    } else if (tracestring_isempty()) {
       nk_msgbox(ctx, "No data to save.", "Notice");
     } else {
       osdialog_filters *filters = osdialog_filters_parse("CSV files:csv;All files:*");
@@ -975,8 +1086,10 @@ static void button_bar(struct nk_context *ctx, APPSTATE *state)
         const char *ext;
         if ((ext = strrchr(path, '.')) == NULL || strchr(ext, DIRSEP_CHAR) != NULL)
           strlcat(path, ".csv", sizearray(path)); /* default extension .csv */
-        int count = tracestring_save(path);
-        if (count <= 0) {
+        /* save in the background, the result is checked on later frames */
+        if (tracestring_savestart(path)) {
+          strlcpy(state->savefile, path, sizearray(state->savefile));
+        } else {
           char msg[_MAX_PATH + 50];
           snprintf(msg, sizearray(msg), "Failed writing to %s.", path);
           nk_msgbox(ctx, msg, "Notice");
@@ -1021,19 +1134,29 @@ static void handle_stateaction(APPSTATE *state)
 {
   if (state->reinitialize == 1) {
     int result;
-    char msg[200];
+    char msg[_MAX_PATH + 50];
     tracelog_statusclear();
+    tracestring_lock();
     tracestring_clear();
     trace_overflowerrors(true);
     ctf_decode_reset();
+    tracestring_unlock();
     state->trace_count = 0;
     state->overflow = 0;
     state->line_limit = 400;
     if ((state->mcuclock = strtol(state->cpuclock_str, NULL, 10)) == 0)
       state->mcuclock = 48000000;
+    /* if the target enables local timestamps in the ITM, these run on the
+       CPU clock (the prescaler is 1 after reset) */
+    trace_settimestampclock(state->mcuclock);
     if (state->swomode == MODE_MANCHESTER || (state->bitrate = strtol(state->bitrate_str, NULL, 10)) == 0)
       state->bitrate = 100000;
-    if (state->init_target || state->init_bmp) {
+    trace_setbitrate((state->swomode == MODE_ASYNC) ? state->bitrate : 0);
+    if (strlen(state->loopbackfile) > 0) {
+      /* replay raw trace data from a file (no debug probe is involved) */
+      state->trace_status = trace_initloopback(state->loopbackfile, state->loopback_realtime ? state->bitrate : 0, true);
+      result = 0;
+    } else if (state->init_target || state->init_bmp) {
       /* open/reset the serial port/device if any initialization must be done */
       if (bmp_comport() != NULL)
         bmp_break();
@@ -1118,7 +1241,16 @@ static void handle_stateaction(APPSTATE *state)
     state->trace_running = (state->trace_status == TRACESTAT_OK);
     switch (state->trace_status) {
     case TRACESTAT_OK:
-      if (state->init_target || state->init_bmp) {
+      if (strlen(state->loopbackfile) > 0) {
+        TRACERECORDING info;
+        if (trace_recordinfo(state->loopbackfile, &info) && info.tsdlhash != trace_tsdlhash(state->TSDLfile)) {
+          snprintf(msg, sizearray(msg), "Replaying %s (recorded with a different TSDL file)", state->loopbackfile);
+          tracelog_statusmsg(TRACESTATMSG_BMP, msg, BMPSTAT_NOTICE);
+        } else {
+          snprintf(msg, sizearray(msg), "Replaying %s", state->loopbackfile);
+          tracelog_statusmsg(TRACESTATMSG_BMP, msg, BMPSTAT_SUCCESS);
+        }
+      } else if (state->init_target || state->init_bmp) {
         assert(strlen(state->mcu_family) > 0);
         snprintf(msg, sizearray(msg), "Connected [%s]", state->mcu_family);
         tracelog_statusmsg(TRACESTATMSG_BMP, msg, BMPSTAT_SUCCESS);
@@ -1155,6 +1287,27 @@ static void handle_stateaction(APPSTATE *state)
     case TRACESTAT_NO_CONNECT:
       tracelog_statusmsg(TRACESTATMSG_BMP, "Failed to \"attach\" to Black Magic Probe", BMPERR_GENERAL);
       break;
+    case TRACESTAT_NO_MEMORY:
+      tracelog_statusmsg(TRACESTATMSG_BMP, "Insufficient memory for the trace queue", BMPERR_GENERAL);
+      break;
+    }
+    /* a recording runs from the first successful initialization until exit,
+       it is not restarted on re-initialization */
+    if (state->trace_status == TRACESTAT_OK && strlen(state->recordfile) > 0 && !trace_recordactive()
+        && strcmp(state->recordfile, state->loopbackfile) != 0)
+    {
+      TRACERECORDING info;
+      info.bitrate = (state->swomode == MODE_ASYNC) ? state->bitrate : 0;
+      info.datasize = (state->datasize == 3) ? 4 : (short)state->datasize;
+      info.tsdlhash = trace_tsdlhash(state->TSDLfile);
+      if (trace_recordstart(state->recordfile, &info)) {
+        snprintf(msg, sizearray(msg), "Recording to %s", state->recordfile);
+        tracelog_statusmsg(TRACESTATMSG_BMP, msg, BMPSTAT_SUCCESS);
+      } else {
+        snprintf(msg, sizearray(msg), "Failed to create recording %s", state->recordfile);
+        tracelog_statusmsg(TRACESTATMSG_BMP, msg, BMPERR_GENERAL);
+        state->recordfile[0] = '\0';   /* do not retry */
+      }
     }
     state->reinitialize = nk_false;
   } else if (state->reinitialize > 0) {
@@ -1162,6 +1315,9 @@ static void handle_stateaction(APPSTATE *state)
   }
 
   if (state->reload_format) {
+    /* the decoder thread uses the CTF definitions and the symbol table, so
+       block it while these are reloaded */
+    tracestring_lock();
     ctf_parse_cleanup();
     ctf_decode_cleanup();
     tracestring_clear();
@@ -1208,6 +1364,7 @@ static void handle_stateaction(APPSTATE *state)
         state->error_flags &= ~ERROR_NO_ELF;
       }
     }
+    tracestring_unlock();
     state->reload_format = false;
   }
 }
@@ -1247,6 +1404,23 @@ int main(int argc, char *argv[])
   char opt_fontstd[64] = "", opt_fontmono[64] = "";
   ini_gets("Settings", "fontstd", "", opt_fontstd, sizearray(opt_fontstd), txtConfigFile);
   ini_gets("Settings", "fontmono", "", opt_fontmono, sizearray(opt_fontmono), txtConfigFile);
+  long opt_queuesize = ini_getl("Settings", "queuesize", 1024, txtConfigFile); /* in KiB */
+  trace_setqueuesize((size_t)opt_queuesize * 1024);
+  int opt_transfers = (int)ini_getl("Settings", "transfers", 8, txtConfigFile);
+  long opt_xfersize = ini_getl("Settings", "transfersize", 4096, txtConfigFile);
+  trace_setcapture(opt_transfers, (size_t)opt_xfersize);
+  long opt_retainlines = ini_getl("Settings", "retain-lines", 0, txtConfigFile);
+  long opt_retainsize = ini_getl("Settings", "retain-size", 0, txtConfigFile); /* in MiB */
+  char opt_spillfile[_MAX_PATH];
+  ini_gets("Settings", "spill-file", "", opt_spillfile, sizearray(opt_spillfile), txtConfigFile);
+  tracestring_setretention((opt_retainlines > 0) ? (unsigned)opt_retainlines : 0,
+                           (opt_retainsize > 0) ? (size_t)opt_retainsize * 1024 * 1024 : 0,
+                           opt_spillfile);
+  char opt_healthfile[_MAX_PATH];
+  ini_gets("Settings", "health-file", "", opt_healthfile, sizearray(opt_healthfile), txtConfigFile);
+  double opt_healthinterval = ini_getf("Settings", "health-interval", 1.0, txtConfigFile);
+  if (opt_healthinterval < 0.1)
+    opt_healthinterval = 0.1;
   char valstr[128];
   int canvas_width, canvas_height;
   ini_gets("Settings", "size", "", valstr, sizearray(valstr), txtConfigFile);
@@ -1288,6 +1462,22 @@ int main(int argc, char *argv[])
             strlcpy(opt_fontmono, mono, sizearray(opt_fontmono));
         }
         break;
+      case 'l':
+      case 'L':
+        ptr = &argv[idx][2];
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        if (access(ptr, 0) == 0) {
+          strlcpy(appstate.loopbackfile, ptr, sizearray(appstate.loopbackfile));
+          appstate.loopback_realtime = (argv[idx][1] == 'L');
+        }
+        break;
+      case 'r':
+        ptr = &argv[idx][2];
+        if (*ptr == '=' || *ptr == ':')
+          ptr++;
+        strlcpy(appstate.recordfile, ptr, sizearray(appstate.recordfile));
+        break;
       case 't':
         ptr = &argv[idx][2];
         if (*ptr == '=' || *ptr == ':')
@@ -1339,7 +1529,12 @@ int main(int argc, char *argv[])
                                           opt_fontstd, opt_fontmono, opt_fontsize);
   nuklear_style(ctx);
 
+  /* decode trace data in a background thread, independent of the GUI */
+  trace_decodethread(true);
+
   int waitidle = 1;
+  double frame_rendertime = 0.0;  /* accumulated time for layout & rendering */
+  unsigned frame_count = 0;
   for ( ;; ) {
     /* handle state, (re-)connect and/or (re-)load of CTF definitions */
     handle_stateaction(&appstate);
@@ -1349,6 +1544,7 @@ int main(int argc, char *argv[])
     if (!guidriver_poll(waitidle))
       break;
     nk_input_end(ctx);
+    double framestart = get_timestamp();
 
     /* other events */
     int dev_event = guidriver_monitor_usb(0x1d50, 0x6018);
@@ -1377,7 +1573,16 @@ int main(int argc, char *argv[])
         /* trace log */
         int count = tracestring_process(appstate.trace_running);
         appstate.trace_count += count;
-        waitidle = (count == 0);
+        waitidle = (count == 0 && appstate.savefile[0] == '\0');
+        TRACESTORESTATS storestats;
+        tracestring_storestats(&storestats);
+        if (storestats.evicted != appstate.evicted) {
+          /* old lines were dropped (or the store was cleared), the matched line moved up */
+          unsigned long long shift = (storestats.evicted > appstate.evicted) ? storestats.evicted - appstate.evicted : 0;
+          if (appstate.cur_match_line >= 0)
+            appstate.cur_match_line = ((unsigned long long)appstate.cur_match_line >= shift) ? appstate.cur_match_line - (int)shift : -1;
+          appstate.evicted = storestats.evicted;
+        }
         nk_layout_row_dynamic(ctx, nk_vsplitter_rowheight(&splitter_ver, 0), 1);
         int limitlines = appstate.trace_running ? appstate.line_limit : -1;
         tracelog_widget(ctx, "tracelog", opt_fontsize, limitlines, appstate.cur_match_line,
@@ -1438,6 +1643,26 @@ int main(int argc, char *argv[])
 
     /* Draw */
     guidriver_render(COLOUR_BG0_S);
+
+    /* sample the statistics periodically, optionally append them to a file
+       (as JSON) */
+    double frameend = get_timestamp();
+    frame_rendertime += frameend - framestart;
+    frame_count += 1;
+    if (frameend - appstate.health.timestamp >= opt_healthinterval) {
+      trace_health(&appstate.health);
+      appstate.health.framedecode = appstate.health.decodeload * appstate.health.interval / frame_count;
+      appstate.health.framerender = frame_rendertime / frame_count;
+      frame_rendertime = 0.0;
+      frame_count = 0;
+      if (opt_healthfile[0] != '\0') {
+        FILE *fp = fopen(opt_healthfile, "at");
+        if (fp != NULL) {
+          trace_healthjson(fp, &appstate.health);
+          fclose(fp);
+        }
+      }
+    }
   }
 
   /* save configuration */
@@ -1445,15 +1670,36 @@ int main(int argc, char *argv[])
   ini_putf("Settings", "fontsize", opt_fontsize, txtConfigFile);
   ini_puts("Settings", "fontstd", opt_fontstd, txtConfigFile);
   ini_puts("Settings", "fontmono", opt_fontmono, txtConfigFile);
+  ini_putl("Settings", "queuesize", opt_queuesize, txtConfigFile);
+  ini_putl("Settings", "transfers", opt_transfers, txtConfigFile);
+  ini_putl("Settings", "transfersize", opt_xfersize, txtConfigFile);
+  ini_putl("Settings", "retain-lines", opt_retainlines, txtConfigFile);
+  ini_putl("Settings", "retain-size", opt_retainsize, txtConfigFile);
+  ini_puts("Settings", "spill-file", opt_spillfile, txtConfigFile);
+  ini_puts("Settings", "health-file", opt_healthfile, txtConfigFile);
+  ini_putf("Settings", "health-interval", opt_healthinterval, txtConfigFile);
   sprintf(valstr, "%d %d", canvas_width, canvas_height);
   ini_puts("Settings", "size", valstr, txtConfigFile);
 
   clear_probelist(appstate.probelist, appstate.netprobe);
   if (appstate.monitor_cmds != NULL)
     free((void*)appstate.monitor_cmds);
+  trace_decodethread(false);
+  trace_recordstop();
   trace_close();
   guidriver_close();
+  if (appstate.savefile[0] != '\0') {
+    bool done = false;
+    for ( ;; ) {
+      tracestring_savestatus(&done);  /* let a background save complete */
+      if (done)
+        break;
+      struct timespec ts = { 0, 10000000 };  /* sleep 10 ms */
+      thrd_sleep(&ts, NULL);
+    }
+  }
   tracestring_clear();
+  tracestring_setretention(0, 0, NULL);  /* closes the spill file */
   bmscript_clear();
   gdbrsp_packetsize(0);
   ctf_parse_cleanup();
@@ -75,6 +75,9 @@ static const CTF_EVENT_FIELD *field = NULL;         /* field currently being par
 static const CTF_CLOCK *clock;                      /* clock set for the stream */
 static double timestamp = 0.0;                      /* timestamp in the event header */
 
+#define ERROR_STREAMS 32
+static unsigned long errorcount[ERROR_STREAMS];     /* decoding errors per stream */
+
 static unsigned char *cache = NULL;
 static size_t cache_size = 0;
 static size_t cache_filled = 0;
@@ -289,6 +292,25 @@ int msgstack_peek(uint16_t *streamid, uint16_t *eventid, uint8_t *severity, doub
   return 1;
 }
 
+static void count_error(long streamid)
+{
+  if (streamid >= 0 && streamid < ERROR_STREAMS)
+    errorcount[streamid] += 1;
+}
+
+/** ctf_decode_errors() returns the number of decoding errors on a stream
+ *  since the decoder was last reset. Errors are: data that had to be skipped
+ *  to find the start of a packet, and packets for an unknown stream or event.
+ *
+ *  \param streamid  The stream ID (or the channel, for streams without ID).
+ */
+unsigned long ctf_decode_errors(int streamid)
+{
+  if (streamid < 0 || streamid >= ERROR_STREAMS)
+    return 0;
+  return errorcount[streamid];
+}
+
 void ctf_set_symtable(const DWARF_SYMBOLLIST *symtable)
 {
   symboltable = symtable;
@@ -547,10 +569,12 @@ restart:
       } else {
         /* mismatch, re-scan */
         cache_reset();
+        count_error(channel);
       }
     }
     if (state == STATE_SCAN_MAGIC) {
       /* scanning for header (so cache check failed) */
+      size_t skipstart = idx;
       while (idx < size) {
         while (idx < size && stream[idx] != magic[0])
           idx++;  /* find first byte of the magic */
@@ -560,6 +584,8 @@ restart:
           if (idx + len > size)
             len = size - idx;
           if (memcmp(stream + idx, magic + cache_filled, len) == 0) {
+            if (idx > skipstart)
+              count_error(channel); /* bytes were skipped to find the magic */
             /* match, check whether this is still a patial match */
             if (len == pkt_header->header.magic_size / 8u) {
               state++;  /* full match -> advance state & restart */
@@ -576,6 +602,8 @@ restart:
           }
         }
       }
+      if (idx > skipstart)
+        count_error(channel);
     }
     break;
 
@@ -659,6 +687,7 @@ restart:
         goto restart;
       } else {
         /* stream not found, drop the decoding */
+        count_error(channel);
         state = STATE_SCAN_MAGIC;
         assert(cache_filled == 0);
         goto restart;
@@ -702,6 +731,7 @@ restart:
         }
       } else {
         /* event not found, drop the decoding */
+        count_error(channel);
         state = STATE_SCAN_MAGIC;
       }
       cache_reset();
@@ -819,5 +849,6 @@ void ctf_decode_reset(void)
   cache_reset();
   msgbuffer_reset();
   state = STATE_SCAN_MAGIC;
+  memset(errorcount, 0, sizeof errorcount);
 }
 
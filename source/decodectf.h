@@ -24,6 +24,7 @@
 int ctf_decode(const unsigned char *stream, size_t size, long channel);
 void ctf_decode_reset(void);
 void ctf_decode_cleanup(void);
+unsigned long ctf_decode_errors(int streamid);
 void ctf_set_symtable(const DWARF_SYMBOLLIST *symtable);
 void ctf_set_filter(unsigned long streammask, unsigned char severity);
 int msgstack_pop(uint16_t *streamid, double *timestamp, char *message, size_t size);
@@ -2022,6 +2022,25 @@ const DWARF_SYMBOLLIST *dwarf_sym_from_index(const DWARF_SYMBOLLIST *symboltable
   return NULL;
 }
 
+static int compare_symbol_name(const void *a,const void *b)
+{
+  const DWARF_SYMBOLLIST *sym1=*(const DWARF_SYMBOLLIST**)a;
+  const DWARF_SYMBOLLIST *sym2=*(const DWARF_SYMBOLLIST**)b;
+  int result=strcmp(sym1->name,sym2->name);
+  if (result==0)
+    result=(sym1->code_addr>sym2->code_addr)-(sym1->code_addr<sym2->code_addr);
+  return result;
+}
+
+static int compare_symbol_address(const void *a,const void *b)
+{
+  const DWARF_SYMBOLLIST *sym1=*(const DWARF_SYMBOLLIST**)a;
+  const DWARF_SYMBOLLIST *sym2=*(const DWARF_SYMBOLLIST**)b;
+  if (sym1->code_addr!=sym2->code_addr)
+    return (sym1->code_addr>sym2->code_addr) ? 1 : -1;
+  return strcmp(sym1->name,sym2->name);
+}
+
 /** dwarf_collect_functions_in_file() stores the pointers to all "code" symbols
  *  that appear in a file into a list.
  *
@@ -2059,22 +2078,17 @@ unsigned dwarf_collect_functions_in_file(const DWARF_SYMBOLLIST *symboltable,int
   for (const DWARF_SYMBOLLIST *sym=symboltable->next; sym!=NULL; sym=sym->next) {
     if (DWARF_IS_FUNCTION(sym) && (fileindex==-1 || sym->fileindex==fileindex)) {
       if (count<numentries) {
-        int pos;
-        if (sort==DWARF_SORT_ADDRESS) {
-          for (pos=0; pos<count && list[pos]->code_addr<sym->code_addr; pos++)
-            {}
-        } else {
-          for (pos=0; pos<count && strcmp(list[pos]->name,sym->name)<0; pos++)
-            {}
-        }
         assert(list!=NULL);
-        if (pos<count)
-          memmove(&list[pos+1],&list[pos],(count-pos)*sizeof(DWARF_SYMBOLLIST*));
-        list[pos]=sym;
+        list[count]=sym;
       }
       count+=1;
     }
   }
+  if (list!=NULL) {
+    unsigned stored=(count<numentries) ? count : numentries;
+    qsort((void*)list,stored,sizeof(DWARF_SYMBOLLIST*),
+          (sort==DWARF_SORT_ADDRESS) ? compare_symbol_address : compare_symbol_name);
+  }
   return count;
 }
 
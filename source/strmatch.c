@@ -206,23 +206,76 @@ static int match(const char *pattern, const char *candidate, int p, int c)
  */
 const char *strmatch(const char *pattern,const char *text,int *length)
 {
-  if (!pattern || !*pattern || !text || !*text)
-    return NULL;  /* empty pattern matches nothing, empty text string is never matched ... */
+  STRPATTERN compiled;
+  if (!strpattern_compile(&compiled,pattern))
+    return NULL;  /* empty pattern matches nothing */
+  return strpattern_match(&compiled,text,length);
+}
+
+/** strpattern_compile() prepares a pattern for repeated matching with
+ *  strpattern_match(). This is useful when the same pattern is matched
+ *  against many strings, because the analysis of the pattern is done only
+ *  once.
+ *
+ *  \param compiled     [out] The compiled pattern.
+ *  \param pattern      The text or pattern to search for, see strmatch(). The
+ *                      compiled pattern refers to this string, so it must
+ *                      remain valid (and unchanged) while the compiled pattern
+ *                      is in use.
+ *
+ *  \return true on success, false if the pattern is empty.
+ */
+bool strpattern_compile(STRPATTERN *compiled,const char *pattern)
+{
+  if (!compiled)
+    return false;
+  memset(compiled,0,sizeof(STRPATTERN));
+  if (!pattern)
+    return false;
 
   /* ignore leading "*" and leading white-space on patterns */
   while (*pattern=='*' || isspace(*pattern))
     pattern++;
   if (!*pattern)
-    return NULL;
+    return false;
+
+  compiled->pattern=pattern;
+  compiled->length=strlen(pattern);
+  compiled->wildcards=(strpbrk(pattern,"?*/")!=NULL);
+  /* when the pattern starts with a literal character, candidate positions in
+     the text can be found quickly with strchr() */
+  compiled->first=(*pattern!='?' && *pattern!='/') ? *pattern : '\0';
+  return true;
+}
+
+/** strpattern_match() finds the first occurrence of a compiled pattern in the
+ *  "text". See strmatch() for the parameters and the return value.
+ */
+const char *strpattern_match(const STRPATTERN *compiled,const char *text,int *length)
+{
+  if (!compiled || !compiled->pattern || !text || !*text)
+    return NULL;  /* empty pattern matches nothing, empty text string is never matched ... */
 
   /* if there are no wild-cards in pattern, we can use strstr() */
+  const char *pattern=compiled->pattern;
   int offset=-1;
   int len=-1;
-  if (!strpbrk(pattern,"?*/")) {
+  if (!compiled->wildcards) {
     const char *ptr=strstr(text,pattern);
-    if (ptr)
-      len=strlen(pattern);
-    offset=ptr-text;
+    if (ptr) {
+      len=(int)compiled->length;
+      offset=ptr-text;
+    }
+  } else if (compiled->first!='\0') {
+    for (const char *ptr=strchr(text,compiled->first); ptr; ptr=strchr(ptr+1,compiled->first)) {
+      int i=ptr-text;
+      int r=match(pattern,text,0,i);
+      if (r) {
+        offset=i;
+        len=r-i;
+        break;
+      }
+    }
   } else {
     for (int i=0; text[i]; i++) {
       int r=match(pattern,text,0,i);
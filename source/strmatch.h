@@ -18,7 +18,17 @@
 #ifndef _STRMATCH_H
 #define _STRMATCH_H
 
+typedef struct tagSTRPATTERN {
+  const char *pattern;  /* pattern, with leading "*" and white-space removed */
+  size_t length;        /* length of the pattern (in bytes) */
+  bool wildcards;       /* whether the pattern contains wild-cards */
+  char first;           /* first character of the pattern if it is not a wild-card, or '\0' */
+} STRPATTERN;
+
 uint32_t utf8_char(const char *text,int *size,bool *valid);
 const char *strmatch(const char *pattern,const char *text,int *length);
 
+bool strpattern_compile(STRPATTERN *compiled,const char *pattern);
+const char *strpattern_match(const STRPATTERN *compiled,const char *text,int *length);
+
 #endif /* _STRMATCH_H */
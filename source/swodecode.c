@@ -0,0 +1,958 @@
+/*
+ * Command-line SWO trace decoder: it captures SWO trace data from a Black
+ * Magic Probe (or replays it from a file or standard input), decodes it (as
+ * plain text or as CTF), and writes the trace messages to standard output in
+ * CSV or JSON format. It is intended for automated test set-ups, where no GUI
+ * is available.
+ *
+ * Copyright 2024 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined WIN32 || defined _WIN32
+# define STRICT
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# include <io.h>
+# if defined __MINGW32__ || defined __MINGW64__ || defined _MSC_VER
+#   include "strlcpy.h"
+# endif
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <bsd/string.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+
+#include "bmp-scan.h"
+#include "c11threads.h"
+#include "decodectf.h"
+#include "dwarf.h"
+#include "parsetsdl.h"
+#include "swotrace.h"
+#include "tcpip.h"
+#include "svnrev.h"
+
+#if defined FORTIFY
+# include <alloc/fortify.h>
+#endif
+
+#if !defined _MAX_PATH
+# define _MAX_PATH 260
+#endif
+
+#if !defined sizearray
+# define sizearray(a)  (sizeof(a) / sizeof((a)[0]))
+#endif
+
+#if defined WIN32 || defined _WIN32
+# define IS_OPTION(s)  (((s)[0] == '-' || (s)[0] == '/') && (s)[1] != '\0')
+# define access(p, m)  _access((p), (m))
+#else
+# define IS_OPTION(s)  ((s)[0] == '-' && (s)[1] != '\0')
+#endif
+
+enum {
+  FORMAT_CSV,
+  FORMAT_JSON,
+  FORMAT_NDJSON,
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static DWARF_LINETABLE dwarf_linetable = { NULL };
+static DWARF_SYMBOLLIST dwarf_symboltable = { NULL };
+static DWARF_PATHLIST dwarf_filetable = { NULL };
+
+int ctf_error_notify(int code, const char *filename, int linenr, const char *message)
+{
+  (void)code; /* unused */
+  if (linenr > 0)
+    fprintf(stderr, "ERROR %s line %d: ", filename, linenr);
+  else
+    fprintf(stderr, "ERROR: ");
+  assert(message != NULL);
+  fprintf(stderr, "%s\n", message);
+  return 0;
+}
+
+static void usage(int status)
+{
+  printf("\nswodecode - decode SWO trace data from the Black Magic Probe to CSV or JSON.\n\n"
+         "Usage: swodecode [options] [source ...]\n\n"
+         "Source:\n"
+         "(none)     Capture from a Black Magic Probe on USB. The probe must already be\n"
+         "           configured for SWO capture (e.g. by bmtrace or by GDB).\n"
+         "usb:n      Capture from the n-th Black Magic Probe on USB (starting at 0).\n"
+         "daemon:p   Capture from a capture daemon (see option -p) on the local host;\n"
+         "           the port is optional.\n"
+         "address    Capture from a ctxLink probe at this IP address.\n"
+         "filename   Decode a recording (see bmtrace -r) or a file with raw SWO data.\n"
+         "-          Read a recording or raw SWO data from standard input.\n\n"
+         "Up to %d sources can be given; their messages are merged on the timestamp.\n"
+         "The channels of the second source are shifted by the offset set with\n"
+         "option -o, those of the third source by twice the offset, and so on.\n\n"
+         "Options:\n"
+         "-a         Absolute timestamps: wall clock time in seconds since the epoch\n"
+         "           (UTC); default: relative to the first message.\n"
+         "-b=value   SWO bitrate (asynchronous mode), to interpolate the timestamps\n"
+         "           of the bytes in a USB packet.\n"
+         "-c=list    Channels to decode, e.g. '-c=0,2-4'; default: all channels.\n"
+         "-d=size    ITM data size in bytes: 1, 2 or 4; default: auto-detect.\n"
+         "-e=path    ELF file, for symbol look-up in CTF messages.\n"
+         "-f=format  Output format: csv (default), json or ndjson.\n"
+         "-j=path    Append capture & decoding statistics to this file every second,\n"
+         "           as one JSON object per line.\n"
+         "-k=value   Clock of the ITM local timestamps in Hz (CPU clock divided by the\n"
+         "           timestamp prescaler); messages then get the target timestamps.\n"
+         "-l=port    Serve the source on this TCP port, as a stand-in for a network\n"
+         "           probe, instead of decoding it. A file with raw SWO data is\n"
+         "           replayed endlessly (at the bitrate set with -b, or at full speed).\n"
+         "-m=size    Benchmark: decode this many MiB of synthetic plain text with\n"
+         "           the fast path and with the byte loop (default 64), then quit.\n"
+         "-o=value   Channel offset between sources (when decoding multiple sources);\n"
+         "           default: 8.\n"
+         "-p=port    Run as a capture daemon: pass the packets from the source on to\n"
+         "           the tools that connect to this port on the local host, so that\n"
+         "           these can capture from the same probe; default port: %d.\n"
+         "-q         Quiet: no statistics on stderr.\n"
+         "-s         Print statistics on stderr every second (besides the summary at\n"
+         "           the end).\n"
+         "-t=path    TSDL metadata file, for CTF decoding.\n"
+         "-v         Show version information.\n"
+         "-w=value   Stop after this many seconds; default: run until the end of the\n"
+         "           input, or until interrupted.\n", TRACE_MAXPROBES, TRACE_DAEMON_PORT);
+  exit(status);
+}
+
+static void unknown_option(const char *option)
+{
+  fprintf(stderr, "Unknown option \"%s\"; use option -h for help.\n", option);
+  exit(EXIT_FAILURE);
+}
+
+static void version(int status)
+{
+  printf("swodecode version %s.\n", SVNREV_STR);
+  printf("Copyright 2024 CompuPhase\nLicensed under the Apache License version 2.0\n");
+  exit(status);
+}
+
+static const char *skip_opt(const char *opt, int count)
+{
+  opt += count;
+  if (*opt == '=' || *opt == ':')
+    opt += 1;
+  return opt;
+}
+
+/** parse_channels() parses a list of channel numbers and ranges, like
+ *  "0,2-4".
+ *
+ *  \return A bit mask with the selected channels, or 0 on a syntax error.
+ */
+static unsigned long parse_channels(const char *list)
+{
+  unsigned long mask = 0;
+  while (*list != '\0') {
+    char *end;
+    long low = strtol(list, &end, 10);
+    long high = low;
+    if (end == list)
+      return 0;
+    if (*end == '-') {
+      list = end + 1;
+      high = strtol(list, &end, 10);
+      if (end == list)
+        return 0;
+    }
+    if (low < 0 || high >= NUM_CHANNELS || low > high)
+      return 0;
+    while (low <= high)
+      mask |= 1uL << low++;
+    list = end;
+    if (*list == ',')
+      list++;
+    else if (*list != '\0')
+      return 0;
+  }
+  return mask;
+}
+
+static bool is_ipaddress(const char *address)
+{
+  int dots = 0;
+  for (const char *ptr = address; *ptr != '\0'; ptr++) {
+    if (*ptr == '.')
+      dots++;
+    else if (*ptr < '0' || *ptr > '9')
+      return false;
+  }
+  return dots == 3;
+}
+
+static void print_json_string(FILE *fp, const char *text, unsigned length)
+{
+  fputc('"', fp);
+  for (unsigned idx = 0; idx < length; idx++) {
+    unsigned char c = (unsigned char)text[idx];
+    switch (c) {
+    case '"':
+      fputs("\\\"", fp);
+      break;
+    case '\\':
+      fputs("\\\\", fp);
+      break;
+    case '\t':
+      fputs("\\t", fp);
+      break;
+    default:
+      if (c < ' ')
+        fprintf(fp, "\\u%04x", c);
+      else
+        fputc(c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+/** emit_line() writes a single trace message. The CSV format is the same as
+ *  that of the "Save" function of bmtrace, so that the output can be loaded
+ *  in bmtrace.
+ */
+static void emit_line(FILE *fp, int format, const TRACELINE *line, double timestamp, unsigned long seqnr)
+{
+  const char *name = channel_getname(line->channel, NULL, 0);
+  const char *severity = ctf_severity_name(line->severity);
+  if (severity == NULL)
+    severity = "(invalid)";
+  if (format == FORMAT_CSV) {
+    fprintf(fp, "%d,\"%s\",%s,%.6f,", line->channel, name, severity, timestamp);
+    for (unsigned idx = 0; idx < line->length; idx++) {
+      if (line->text[idx] == '"')
+        fputc('"', fp);
+      fputc(line->text[idx], fp);
+    }
+    fputc('\n', fp);
+  } else {
+    if (format == FORMAT_JSON)
+      fputs((seqnr == 0) ? "  " : ",\n  ", fp);
+    fprintf(fp, "{\"channel\":%d,\"name\":", line->channel);
+    print_json_string(fp, name, (unsigned)strlen(name));
+    fprintf(fp, ",\"severity\":\"%s\",\"timestamp\":%.6f,\"text\":", severity, timestamp);
+    print_json_string(fp, line->text, line->length);
+    fputc('}', fp);
+    if (format == FORMAT_NDJSON)
+      fputc('\n', fp);
+  }
+}
+
+static void print_stats(double elapsed, unsigned long long bytes, unsigned long lines, bool summary)
+{
+  TRACEQUEUESTATS stats;
+  trace_queuestats(&stats, false);
+  if (elapsed < 0.001)
+    elapsed = 0.001;
+  fprintf(stderr, "%s%.1f s, %llu bytes (%.1f kB/s), %lu lines (%.0f lines/s), "
+                  "%d packet errors, %lu packets dropped (%llu bytes)\n",
+          summary ? "Total: " : "", elapsed, stats.bytes, bytes / elapsed / 1000.0,
+          lines, lines / elapsed, trace_getpacketerrors(false),
+          stats.dropped, stats.dropped_bytes);
+  if (summary) {
+    TRACEITMSTATS itm;
+    trace_itmstats(&itm, false);
+    if (itm.timestamps + itm.globalstamps + itm.exceptions + itm.pcsamples + itm.datatrace > 0)
+      fprintf(stderr, "ITM: %lu timestamps (%lu delayed), %lu global timestamps, %lu exceptions, "
+                      "%lu PC samples, %lu data trace packets, %lu overflows\n",
+              itm.timestamps, itm.delayed, itm.globalstamps, itm.exceptions,
+              itm.pcsamples, itm.datatrace, itm.overflows);
+  }
+}
+
+/** benchmark() compares the decoding of plain text with the vectorized fast
+ *  path against the byte loop, on synthetic trace data: lines of text, sent
+ *  as single-byte ITM packets on channel 0.
+ */
+#define BENCH_BLOCK 4096  /* same as the default USB transfer size */
+
+static void benchmark(double megabytes)
+{
+  size_t size = (size_t)(megabytes * 1024 * 1024) & ~(size_t)1;
+  unsigned char *data = (size > 0) ? malloc(size) : NULL;
+  if (data == NULL) {
+    fprintf(stderr, "Insufficient memory for the benchmark\n");
+    exit(EXIT_FAILURE);
+  }
+  unsigned long seqnr = 0;
+  char text[80];
+  int textlen = 0, textpos = 0;
+  for (size_t pos = 0; pos < size; pos += 2) {
+    if (textpos >= textlen) {
+      textlen = sprintf(text, "Message %lu: value=%lu status=%s\n",
+                        seqnr, (seqnr * 7919) % 100000, (seqnr % 3 != 0) ? "ok" : "pending");
+      textpos = 0;
+      seqnr++;
+    }
+    data[pos] = 0x01;   /* channel 0, 1 byte */
+    data[pos + 1] = (unsigned char)text[textpos++];
+  }
+
+  static const char *names[] = { "byte loop", "fast path" };
+  double elapsed[2];
+  unsigned long hash[2];
+  for (int pass = 0; pass < 2; pass++) {
+    trace_setfastpath(pass == 1);
+    tracestring_clear();
+    double start = get_timestamp();
+    for (size_t pos = 0; pos < size; pos += BENCH_BLOCK)
+      tracestring_decodebuffer(data + pos, (size - pos < BENCH_BLOCK) ? size - pos : BENCH_BLOCK, start);
+    elapsed[pass] = get_timestamp() - start;
+    if (elapsed[pass] < 0.000001)
+      elapsed[pass] = 0.000001;
+    /* checksum on the decoded lines, to verify that both paths give the same result */
+    unsigned count = tracestring_count();
+    TRACELINE info;
+    hash[pass] = 2166136261uL;
+    for (unsigned line = 0; line < count && tracestring_getline(line, &info); line++)
+      for (unsigned idx = 0; idx < info.length; idx++)
+        hash[pass] = ((hash[pass] ^ (unsigned char)info.text[idx]) * 16777619uL) & 0xffffffffuL;
+    printf("%-10s %8.1f MB/s, %u lines\n", names[pass], size / elapsed[pass] / 1.0e6, count);
+  }
+  printf("Speed-up: %.2f%s\n", elapsed[0] / elapsed[1],
+         (hash[0] == hash[1]) ? "" : " (ERROR: the decoded lines differ)");
+  trace_setfastpath(true);
+  tracestring_clear();
+  free(data);
+}
+
+static void sighandler(int sig)
+{
+  (void)sig;
+  interrupted = 1;
+}
+
+/* The server passes the packets from the probe (or from a file) on to any
+   number of TCP clients: it stands in for a network probe (raw SWO data), or
+   it is a capture daemon (packets with timestamps, in the format of a
+   recording), so that several tools can capture from the same probe.
+   Each packet is taken from the trace queue once and stored in a ring buffer
+   that all clients send from; each client only has a position in the ring.
+   When a client falls so far behind that the packets that it has not yet sent
+   are overwritten, it skips to the oldest packet that is still in the ring
+   (the remainder of a packet that it had started to send is first copied
+   out, so that its stream stays intact). So a slow client loses packets, but
+   it does not hold up the other clients nor the capture. */
+#define FANOUT_RINGSIZE   (4 * 1024 * 1024) /* must be a power of 2 */
+#define FANOUT_RECORDS    65536             /* max. packets in the ring, must be a power of 2 */
+#define FANOUT_MAXPACKET  (64 * 1024)       /* max. packet size (larger packets are truncated) */
+#define FANOUT_MAXFRAME   (FANOUT_MAXPACKET + 64) /* a packet with its record header */
+#define FANOUT_CLIENTS    16
+
+typedef struct tagFANOUTCLIENT {
+  SOCKET sock;
+  unsigned long long pos;       /* position in the ring of the next byte to send */
+  unsigned char *carry;         /* data to send before the ring data (the stream header, or part of an overwritten packet) */
+  size_t carrylen, carrypos;
+  unsigned long dropped;        /* packets that were dropped for this client */
+} FANOUTCLIENT;
+
+typedef struct tagFANOUT {
+  unsigned char *ring;
+  unsigned long long head;      /* position where the next packet is stored */
+  unsigned long long starts[FANOUT_RECORDS]; /* start positions of the packets in the ring */
+  unsigned first, count;        /* oldest entry in "starts", and number of entries */
+  FANOUTCLIENT clients[FANOUT_CLIENTS];
+  int numclients;
+} FANOUT;
+
+#if defined WIN32 || defined _WIN32
+# define SOCKET_WOULDBLOCK()  (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+# define SOCKET_WOULDBLOCK()  (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#endif
+
+static void socket_nonblocking(SOCKET sock)
+{
+# if defined WIN32 || defined _WIN32
+    unsigned long mode = 1;
+    ioctlsocket(sock, FIONBIO, &mode);
+# else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+# endif
+}
+
+static void ring_read(const FANOUT *fanout, unsigned long long pos, unsigned char *buffer, size_t length)
+{
+  size_t offset = (size_t)(pos & (FANOUT_RINGSIZE - 1));
+  size_t part = (length < FANOUT_RINGSIZE - offset) ? length : FANOUT_RINGSIZE - offset;
+  memcpy(buffer, fanout->ring + offset, part);
+  memcpy(buffer + part, fanout->ring, length - part);
+}
+
+static void ring_write(FANOUT *fanout, const unsigned char *buffer, size_t length)
+{
+  size_t offset = (size_t)(fanout->head & (FANOUT_RINGSIZE - 1));
+  size_t part = (length < FANOUT_RINGSIZE - offset) ? length : FANOUT_RINGSIZE - offset;
+  memcpy(fanout->ring + offset, buffer, part);
+  memcpy(fanout->ring, buffer + part, length - part);
+  fanout->head += length;
+}
+
+/** fanout_recordend() returns the end position of the packet that holds the
+ *  ring position "pos" (so "pos" itself if it is at the start of a packet).
+ */
+static unsigned long long fanout_recordend(const FANOUT *fanout, unsigned long long pos)
+{
+  unsigned low = 0, high = fanout->count;
+  while (low < high) {  /* find the first packet that starts at or after pos */
+    unsigned mid = (low + high) / 2;
+    if (fanout->starts[(fanout->first + mid) & (FANOUT_RECORDS - 1)] < pos)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return (low < fanout->count) ? fanout->starts[(fanout->first + low) & (FANOUT_RECORDS - 1)] : fanout->head;
+}
+
+/** fanout_add() stores a packet (with its record header, if any) in the ring,
+ *  after moving the clients that have not yet sent the data that it
+ *  overwrites.
+ */
+static void fanout_add(FANOUT *fanout, const unsigned char *frame, size_t length)
+{
+  assert(length <= FANOUT_MAXFRAME);
+  /* remove the packets that the new packet (partially) overwrites, plus the
+     oldest packet if the table with packet positions is full */
+  unsigned long long limit = (fanout->head + length > FANOUT_RINGSIZE) ? fanout->head + length - FANOUT_RINGSIZE : 0;
+  unsigned drop = 0;
+  while (drop < fanout->count
+         && (fanout->starts[(fanout->first + drop) & (FANOUT_RECORDS - 1)] < limit
+             || fanout->count - drop >= FANOUT_RECORDS))
+    drop++;
+  if (drop > 0) {
+    /* clients that lag behind keep the remainder of the packet that they are
+       sending, and then skip to the oldest packet that is kept */
+    unsigned long long resume = (drop < fanout->count) ? fanout->starts[(fanout->first + drop) & (FANOUT_RECORDS - 1)] : fanout->head;
+    for (int idx = 0; idx < fanout->numclients; idx++) {
+      FANOUTCLIENT *client = &fanout->clients[idx];
+      if (client->pos >= resume)
+        continue;
+      unsigned long long end = fanout_recordend(fanout, client->pos);
+      if (end > client->pos) {
+        assert(client->carrypos >= client->carrylen); /* while the carry buffer is in use, pos is at the start of a packet */
+        client->carrylen = (size_t)(end - client->pos);
+        client->carrypos = 0;
+        ring_read(fanout, client->pos, client->carry, client->carrylen);
+      }
+      while (end < resume) {
+        end = fanout_recordend(fanout, end + 1);
+        client->dropped += 1;
+      }
+      client->pos = resume;
+    }
+    fanout->first = (fanout->first + drop) & (FANOUT_RECORDS - 1);
+    fanout->count -= drop;
+  }
+  fanout->starts[(fanout->first + fanout->count) & (FANOUT_RECORDS - 1)] = fanout->head;
+  fanout->count += 1;
+  ring_write(fanout, frame, length);
+}
+
+/** fanout_send() sends pending data to a client, without blocking.
+ *
+ *  \return The number of bytes sent, or -1 if the connection was lost.
+ */
+static long fanout_send(FANOUT *fanout, FANOUTCLIENT *client)
+{
+  long total = 0;
+  while (client->carrypos < client->carrylen) {
+    int count = send(client->sock, (const char*)client->carry + client->carrypos, (int)(client->carrylen - client->carrypos), 0);
+    if (count <= 0)
+      return (count < 0 && SOCKET_WOULDBLOCK()) ? total : -1;
+    client->carrypos += count;
+    total += count;
+  }
+  while (client->pos < fanout->head) {
+    size_t offset = (size_t)(client->pos & (FANOUT_RINGSIZE - 1));
+    size_t length = (size_t)(fanout->head - client->pos);
+    if (length > FANOUT_RINGSIZE - offset)
+      length = FANOUT_RINGSIZE - offset;
+    int count = send(client->sock, (const char*)fanout->ring + offset, (int)length, 0);
+    if (count <= 0)
+      return (count < 0 && SOCKET_WOULDBLOCK()) ? total : -1;
+    client->pos += count;
+    total += count;
+  }
+  return total;
+}
+
+static void fanout_drop(FANOUT *fanout, int idx, int verbosity)
+{
+  assert(idx >= 0 && idx < fanout->numclients);
+  FANOUTCLIENT *client = &fanout->clients[idx];
+  if (verbosity >= 2)
+    fprintf(stderr, "Client disconnected (%lu packets dropped)\n", client->dropped);
+  closesocket(client->sock);
+  free(client->carry);
+  fanout->numclients -= 1;
+  fanout->clients[idx] = fanout->clients[fanout->numclients];
+}
+
+/** serve() passes the packets that the trace source delivers on to the
+ *  clients that connect to a TCP port. It runs until interrupted, until the
+ *  timeout, or until the end of the data (for a file).
+ *
+ *  \param port       The TCP port to listen on.
+ *  \param daemon     true to run as a capture daemon (packets with timestamps,
+ *                    local clients only), false to stand in for a network
+ *                    probe (raw SWO data).
+ *  \param info       The settings for the stream header (capture daemon).
+ *  \param timeout    The time to run, 0 for no limit.
+ *  \param verbosity  The level of messages on stderr.
+ */
+static int serve(unsigned short port, bool daemon, const TRACERECORDING *info, double timeout, int verbosity)
+{
+  SOCKET server = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof address);
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(daemon ? INADDR_LOOPBACK : INADDR_ANY);
+  address.sin_port = htons(port);
+  int reuse = 1;
+  if (server != INVALID_SOCKET)
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof reuse);
+  if (server == INVALID_SOCKET || bind(server, (struct sockaddr*)&address, sizeof address) != 0
+      || listen(server, FANOUT_CLIENTS) != 0)
+  {
+    fprintf(stderr, "Failed to listen on port %u\n", port);
+    if (server != INVALID_SOCKET)
+      closesocket(server);
+    return EXIT_FAILURE;
+  }
+  socket_nonblocking(server);
+# if defined SIGPIPE
+    signal(SIGPIPE, SIG_IGN); /* a client that disconnects must not end the server */
+# endif
+
+  FANOUT *fanout = malloc(sizeof(FANOUT));
+  unsigned char *frame = malloc(FANOUT_MAXFRAME);
+  if (fanout != NULL)
+    memset(fanout, 0, sizeof(FANOUT));
+  if (fanout == NULL || frame == NULL || (fanout->ring = malloc(FANOUT_RINGSIZE)) == NULL) {
+    fprintf(stderr, "Insufficient memory\n");
+    if (fanout != NULL)
+      free(fanout);
+    if (frame != NULL)
+      free(frame);
+    closesocket(server);
+    return EXIT_FAILURE;
+  }
+  if (verbosity >= 1)
+    fprintf(stderr, "Serving on port %u\n", port);
+
+  unsigned long clients = 0;
+  unsigned long long sent = 0;
+  double starttime = get_timestamp();
+  for ( ;; ) {
+    /* accept new clients */
+    SOCKET sock;
+    while (fanout->numclients < FANOUT_CLIENTS && (sock = accept(server, NULL, NULL)) != INVALID_SOCKET) {
+      FANOUTCLIENT *client = &fanout->clients[fanout->numclients];
+      memset(client, 0, sizeof(FANOUTCLIENT));
+      if ((client->carry = malloc(FANOUT_MAXFRAME)) == NULL) {
+        closesocket(sock);
+        break;
+      }
+      socket_nonblocking(sock);
+      client->sock = sock;
+      client->pos = fanout->head;   /* start with the next packet */
+      if (daemon)
+        client->carrylen = trace_recordheader(client->carry, FANOUT_MAXFRAME, info);
+      fanout->numclients += 1;
+      clients += 1;
+      if (verbosity >= 2)
+        fprintf(stderr, "Client connected\n");
+    }
+
+    /* move the packets from the trace queue to the ring */
+    int packets = 0;
+    size_t length;
+    double timestamp;
+    size_t hdrsize = daemon ? trace_recordframe(frame, FANOUT_MAXFRAME, 0, 0.0) : 0;
+    while (packets < 256 && (length = trace_readraw(frame + hdrsize, FANOUT_MAXPACKET, &timestamp)) > 0) {
+      if (daemon)
+        trace_recordframe(frame, hdrsize, length, timestamp);
+      fanout_add(fanout, frame, hdrsize + length);
+      packets++;
+    }
+
+    /* send to the clients */
+    bool pending = false;
+    for (int idx = fanout->numclients - 1; idx >= 0; idx--) {
+      FANOUTCLIENT *client = &fanout->clients[idx];
+      long count = fanout_send(fanout, client);
+      if (count < 0) {
+        fanout_drop(fanout, idx, verbosity);
+        continue;
+      }
+      sent += count;
+      if (client->carrypos < client->carrylen || client->pos < fanout->head)
+        pending = true;
+    }
+
+    bool endofdata = trace_endofdata() && !pending;
+    if (interrupted || endofdata || (timeout > 0.0 && get_timestamp() - starttime >= timeout))
+      break;
+    if (packets == 0) {
+      struct timespec ts = { 0, 1000000 };
+      thrd_sleep(&ts, NULL);
+    }
+  }
+
+  while (fanout->numclients > 0)
+    fanout_drop(fanout, fanout->numclients - 1, verbosity);
+  closesocket(server);
+  free(fanout->ring);
+  free(fanout);
+  free(frame);
+  if (verbosity >= 1)
+    fprintf(stderr, "Sent %llu bytes to %lu client(s) in %.1f s\n", sent, clients, get_timestamp() - starttime);
+  return EXIT_SUCCESS;
+}
+
+/** open_source() opens a trace source in capture context "index". The source
+ *  is "usb" or "usb:n" for a probe on USB, "daemon" or "daemon:port" for a
+ *  capture daemon, an IP address, a file or "-" for standard input.
+ */
+static int open_source(int index, const char *source, unsigned long bitrate, bool repeat)
+{
+  if (strncmp(source, "usb", 3) == 0 && (source[3] == '\0' || source[3] == ':')) {
+    int seqnr = (source[3] == ':') ? (int)strtol(source + 4, NULL, 10) : 0;
+    return trace_initprobe(index, seqnr, BMP_EP_TRACE, NULL);
+  }
+  if (strncmp(source, "daemon", 6) == 0 && (source[6] == '\0' || source[6] == ':')) {
+    unsigned short port = (source[6] == ':') ? (unsigned short)strtoul(source + 7, NULL, 10) : TRACE_DAEMON_PORT;
+    return trace_initprobedaemon(index, port);
+  }
+  if (strcmp(source, "-") == 0 || access(source, 0) == 0)
+    return trace_initprobeloopback(index, source, bitrate, repeat);
+  if (is_ipaddress(source))
+    return trace_initprobe(index, 0, BMP_PORT_TRACE, source);
+  return -1;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *sources[TRACE_MAXPROBES];
+  int numsources = 0;
+  int chanoffset = 8;
+  char TSDLfile[_MAX_PATH] = "";
+  char ELFfile[_MAX_PATH] = "";
+  unsigned long channelmask = ~0uL;
+  int datasize = 0;
+  int format = FORMAT_CSV;
+  int verbosity = 1;  /* 0 = quiet, 1 = summary, 2 = periodic statistics */
+  double timeout = 0.0;
+  unsigned long tsclock = 0;
+  unsigned long bitrate = 0;
+  bool absolute = false;
+  double benchsize = 0.0;
+  char healthfile[_MAX_PATH] = "";
+  unsigned short serveport = 0;
+  bool daemon = false;
+
+  for (int idx = 1; idx < argc; idx++) {
+    const char *opt;
+    if (IS_OPTION(argv[idx])) {
+      switch (argv[idx][1]) {
+      case '?':
+      case 'h':
+        usage(EXIT_SUCCESS);
+        break;
+      case 'a':
+        absolute = true;
+        break;
+      case 'b':
+        opt = skip_opt(argv[idx], 2);
+        bitrate = strtoul(opt, NULL, 10);
+        break;
+      case 'c':
+        opt = skip_opt(argv[idx], 2);
+        if ((channelmask = parse_channels(opt)) == 0)
+          unknown_option(argv[idx]);
+        break;
+      case 'd':
+        opt = skip_opt(argv[idx], 2);
+        datasize = (int)strtol(opt, NULL, 10);
+        if (datasize != 0 && datasize != 1 && datasize != 2 && datasize != 4)
+          unknown_option(argv[idx]);
+        break;
+      case 'e':
+        opt = skip_opt(argv[idx], 2);
+        strlcpy(ELFfile, opt, sizearray(ELFfile));
+        break;
+      case 'f':
+        opt = skip_opt(argv[idx], 2);
+        if (strcmp(opt, "csv") == 0)
+          format = FORMAT_CSV;
+        else if (strcmp(opt, "json") == 0)
+          format = FORMAT_JSON;
+        else if (strcmp(opt, "ndjson") == 0)
+          format = FORMAT_NDJSON;
+        else
+          unknown_option(argv[idx]);
+        break;
+      case 'j':
+        opt = skip_opt(argv[idx], 2);
+        strlcpy(healthfile, opt, sizearray(healthfile));
+        break;
+      case 'k':
+        opt = skip_opt(argv[idx], 2);
+        tsclock = strtoul(opt, NULL, 10);
+        break;
+      case 'l':
+      case 'p':
+        opt = skip_opt(argv[idx], 2);
+        daemon = (argv[idx][1] == 'p');
+        serveport = (*opt != '\0') ? (unsigned short)strtoul(opt, NULL, 10) : (daemon ? TRACE_DAEMON_PORT : 0);
+        if (serveport == 0)
+          unknown_option(argv[idx]);
+        break;
+      case 'm':
+        opt = skip_opt(argv[idx], 2);
+        benchsize = (*opt != '\0') ? strtod(opt, NULL) : 64.0;
+        if (benchsize <= 0.0)
+          unknown_option(argv[idx]);
+        break;
+      case 'o':
+        opt = skip_opt(argv[idx], 2);
+        chanoffset = (int)strtol(opt, NULL, 10);
+        if (chanoffset < 0 || chanoffset >= NUM_CHANNELS)
+          unknown_option(argv[idx]);
+        break;
+      case 'q':
+        verbosity = 0;
+        break;
+      case 's':
+        verbosity = 2;
+        break;
+      case 't':
+        opt = skip_opt(argv[idx], 2);
+        strlcpy(TSDLfile, opt, sizearray(TSDLfile));
+        break;
+      case 'v':
+        version(EXIT_SUCCESS);
+        break;
+      case 'w':
+        opt = skip_opt(argv[idx], 2);
+        timeout = strtod(opt, NULL);
+        break;
+      default:
+        unknown_option(argv[idx]);
+      }
+    } else if (numsources < TRACE_MAXPROBES) {
+      sources[numsources++] = argv[idx];
+    } else {
+      fprintf(stderr, "Too many sources (at most %d are supported)\n", TRACE_MAXPROBES);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* channels & decoding */
+  for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+    struct nk_color black = { 0, 0, 0, 255 };
+    channel_set(chan, (channelmask & (1uL << chan)) != 0, NULL, black);
+  }
+  trace_setdatasize((short)datasize);
+  trace_settimestampclock(tsclock);
+  trace_setbitrate(bitrate);
+  if (benchsize > 0.0) {
+    benchmark(benchsize);
+    return EXIT_SUCCESS;
+  }
+  if (strlen(TSDLfile) > 0) {
+    if (!ctf_parse_init(TSDLfile) || !ctf_parse_run()) {
+      fprintf(stderr, "Failed to load TSDL file %s\n", TSDLfile);
+      return EXIT_FAILURE;
+    }
+    /* stream names overrule the channel names */
+    const CTF_STREAM *stream;
+    for (int seqnr = 0; (stream = stream_by_seqnr(seqnr)) != NULL; seqnr++) {
+      if (strlen(stream->name) > 0) {
+        int chan = stream->stream_id;
+        assert(chan >= 0 && chan < NUM_CHANNELS);
+        channel_setname(chan, stream->name);
+      }
+    }
+  }
+  if (strlen(ELFfile) > 0) {
+    FILE *fp = fopen(ELFfile, "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "Failed to open ELF file %s\n", ELFfile);
+      return EXIT_FAILURE;
+    }
+    int address_size;
+    dwarf_read(fp, &dwarf_linetable, &dwarf_symboltable, &dwarf_filetable, &address_size);
+    fclose(fp);
+    ctf_set_symtable(&dwarf_symboltable);
+  }
+
+  /* open the sources */
+  if (numsources == 0)
+    sources[numsources++] = "usb:0";
+  if (serveport != 0 && numsources > 1) {
+    fprintf(stderr, "Option -%c requires a single source\n", daemon ? 'p' : 'l');
+    return EXIT_FAILURE;
+  }
+  tcpip_init();
+  for (int idx = 0; idx < numsources; idx++) {
+    const char *source = sources[idx];
+    /* when serving, a file is replayed at the bitrate (and for the stand-in
+       of a network probe, endlessly) */
+    int result = (serveport != 0) ? open_source(idx, source, bitrate, !daemon) : open_source(idx, source, 0, false);
+    if (result < 0) {
+      fprintf(stderr, "File %s not found\n", source);
+      trace_close();
+      tcpip_cleanup();
+      return EXIT_FAILURE;
+    }
+    if (result != TRACESTAT_OK) {
+      int loc;
+      unsigned long error = trace_errno(&loc);
+      fprintf(stderr, "Failed to open the trace source %s (status %d, error %d:%lu)\n", source, result, loc, error);
+      trace_close();
+      tcpip_cleanup();
+      return EXIT_FAILURE;
+    }
+    trace_setprobechannels(idx, idx * chanoffset);
+  }
+
+  if (serveport != 0) {
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    TRACERECORDING info;
+    memset(&info, 0, sizeof info);
+    info.bitrate = bitrate;
+    info.datasize = (short)datasize;
+    info.tsdlhash = trace_tsdlhash(TSDLfile);
+    int result = serve(serveport, daemon, &info, timeout, verbosity);
+    trace_close();
+    tcpip_cleanup();
+    return result;
+  }
+
+  FILE *healthfp = NULL;
+  if (strlen(healthfile) > 0 && (healthfp = fopen(healthfile, "at")) == NULL) {
+    fprintf(stderr, "Failed to create file %s\n", healthfile);
+    trace_close();
+    tcpip_cleanup();
+    return EXIT_FAILURE;
+  }
+  TRACEHEALTH health;
+  trace_health(&health);  /* start of the first interval */
+
+  signal(SIGINT, sighandler);
+  signal(SIGTERM, sighandler);
+
+  /* Decode in batches: take all packets that are in the queue, write out all
+     lines that are complete, then drop these lines. Output is flushed once
+     per batch. */
+  static char outbuffer[64 * 1024];
+  setvbuf(stdout, outbuffer, _IOFBF, sizeof outbuffer);
+  if (format == FORMAT_CSV)
+    printf("Channel,Name,Severity,Timestamp,Text\n");
+  else if (format == FORMAT_JSON)
+    printf("[\n");
+  double starttime = get_timestamp();
+  double reporttime = starttime;
+  double basetime = -1.0;     /* timestamp of the first trace message */
+  unsigned long lines = 0;
+  unsigned long long prevbytes = 0;
+  unsigned long prevlines = 0;
+  for ( ;; ) {
+    bool endofdata = trace_endofdata();  /* check before processing the queue */
+    bool stop = interrupted || endofdata || (timeout > 0.0 && get_timestamp() - starttime >= timeout);
+    tracestring_process(true);
+    unsigned count = tracestring_count();
+    unsigned line;
+    TRACELINE info;
+    for (line = 0; line < count && tracestring_getline(line, &info); line++) {
+      if (!info.complete && !stop)
+        break;  /* more text may be appended to this line */
+      if (basetime < 0.0)
+        basetime = info.timestamp;
+      double timestamp = absolute ? trace_walltime(info.timestamp) : info.timestamp - basetime;
+      emit_line(stdout, format, &info, timestamp, lines);
+      lines += 1;
+    }
+    if (line > 0) {
+      tracestring_purge();
+      fflush(stdout);
+    }
+    if (stop)
+      break;
+
+    double now = get_timestamp();
+    if (now - reporttime >= 1.0) {
+      if (verbosity >= 2) {
+        TRACEQUEUESTATS stats;
+        trace_queuestats(&stats, false);
+        print_stats(now - reporttime, stats.bytes - prevbytes, lines - prevlines, false);
+        prevbytes = stats.bytes;
+        prevlines = lines;
+      }
+      if (healthfp != NULL) {
+        trace_health(&health);
+        trace_healthjson(healthfp, &health);
+      }
+      reporttime = now;
+    }
+    if (line == 0) {
+      /* nothing to do, wait for more data */
+      struct timespec ts = { 0, 1000000 };
+      thrd_sleep(&ts, NULL);
+    }
+  }
+  if (format == FORMAT_JSON)
+    printf("%s]\n", (lines > 0) ? "\n" : "");
+  fflush(stdout);
+  if (healthfp != NULL) {
+    trace_health(&health);
+    trace_healthjson(healthfp, &health);
+    fclose(healthfp);
+  }
+
+  if (verbosity >= 1) {
+    TRACEQUEUESTATS stats;
+    trace_queuestats(&stats, false);
+    print_stats(get_timestamp() - starttime, stats.bytes, lines, true);
+  }
+
+  trace_close();
+  tracestring_clear();
+  ctf_parse_cleanup();
+  ctf_decode_cleanup();
+  dwarf_cleanup(&dwarf_linetable, &dwarf_symboltable, &dwarf_filetable);
+  tcpip_cleanup();
+  return EXIT_SUCCESS;
+}
@@ -19,10 +19,12 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined WIN32 || defined _WIN32
 # define STRICT
@@ -33,6 +35,8 @@
 # include <initguid.h>
 # include <setupapi.h>
 # include <malloc.h>
+# include <io.h>
+# include <fcntl.h>
 # include "usb-support.h"
 # if defined __MINGW32__ || defined __MINGW64__ || defined _MSC_VER
 #   include "strlcpy.h"
@@ -43,21 +47,34 @@
 # include <pthread.h>
 # include <unistd.h>
 # include <bsd/string.h>
+# include <fcntl.h>
+# include <sys/mman.h>
 # include <sys/stat.h>
+# include <poll.h>
 # include <sys/socket.h>
 # include <arpa/inet.h>
 # include <libusb-1.0/libusb.h>
-  typedef int SOCKET;
-# define INVALID_SOCKET (-1)
+#endif
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define SIMD_SSE2
+#elif defined __ARM_NEON || defined __ARM_NEON__
+# include <arm_neon.h>
+# define SIMD_NEON
 #endif
 
 #include "bmp-scan.h"
-#include "guidriver.h"
-#include "nuklear_style.h"
+#include "c11threads.h"
+#if !defined NO_GUI
+# include "guidriver.h"
+# include "nuklear_style.h"
+#endif
 #include "parsetsdl.h"
 #include "decodectf.h"
 #include "strmatch.h"
 #include "swotrace.h"
+#include "tcpip.h"
 
 #if defined FORTIFY
 # include <alloc/fortify.h>
@@ -147,807 +164,4621 @@ void channel_setcolor(int index, struct nk_color color)
 }
 
 
-#define PACKET_SIZE 64
-#define PACKET_NUM  128
+/* Memory ordering primitives for the packet queue. The queue is lock-free, with
+   a single producer (the reader thread) and a single consumer (the thread that
+   decodes the packets). */
+#if defined __GNUC__ || defined __clang__
+# define ATOMIC_LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define ATOMIC_STORE_RELEASE(p,v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined WIN32 || defined _WIN32
+  static size_t atomic_load_acquire(volatile size_t *p)
+  {
+    size_t v = *p;
+    MemoryBarrier();
+    return v;
+  }
+  static void atomic_store_release(volatile size_t *p, size_t v)
+  {
+    MemoryBarrier();
+    *p = v;
+  }
+# define ATOMIC_LOAD_ACQUIRE(p)     atomic_load_acquire((p))
+# define ATOMIC_STORE_RELEASE(p,v)  atomic_store_release((p), (v))
+#else
+# define ATOMIC_LOAD_ACQUIRE(p)     (*(p))
+# define ATOMIC_STORE_RELEASE(p,v)  (*(p) = (v))
+#endif
+
+#if defined __GNUC__ || defined __clang__
+# define POPCOUNT64(v)  __builtin_popcountll(v)
+# define CTZ64(v)       __builtin_ctzll(v)
+#else
+  static int POPCOUNT64(uint64_t v)
+  {
+    int count = 0;
+    for ( ; v != 0; v &= v - 1)
+      count++;
+    return count;
+  }
+  static int CTZ64(uint64_t v)
+  {
+    int count = 0;
+    for ( ; (v & 1) == 0; v >>= 1)
+      count++;
+    return count;
+  }
+#endif
+
+/* The packet queue is a ring buffer of bytes, in which variable-length packets
+   are stored. Each packet starts with a header, the packet data follows the
+   header. When a packet does not fit in the space between the tail and the
+   end of the buffer, a "wrap" marker is stored and the packet is stored at the
+   start of the buffer.
+   The head and tail indices are free-running counters; the ring buffer size is
+   a power of two. Each capture context (one per probe) has its own queue. */
+#define PACKET_SIZE     64            /* size of a USB bulk packet */
+#define QUEUE_MINSIZE   (16*1024)     /* minimum size of the packet queue in bytes */
+#define QUEUE_DEFSIZE   (1024*1024)   /* default size of the packet queue in bytes */
 typedef struct tagPACKET {
-  unsigned char data[PACKET_SIZE];
-  size_t length;
+  uint32_t length;                    /* size of the packet data in bytes */
+  uint32_t arrival;                   /* host clock when queued, in microseconds (wraps around) */
   double timestamp;
 } PACKET;
-static PACKET trace_queue[PACKET_NUM];
-static int tracequeue_head = 0, tracequeue_tail = 0;
-static int tracequeue_overflow = 0;
+#define PKT_WRAP        (~(uint32_t)0)
+#define PKT_DATA(p)     ((const unsigned char*)(p) + sizeof(PACKET))
+#define PKT_ALIGN(n)    (((n) + sizeof(PACKET) - 1) & ~(sizeof(PACKET) - 1))
+
+/* The statistics counters are only written by the producer; they are
+   word-sized, so that the consumer can read them without tearing. They wrap
+   around, and the consumer accumulates the differences since its previous
+   read (in "stats"). A reset is done on the consumer side as well, except for
+   the high-water mark, which the producer clears on request. */
+typedef struct tagQUEUECOUNTERS {
+  volatile size_t packets;
+  volatile size_t bytes;
+  volatile size_t dropped;
+  volatile size_t dropped_bytes;
+  volatile size_t highwater;
+} QUEUECOUNTERS;
+
+typedef struct tagTRACEQUEUE {
+  unsigned char *buffer;
+  size_t size;                        /* size of the buffer in bytes (power of 2) */
+  volatile size_t head, tail;
+  int overflow;                       /* set when a packet is dropped */
+  QUEUECOUNTERS counters;             /* written by the producer */
+  volatile size_t hwreset;            /* set by the consumer to reset the high-water mark */
+  QUEUECOUNTERS seen;                 /* counters at the previous read (consumer) */
+  TRACEQUEUESTATS stats;              /* accumulated statistics (consumer) */
+} TRACEQUEUE;
+
+static size_t tracequeue_size = QUEUE_DEFSIZE;  /* size for newly allocated queues */
+
+/** tracequeue_hasroom() returns whether a packet with the given length fits
+ *  in the queue. It must only be called from the reader thread.
+ */
+static bool tracequeue_hasroom(TRACEQUEUE *queue, size_t length)
+{
+  if (queue->buffer == NULL)
+    return false;
+  size_t tail = queue->tail;      /* tail is only modified by the producer */
+  size_t head = ATOMIC_LOAD_ACQUIRE(&queue->head);
+  size_t needed = PKT_ALIGN(sizeof(PACKET) + length);
+  if (needed > queue->size / 2)
+    return false;
+  size_t contiguous = queue->size - (tail & (queue->size - 1));
+  if (needed > contiguous)
+    needed += contiguous;         /* remaining space at the end is skipped */
+  return needed <= queue->size - (tail - head);
+}
 
-typedef struct tagTRACESTRING {
-  struct tagTRACESTRING *next;
-  char *text;
-  unsigned short length, size;  /* text length & text buffer size (length <= size) */
-  double timestamp;             /* in seconds */
-  char timefmt[16];             /* formatted string with time stamp */
-  unsigned short timefmt_len;   /* length of the formatted time stamp */
-  char *channelname;            /* name of the stream/channel (may be NULL) */
-  unsigned char channel_id;     /* number of the name/channel */
-  unsigned char severity;
-  short flags;                  /* used to keep state while decoding plain trace messages */
-} TRACESTRING;
+/** tracequeue_push() appends a packet to the queue. It must only be called
+ *  from the reader thread.
+ *
+ *  \return true on success, false if the queue is full (the packet is dropped).
+ */
+static bool tracequeue_push(TRACEQUEUE *queue, const unsigned char *data, size_t length, double timestamp)
+{
+  assert(data != NULL);
+  assert(length > 0);
 
-#define TSFLAG_EOL        0x0001  /* line is finished (do not concatenate more data) */
-#define TSFLAG_BOOKMARK   0x0002  /* line is bookmarked */
-#define TSFLAG_ACTIVEMARK 0x0004  /* this is the active/current bookmark */
+  if (!tracequeue_hasroom(queue, length)) {
+    queue->overflow += 1;         /* notify packet queue overflow */
+    ATOMIC_STORE_RELEASE(&queue->counters.dropped, queue->counters.dropped + 1);
+    ATOMIC_STORE_RELEASE(&queue->counters.dropped_bytes, queue->counters.dropped_bytes + length);
+    return false;
+  }
 
-static SOCKET TraceSocket = INVALID_SOCKET;
+  size_t tail = queue->tail;
+  size_t head = ATOMIC_LOAD_ACQUIRE(&queue->head);
+  size_t needed = PKT_ALIGN(sizeof(PACKET) + length);
+  size_t contiguous = queue->size - (tail & (queue->size - 1));
+  PACKET *pkt;
+  if (needed > contiguous) {
+    /* skip the remaining space at the end of the buffer */
+    pkt = (PACKET*)(queue->buffer + (tail & (queue->size - 1)));
+    pkt->length = PKT_WRAP;
+    tail += contiguous;
+  }
+  pkt = (PACKET*)(queue->buffer + (tail & (queue->size - 1)));
+  pkt->length = (uint32_t)length;
+  pkt->arrival = (uint32_t)(unsigned long long)(get_timestamp() * 1e6);
+  pkt->timestamp = timestamp;
+  memcpy((unsigned char*)pkt + sizeof(PACKET), data, length);
+  tail += needed;
+  ATOMIC_STORE_RELEASE(&queue->tail, tail);
+
+  ATOMIC_STORE_RELEASE(&queue->counters.packets, queue->counters.packets + 1);
+  ATOMIC_STORE_RELEASE(&queue->counters.bytes, queue->counters.bytes + length);
+  if (ATOMIC_LOAD_ACQUIRE(&queue->hwreset)) {
+    ATOMIC_STORE_RELEASE(&queue->counters.highwater, 0);
+    ATOMIC_STORE_RELEASE(&queue->hwreset, 0);
+  }
+  if (queue->counters.highwater < tail - head)
+    ATOMIC_STORE_RELEASE(&queue->counters.highwater, tail - head);
+  return true;
+}
 
-#define TRACESTRING_MAXLENGTH 256
-#define TRACESTRING_INITSIZE  32
-static TRACESTRING tracestring_root = { NULL, NULL };
-static TRACESTRING *tracestring_tail = NULL;
-
-static unsigned char itm_cache[5]; /**< we may need to cache an ITM data packet that does
-                                        not fit completely in an USB packet; ITM data
-                                        packets are 5 bytes max. */
-static size_t itm_cachefilled = 0;
-static unsigned short itm_datasize = 1;    /* size in bytes (not bits) */
-static short itm_datasz_auto = 0;
-static unsigned itm_packet_errors = 0;
+/** tracequeue_mark() returns the current tail position of the queue. It is
+ *  used to limit the packets that the consumer handles in one run, so that a
+ *  fast producer cannot keep the consumer busy indefinitely.
+ */
+static size_t tracequeue_mark(TRACEQUEUE *queue)
+{
+  return ATOMIC_LOAD_ACQUIRE(&queue->tail);
+}
 
-#define ITM_VALIDHDR(b)   (((b) & 0x07) >= 1 && ((b) & 0x07) <= 3)
-#define ITM_CHANNEL(b)    (unsigned)(((b) >> 3) & 0x1f) /* get channel number from ITM packet header */
-#define ITM_LENGTH(b)     (unsigned)(((b) & 0x07) == 3 ? 4 : (b) & 0x07)
+/** tracequeue_peek() returns the packet at the head of the queue, or NULL if
+ *  the queue is empty (or if the head has reached the mark). It must only be
+ *  called from the consumer thread. The packet stays valid until
+ *  tracequeue_pop() is called.
+ */
+static const PACKET *tracequeue_peek(TRACEQUEUE *queue, size_t mark)
+{
+  size_t head = queue->head;      /* head is only modified by the consumer */
+  while (head != mark) {
+    const PACKET *pkt = (const PACKET*)(queue->buffer + (head & (queue->size - 1)));
+    if (pkt->length != PKT_WRAP)
+      return pkt;
+    head += queue->size - (head & (queue->size - 1));
+    ATOMIC_STORE_RELEASE(&queue->head, head);
+  }
+  return NULL;
+}
 
-static void tracestring_add(unsigned channel, const unsigned char *buffer, size_t length, double timestamp)
+/** tracequeue_pop() removes the packet at the head of the queue, which must
+ *  be the packet that tracequeue_peek() returned.
+ */
+static void tracequeue_pop(TRACEQUEUE *queue, const PACKET *pkt)
 {
-  assert(channel < NUM_CHANNELS);
-  assert(buffer != NULL);
-  assert(length > 0);
+  assert(pkt != NULL);
+  assert((const unsigned char*)pkt == queue->buffer + (queue->head & (queue->size - 1)));
+  ATOMIC_STORE_RELEASE(&queue->head, queue->head + PKT_ALIGN(sizeof(PACKET) + pkt->length));
+}
 
-  /* check whether the channel is enabled (in passive mode, the target that
-     sends the trace messages is oblivious of the settings in this viewer,
-     so it may send trace messages for disabled channels) */
-  if (!channels[channel].enabled)
-    return;
+/** tracequeue_isempty() returns whether all packets in the queue have been
+ *  handled.
+ */
+static bool tracequeue_isempty(TRACEQUEUE *queue)
+{
+  return ATOMIC_LOAD_ACQUIRE(&queue->head) == ATOMIC_LOAD_ACQUIRE(&queue->tail);
+}
 
-  if (stream_isactive(channel)) {
-    /* CTF mode */
-    int count = ctf_decode(buffer, length, channel);
-    if (count > 0) {
-      uint16_t streamid, eventid;
-      uint8_t severity;
-      double tstamp, tstamp_relative;
-      const char *message;
-      while (msgstack_peek(&streamid, &eventid, &severity, &tstamp, &message)) {
-        TRACESTRING *item = malloc(sizeof(TRACESTRING));
-        if (item != NULL) {
-          memset(item, 0, sizeof(TRACESTRING));
-          item->length = (unsigned short)strlen(message);
-          item->size = item->length + 1;
-          item->text = malloc(item->size * sizeof(unsigned char));
-          if (item->text != NULL) {
-            strcpy(item->text, message);
-            item->length = item->size - 1;
-            item->channel_id = (unsigned char)streamid;
-            item->severity = severity;
-            if (tstamp > 0.001)
-              timestamp = tstamp; /* use precision timestamp from remote host */
-            item->timestamp = timestamp;
-            /* create formatted timestamp */
-            if (tracestring_root.next != NULL)
-              tstamp_relative = timestamp - tracestring_root.next->timestamp;
-            else
-              tstamp_relative = 0.0;
-            if (tstamp > 0.001)
-              sprintf(item->timefmt, "%.6f", tstamp_relative);
-            else
-              sprintf(item->timefmt, "%.3f", tstamp_relative);
-            item->timefmt_len = (unsigned short)strlen(item->timefmt);
-            assert(item->timefmt_len < sizearray(item->timefmt));
-            /* append to tail */
-            if (tracestring_tail != NULL)
-              tracestring_tail->next = item;
-            else
-              tracestring_root.next = item;
-            tracestring_tail = item;
-          } else {
-            free((void*)item);
-          }
-        }
-        msgstack_pop(NULL, NULL, NULL, 0);
-      }
+/** tracequeue_alloc() allocates the packet queue (if not already allocated,
+ *  or if the configured size changed) and flushes it.
+ */
+static bool tracequeue_alloc(TRACEQUEUE *queue)
+{
+  if (queue->buffer != NULL && queue->size != tracequeue_size) {
+    free(queue->buffer);
+    queue->buffer = NULL;
+  }
+  if (queue->buffer == NULL) {
+    queue->buffer = malloc(tracequeue_size);
+    if (queue->buffer == NULL)
+      return false;
+    queue->size = tracequeue_size;
+  }
+  queue->head = queue->tail = 0;
+  return true;
+}
+
+/* The host timestamps come from a monotonic clock, which drifts relative to
+   the (NTP-disciplined) wall clock. For export, a timestamp is mapped to the
+   wall clock with a linear fit between the first anchor (a simultaneous
+   reading of both clocks) and the most recent one; anchors are refreshed
+   periodically. For a replayed recording, the offset that was stored in the
+   recording is used instead. */
+#define WALL_INTERVAL   10.0    /* seconds between anchors */
+#define WALL_MAXDRIFT   0.001   /* larger drift means that the wall clock was set */
+
+static double get_realtime(void);
+
+static double wall_mono0 = -1.0, wall_real0 = 0.0;  /* first anchor */
+static double wall_mono = 0.0, wall_real = 0.0;     /* most recent anchor */
+static double wall_rate = 1.0;
+static double wall_offset = 0.0;  /* fixed offset for a recording, 0 = live */
+
+static void wall_anchor(double *mono, double *real)
+{
+  /* read the wall clock on both sides of the monotonic clock, and keep the
+     reading with the shortest interval */
+  double interval = -1.0;
+  for (int i = 0; i < 3; i++) {
+    double r1 = get_realtime();
+    double m = get_timestamp();
+    double r2 = get_realtime();
+    if (interval < 0.0 || r2 - r1 < interval) {
+      interval = r2 - r1;
+      *mono = m;
+      *real = (r1 + r2) / 2;
     }
-  } else {
-    /* plain text mode */
-    double tstamp_relative;
-    unsigned idx;
-    while (length > 0 && buffer[length - 1] == '\0')
-      length--; /* this can happen with expansion from zero-compression */
-    for (idx = 0; idx < length; idx++) {
-      /* see whether to append to the recent string, or to add a new string */
-      if (tracestring_tail != NULL) {
-        if (buffer[idx] == '\r' || buffer[idx] == '\n') {
-          tracestring_tail->flags |= TSFLAG_EOL;  /* on newline, create a new string */
-          continue;
-        } else if (tracestring_tail->channel_id != channel) {
-          tracestring_tail->flags |= TSFLAG_EOL;  /* different channel, terminate previous string */
-        } else if (tracestring_tail->length >= TRACESTRING_MAXLENGTH) {
-          tracestring_tail->flags |= TSFLAG_EOL;  /* line length limit */
-        }
-        /* time criterion: there should not be more that 0.1 seconds between
-           parts of a continued string */
-        if (tracestring_tail != NULL && timestamp - tracestring_tail->timestamp > 0.1)
-          tracestring_tail->flags |= TSFLAG_EOL;  /* interval limit */
-      }
+  }
+}
 
-      if (tracestring_tail != NULL && (tracestring_tail->flags & TSFLAG_EOL) == 0) {
-        /* append text to the current string */
-        if (tracestring_tail->length >= tracestring_tail->size) {
-          int newsize = tracestring_tail->size * 2;
-          char *ptr = malloc(newsize * sizeof(unsigned char));
-          if (ptr != NULL) {
-            memcpy(ptr, tracestring_tail->text, tracestring_tail->length);
-            free((void*)tracestring_tail->text);
-            tracestring_tail->text = ptr;
-            tracestring_tail->size = (unsigned short)newsize;
-          }
-        }
-        if (tracestring_tail->length < tracestring_tail->size)
-          tracestring_tail->text[tracestring_tail->length++] = buffer[idx];
-      } else {
-        /* create a new string */
-        TRACESTRING *item;
-        if (tracestring_tail == NULL && (buffer[idx] == '\r' || buffer[idx] == '\n'))
-          continue; /* don't create an empty first string */
-        item = malloc(sizeof(TRACESTRING));
-        if (item != NULL) {
-          memset(item, 0, sizeof(TRACESTRING));
-          item->size = TRACESTRING_INITSIZE;
-          item->text = malloc(item->size * sizeof(unsigned char));
-          if (item->text != NULL) {
-            item->channel_id = (unsigned char)channel;
-            item->timestamp = timestamp;
-            /* create formatted timestamp */
-            if (tracestring_root.next != NULL)
-              tstamp_relative = timestamp - tracestring_root.next->timestamp;
-            else
-              tstamp_relative = 0.0;
-            sprintf(item->timefmt, "%.3f", tstamp_relative);
-            item->timefmt_len = (unsigned short)strlen(item->timefmt);
-            assert(item->timefmt_len < sizearray(item->timefmt));
-            /* append to tail */
-            if (tracestring_tail != NULL)
-              tracestring_tail->next = item;
-            else
-              tracestring_root.next = item;
-            tracestring_tail = item;
-            tracestring_tail->text[tracestring_tail->length++] = buffer[idx];
-          } else {
-            free(item); /* adding a new string failed */
-          }
-        }
-      }
+/** trace_walltime() converts a host timestamp (as returned by get_timestamp(),
+ *  and as stored with the trace messages) to wall clock time, corrected for
+ *  the drift between the two clocks.
+ *
+ *  \param timestamp  The host timestamp.
+ *
+ *  \return The wall clock time in seconds since the epoch (UTC).
+ *
+ *  \note This function should be called from a single thread.
+ */
+double trace_walltime(double timestamp)
+{
+  if (wall_offset != 0.0)
+    return timestamp + wall_offset;
+  if (wall_mono0 < 0.0) {
+    wall_anchor(&wall_mono0, &wall_real0);
+    wall_mono = wall_mono0;
+    wall_real = wall_real0;
+  } else if (get_timestamp() - wall_mono >= WALL_INTERVAL) {
+    wall_anchor(&wall_mono, &wall_real);
+    wall_rate = (wall_real - wall_real0) / (wall_mono - wall_mono0);
+    if (wall_rate < 1.0 - WALL_MAXDRIFT || wall_rate > 1.0 + WALL_MAXDRIFT) {
+      wall_mono0 = wall_mono;   /* restart the fit */
+      wall_real0 = wall_real;
+      wall_rate = 1.0;
     }
   }
+  return wall_real + (timestamp - wall_mono) * wall_rate;
 }
 
-void tracestring_clear(void)
+/* A recording holds the raw trace data as it was received from the probe, so
+   that it can be replayed (and decoded with different settings) later. The
+   file starts with a header, followed by the packets, each with a record
+   header that holds the length and the host timestamp of the packet. All
+   fields are stored in Little Endian. */
+#define REC_SIGNATURE   "BMSWOREC"
+#define REC_VERSION     1
+#define REC_HDRSIZE     40  /* signature, version, header size, bitrate,
+                               data size, reserved, TSDL hash, creation time,
+                               wall clock offset */
+#define REC_HDRMIN      32  /* header of the first recordings (without the
+                               wall clock offset) */
+#define REC_PKTHDRSIZE  16  /* length, reserved, timestamp */
+
+static FILE *record_fp = NULL;
+static unsigned long record_packets = 0;
+
+static void rec_putle(unsigned char *buffer, uint64_t value, int size)
 {
-  TRACESTRING *item;
-  while (tracestring_root.next != NULL) {
-    item = tracestring_root.next;
-    tracestring_root.next = item->next;
-    assert(item->text!=NULL);
-    free(item->text);
-    if (item->channelname != NULL)
-      free(item->channelname);
-    free(item);
+  for (int i = 0; i < size; i++) {
+    buffer[i] = (unsigned char)(value & 0xff);
+    value >>= 8;
   }
-  tracestring_tail = NULL;
 }
 
-bool tracestring_isempty(void)
+static uint64_t rec_getle(const unsigned char *buffer, int size)
 {
-  return (tracestring_root.next == NULL);
+  uint64_t value = 0;
+  for (int i = size - 1; i >= 0; i--)
+    value = (value << 8) | buffer[i];
+  return value;
 }
 
-unsigned tracestring_count(void)
+static void rec_putdouble(unsigned char *buffer, double value)
 {
-  TRACESTRING *item;
-  unsigned count = 0;
-  for (item = tracestring_root.next; item != NULL; item = item->next)
-    count++;
-  return count;
+  uint64_t bits;
+  assert(sizeof bits == sizeof value);
+  memcpy(&bits, &value, sizeof bits);
+  rec_putle(buffer, bits, 8);
 }
 
-int tracestring_process(bool enabled)
+static double rec_getdouble(const unsigned char *buffer)
 {
-  int count = 0;
-  while (tracequeue_head != tracequeue_tail) {
-    if (enabled) {
-      const unsigned char *pktdata = trace_queue[tracequeue_head].data;
-      size_t pktlen = trace_queue[tracequeue_head].length;
-      unsigned chan = ~0u;
-      unsigned char buffer[PACKET_SIZE];
-      size_t buflen = 0;
-      unsigned len;
-
-      /* we require that if a packet is incomplete, the remainder follows
-         immediately behind it; clear the cache if there is too long of a gap
-         from the previous packet */
-      static double prev_timestamp = 0;
-      double delta_stamp = trace_queue[tracequeue_head].timestamp - prev_timestamp;
-      if (delta_stamp < 0.0 || delta_stamp > 0.05)
-        itm_cachefilled = 0;
-      prev_timestamp = trace_queue[tracequeue_head].timestamp;
-
-      if (itm_cachefilled > 0) {
-        chan = ITM_CHANNEL(itm_cache[0]);
-        len = ITM_LENGTH(itm_cache[0]);
-        if (len > itm_datasize) {
-          if (itm_datasz_auto) {
-            itm_datasize = len; /* if larger data word is found, datasize must be adjusted */
-          } else {
-            ctf_decode_reset();
-            itm_packet_errors += 1;
-            goto skip_packet;   /* not a valid ITM packet, ignore it */
-          }
-        }
-        assert(itm_cachefilled <= 4);
-        int append = len - (itm_cachefilled - 1);
-        assert(append > 0);     /* there must be data left to copy (otherwise nothing would be cached) */
-        if (append > pktlen) {
-          /* data left in the packet (combined with the cache) is still too small
-             to make a complete packet -> append to cache */
-          memcpy(itm_cache + itm_cachefilled, pktdata, pktlen);
-          itm_cachefilled += pktlen;
-          pktlen = 0;
-        } else {
-          if (itm_cachefilled > 1) {
-            /* copy data bytes still in the cache */
-            memcpy(buffer + buflen, itm_cache + 1, itm_cachefilled - 1);
-            buflen += itm_cachefilled - 1;
-          }
-          memcpy(buffer + buflen, pktdata, append);
-          buflen += append;
-          pktdata += append;
-          pktlen -= append;
-          itm_cachefilled = 0;
-        }
-      } else {
-        assert(pktlen > 0);
-        chan = ITM_CHANNEL(*pktdata);
-      }
+  uint64_t bits = rec_getle(buffer, 8);
+  double value;
+  memcpy(&value, &bits, sizeof value);
+  return value;
+}
 
-      while (pktlen > 0) {
-        if (*pktdata == 0x17) {
-          /* profile packet (PC address) */
-          pktdata += 5;
-          pktlen = (pktlen > 5) ? pktlen - 5 : 0;
-          continue;
-        } else if (!ITM_VALIDHDR(*pktdata)) {
-          ctf_decode_reset();
-          itm_packet_errors += 1;
-          goto skip_packet;     /* not a valid ITM packet, ignore it */
-        }
-        /* if the channel changes in the middle of a packet, add a string and
-           restart */
-        if (chan != ITM_CHANNEL(*pktdata)) {
-          if (chan < NUM_CHANNELS && buflen > 0)
-            tracestring_add(chan, buffer, buflen, trace_queue[tracequeue_head].timestamp);
-          chan = ITM_CHANNEL(*pktdata);
-          buflen = 0;
-        }
-        len = ITM_LENGTH(*pktdata);
-        if (pktlen < len + 1) {
-          /* store remaining data in the packet in the cache and quit */
-          memcpy(itm_cache, pktdata, pktlen);
-          itm_cachefilled = pktlen;
-          break;
-        }
-        if (len > itm_datasize) {
-          if (itm_datasz_auto) {
-            itm_datasize = len; /* if larger data word is found, datasize must be adjusted */
-          } else {
-            ctf_decode_reset();
-            itm_packet_errors += 1;
-            goto skip_packet;   /* not a valid ITM packet, ignore it */
-          }
-        }
-        memcpy(buffer + buflen, pktdata + 1, len);
-        buflen += len;
-        pktdata += len + 1;
-        pktlen -= len + 1;
-      }
-      if (chan < NUM_CHANNELS && buflen > 0) {
-        tracestring_add(chan, buffer, buflen, trace_queue[tracequeue_head].timestamp);
-        count++;
-      }
-    }
-  skip_packet:
-    tracequeue_head = (tracequeue_head + 1) % PACKET_NUM;
+/** trace_tsdlhash() returns a hash (32-bit FNV-1a) of the contents of a file.
+ *  It is used to check whether a recording is decoded with the same TSDL file
+ *  as the one that was active when it was recorded.
+ *
+ *  \param filename   The name of the TSDL file, may be NULL.
+ *
+ *  \return The hash value, or 0 if the file cannot be read.
+ */
+unsigned long trace_tsdlhash(const char *filename)
+{
+  if (filename == NULL || *filename == '\0')
+    return 0;
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return 0;
+  uint32_t hash = 2166136261u;
+  unsigned char buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof buffer, fp)) > 0) {
+    for (size_t i = 0; i < count; i++)
+      hash = (hash ^ buffer[i]) * 16777619u;
   }
+  fclose(fp);
+  return (hash != 0) ? hash : 1;  /* 0 is reserved for "no TSDL file" */
+}
 
-  if (!enabled)
-    tracequeue_overflow = 0;  /* ignore overflow events if not running/decoding */
-  return count;
+/** trace_recordheader() creates the header of a recording, for a recording
+ *  file or for a stream in the same format (see trace_initdaemon()).
+ *
+ *  \param buffer     The buffer for the header.
+ *  \param size       The size of the buffer in bytes.
+ *  \param info       The settings that are stored in the header (the "created"
+ *                    and "walloffset" fields are set by this function).
+ *
+ *  \return The size of the header, or 0 if the buffer is too small.
+ */
+size_t trace_recordheader(unsigned char *buffer, size_t size, const TRACERECORDING *info)
+{
+  assert(buffer != NULL);
+  assert(info != NULL);
+  if (size < REC_HDRSIZE)
+    return 0;
+  memset(buffer, 0, REC_HDRSIZE);
+  memcpy(buffer, REC_SIGNATURE, 8);
+  rec_putle(buffer + 8, REC_VERSION, 2);
+  rec_putle(buffer + 10, REC_HDRSIZE, 2);
+  rec_putle(buffer + 12, info->bitrate, 4);
+  rec_putle(buffer + 16, info->datasize, 2);
+  rec_putle(buffer + 20, info->tsdlhash, 4);
+  rec_putle(buffer + 24, (uint64_t)time(NULL), 8);
+  double now = get_timestamp();
+  rec_putdouble(buffer + 32, trace_walltime(now) - now);
+  return REC_HDRSIZE;
 }
 
-/** tracestring_find() jumps to the previous or next match.
+/** trace_recordframe() creates the record header for a packet in a recording
+ *  (or in a stream in the same format).
  *
- *  \param pattern  The text to search, which may contain wildcards.
- *  \param curline  The starting point for the search (a line number), or -1 to
- *                  search from the top to the first match.
+ *  \param buffer     The buffer for the record header.
+ *  \param size       The size of the buffer in bytes.
+ *  \param length     The size of the packet data that follows the header.
+ *  \param timestamp  The host timestamp of the packet.
  *
- *  \return A line number for the next match, or -1 if the text is not found.
+ *  \return The size of the record header, or 0 if the buffer is too small.
+ */
+size_t trace_recordframe(unsigned char *buffer, size_t size, size_t length, double timestamp)
+{
+  assert(buffer != NULL);
+  if (size < REC_PKTHDRSIZE)
+    return 0;
+  rec_putle(buffer, length, 4);
+  rec_putle(buffer + 4, 0, 4);
+  rec_putdouble(buffer + 8, timestamp);
+  return REC_PKTHDRSIZE;
+}
+
+/** trace_recordstart() starts recording the raw trace data to a file. The
+ *  packets are recorded as they are taken from the queue by the decoder, so
+ *  recording does not add work to the thread that reads from the probe.
  *
- *  \note The search wraps around from the end to the beginning.
+ *  \param filename   The name of the recording file; an existing file is
+ *                    overwritten.
+ *  \param info       The settings that are stored in the header of the file
+ *                    (the "created" and "walloffset" fields are set by this
+ *                    function).
+ *
+ *  \return true on success, false if the file cannot be created.
  */
-int tracestring_find(const char *pattern, int curline)
+bool trace_recordstart(const char *filename, const TRACERECORDING *info)
 {
-  assert(curline >= 0 || curline == -1);
-  assert(pattern != NULL);
+  assert(filename != NULL);
+  assert(info != NULL);
+  trace_recordstop();
 
-  int cur_mark = curline + 1;
-  TRACESTRING *item = tracestring_root.next;
-  int line = 0;
-  while (item != NULL && line < cur_mark) {
-    line++;
-    item = item->next;
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL)
+    return false;
+  setvbuf(fp, NULL, _IOFBF, 256*1024);
+  unsigned char header[REC_HDRSIZE];
+  trace_recordheader(header, sizeof header, info);
+  if (fwrite(header, 1, sizeof header, fp) != sizeof header) {
+    fclose(fp);
+    remove(filename);
+    return false;
   }
-  if (item == NULL || curline < 0) {
-    item = tracestring_root.next;
-    line = 0;
-  } else {
-    item = item->next;
-    line++;
+
+  tracestring_lock();   /* the decoder thread may be running */
+  record_fp = fp;
+  record_packets = 0;
+  tracestring_unlock();
+  return true;
+}
+
+/** trace_recordstop() stops an active recording and closes the file.
+ *
+ *  \return The number of packets in the recording.
+ */
+unsigned long trace_recordstop(void)
+{
+  tracestring_lock();
+  FILE *fp = record_fp;
+  record_fp = NULL;
+  tracestring_unlock();
+  if (fp != NULL)
+    fclose(fp);
+  return record_packets;
+}
+
+/** trace_recordactive() returns whether a recording is in progress. */
+bool trace_recordactive(void)
+{
+  return record_fp != NULL;
+}
+
+/** record_packet() appends a packet to the recording, if one is active. On a
+ *  write error, the recording is stopped.
+ */
+static void record_packet(const PACKET *pkt)
+{
+  if (record_fp == NULL)
+    return;
+  unsigned char header[REC_PKTHDRSIZE];
+  trace_recordframe(header, sizeof header, pkt->length, pkt->timestamp);
+  if (fwrite(header, 1, sizeof header, record_fp) != sizeof header
+      || fwrite(PKT_DATA(pkt), 1, pkt->length, record_fp) != pkt->length)
+  {
+    fclose(record_fp);
+    record_fp = NULL;
+    return;
   }
+  record_packets += 1;
+}
 
-  size_t bufsize = 0;
-  char *buffer = NULL;
-  while ((line != cur_mark || curline < 0) && item != NULL) {
-    curline = cur_mark;
-    /* allocate a buffer for item->text, and copy it into this buffer, because
-       it item->text not necessarilty zero-terminated */
-    while (item->length >= bufsize) {
-      if (buffer != NULL)
-        free(buffer);
-      bufsize = (bufsize < 128) ? 128 : 2 * bufsize;
-      char *buffer = malloc(bufsize * sizeof(char));
-      if (buffer == NULL)
-        return -1;
+/** rec_parseheader() checks the header of a recording, and optionally
+ *  extracts the settings from it.
+ *
+ *  \param header     The start of the recording.
+ *  \param size       The number of bytes in "header".
+ *  \param info       [out] Filled with the settings; may be NULL.
+ */
+static bool rec_parseheader(const unsigned char *header, size_t size, TRACERECORDING *info)
+{
+  if (size < REC_HDRMIN || memcmp(header, REC_SIGNATURE, 8) != 0
+      || rec_getle(header + 8, 2) > REC_VERSION || rec_getle(header + 10, 2) < REC_HDRMIN)
+    return false;
+  if (info != NULL) {
+    info->bitrate = (unsigned long)rec_getle(header + 12, 4);
+    info->datasize = (short)rec_getle(header + 16, 2);
+    info->tsdlhash = (unsigned long)rec_getle(header + 20, 4);
+    info->created = rec_getle(header + 24, 8);
+    info->walloffset = 0.0;
+    if (size >= REC_HDRSIZE && rec_getle(header + 10, 2) >= REC_HDRSIZE)
+      info->walloffset = rec_getdouble(header + 32);
+  }
+  return true;
+}
+
+/** trace_recordinfo() reads the header of a recording.
+ *
+ *  \param filename   The name of the file.
+ *  \param info       [out] Filled with the settings from the header. This
+ *                    parameter may be NULL.
+ *
+ *  \return true if the file is a recording (of a supported version), false if
+ *          it is not (e.g. a file with raw SWO data) or cannot be read.
+ */
+bool trace_recordinfo(const char *filename, TRACERECORDING *info)
+{
+  assert(filename != NULL);
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  unsigned char header[REC_HDRSIZE];
+  size_t size = fread(header, 1, sizeof header, fp);
+  fclose(fp);
+  return rec_parseheader(header, size, info);
+}
+
+/* Trace messages are kept in a columnar store. The attributes of each line
+   (timestamp, channel, severity, flags and the location of the text) are in
+   parallel arrays, which are allocated in chunks of a fixed number of lines;
+   a directory of chunks gives direct access to any line. The text of all lines
+   is stored (zero-terminated) in large blocks, which are only appended to.
+   With a retention limit, the oldest chunk is recycled (after the text blocks
+   that only hold its lines are freed), so that memory stays bounded; the line
+   numbers then shift down by a whole chunk, and "evicted" counts the lines that
+   were removed from the front. */
+#define STORE_CHUNKSHIFT  12
+#define STORE_CHUNKLINES  (1 << STORE_CHUNKSHIFT) /* number of lines in a chunk */
+#define STORE_TEXTBLOCK   (256*1024)              /* default size of a text block */
+
+typedef struct tagLINECHUNK {
+  const char *text[STORE_CHUNKLINES];       /* pointer into a text block */
+  double timestamp[STORE_CHUNKLINES];       /* in seconds */
+  unsigned short length[STORE_CHUNKLINES];  /* text length */
+  unsigned char channel[STORE_CHUNKLINES];  /* number of the name/channel */
+  unsigned char severity[STORE_CHUNKLINES];
+  unsigned char flags[STORE_CHUNKLINES];    /* used to keep state while decoding plain trace messages */
+} LINECHUNK;
+
+typedef struct tagTEXTBLOCK {
+  struct tagTEXTBLOCK *next;
+  unsigned long long firstline; /* absolute number of the first line in the block */
+  size_t size, used;
+  char data[];
+} TEXTBLOCK;
+
+typedef struct tagTRACESTORE {
+  LINECHUNK **chunks;           /* directory of chunks */
+  unsigned numchunks;           /* number of allocated chunks */
+  unsigned maxchunks;           /* size of the chunk directory */
+  unsigned count;               /* number of lines in the store */
+  TEXTBLOCK *blocks, *lastblock;
+  unsigned *bookmarks;          /* line numbers of bookmarks (sorted) */
+  unsigned numbookmarks, maxbookmarks;
+  int activemark;               /* line number of the active bookmark, or -1 */
+  double mintime, maxtime;      /* range of the timestamps (for the column width) */
+  bool precise;                 /* whether any line has a precise timestamp */
+  char *channelnames[NUM_CHANNELS]; /* channel names (from a file that was loaded) */
+  unsigned long long evicted;   /* number of lines removed by the retention limit */
+  size_t memsize;               /* memory allocated for chunks and text blocks */
+  double starttime;             /* timestamp of the first line (also if evicted) */
+} TRACESTORE;
+
+#define TSFLAG_EOL        0x01  /* line is finished (do not concatenate more data) */
+#define TSFLAG_BOOKMARK   0x02  /* line is bookmarked */
+#define TSFLAG_PRECISE    0x04  /* timestamp is shown with microsecond resolution */
+
+#define LINE_CHUNK(line)  (tracestore.chunks[(line) >> STORE_CHUNKSHIFT])
+#define LINE_INDEX(line)  ((line) & (STORE_CHUNKLINES - 1))
+
+#define TRACESTRING_MAXLENGTH 256
+static TRACESTORE tracestore = { NULL, 0, 0, 0, NULL, NULL, NULL, 0, 0, -1 };
+static unsigned store_generation = 1;   /* incremented each time the store is cleared (never 0) */
+
+static unsigned store_maxlines = 0;     /* retention limit in lines (0 = no limit) */
+static size_t store_maxbytes = 0;       /* retention limit in bytes (0 = no limit) */
+static FILE *store_spill = NULL;        /* file for evicted lines (NULL = discard) */
+static char *store_spillbuf = NULL;     /* buffer for formatting evicted lines */
+static unsigned store_spillmarks = 0;   /* bookmarks written to the spill file */
+static unsigned long long store_spilled = 0;
+
+#define STORE_WRITEBUF  (1024*1024)     /* buffer size for saving lines to a file */
+
+static bool tracesearch_busy(void);
+
+/** store_formatline() formats a line in CSV format, with the timestamp relative
+ *  to "starttime". The bookmark count is incremented if the line is bookmarked.
+ *
+ *  \return The number of characters stored in the buffer, or 0 if the line
+ *          does not fit in the buffer.
+ */
+static size_t store_formatline(char *buffer, size_t size, unsigned line, double starttime, unsigned *bookmarkcount)
+{
+  const LINECHUNK *chunk = LINE_CHUNK(line);
+  unsigned idx = LINE_INDEX(line);
+  const char *severity = ctf_severity_name(chunk->severity[idx]);
+  if (severity == NULL)
+    severity = "(invalid)";
+  int pos = snprintf(buffer, size, "%d,\"%s\",%s,%.6f,", chunk->channel[idx], channels[chunk->channel[idx]].name,
+                     severity, chunk->timestamp[idx] - starttime);
+  /* worst case for the text is that all characters are double quotes */
+  if (pos < 0 || (size_t)pos + 2 * chunk->length[idx] + 16 > size)
+    return 0;
+  char *tail = buffer + pos;
+  for (const char *ptr = chunk->text[idx]; *ptr != '\0'; ptr++) {
+    if (*ptr == '"')
+      *tail++ = '"';
+    *tail++ = *ptr;
+  }
+  if ((chunk->flags[idx] & TSFLAG_BOOKMARK) != 0)
+    tail += sprintf(tail, ",#%u", ++*bookmarkcount);
+  *tail++ = '\n';
+  return tail - buffer;
+}
+
+/** store_overlimit() returns whether the oldest chunk should be evicted before
+ *  a new chunk is started. The limit on the line count is the minimum number of
+ *  lines to keep, so a chunk is only dropped when enough lines remain.
+ */
+static bool store_overlimit(void)
+{
+  if (tracestore.numchunks == 0)
+    return false;
+  if (store_maxlines > 0 && tracestore.count >= STORE_CHUNKLINES
+      && tracestore.count - STORE_CHUNKLINES >= store_maxlines)
+    return true;
+  if (store_maxbytes > 0 && tracestore.memsize > store_maxbytes)
+    return true;
+  return false;
+}
+
+/** store_evict() removes the oldest chunk of lines from the store, and returns
+ *  it for reuse. The lines are written to the spill file (if one is set), and
+ *  the text blocks that no longer hold any retained line are freed. The
+ *  directory is shifted down by one entry, so the cost per line is amortized
+ *  constant. The caller must make sure that the chunk is full.
+ */
+static LINECHUNK *store_evict(void)
+{
+  assert(tracestore.numchunks > 0 && tracestore.count >= STORE_CHUNKLINES);
+  if (store_spill != NULL) {
+    assert(store_spillbuf != NULL);
+    size_t used = 0;
+    for (unsigned line = 0; line < STORE_CHUNKLINES; line++) {
+      size_t len = store_formatline(store_spillbuf + used, STORE_WRITEBUF - used, line, tracestore.starttime, &store_spillmarks);
+      if (len == 0 && used > 0) {
+        fwrite(store_spillbuf, 1, used, store_spill);
+        used = 0;
+        len = store_formatline(store_spillbuf, STORE_WRITEBUF, line, tracestore.starttime, &store_spillmarks);
+      }
+      used += len;
+    }
+    if (used > 0)
+      fwrite(store_spillbuf, 1, used, store_spill);
+    store_spilled += STORE_CHUNKLINES;
+  }
+
+  LINECHUNK *chunk = tracestore.chunks[0];
+  tracestore.numchunks -= 1;
+  memmove(tracestore.chunks, tracestore.chunks + 1, tracestore.numchunks * sizeof(LINECHUNK*));
+  tracestore.count -= STORE_CHUNKLINES;
+  tracestore.evicted += STORE_CHUNKLINES;
+
+  /* a block can go when the next block starts at or before the first retained
+     line (the last block is never freed) */
+  while (tracestore.blocks != tracestore.lastblock && tracestore.blocks->next->firstline <= tracestore.evicted) {
+    TEXTBLOCK *block = tracestore.blocks;
+    tracestore.blocks = block->next;
+    tracestore.memsize -= sizeof(TEXTBLOCK) + block->size;
+    free(block);
+  }
+
+  /* drop the bookmarks on the evicted lines, renumber the others */
+  unsigned drop = 0;
+  while (drop < tracestore.numbookmarks && tracestore.bookmarks[drop] < STORE_CHUNKLINES)
+    drop++;
+  tracestore.numbookmarks -= drop;
+  for (unsigned idx = 0; idx < tracestore.numbookmarks; idx++)
+    tracestore.bookmarks[idx] = tracestore.bookmarks[idx + drop] - STORE_CHUNKLINES;
+  if (tracestore.activemark >= STORE_CHUNKLINES)
+    tracestore.activemark -= STORE_CHUNKLINES;
+  else
+    tracestore.activemark = -1;
+  return chunk;
+}
+
+/** store_newline() adds an empty line to the store.
+ *
+ *  \return The line number of the new line, or -1 on failure.
+ */
+static int store_newline(unsigned channel, unsigned severity, double timestamp, unsigned flags)
+{
+  assert(channel < NUM_CHANNELS);
+
+  /* make sure there is space in the text block for the terminating zero */
+  TEXTBLOCK *block = tracestore.lastblock;
+  if (block == NULL || block->used >= block->size) {
+    block = malloc(sizeof(TEXTBLOCK) + STORE_TEXTBLOCK);
+    if (block == NULL)
+      return -1;
+    block->next = NULL;
+    block->firstline = tracestore.evicted + tracestore.count;
+    block->size = STORE_TEXTBLOCK;
+    block->used = 0;
+    tracestore.memsize += sizeof(TEXTBLOCK) + block->size;
+    if (tracestore.lastblock != NULL)
+      tracestore.lastblock->next = block;
+    else
+      tracestore.blocks = block;
+    tracestore.lastblock = block;
+  }
+
+  /* make sure there is a chunk for the line; when over the retention limit,
+     the oldest chunk is recycled (unless a background search still reads it) */
+  unsigned line = tracestore.count;
+  if ((line >> STORE_CHUNKSHIFT) >= tracestore.numchunks) {
+    LINECHUNK *newchunk = NULL;
+    if (!tracesearch_busy()) {
+      while (store_overlimit()) {
+        LINECHUNK *chunk = store_evict();
+        if (newchunk == NULL) {
+          newchunk = chunk;
+        } else {
+          free(chunk);  /* catching up after eviction was postponed */
+          tracestore.memsize -= sizeof(LINECHUNK);
+        }
+      }
+      line = tracestore.count;
     }
-    memcpy(buffer, item->text, item->length);
-    buffer[item->length] = '\0';
-    const char *ptr = strmatch(pattern, buffer, NULL);
-    if (ptr != NULL) {
-      free(buffer);
-      return line;  /* found, stop search */
+    if (newchunk == NULL && tracestore.numchunks >= tracestore.maxchunks) {
+      unsigned newsize = (tracestore.maxchunks == 0) ? 16 : 2 * tracestore.maxchunks;
+      LINECHUNK **list = realloc(tracestore.chunks, newsize * sizeof(LINECHUNK*));
+      if (list == NULL)
+        return -1;
+      tracestore.chunks = list;
+      tracestore.maxchunks = newsize;
     }
-    item = item->next;
-    line++;
-    if (item == NULL) {
-      item = tracestring_root.next; /* wrap-around */
-      line = 0;
+    if (newchunk == NULL) {
+      newchunk = malloc(sizeof(LINECHUNK));
+      if (newchunk == NULL)
+        return -1;
+      tracestore.memsize += sizeof(LINECHUNK);
     }
-  } /* while (line != cur_mark) */
+    tracestore.chunks[tracestore.numchunks++] = newchunk;
+  }
+  if (line == 0 && tracestore.evicted == 0) {
+    tracestore.starttime = timestamp;
+    tracestore.mintime = tracestore.maxtime = timestamp;
+  } else if (timestamp > tracestore.maxtime) {
+    tracestore.maxtime = timestamp;
+  } else if (timestamp < tracestore.mintime) {
+    tracestore.mintime = timestamp;
+  }
+  if ((flags & TSFLAG_PRECISE) != 0)
+    tracestore.precise = true;
+
+  LINECHUNK *chunk = LINE_CHUNK(line);
+  unsigned idx = LINE_INDEX(line);
+  char *text = block->data + block->used;
+  *text = '\0';
+  block->used += 1;
+  chunk->text[idx] = text;
+  chunk->length[idx] = 0;
+  chunk->timestamp[idx] = timestamp;
+  chunk->channel[idx] = (unsigned char)channel;
+  chunk->severity[idx] = (unsigned char)severity;
+  chunk->flags[idx] = (unsigned char)flags;
+  tracestore.count = line + 1;
+  return (int)line;
+}
 
-  if (buffer != NULL)
-    free(buffer);
-  return -1;  /* not found */
+/** store_appendtext() appends text to the last line in the store. The text of
+ *  this line is always at the end of the last text block. If the text does not
+ *  fit in the block, the line is moved to a new block.
+ */
+static bool store_appendtext(const char *text, size_t length)
+{
+  assert(tracestore.count > 0);
+  assert(text != NULL);
+  unsigned line = tracestore.count - 1;
+  LINECHUNK *chunk = LINE_CHUNK(line);
+  unsigned idx = LINE_INDEX(line);
+  size_t curlength = chunk->length[idx];
+  if (curlength + length > USHRT_MAX)
+    length = USHRT_MAX - curlength;
+  TEXTBLOCK *block = tracestore.lastblock;
+  assert(block != NULL);
+  assert(chunk->text[idx] + curlength + 1 == block->data + block->used);
+  if (block->used + length > block->size) {
+    size_t size = (curlength + length + 1 > STORE_TEXTBLOCK) ? curlength + length + 1 : STORE_TEXTBLOCK;
+    TEXTBLOCK *newblock = malloc(sizeof(TEXTBLOCK) + size);
+    if (newblock == NULL)
+      return false;
+    newblock->next = NULL;
+    newblock->firstline = tracestore.evicted + line;
+    newblock->size = size;
+    tracestore.memsize += sizeof(TEXTBLOCK) + size;
+    memcpy(newblock->data, chunk->text[idx], curlength + 1);
+    newblock->used = curlength + 1;
+    block->used -= curlength + 1;   /* line moved out of the old block */
+    block->next = newblock;
+    tracestore.lastblock = block = newblock;
+    chunk->text[idx] = newblock->data;
+  }
+  char *tail = block->data + block->used - 1;
+  memcpy(tail, text, length);
+  tail[length] = '\0';
+  block->used += length;
+  chunk->length[idx] = (unsigned short)(curlength + length);
+  return true;
 }
 
-/** tracestring_findtimestamp() finds the line closest to the given
- *  timestamp. Note that it can return -1 when there are not strings in the
- *  list.
+#if !defined NO_GUI
+/* Timestamps are formatted only for the lines that are displayed; a small
+   cache holds the recently formatted strings, so that lines that stay in view
+   are not re-formatted on every frame. Entries are keyed by the absolute line
+   number and the generation of the store. */
+#define TIMEFMT_CACHE 256   /* must be a power of 2 */
+
+typedef struct tagTIMEFMT {
+  unsigned long long line;      /* absolute line number */
+  unsigned generation;          /* store generation, 0 = unused */
+  char text[24];
+} TIMEFMT;
+
+static TIMEFMT timefmt_cache[TIMEFMT_CACHE];
+
+/** store_timefmt() returns the formatted timestamp for a line; the timestamp
+ *  is relative to the first line that was added to the store (which may since
+ *  have been evicted).
+ *
+ *  \note The returned string is valid until the next call.
  */
-int tracestring_findtimestamp(double timestamp)
+static const char *store_timefmt(unsigned line)
 {
-  int line = 0;
-  for (TRACESTRING *item = tracestring_root.next; item != NULL && item->timestamp < timestamp; item = item->next)
-    line += 1;
-  return line - 1;
+  assert(line < tracestore.count);
+  unsigned long long absline = tracestore.evicted + line;
+  TIMEFMT *entry = &timefmt_cache[absline & (TIMEFMT_CACHE - 1)];
+  if (entry->generation != store_generation || entry->line != absline) {
+    const LINECHUNK *chunk = LINE_CHUNK(line);
+    unsigned idx = LINE_INDEX(line);
+    bool precise = (chunk->flags[idx] & TSFLAG_PRECISE) != 0;
+    snprintf(entry->text, sizearray(entry->text), precise ? "%.6f" : "%.3f",
+             chunk->timestamp[idx] - tracestore.starttime);
+    entry->line = absline;
+    entry->generation = store_generation;
+  }
+  return entry->text;
+}
+
+/** store_timewidth() returns the number of characters in the longest
+ *  formatted timestamp, from the range of timestamps in the store.
+ */
+static unsigned store_timewidth(void)
+{
+  if (tracestore.count == 0 && tracestore.evicted == 0)
+    return 0;
+  double low = tracestore.mintime - tracestore.starttime;
+  double high = tracestore.maxtime - tracestore.starttime;
+  int decimals = tracestore.precise ? 6 : 3;
+  int lowlen = snprintf(NULL, 0, "%.*f", decimals, low);
+  int highlen = snprintf(NULL, 0, "%.*f", decimals, high);
+  return (unsigned)((lowlen > highlen) ? lowlen : highlen);
+}
+#endif /* NO_GUI */
+
+/** store_togglebookmark() sets or clears a bookmark on a line. The list of
+ *  bookmarks is kept sorted.
+ */
+static void store_togglebookmark(unsigned line)
+{
+  assert(line < tracestore.count);
+  LINECHUNK *chunk = LINE_CHUNK(line);
+  unsigned idx = LINE_INDEX(line);
+  /* binary search for the position in the list of bookmarks */
+  unsigned low = 0, high = tracestore.numbookmarks;
+  while (low < high) {
+    unsigned mid = (low + high) / 2;
+    if (tracestore.bookmarks[mid] < line)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (chunk->flags[idx] & TSFLAG_BOOKMARK) {
+    assert(low < tracestore.numbookmarks && tracestore.bookmarks[low] == line);
+    memmove(tracestore.bookmarks + low, tracestore.bookmarks + low + 1,
+            (tracestore.numbookmarks - low - 1) * sizeof(unsigned));
+    tracestore.numbookmarks -= 1;
+    chunk->flags[idx] &= ~TSFLAG_BOOKMARK;
+  } else {
+    if (tracestore.numbookmarks >= tracestore.maxbookmarks) {
+      unsigned newsize = (tracestore.maxbookmarks == 0) ? 16 : 2 * tracestore.maxbookmarks;
+      unsigned *list = realloc(tracestore.bookmarks, newsize * sizeof(unsigned));
+      if (list == NULL)
+        return;
+      tracestore.bookmarks = list;
+      tracestore.maxbookmarks = newsize;
+    }
+    memmove(tracestore.bookmarks + low + 1, tracestore.bookmarks + low,
+            (tracestore.numbookmarks - low) * sizeof(unsigned));
+    tracestore.bookmarks[low] = line;
+    tracestore.numbookmarks += 1;
+    chunk->flags[idx] |= TSFLAG_BOOKMARK;
+  }
+}
+
+static void store_clear(void)
+{
+  for (unsigned idx = 0; idx < tracestore.numchunks; idx++)
+    free(tracestore.chunks[idx]);
+  if (tracestore.chunks != NULL)
+    free(tracestore.chunks);
+  while (tracestore.blocks != NULL) {
+    TEXTBLOCK *block = tracestore.blocks;
+    tracestore.blocks = block->next;
+    free(block);
+  }
+  if (tracestore.bookmarks != NULL)
+    free(tracestore.bookmarks);
+  for (int chan = 0; chan < NUM_CHANNELS; chan++)
+    if (tracestore.channelnames[chan] != NULL)
+      free(tracestore.channelnames[chan]);
+  memset(&tracestore, 0, sizeof tracestore);
+  tracestore.activemark = -1;
+  if (++store_generation == 0)
+    store_generation = 1;
+}
+
+/* ITM and DWT packets (ARMv7-M Architecture Reference Manual, appendix D4).
+   The header byte of a packet determines its type and the size of its
+   payload; the decoder looks both up in a table (which is built from the bit
+   patterns of the headers on first use). A packet may continue in the next
+   USB packet, in which case its head is kept in the decoder state. */
+enum {
+  ITMPKT_RESERVED,  /* reserved header (the stream is out of sync) */
+  ITMPKT_SYNC,      /* synchronization (at least 47 zero bits, then a 1 bit) */
+  ITMPKT_OVERFLOW,
+  ITMPKT_LTS,       /* local timestamp (formats 1 and 2) */
+  ITMPKT_GTS1,      /* global timestamp, low bits */
+  ITMPKT_GTS2,      /* global timestamp, high bits */
+  ITMPKT_EXTENSION,
+  ITMPKT_SWIT,      /* instrumentation packet (software source) */
+  ITMPKT_EVENT,     /* DWT event counter wrap-around */
+  ITMPKT_EXCEPTION, /* DWT exception trace */
+  ITMPKT_PCSAMPLE,  /* DWT periodic PC sample */
+  ITMPKT_DATAPC,    /* DWT data trace, PC value */
+  ITMPKT_DATAADDR,  /* DWT data trace, address offset */
+  ITMPKT_DATAVALUE, /* DWT data trace, data value */
+  ITMPKT_HWOTHER,   /* hardware source packet with an unknown discriminator */
+};
+
+#define ITM_VARSIZE     0xff  /* payload is coded with continuation bits */
+#define ITM_MAXPAYLOAD  6     /* GTS2 packet with a 64-bit timestamp */
+#define ITM_SYNCZEROS   5     /* zero bytes before the 0x80 of a synchronization packet */
+#define ITM_DATAWRITE   0x04  /* flag in ITMPACKET.id of a data value packet */
+#define ITM_RUNMAX      256   /* maximum number of packets in a run */
+
+typedef struct tagITMHEADER {
+  unsigned char type;
+  unsigned char size;         /* payload size in bytes, or ITM_VARSIZE */
+} ITMHEADER;
+
+typedef struct tagITMPACKET {
+  unsigned char type;
+  unsigned char id;           /* stimulus port, DWT comparator, or the TC bits of a local timestamp */
+  unsigned char size;         /* payload size in bytes */
+  uint64_t value;             /* payload (Little Endian, or concatenated 7-bit groups) */
+  double timestamp;           /* host time of the last byte of the packet */
+  unsigned count;             /* number of packets, for a run of single-byte instrumentation packets */
+  const unsigned char *data;  /* payload bytes of the run (NULL for a single packet) */
+  double step;                /* interval between the packets in a run */
+} ITMPACKET;
+
+typedef bool (*ITM_HANDLER)(const ITMPACKET *packet, void *arg);
+
+typedef struct tagITMDECODER {
+  unsigned char partial[1 + ITM_MAXPAYLOAD];  /* head of a packet that continues in the next block */
+  unsigned partiallen;
+  unsigned zeros;             /* length of the current run of zero bytes */
+  double prev_timestamp;      /* host timestamp of the previous block */
+  double bytetime;            /* transmission time of a byte, 0 = no interpolation */
+  uint64_t ticks;             /* accumulated local timestamp */
+  uint64_t globaltime;        /* most recent global timestamp */
+} ITMDECODER;
+
+static ITMHEADER itm_headers[256];
+static bool itm_headers_init = false;
+static TRACEITMSTATS itm_stats;
+static bool itm_fastpath = true;           /* use the vectorized paths */
+static unsigned short itm_datasize = 1;    /* size in bytes (not bits) */
+static short itm_datasz_auto = 0;
+static unsigned itm_packet_errors = 0;
+
+static void itm_buildtable(void)
+{
+  for (int b = 0; b < 256; b++) {
+    ITMHEADER *hdr = &itm_headers[b];
+    hdr->size = 0;
+    if ((b & 0x03) != 0) {
+      /* source packet, with a payload of 1, 2 or 4 bytes */
+      hdr->size = (unsigned char)(((b & 0x03) == 3) ? 4 : (b & 0x03));
+      int id = b >> 3;  /* stimulus port, or discriminator for hardware sources */
+      if ((b & 0x04) == 0)
+        hdr->type = ITMPKT_SWIT;
+      else if (id == 0)
+        hdr->type = ITMPKT_EVENT;
+      else if (id == 1)
+        hdr->type = ITMPKT_EXCEPTION;
+      else if (id == 2)
+        hdr->type = ITMPKT_PCSAMPLE;
+      else if (id >= 8 && id < 16)
+        hdr->type = (id & 1) ? ITMPKT_DATAADDR : ITMPKT_DATAPC;
+      else if (id >= 16 && id < 24)
+        hdr->type = ITMPKT_DATAVALUE;
+      else
+        hdr->type = ITMPKT_HWOTHER;
+    } else if (b == 0x00) {
+      hdr->type = ITMPKT_SYNC;
+    } else if (b == 0x70) {
+      hdr->type = ITMPKT_OVERFLOW;
+    } else if ((b & 0x8f) == 0x00) {
+      hdr->type = ITMPKT_LTS;       /* format 2: timestamp in the header */
+    } else if ((b & 0xcf) == 0xc0) {
+      hdr->type = ITMPKT_LTS;       /* format 1: TC bits in the header */
+      hdr->size = ITM_VARSIZE;
+    } else if (b == 0x94) {
+      hdr->type = ITMPKT_GTS1;
+      hdr->size = ITM_VARSIZE;
+    } else if (b == 0xb4) {
+      hdr->type = ITMPKT_GTS2;
+      hdr->size = ITM_VARSIZE;
+    } else if ((b & 0x0b) == 0x08) {
+      hdr->type = ITMPKT_EXTENSION;
+      hdr->size = (b & 0x80) ? ITM_VARSIZE : 0;
+    } else {
+      hdr->type = ITMPKT_RESERVED;
+    }
+  }
+}
+
+/** itm_packetlength() returns the length of the packet that starts at "data",
+ *  including the header, or 0 if the packet is incomplete.
+ */
+static size_t itm_packetlength(const unsigned char *data, size_t avail)
+{
+  assert(avail > 0);
+  unsigned size = itm_headers[data[0]].size;
+  if (size != ITM_VARSIZE)
+    return (avail > size) ? size + 1 : 0;
+  for (size_t idx = 1; idx < avail; idx++)
+    if ((data[idx] & 0x80) == 0 || idx == ITM_MAXPAYLOAD)
+      return idx + 1;
+  return 0;
+}
+
+static void itm_parse(const unsigned char *data, size_t length, ITMPACKET *packet)
+{
+  const ITMHEADER *hdr = &itm_headers[data[0]];
+  packet->type = hdr->type;
+  packet->id = (unsigned char)(data[0] >> 3);
+  packet->size = (unsigned char)(length - 1);
+  packet->value = 0;
+  packet->count = 1;
+  packet->data = NULL;
+  packet->step = 0.0;
+  for (size_t idx = length - 1; idx > 0; idx--) {
+    if (hdr->size == ITM_VARSIZE)
+      packet->value = (packet->value << 7) | (data[idx] & 0x7f);
+    else
+      packet->value = (packet->value << 8) | data[idx];
+  }
+
+  switch (hdr->type) {
+  case ITMPKT_LTS:
+    packet->id = (unsigned char)((data[0] >> 4) & 0x03);  /* TC bits */
+    if (hdr->size != ITM_VARSIZE) {
+      packet->id = 0;   /* format 2 is always synchronous */
+      packet->value = (data[0] >> 4) & 0x07;
+    }
+    break;
+  case ITMPKT_GTS1:
+    packet->id = 0;
+    if (packet->size == 4) {
+      packet->id = (unsigned char)((packet->value >> 26) & 0x03);  /* ClkCh and Wrap bits */
+      packet->value &= 0x03ffffff;
+    }
+    break;
+  case ITMPKT_EXTENSION:
+    packet->id = (unsigned char)((data[0] >> 2) & 0x01);  /* source bit */
+    packet->value = (packet->value << 3) | ((data[0] >> 4) & 0x07);
+    break;
+  case ITMPKT_DATAPC:
+  case ITMPKT_DATAADDR:
+    packet->id = (unsigned char)((data[0] >> 4) & 0x03);  /* comparator */
+    break;
+  case ITMPKT_DATAVALUE:
+    packet->id = (unsigned char)(((data[0] >> 4) & 0x03) | ((data[0] & 0x08) ? ITM_DATAWRITE : 0));
+    break;
+  }
+}
+
+/** itm_gatherrun() collects the payload of a run of instrumentation packets
+ *  with a single-byte payload, all with the same header (so on the same
+ *  port). The vectorized version checks and de-interleaves 8 or 16 packets
+ *  at a time; the byte loop handles the tail.
+ *
+ *  \param data     The start of the run, which must be a single-byte
+ *                  instrumentation packet.
+ *  \param length   The number of bytes available at "data".
+ *  \param buffer   [out] Filled with the payload bytes.
+ *  \param size     The size of "buffer" (the maximum number of packets).
+ *
+ *  \return The number of packets in the run.
+ */
+static size_t itm_gatherrun(const unsigned char *data, size_t length, unsigned char *buffer, size_t size)
+{
+  unsigned char header = data[0];
+  size_t count = 0;
+# if defined SIMD_SSE2
+    const __m128i hdr = _mm_set1_epi16(header);
+    const __m128i lowmask = _mm_set1_epi16(0x00ff);
+    while (count + 8 <= size && 2 * (count + 8) <= length) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + 2 * count));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, lowmask), hdr)) != 0xffff)
+        break;
+      __m128i payload = _mm_srli_epi16(v, 8);
+      _mm_storel_epi64((__m128i*)(buffer + count), _mm_packus_epi16(payload, payload));
+      count += 8;
+    }
+# elif defined SIMD_NEON
+    const uint8x16_t hdr = vdupq_n_u8(header);
+    while (count + 16 <= size && 2 * (count + 16) <= length) {
+      uint8x16x2_t v = vld2q_u8(data + 2 * count);  /* val[0] = headers, val[1] = payload */
+      uint64x2_t eq = vreinterpretq_u64_u8(vceqq_u8(v.val[0], hdr));
+      if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != ~(uint64_t)0)
+        break;
+      vst1q_u8(buffer + count, v.val[1]);
+      count += 16;
+    }
+# endif
+  while (count < size && 2 * count + 1 < length && data[2 * count] == header) {
+    buffer[count] = data[2 * count + 1];
+    count++;
+  }
+  return count;
+}
+
+/** scan_eol() returns the offset of the first '\r' or '\n' in the buffer, or
+ *  "length" if there is none.
+ */
+static size_t scan_eol(const unsigned char *buffer, size_t length)
+{
+  size_t idx = 0;
+  if (itm_fastpath) {
+#   if defined SIMD_SSE2
+      const __m128i cr = _mm_set1_epi8('\r');
+      const __m128i lf = _mm_set1_epi8('\n');
+      for ( ; idx + 16 <= length; idx += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buffer + idx));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask != 0)
+          return idx + CTZ64((uint64_t)mask);
+      }
+#   elif defined SIMD_NEON
+      const uint8x16_t cr = vdupq_n_u8('\r');
+      const uint8x16_t lf = vdupq_n_u8('\n');
+      for ( ; idx + 16 <= length; idx += 16) {
+        uint8x16_t v = vld1q_u8(buffer + idx);
+        uint8x16_t eq = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+        /* narrow the comparison result to 4 bits per byte */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask != 0)
+          return idx + CTZ64(mask) / 4;
+      }
+#   endif
+  }
+  while (idx < length && buffer[idx] != '\r' && buffer[idx] != '\n')
+    idx++;
+  return idx;
+}
+
+/** itm_dispatch() updates the decoder state and the statistics for a packet,
+ *  and passes it on to the handler.
+ */
+static bool itm_dispatch(ITMDECODER *decoder, const ITMPACKET *packet, ITM_HANDLER handler, void *arg)
+{
+  switch (packet->type) {
+  case ITMPKT_RESERVED:
+    itm_stats.invalid += 1;
+    break;
+  case ITMPKT_SYNC:
+    itm_stats.syncs += 1;
+    break;
+  case ITMPKT_OVERFLOW:
+    itm_stats.overflows += 1;
+    break;
+  case ITMPKT_LTS:
+    decoder->ticks += packet->value;
+    itm_stats.timestamps += 1;
+    if (packet->id != 0)
+      itm_stats.delayed += 1;
+    break;
+  case ITMPKT_GTS1: {
+    /* only the low bits that changed may be sent */
+    uint64_t mask = (packet->size >= 4) ? 0x03ffffff : ((uint64_t)1 << (7 * packet->size)) - 1;
+    decoder->globaltime = (decoder->globaltime & ~mask) | packet->value;
+    itm_stats.globalstamps += 1;
+    break;
+  }
+  case ITMPKT_GTS2:
+    decoder->globaltime = (decoder->globaltime & 0x03ffffff) | (packet->value << 26);
+    itm_stats.globalstamps += 1;
+    break;
+  case ITMPKT_SWIT:
+    itm_stats.swit += packet->count;
+    itm_stats.chanpackets[packet->id] += packet->count;
+    itm_stats.chanbytes[packet->id] += packet->count * packet->size;
+    break;
+  case ITMPKT_EVENT:
+    /* each bit flags the wrap-around of an 8-bit DWT counter */
+    for (int bit = 0; bit < (int)sizearray(itm_stats.eventwraps); bit++)
+      if (packet->value & (1u << bit))
+        itm_stats.eventwraps[bit] += 1;
+    break;
+  case ITMPKT_EXCEPTION:
+    itm_stats.exceptions += 1;
+    break;
+  case ITMPKT_PCSAMPLE:
+    itm_stats.pcsamples += 1;
+    break;
+  case ITMPKT_DATAPC:
+  case ITMPKT_DATAADDR:
+  case ITMPKT_DATAVALUE:
+    itm_stats.datatrace += 1;
+    break;
+  default:
+    itm_stats.other += 1;
+  }
+  return handler(packet, arg);
+}
+
+/** itm_decode() splits a block of trace data into ITM and DWT packets, and
+ *  calls the handler for each packet.
+ *
+ *  \param decoder    The decoder state, which holds the head of a packet that
+ *                    straddles two blocks.
+ *  \param data       The block of trace data.
+ *  \param length     The size of the block in bytes.
+ *  \param timestamp  The host timestamp of the block.
+ *  \param handler    The function to call for each packet; when it returns
+ *                    false, the remainder of the block is dropped.
+ *  \param arg        Passed on to the handler.
+ *
+ *  \return true if the block was decoded completely, false if the handler
+ *          rejected a packet.
+ */
+static bool itm_decode(ITMDECODER *decoder, const unsigned char *data, size_t length, double timestamp,
+                       ITM_HANDLER handler, void *arg)
+{
+  if (!itm_headers_init) {
+    itm_buildtable();
+    itm_headers_init = true;
+  }
+
+  /* we require that if a packet is incomplete, the remainder follows
+     immediately behind it; drop the head if there is too long of a gap
+     from the previous block */
+  double delta_stamp = timestamp - decoder->prev_timestamp;
+  bool contiguous = (delta_stamp >= 0.0 && delta_stamp <= 0.05);
+  if (!contiguous)
+    decoder->partiallen = 0;
+
+  /* the timestamp is the arrival time of the block; from the bitrate, the
+     time of each byte is interpolated (but the bytes cannot have arrived
+     before the previous block) */
+  double start = timestamp, step = 0.0;
+  if (decoder->bytetime > 0.0 && length > 0) {
+    start = timestamp - length * decoder->bytetime;
+    if (contiguous && start < decoder->prev_timestamp)
+      start = decoder->prev_timestamp;
+    step = (timestamp - start) / length;
+  }
+  decoder->prev_timestamp = timestamp;
+  const unsigned char *base = data;
+
+  ITMPACKET packet;
+  unsigned char runbuffer[ITM_RUNMAX];
+  while (decoder->partiallen > 0 && length > 0) {
+    assert(decoder->partiallen < sizearray(decoder->partial));
+    decoder->partial[decoder->partiallen++] = *data++;
+    length--;
+    size_t len = itm_packetlength(decoder->partial, decoder->partiallen);
+    if (len > 0) {
+      assert(len == decoder->partiallen);
+      decoder->partiallen = 0;
+      itm_parse(decoder->partial, len, &packet);
+      packet.timestamp = start + step * (data - base);
+      if (!itm_dispatch(decoder, &packet, handler, arg))
+        return false;
+    }
+  }
+
+  while (length > 0) {
+    if (*data == 0x00) {
+      decoder->zeros += 1;
+      data++;
+      length--;
+      continue;
+    }
+    if (*data == 0x80 && decoder->zeros >= ITM_SYNCZEROS) {
+      decoder->zeros = 0;
+      packet.type = ITMPKT_SYNC;
+      packet.id = packet.size = 0;
+      packet.value = 0;
+      packet.count = 1;
+      packet.data = NULL;
+      packet.step = 0.0;
+      packet.timestamp = start + step * (data + 1 - base);
+      if (!itm_dispatch(decoder, &packet, handler, arg))
+        return false;
+      data++;
+      length--;
+      continue;
+    }
+    decoder->zeros = 0;
+    if ((*data & 0x07) == 0x01 && itm_fastpath && length >= 4 && data[2] == *data) {
+      /* plain text is typically sent as single-byte packets on one port */
+      size_t count = itm_gatherrun(data, length, runbuffer, sizearray(runbuffer));
+      assert(count >= 2);
+      itm_parse(data, 2, &packet);
+      packet.count = (unsigned)count;
+      packet.data = runbuffer;
+      packet.step = 2 * step;
+      packet.timestamp = start + step * (data + 2 - base);
+      if (!itm_dispatch(decoder, &packet, handler, arg))
+        return false;
+      data += 2 * count;
+      length -= 2 * count;
+      continue;
+    }
+    size_t len = itm_packetlength(data, length);
+    if (len == 0) {
+      /* store the head of the packet and wait for the remainder */
+      memcpy(decoder->partial, data, length);
+      decoder->partiallen = (unsigned)length;
+      break;
+    }
+    itm_parse(data, len, &packet);
+    packet.timestamp = start + step * (data + len - base);
+    if (!itm_dispatch(decoder, &packet, handler, arg))
+      return false;
+    data += len;
+    length -= len;
+  }
+  return true;
+}
+
+/* With hardware timestamps, the trace data of a source packet is held until
+   the local timestamp packet that follows it, because ITM sends a timestamp
+   after the packets that it applies to. The target time is the local
+   timestamp count divided by the timestamp clock, anchored to the host time
+   at the first timestamp. It is re-anchored when it falls behind the host
+   time too far, for example after packets were dropped; it may run ahead of
+   the host time, though, because a file may be replayed at full speed. */
+#define ITM_PENDINGSIZE   1024
+#define ITM_PENDINGRUNS   64
+#define ITM_PENDINGDELAY  0.05  /* flush held data if no timestamp follows */
+#define ITM_RESYNC        0.5   /* maximum lag behind the host clock, in seconds */
+
+typedef struct tagITMRUN {
+  unsigned char channel;
+  unsigned short length;
+  double timestamp;           /* host time of the first packet in the run */
+} ITMRUN;
+
+static unsigned long itm_tsclock = 0;     /* frequency of the local timestamp counter, 0 = not used */
+static unsigned long itm_bitrate = 0;     /* SWO bitrate, for interpolation of the host time */
+
+/* A capture context holds the state for one probe: the reader (a thread that
+   reads from USB or TCP/IP, or that replays a file), the packet queue that the
+   reader fills, and the ITM decoder state for the data of that probe. The
+   trace_init() family of functions works on the primary probe (context 0);
+   more probes are opened with trace_initprobe(). The ITM channels of each
+   probe are mapped onto the (shared) channel table with an offset, and the
+   decoded data of all probes is merged by timestamp. CTF decoding is only
+   done for the primary probe. */
+#define MAX_PROBES  TRACE_MAXPROBES
+
+typedef struct tagTRACEPROBE {
+  TRACEQUEUE queue;
+  volatile unsigned long errors;  /* failed reads from the probe */
+  int chanbase;                   /* offset for the channel numbers */
+  /* reader */
+# if defined WIN32 || defined _WIN32
+    HANDLE thread;
+    HANDLE usbdev;
+    USB_INTERFACE_HANDLE usbiface;
+    unsigned char *usbbuffer;
+# else
+    pthread_t thread;
+    libusb_context *usbctx;       /* each probe has its own context, so that
+                                     the reader only handles its own transfers */
+    libusb_device_handle *usbiface;
+# endif
+  volatile int force_exit;
+  unsigned char endpoint;
+  /* network probe */
+  SOCKET socket;                  /* INVALID_SOCKET while reconnecting */
+  bool network;
+  char netaddr[20];               /* IP address, for reconnecting */
+  unsigned short netport;
+  bool framed;                    /* stream in the format of a recording (from a capture daemon) */
+  unsigned char *netbuffer;       /* buffer for coalescing the received data */
+  volatile unsigned long reconnects;
+  /* replay of a file (see trace_initloopback()) */
+  thrd_t loopback_thread;
+  volatile int loopback_active;
+  volatile int loopback_done;     /* set when all data has been sent */
+  bool loopback_repeat;           /* for raw data: replay endlessly */
+  bool loopback_stdin;
+  struct tagSTREAMREADER *loopback_reader; /* state of the thread that reads standard input */
+  bool loopback_realtime;         /* for recordings: replay with the recorded timing */
+  const unsigned char *loopback_data;
+  size_t loopback_size;
+  unsigned long loopback_rate;    /* in bytes per second, 0 = full speed */
+  /* ITM decoder */
+  ITMDECODER decoder;
+  unsigned char pending[ITM_PENDINGSIZE];
+  size_t pendinglen;
+  ITMRUN runs[ITM_PENDINGRUNS];
+  unsigned runcount;
+  double pendingclock;            /* local time at which the data was put on hold */
+  double tsbase;                  /* host time that matches local timestamp zero */
+} TRACEPROBE;
+
+static TRACEPROBE trace_probes[MAX_PROBES];
+static bool trace_merging = false;  /* set when more than one probe is open */
+
+/** trace_probe() returns the capture context of a probe; the contexts are
+ *  initialized on first use.
+ */
+static TRACEPROBE *trace_probe(int index)
+{
+  static bool initialized = false;
+  if (!initialized) {
+    for (int idx = 0; idx < MAX_PROBES; idx++) {
+      TRACEPROBE *probe = &trace_probes[idx];
+      memset(probe, 0, sizeof(TRACEPROBE));
+#     if defined WIN32 || defined _WIN32
+        probe->usbdev = probe->usbiface = INVALID_HANDLE_VALUE;
+#     endif
+      probe->endpoint = BMP_EP_TRACE;
+      probe->socket = INVALID_SOCKET;
+      probe->tsbase = -1.0;
+    }
+    initialized = true;
+  }
+  assert(index >= 0 && index < MAX_PROBES);
+  return &trace_probes[index];
+}
+
+static void capture_clampsize(void);
+
+/** trace_setqueuesize() sets the size of the packet queue, in bytes. The size
+ *  is rounded up to a power of two. The queue size can only be changed while
+ *  the trace interface is closed. Each probe has a queue of this size.
+ *
+ *  \return true on success, false if the trace interface is open.
+ */
+bool trace_setqueuesize(size_t size)
+{
+  if (trace_isopen())
+    return false;
+  size_t newsize = QUEUE_MINSIZE;
+  while (newsize < size && newsize < ((size_t)1 << (sizeof(size_t) * 8 - 2)))
+    newsize <<= 1;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    TRACEQUEUE *queue = &trace_probe(idx)->queue;
+    if (newsize != queue->size && queue->buffer != NULL) {
+      free(queue->buffer);
+      queue->buffer = NULL;
+    }
+    queue->head = queue->tail = 0;
+  }
+  tracequeue_size = newsize;
+  capture_clampsize();  /* a USB transfer must fit in the (new) queue */
+  return true;
+}
+
+/** tracequeue_collect() adds the producer counters that changed since the
+ *  previous call to the accumulated statistics. It must only be called from
+ *  the consumer side.
+ */
+static void tracequeue_collect(TRACEQUEUE *queue)
+{
+  QUEUECOUNTERS now;
+  now.packets = ATOMIC_LOAD_ACQUIRE(&queue->counters.packets);
+  now.bytes = ATOMIC_LOAD_ACQUIRE(&queue->counters.bytes);
+  now.dropped = ATOMIC_LOAD_ACQUIRE(&queue->counters.dropped);
+  now.dropped_bytes = ATOMIC_LOAD_ACQUIRE(&queue->counters.dropped_bytes);
+  /* unsigned subtraction handles the wrap-around of the counters */
+  queue->stats.packets += now.packets - queue->seen.packets;
+  queue->stats.bytes += now.bytes - queue->seen.bytes;
+  queue->stats.dropped += now.dropped - queue->seen.dropped;
+  queue->stats.dropped_bytes += now.dropped_bytes - queue->seen.dropped_bytes;
+  queue->seen.packets = now.packets;
+  queue->seen.bytes = now.bytes;
+  queue->seen.dropped = now.dropped;
+  queue->seen.dropped_bytes = now.dropped_bytes;
+  queue->stats.highwater = ATOMIC_LOAD_ACQUIRE(&queue->hwreset) ? 0 : ATOMIC_LOAD_ACQUIRE(&queue->counters.highwater);
+}
+
+/** trace_queuestats() returns the statistics of the packet queue: the fill
+ *  level, the high-water mark and the number of dropped packets. When several
+ *  probes are open, the statistics are summed over all queues (except for the
+ *  high-water mark, which is the maximum of the queues).
+ *
+ *  \param stats  [out] Filled with the statistics. This parameter may be NULL
+ *                (in which case only the reset is done).
+ *  \param reset  Whether to reset the high-water mark and the counters.
+ *
+ *  \note The statistics are collected and reset on the side of the caller, so
+ *        this function does not interfere with the reader thread. It must
+ *        always be called from the same thread, though.
+ */
+void trace_queuestats(TRACEQUEUESTATS *stats, bool reset)
+{
+  for (int idx = 0; idx < MAX_PROBES; idx++)
+    tracequeue_collect(&trace_probe(idx)->queue);
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(TRACEQUEUESTATS));
+    for (int idx = 0; idx < MAX_PROBES; idx++) {
+      TRACEQUEUE *queue = &trace_probe(idx)->queue;
+      if (queue->buffer != NULL) {
+        stats->size += queue->size;
+        stats->fill += ATOMIC_LOAD_ACQUIRE(&queue->tail) - ATOMIC_LOAD_ACQUIRE(&queue->head);
+      }
+      if (stats->highwater < queue->stats.highwater)
+        stats->highwater = queue->stats.highwater;
+      stats->packets += queue->stats.packets;
+      stats->bytes += queue->stats.bytes;
+      stats->dropped += queue->stats.dropped;
+      stats->dropped_bytes += queue->stats.dropped_bytes;
+    }
+    if (stats->size == 0)
+      stats->size = tracequeue_size;  /* no queue allocated yet */
+  }
+  if (reset) {
+    for (int idx = 0; idx < MAX_PROBES; idx++) {
+      TRACEQUEUE *queue = &trace_probe(idx)->queue;
+      memset(&queue->stats, 0, sizeof(TRACEQUEUESTATS));
+      ATOMIC_STORE_RELEASE(&queue->hwreset, 1);
+    }
+  }
+}
+
+static void tracestring_add(TRACEPROBE *probe, unsigned port, const unsigned char *buffer, size_t length,
+                            double timestamp, bool precise)
+{
+  assert(port < NUM_CHANNELS);
+  assert(buffer != NULL);
+  assert(length > 0);
+
+  /* check whether the channel is enabled (in passive mode, the target that
+     sends the trace messages is oblivious of the settings in this viewer,
+     so it may send trace messages for disabled channels) */
+  unsigned channel = (port + probe->chanbase) % NUM_CHANNELS;
+  if (!channels[channel].enabled)
+    return;
+
+  if (probe == trace_probes && stream_isactive(port)) {
+    /* CTF mode */
+    int count = ctf_decode(buffer, length, port);
+    if (count > 0) {
+      uint16_t streamid, eventid;
+      uint8_t severity;
+      double tstamp;
+      const char *message;
+      while (msgstack_peek(&streamid, &eventid, &severity, &tstamp, &message)) {
+        if (tstamp > 0.001)
+          timestamp = tstamp; /* use precision timestamp from remote host */
+        unsigned flags = TSFLAG_EOL;
+        if (precise || tstamp > 0.001)
+          flags |= TSFLAG_PRECISE;
+        int line = store_newline(streamid, severity, timestamp, flags);
+        if (line >= 0)
+          store_appendtext(message, strlen(message));
+        msgstack_pop(NULL, NULL, NULL, 0);
+      }
+    }
+  } else {
+    /* plain text mode */
+    unsigned idx, start;
+    while (length > 0 && buffer[length - 1] == '\0')
+      length--; /* this can happen with expansion from zero-compression */
+    for (idx = 0; idx < length; ) {
+      /* see whether to append to the recent string, or to add a new string */
+      if (tracestore.count > 0) {
+        unsigned line = tracestore.count - 1;
+        LINECHUNK *chunk = LINE_CHUNK(line);
+        unsigned ci = LINE_INDEX(line);
+        if (buffer[idx] == '\r' || buffer[idx] == '\n') {
+          chunk->flags[ci] |= TSFLAG_EOL;   /* on newline, create a new string */
+          idx++;
+          continue;
+        } else if (chunk->channel[ci] != channel) {
+          chunk->flags[ci] |= TSFLAG_EOL;   /* different channel, terminate previous string */
+        } else if (chunk->length[ci] >= TRACESTRING_MAXLENGTH) {
+          chunk->flags[ci] |= TSFLAG_EOL;   /* line length limit */
+        }
+        /* time criterion: there should not be more that 0.1 seconds between
+           parts of a continued string */
+        if (timestamp - chunk->timestamp[ci] > 0.1)
+          chunk->flags[ci] |= TSFLAG_EOL;   /* interval limit */
+        if ((chunk->flags[ci] & TSFLAG_EOL) != 0) {
+          /* create a new string */
+          if (store_newline(channel, 0, timestamp, precise ? TSFLAG_PRECISE : 0) < 0)
+            return; /* adding a new string failed */
+        }
+      } else {
+        if (buffer[idx] == '\r' || buffer[idx] == '\n') {
+          idx++;
+          continue; /* don't create an empty first string */
+        }
+        if (store_newline(channel, 0, timestamp, precise ? TSFLAG_PRECISE : 0) < 0)
+          return; /* adding a new string failed */
+      }
+      /* append the run of text up to the next newline, or up to the line
+         length limit, in a single call */
+      unsigned line = tracestore.count - 1;
+      size_t room = TRACESTRING_MAXLENGTH - LINE_CHUNK(line)->length[LINE_INDEX(line)];
+      start = idx;
+      idx += (unsigned)scan_eol(buffer + start, (length - start < room) ? length - start : room);
+      if (!store_appendtext((const char*)buffer + start, idx - start))
+        return;
+    }
+  }
+}
+
+static bool itm_hardwaretime(const TRACEPROBE *probe)
+{
+  return itm_tsclock > 0 && probe->tsbase >= 0.0;
+}
+
+/** itm_targettime() returns the time of the current local timestamp count,
+ *  on the scale of the host clock.
+ */
+static double itm_targettime(TRACEPROBE *probe, double hosttime)
+{
+  assert(itm_tsclock > 0);
+  double t = (double)probe->decoder.ticks / itm_tsclock;
+  double drift = probe->tsbase + t - hosttime;
+  if (probe->tsbase < 0.0 || drift < -ITM_RESYNC)
+    probe->tsbase = hosttime - t;
+  return probe->tsbase + t;
+}
+
+/** itm_flush() adds the trace data that is on hold to the trace strings.
+ *
+ *  \param probe      The capture context.
+ *  \param hwtime     true if all data gets the target time in "timestamp",
+ *                    false if each run keeps its (interpolated) host time.
+ *  \param timestamp  The target time, if "hwtime" is true.
+ *  \param keeptail   Whether to keep an incomplete line (the last run, if it
+ *                    does not end with a newline) on hold. When the data of
+ *                    several probes is merged, this avoids that a line is
+ *                    broken up by a line of another probe.
+ *
+ *  \return 1 if data was added, 0 if nothing was on hold.
+ */
+static int itm_flush(TRACEPROBE *probe, bool hwtime, double timestamp, bool keeptail)
+{
+  unsigned count = probe->runcount;
+  if (count > 0 && keeptail) {
+    unsigned char last = probe->pending[probe->pendinglen - 1];
+    if (last != '\n' && last != '\r')
+      count -= 1;
+  }
+  if (count == 0)
+    return 0;
+  bool precise = hwtime || probe->decoder.bytetime > 0.0;
+  size_t offset = 0;
+  for (unsigned idx = 0; idx < count; idx++) {
+    tracestring_add(probe, probe->runs[idx].channel, probe->pending + offset, probe->runs[idx].length,
+                    hwtime ? timestamp : probe->runs[idx].timestamp, precise);
+    offset += probe->runs[idx].length;
+  }
+  if (count < probe->runcount) {
+    /* move the incomplete line to the start of the buffer */
+    assert(count + 1 == probe->runcount);
+    probe->runs[0] = probe->runs[count];
+    memmove(probe->pending, probe->pending + offset, probe->pendinglen - offset);
+    probe->pendinglen -= offset;
+    probe->runcount = 1;
+    probe->pendingclock = get_timestamp();
+  } else {
+    assert(offset == probe->pendinglen);
+    probe->runcount = 0;
+    probe->pendinglen = 0;
+  }
+  return 1;
+}
+
+/** itm_release() adds the trace data that is on hold, with the most recent
+ *  target time (if hardware timestamps are active), or with the host time.
+ */
+static int itm_release(TRACEPROBE *probe, double hosttime)
+{
+  if (itm_hardwaretime(probe))
+    return itm_flush(probe, true, itm_targettime(probe, hosttime), false);
+  return itm_flush(probe, false, 0.0, false);
+}
+
+/** itm_pend() puts trace data on hold (until the next local timestamp, or
+ *  until the end of the block).
+ *
+ *  \param channel    The stimulus port.
+ *  \param data       The payload bytes.
+ *  \param length     The number of bytes in "data".
+ *  \param timestamp  The host time of the first byte (or packet).
+ *  \param step       The time interval between successive bytes.
+ *
+ *  \return The number of times that data had to be released early (because
+ *          the buffer was full).
+ */
+static int itm_pend(TRACEPROBE *probe, unsigned channel, const unsigned char *data, size_t length,
+                    double timestamp, double step)
+{
+  int count = 0;
+  while (length > 0) {
+    /* a new run starts on a channel switch, and after a newline (so that
+       each line gets the time of its first packet) */
+    bool newrun = (probe->runcount == 0 || probe->runs[probe->runcount - 1].channel != channel
+                   || probe->pending[probe->pendinglen - 1] == '\n'
+                   || probe->pending[probe->pendinglen - 1] == '\r');
+    if (probe->pendinglen == ITM_PENDINGSIZE || (newrun && probe->runcount == ITM_PENDINGRUNS)) {
+      count += itm_release(probe, timestamp);
+      newrun = true;
+    }
+    if (probe->runcount == 0)
+      probe->pendingclock = get_timestamp();
+    if (newrun) {
+      probe->runs[probe->runcount].channel = (unsigned char)channel;
+      probe->runs[probe->runcount].length = 0;
+      probe->runs[probe->runcount].timestamp = timestamp;
+      probe->runcount++;
+    }
+    /* copy up to (and including) the next newline in one go */
+    size_t room = ITM_PENDINGSIZE - probe->pendinglen;
+    size_t span = scan_eol(data, (length < room) ? length : room);
+    if (span < length && span < room)
+      span++;
+    memcpy(probe->pending + probe->pendinglen, data, span);
+    probe->pendinglen += span;
+    probe->runs[probe->runcount - 1].length += (unsigned short)span;
+    data += span;
+    length -= span;
+    timestamp += span * step;
+  }
+  return count;
+}
+
+typedef struct tagITMTRACECTX {
+  TRACEPROBE *probe;
+  int count;                    /* number of times that trace data was added */
+} ITMTRACECTX;
+
+static bool tracestring_itmpacket(const ITMPACKET *packet, void *arg)
+{
+  ITMTRACECTX *ctx = (ITMTRACECTX*)arg;
+  assert(ctx != NULL);
+  switch (packet->type) {
+  case ITMPKT_SWIT: {
+    if (packet->size > itm_datasize) {
+      if (itm_datasz_auto) {
+        itm_datasize = packet->size; /* if larger data word is found, datasize must be adjusted */
+      } else {
+        if (ctx->probe == trace_probes)
+          ctf_decode_reset();
+        itm_packet_errors += 1;
+        return false;   /* not a valid ITM packet, ignore the remainder of the block */
+      }
+    }
+    if (packet->data != NULL) {
+      ctx->count += itm_pend(ctx->probe, packet->id, packet->data, packet->count, packet->timestamp, packet->step);
+    } else {
+      unsigned char bytes[4];
+      for (unsigned idx = 0; idx < packet->size; idx++)
+        bytes[idx] = (unsigned char)(packet->value >> (8 * idx));
+      ctx->count += itm_pend(ctx->probe, packet->id, bytes, packet->size, packet->timestamp, 0.0);
+    }
+    break;
+  }
+  case ITMPKT_LTS:
+    if (itm_tsclock > 0)
+      ctx->count += itm_flush(ctx->probe, true, itm_targettime(ctx->probe, packet->timestamp), trace_merging);
+    break;
+  case ITMPKT_RESERVED:
+    if (ctx->probe == trace_probes)
+      ctf_decode_reset();
+    itm_packet_errors += 1;
+    return false;       /* not a valid ITM packet, ignore the remainder of the block */
+  }
+  return true;
+}
+
+/** worker_count() returns the number of worker threads to use for a bulk
+ *  operation on the trace strings (such as filtering or searching), based on
+ *  the number of processors.
+ */
+#define MAX_WORKERS 8
+static int worker_count(void)
+{
+  static int count = 0;
+  if (count == 0) {
+#   if defined WIN32 || defined _WIN32
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      count = (int)info.dwNumberOfProcessors;
+#   elif defined _SC_NPROCESSORS_ONLN
+      count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#   endif
+    if (count < 1)
+      count = 1;
+    else if (count > MAX_WORKERS)
+      count = MAX_WORKERS;
+  }
+  return count;
+}
+
+/** file_map() maps a file in memory, for reading.
+ *
+ *  \param filename    The path to the file.
+ *  \param size        [out] The size of the file in bytes.
+ *  \param sequential  Hint that the file will be read from start to end.
+ *
+ *  \return A pointer to the data, or NULL on failure (or if the file is empty).
+ */
+static const unsigned char *file_map(const char *filename, size_t *size, bool sequential)
+{
+  const unsigned char *data = NULL;
+  *size = 0;
+# if defined WIN32 || defined _WIN32
+    (void)sequential;
+    HANDLE hfile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE)
+      return NULL;
+    LARGE_INTEGER filesize;
+    if (GetFileSizeEx(hfile, &filesize) && filesize.QuadPart > 0) {
+      HANDLE hmap = CreateFileMapping(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (hmap != NULL) {
+        data = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+        if (data != NULL)
+          *size = (size_t)filesize.QuadPart;
+        CloseHandle(hmap);  /* the view keeps the mapping open */
+      }
+    }
+    CloseHandle(hfile);     /* the mapping keeps the file open */
+# else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+      return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED) {
+        if (sequential)
+          madvise(ptr, (size_t)st.st_size, MADV_SEQUENTIAL);
+        data = ptr;
+        *size = (size_t)st.st_size;
+      }
+    }
+    close(fd);              /* the mapping keeps the file open */
+# endif
+  return data;
+}
+
+static void file_unmap(const unsigned char *data, size_t size)
+{
+  assert(data != NULL);
+# if defined WIN32 || defined _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+# else
+    munmap((void*)data, size);
+# endif
+}
+
+/* The decoder may run in a separate thread, so that decoding does not depend
+   on the frame rate of the GUI. The trace strings are then shared between the
+   decoder thread (which adds strings) and the GUI thread (which reads them),
+   and access to them is protected with a (recursive) mutex. */
+static mtx_t tracestring_mutex;
+static bool tracestring_mutex_init = false;
+static thrd_t decoder_thread;
+static volatile int decoder_active = 0;
+static volatile int decoder_enabled = 1;
+static volatile size_t decoder_count = 0;   /* number of packets decoded into messages */
+static size_t decoder_reported = 0;         /* number of packets reported to the GUI */
+
+/** tracestring_lock() locks the trace strings against concurrent modification
+ *  by the decoder thread. All tracestring_...() functions lock the strings
+ *  implicitly; this function is for an application that must reset or reload
+ *  the decoder state (e.g. the CTF definitions) while the decoder thread runs.
+ *  Calls to tracestring_lock() and tracestring_unlock() may be nested.
+ */
+void tracestring_lock(void)
+{
+  if (!tracestring_mutex_init) {
+    mtx_init(&tracestring_mutex, mtx_recursive);
+    tracestring_mutex_init = true;
+  }
+  mtx_lock(&tracestring_mutex);
+}
+
+void tracestring_unlock(void)
+{
+  assert(tracestring_mutex_init);
+  mtx_unlock(&tracestring_mutex);
+}
+
+static void tracesearch_stop(void);
+
+void tracestring_clear(void)
+{
+  tracestring_lock();
+  tracesearch_stop();
+  store_clear();
+  tracestring_unlock();
+}
+
+bool tracestring_isempty(void)
+{
+  tracestring_lock();
+  bool result = (tracestore.count == 0);
+  tracestring_unlock();
+  return result;
+}
+
+unsigned tracestring_count(void)
+{
+  tracestring_lock();
+  unsigned count = tracestore.count;
+  tracestring_unlock();
+  return count;
+}
+
+/** tracestring_getline() returns the fields of a trace message.
+ *
+ *  \param line   The line number (0-based).
+ *  \param info   [out] Filled with the fields of the line.
+ *
+ *  \return true on success, false if the line number is out of range.
+ *
+ *  \note The text pointer stays valid until the trace strings are cleared or
+ *        purged (or until the line is evicted, when a retention limit is set),
+ *        except for an incomplete line: more text may still be
+ *        appended to it, and the text may move in the process. When the
+ *        decoder thread runs, a caller that reads a range of lines should
+ *        call tracestring_lock() around it.
+ */
+bool tracestring_getline(unsigned line, TRACELINE *info)
+{
+  assert(info != NULL);
+  tracestring_lock();
+  bool result = (line < tracestore.count);
+  if (result) {
+    const LINECHUNK *chunk = LINE_CHUNK(line);
+    unsigned idx = LINE_INDEX(line);
+    info->text = chunk->text[idx];
+    info->length = chunk->length[idx];
+    info->timestamp = chunk->timestamp[idx];
+    info->channel = chunk->channel[idx];
+    info->severity = chunk->severity[idx];
+    /* only the last line can still be extended */
+    info->complete = (line + 1 < tracestore.count || (chunk->flags[idx] & TSFLAG_EOL) != 0);
+  }
+  tracestring_unlock();
+  return result;
+}
+
+/** tracestring_purge() removes all complete lines; only an incomplete last
+ *  line is kept (so that more text can still be appended to it). This is for
+ *  an application that passes the trace messages on, and that does not need
+ *  to keep them. Unlike tracestring_clear(), the names of the CTF streams are
+ *  kept too.
+ */
+void tracestring_purge(void)
+{
+  tracestring_lock();
+  tracesearch_stop();
+  char *channelnames[NUM_CHANNELS];
+  memcpy(channelnames, tracestore.channelnames, sizeof channelnames);
+  memset(tracestore.channelnames, 0, sizeof tracestore.channelnames);
+  unsigned count = tracestore.count;
+  const LINECHUNK *chunk = (count > 0) ? LINE_CHUNK(count - 1) : NULL;
+  unsigned idx = (count > 0) ? LINE_INDEX(count - 1) : 0;
+  if (chunk != NULL && (chunk->flags[idx] & TSFLAG_EOL) == 0) {
+    /* copy the incomplete line, then recreate it in the cleared store */
+    char text[TRACESTRING_MAXLENGTH + 1];
+    unsigned length = chunk->length[idx];
+    assert(length <= TRACESTRING_MAXLENGTH);
+    memcpy(text, chunk->text[idx], length);
+    unsigned channel = chunk->channel[idx];
+    unsigned severity = chunk->severity[idx];
+    unsigned flags = chunk->flags[idx] & ~TSFLAG_BOOKMARK;
+    double timestamp = chunk->timestamp[idx];
+    store_clear();
+    int line = store_newline(channel, severity, timestamp, flags);
+    if (line >= 0)
+      store_appendtext(text, length);
+  } else {
+    store_clear();
+  }
+  memcpy(tracestore.channelnames, channelnames, sizeof channelnames);
+  tracestring_unlock();
+}
+
+/** tracestring_setretention() sets a limit on the trace messages that are
+ *  kept in memory. When the limit is exceeded, the oldest messages are evicted
+ *  (in blocks of a few thousand lines), and optionally appended to a file.
+ *
+ *  \param maxlines   The minimum number of lines to keep; more lines are
+ *                    evicted. Set to 0 for no limit on the line count.
+ *  \param maxbytes   The approximate limit on the memory for the lines, in
+ *                    bytes. Set to 0 for no limit on the memory size.
+ *  \param spillfile  The path of a file that the evicted lines are written to,
+ *                    in the same CSV format as tracestring_save(). If NULL
+ *                    (or empty), evicted lines are discarded.
+ *
+ *  \return true on success, false if the spill file cannot be created.
+ *
+ *  \note Line numbers (as used by tracestring_getline(), tracestring_find()
+ *        and others) refer to the retained lines: after an eviction, all line
+ *        numbers shift down. tracestring_storestats() returns the number of
+ *        lines evicted so far, to adjust line numbers that a caller keeps.
+ *
+ *  \note Eviction is postponed while a background search (see
+ *        tracestring_findcount()) still runs.
+ */
+bool tracestring_setretention(unsigned maxlines, size_t maxbytes, const char *spillfile)
+{
+  tracestring_lock();
+  if (store_spill != NULL) {
+    fclose(store_spill);
+    store_spill = NULL;
+  }
+  if (store_spillbuf != NULL) {
+    free(store_spillbuf);
+    store_spillbuf = NULL;
+  }
+  store_maxlines = maxlines;
+  store_maxbytes = maxbytes;
+  store_spillmarks = 0;
+  store_spilled = 0;
+  bool result = true;
+  if (spillfile != NULL && *spillfile != '\0') {
+    store_spillbuf = malloc(STORE_WRITEBUF);
+    if (store_spillbuf != NULL)
+      store_spill = fopen(spillfile, "wt");
+    if (store_spill != NULL) {
+      fprintf(store_spill, "Channel,Name,Severity,Timestamp,Text\n");
+    } else {
+      if (store_spillbuf != NULL)
+        free(store_spillbuf);
+      store_spillbuf = NULL;
+      result = false;
+    }
+  }
+  tracestring_unlock();
+  return result;
+}
+
+/** tracestring_storestats() returns the size of the store, and the number of
+ *  lines that were evicted by the retention limit (since the store was last
+ *  cleared). The count of spilled lines runs from the most recent call to
+ *  tracestring_setretention().
+ */
+void tracestring_storestats(TRACESTORESTATS *stats)
+{
+  assert(stats != NULL);
+  tracestring_lock();
+  stats->lines = tracestore.count;
+  stats->memsize = tracestore.memsize;
+  stats->evicted = tracestore.evicted;
+  stats->spilled = store_spilled;
+  tracestring_unlock();
+}
+
+static void tracestring_decodeblock(ITMTRACECTX *ctx, const unsigned char *data, size_t length, double timestamp)
+{
+  TRACEPROBE *probe = ctx->probe;
+  itm_decode(&probe->decoder, data, length, timestamp, tracestring_itmpacket, ctx);
+  /* without hardware timestamps, the messages get the host time at which
+     they arrived */
+  if (!itm_hardwaretime(probe))
+    ctx->count += itm_flush(probe, false, 0.0, trace_merging);
+}
+
+/* statistics of the decoder, for trace_health() */
+static unsigned long long decode_packets = 0;
+static double decode_latency = 0.0;     /* sum of the latencies of all packets */
+static double decode_maxlatency = 0.0;  /* maximum latency since the previous sample */
+static double decode_busy = 0.0;        /* total time spent decoding */
+
+/** decode_account() updates the decoder statistics for a packet that is taken
+ *  from the queue. The latency is the time between the moment that the packet
+ *  was queued and the moment that it is decoded.
+ */
+static void decode_account(const PACKET *pkt, double now)
+{
+  uint32_t delta = (uint32_t)(unsigned long long)(now * 1e6) - pkt->arrival;
+  double latency = delta / 1e6;
+  decode_packets += 1;
+  decode_latency += latency;
+  if (latency > decode_maxlatency)
+    decode_maxlatency = latency;
+}
+
+/* When several probes are open, the packets in their queues are decoded in
+   the order of their timestamps, so that the messages of all probes are
+   interleaved by time. A packet is only decoded when none of the other probes
+   can still deliver an older packet: that probe has a packet queued already,
+   or it is closed, or it replays a file and has reached the end of it; for a
+   live probe, the packet must be older than the maximum delay between the
+   capture of a packet and its arrival in the queue. */
+#define MERGE_DELAY 0.05
+
+static bool probe_isopen(const TRACEPROBE *probe);
+static bool decoder_waiting = false;  /* packets are held back for merging */
+
+/** tracestring_decode() decodes the packets that are in the queues into trace
+ *  messages. It must be called with the trace strings locked.
+ */
+static int tracestring_decode(bool enabled)
+{
+  TRACEPROBE *probes[MAX_PROBES];
+  size_t marks[MAX_PROBES];
+  int numprobes = 0;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    TRACEPROBE *probe = trace_probe(idx);
+    if (probe->queue.buffer != NULL && (idx == 0 || probe_isopen(probe) || !tracequeue_isempty(&probe->queue))) {
+      probes[numprobes] = probe;
+      marks[numprobes] = tracequeue_mark(&probe->queue);
+      numprobes++;
+    }
+  }
+
+  ITMTRACECTX ctx = { NULL, 0 };
+  double start = -1.0;
+  decoder_waiting = false;
+  for ( ;; ) {
+    /* find the oldest packet at the head of the queues */
+    TRACEPROBE *probe = NULL;
+    const PACKET *pkt = NULL;
+    bool stalled = false, live = false;
+    for (int idx = 0; idx < numprobes; idx++) {
+      const PACKET *head = tracequeue_peek(&probes[idx]->queue, marks[idx]);
+      if (head != NULL) {
+        if (pkt == NULL || head->timestamp < pkt->timestamp) {
+          pkt = head;
+          probe = probes[idx];
+        }
+      } else if (numprobes > 1 && probe_isopen(probes[idx])) {
+        if (!probes[idx]->loopback_active)
+          live = true;
+        else if (!probes[idx]->loopback_done)
+          stalled = true;
+      }
+    }
+    if (pkt == NULL)
+      break;
+    if (stalled || (live && pkt->timestamp > get_timestamp() - MERGE_DELAY)) {
+      decoder_waiting = true;
+      break;
+    }
+    if (start < 0.0)
+      start = get_timestamp();
+    decode_account(pkt, start);
+    if (probe == trace_probes)
+      record_packet(pkt);
+    if (enabled) {
+      ctx.probe = probe;
+      tracestring_decodeblock(&ctx, PKT_DATA(pkt), pkt->length, pkt->timestamp);
+    }
+    tracequeue_pop(&probe->queue, pkt);
+  }
+  if (start >= 0.0)
+    decode_busy += get_timestamp() - start;
+
+  for (int idx = 0; idx < numprobes; idx++) {
+    TRACEPROBE *probe = probes[idx];
+    /* release data that waits for a timestamp that does not come */
+    if (probe->runcount > 0 && get_timestamp() - probe->pendingclock > ITM_PENDINGDELAY) {
+      ctx.probe = probe;
+      ctx.count += itm_release(probe, probe->decoder.prev_timestamp);
+    }
+    if (!enabled)
+      probe->queue.overflow = 0;  /* ignore overflow events if not running/decoding */
+  }
+  return ctx.count;
+}
+
+/** tracestring_pending() returns whether there are packets to decode (that
+ *  are not held back for merging).
+ */
+static bool tracestring_pending(void)
+{
+  if (decoder_waiting)
+    return false;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    TRACEPROBE *probe = trace_probe(idx);
+    if (probe->queue.buffer != NULL && !tracequeue_isempty(&probe->queue))
+      return true;
+  }
+  return false;
+}
+
+/** trace_updatemerging() re-evaluates whether packets from multiple capture
+ *  contexts must be merged; this is the case when more than one is open.
+ */
+static void trace_updatemerging(void)
+{
+  int count = 0;
+  for (int idx = 0; idx < MAX_PROBES; idx++)
+    if (probe_isopen(trace_probe(idx)))
+      count++;
+  tracestring_lock();
+  trace_merging = (count > 1);
+  tracestring_unlock();
+}
+
+static int decoder_run(void *arg)
+{
+  (void)arg;
+  while (decoder_active) {
+    tracestring_lock();
+    int count = tracestring_decode(decoder_enabled);
+    tracestring_unlock();
+    if (count > 0)
+      ATOMIC_STORE_RELEASE(&decoder_count, decoder_count + count);
+    if (!tracestring_pending()) {
+      struct timespec ts = { 0, 2000000 };  /* queue is empty, sleep 2 ms */
+      thrd_sleep(&ts, NULL);
+    }
+  }
+  return 0;
+}
+
+/** trace_decodethread() starts or stops the decoder thread. When the decoder
+ *  thread runs, the packets from the trace queue are decoded in the
+ *  background, and tracestring_process() only reports on the progress.
+ *
+ *  \param start  true to start the thread, false to stop it.
+ *
+ *  \return true on success, false if the thread could not be created.
+ *
+ *  \note The decoder thread handles trace messages; it cannot be combined
+ *        with traceprofile_process().
+ */
+bool trace_decodethread(bool start)
+{
+  if (start && !decoder_active) {
+    tracestring_lock();   /* make sure the mutex and the contexts are initialized */
+    trace_probe(0);
+    tracestring_unlock();
+    decoder_reported = decoder_count;
+    decoder_active = 1;
+    if (thrd_create(&decoder_thread, decoder_run, NULL) != thrd_success) {
+      decoder_active = 0;
+      return false;
+    }
+  } else if (!start && decoder_active) {
+    decoder_active = 0;
+    thrd_join(decoder_thread, NULL);
+  }
+  return true;
+}
+
+/** tracestring_process() decodes the packets that are in the queue into
+ *  trace messages. If the decoder thread is active, the decoding is done
+ *  in that thread, and this function only returns the progress.
+ *
+ *  \param enabled  If false, the packets are dropped (not decoded).
+ *
+ *  \return The number of packets that resulted in (new) trace messages, since
+ *          the previous call.
+ */
+int tracestring_process(bool enabled)
+{
+  if (decoder_active) {
+    decoder_enabled = enabled;
+    size_t total = ATOMIC_LOAD_ACQUIRE(&decoder_count);
+    int count = (int)(total - decoder_reported);
+    decoder_reported = total;
+    return count;
+  }
+  tracestring_lock();
+  int count = tracestring_decode(enabled);
+  tracestring_unlock();
+  return count;
+}
+
+/* A search splits the lines in blocks, which worker threads pick up in search
+   order (starting at the current line, and wrapping around). To find the next
+   match, the workers stop picking up new blocks as soon as a match is found
+   in an earlier block. To count all matches, a search runs in the background
+   on a snapshot of the store: lines that are complete at the start of the
+   search do not change anymore (and the chunks and text blocks of these lines
+   do not move), so the background search does not need to lock the store. */
+#define SEARCH_BLOCKLINES 16384
+
+typedef struct tagSEARCHJOB {
+  STRPATTERN pattern;
+  char *text;                   /* copy of the search pattern */
+  LINECHUNK **chunks;           /* chunk directory (or a snapshot of it) */
+  unsigned lines;               /* number of lines to search */
+  unsigned start;               /* line at which the search starts */
+  unsigned numblocks;
+  unsigned nextblock;           /* next block to be picked up by a worker */
+  unsigned firsthit;            /* earliest match (in search order), or UINT_MAX */
+  unsigned hits;                /* number of matches (when counting all) */
+  int running;                  /* number of workers still running */
+  bool countall;                /* count all matches, or stop at the first */
+  volatile size_t cancel;
+  mtx_t lock;
+  thrd_t threads[MAX_WORKERS];
+  int numthreads;
+  unsigned generation;          /* generation of the store */
+} SEARCHJOB;
+
+static SEARCHJOB tracesearch;
+static bool tracesearch_active = false;
+
+static int search_worker(void *arg)
+{
+  SEARCHJOB *job = (SEARCHJOB*)arg;
+  for ( ;; ) {
+    mtx_lock(&job->lock);
+    unsigned block = job->nextblock;
+    bool done = ATOMIC_LOAD_ACQUIRE(&job->cancel) || block >= job->numblocks
+                || (!job->countall && job->firsthit < block * SEARCH_BLOCKLINES);
+    if (!done)
+      job->nextblock = block + 1;
+    mtx_unlock(&job->lock);
+    if (done)
+      break;
+
+    unsigned first = block * SEARCH_BLOCKLINES;
+    unsigned last = first + SEARCH_BLOCKLINES;
+    if (last > job->lines)
+      last = job->lines;
+    unsigned hits = 0;
+    unsigned line = first + job->start;
+    if (line >= job->lines)
+      line -= job->lines;
+    for (unsigned order = first; order < last && !ATOMIC_LOAD_ACQUIRE(&job->cancel); order++) {
+      const char *text = job->chunks[line >> STORE_CHUNKSHIFT]->text[line & (STORE_CHUNKLINES - 1)];
+      if (strpattern_match(&job->pattern, text, NULL) != NULL) {
+        if (!job->countall) {
+          mtx_lock(&job->lock);
+          if (order < job->firsthit)
+            job->firsthit = order;
+          mtx_unlock(&job->lock);
+          break;  /* only the first match in the block is relevant */
+        }
+        hits++;
+      }
+      if (++line >= job->lines)
+        line = 0; /* wrap-around */
+    }
+    if (hits > 0) {
+      mtx_lock(&job->lock);
+      job->hits += hits;
+      mtx_unlock(&job->lock);
+    }
+  }
+  mtx_lock(&job->lock);
+  job->running -= 1;
+  mtx_unlock(&job->lock);
+  return 0;
+}
+
+/** search_init() sets up a search job, but does not start the workers.
+ */
+static bool search_init(SEARCHJOB *job, const char *pattern, unsigned lines, unsigned start, bool countall)
+{
+  memset(job, 0, sizeof(SEARCHJOB));
+  job->text = strdup(pattern);
+  if (job->text == NULL || !strpattern_compile(&job->pattern, job->text)) {
+    if (job->text != NULL)
+      free(job->text);
+    return false;
+  }
+  mtx_init(&job->lock, mtx_plain);
+  job->lines = lines;
+  job->start = start;
+  job->numblocks = (lines + SEARCH_BLOCKLINES - 1) / SEARCH_BLOCKLINES;
+  job->firsthit = UINT_MAX;
+  job->countall = countall;
+  return true;
+}
+
+/** search_run() starts the workers for a search job. When "background" is
+ *  false, the calling thread takes part in the search, and the function
+ *  returns when the search is complete.
+ */
+static void search_run(SEARCHJOB *job, bool background)
+{
+  int workers = worker_count();
+  if (job->numblocks < (unsigned)workers)
+    workers = (job->numblocks > 0) ? (int)job->numblocks : 1;
+  job->running = workers;
+  int created = background ? 0 : 1;  /* the calling thread is one of the workers */
+  for ( ; created < workers; created++)
+    if (thrd_create(&job->threads[job->numthreads], search_worker, job) == thrd_success)
+      job->numthreads += 1;
+    else
+      job->running -= 1;
+  if (!background) {
+    search_worker(job);
+    for (int idx = 0; idx < job->numthreads; idx++)
+      thrd_join(job->threads[idx], NULL);
+    job->numthreads = 0;
+  }
+}
+
+static void search_cleanup(SEARCHJOB *job)
+{
+  ATOMIC_STORE_RELEASE(&job->cancel, 1);
+  for (int idx = 0; idx < job->numthreads; idx++)
+    thrd_join(job->threads[idx], NULL);
+  job->numthreads = 0;
+  mtx_destroy(&job->lock);
+  free(job->text);
+  job->text = NULL;
+}
+
+/** tracesearch_stop() stops the background search (that counts all matches),
+ *  if one is active.
+ */
+static void tracesearch_stop(void)
+{
+  if (tracesearch_active) {
+    search_cleanup(&tracesearch);
+    free(tracesearch.chunks);
+    tracesearch_active = false;
+  }
+}
+
+/** tracesearch_busy() returns whether the workers of the background search
+ *  may still read the chunks of the store.
+ */
+static bool tracesearch_busy(void)
+{
+  if (!tracesearch_active)
+    return false;
+  mtx_lock(&tracesearch.lock);
+  bool busy = (tracesearch.running > 0);
+  mtx_unlock(&tracesearch.lock);
+  return busy;
+}
+
+/** tracesearch_start() starts a background search that counts all matches of
+ *  the pattern. It must be called with the trace strings locked.
+ */
+static void tracesearch_start(const char *pattern)
+{
+  if (tracesearch_active && strcmp(tracesearch.text, pattern) == 0
+      && tracesearch.generation == store_generation)
+    return; /* this search is already running (or done) */
+  tracesearch_stop();
+
+  /* only complete lines are searched, because the text of the last line
+     may still change */
+  unsigned lines = tracestore.count;
+  if (lines > 0 && (LINE_CHUNK(lines - 1)->flags[LINE_INDEX(lines - 1)] & TSFLAG_EOL) == 0)
+    lines -= 1;
+  if (!search_init(&tracesearch, pattern, lines, 0, true))
+    return;
+  unsigned numchunks = (lines + STORE_CHUNKLINES - 1) >> STORE_CHUNKSHIFT;
+  tracesearch.chunks = malloc((numchunks > 0 ? numchunks : 1) * sizeof(LINECHUNK*));
+  if (tracesearch.chunks == NULL) {
+    search_cleanup(&tracesearch);
+    return;
+  }
+  if (numchunks > 0)
+    memcpy(tracesearch.chunks, tracestore.chunks, numchunks * sizeof(LINECHUNK*));
+  tracesearch.generation = store_generation;
+  tracesearch_active = true;
+  search_run(&tracesearch, true);
+}
+
+/** tracestring_find() jumps to the previous or next match.
+ *
+ *  \param pattern  The text to search, which may contain wildcards.
+ *  \param curline  The starting point for the search (a line number), or -1 to
+ *                  search from the top to the first match.
+ *
+ *  \return A line number for the next match, or -1 if the text is not found.
+ *
+ *  \note The search wraps around from the end to the beginning.
+ *
+ *  \note This function also starts counting all matches in the background;
+ *        see tracestring_findcount().
+ */
+int tracestring_find(const char *pattern, int curline)
+{
+  assert(curline >= 0 || curline == -1);
+  assert(pattern != NULL);
+
+  tracestring_lock();
+  int count = (int)tracestore.count;
+  int result = -1;
+  SEARCHJOB job;
+  if (count > 0 && search_init(&job, pattern, (unsigned)count, 0, false)) {
+    job.start = (curline < 0 || curline + 1 >= count) ? 0 : curline + 1;
+    job.chunks = tracestore.chunks;
+    search_run(&job, false);
+    if (job.firsthit != UINT_MAX) {
+      result = (int)(job.firsthit + job.start);
+      if (result >= count)
+        result -= count;
+    }
+    search_cleanup(&job);
+    tracesearch_start(pattern);
+  }
+  tracestring_unlock();
+  return result;
+}
+
+/** tracestring_findcount() returns the number of matches of the most recent
+ *  search (see tracestring_find()). The matches are counted in the background,
+ *  so the count may still be incomplete.
+ *
+ *  \param complete   [out] Set to true if all matches have been counted. This
+ *                    parameter may be NULL.
+ *
+ *  \return The number of matches, or -1 if no search is active.
+ */
+int tracestring_findcount(bool *complete)
+{
+  if (complete != NULL)
+    *complete = false;
+  if (!tracesearch_active)
+    return -1;
+  mtx_lock(&tracesearch.lock);
+  int hits = (int)tracesearch.hits;
+  if (complete != NULL)
+    *complete = (tracesearch.running == 0);
+  mtx_unlock(&tracesearch.lock);
+  return hits;
+}
+
+/** tracestring_findtimestamp() finds the line closest to the given
+ *  timestamp. Note that it can return -1 when there are not strings in the
+ *  list.
+ */
+int tracestring_findtimestamp(double timestamp)
+{
+  tracestring_lock();
+  /* binary search for the first line at or after the timestamp (timestamps
+     in the store are in ascending order) */
+  unsigned low = 0, high = tracestore.count;
+  while (low < high) {
+    unsigned mid = (low + high) / 2;
+    if (LINE_CHUNK(mid)->timestamp[LINE_INDEX(mid)] < timestamp)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  tracestring_unlock();
+  return (int)low - 1;
+}
+
+/** tracestring_findbookmark() finds the next or previous bookmark.
+ *
+ *  \param action   BK_NEXT to move to the next bookmark; BK_PREV to move to
+ *                  the previous bookmark; BK_CLEAR to remove the active
+ *                  bookmark.
+ *
+ *  \return A line number for the next/prevous bookmark (which is now set
+ *          active), or 1 if no bookmark could be set active.
+ *
+ *  \note The next/previous bookmark step wraps around from the end to the
+ *        beginning (and vice versa).
+ */
+int tracestring_findbookmark(int action)
+{
+  tracestring_lock();
+  int result = -1;
+  unsigned num = tracestore.numbookmarks;
+  if (num > 0 && (action == BK_NEXT || action == BK_PREV)) {
+    /* find the position of the active mark in the (sorted) list */
+    unsigned pos = num;
+    if (tracestore.activemark >= 0) {
+      unsigned low = 0, high = num;
+      while (low < high) {
+        unsigned mid = (low + high) / 2;
+        if (tracestore.bookmarks[mid] < (unsigned)tracestore.activemark)
+          low = mid + 1;
+        else
+          high = mid;
+      }
+      if (low < num && tracestore.bookmarks[low] == (unsigned)tracestore.activemark)
+        pos = low;
+    }
+    if (action == BK_NEXT)
+      result = (pos < num - 1) ? (int)tracestore.bookmarks[pos + 1] : (int)tracestore.bookmarks[0];
+    else
+      result = (pos > 0 && pos < num) ? (int)tracestore.bookmarks[pos - 1] : (int)tracestore.bookmarks[num - 1];
+  }
+  tracestore.activemark = result;
+  tracestring_unlock();
+
+  return result;
+}
+
+static char *getfield(char **base)
+{
+  assert(base != NULL && *base != NULL);
+  char *start = *base;
+  while (*start != '\0' && *start <= ' ')
+    start++;            /* skip white space */
+  if (*start == '\0')
+    return NULL;
+
+  char *tail = start;
+  if (*tail == '"') {
+    /* skip string, and possibly reduce doubled quotes */
+    start++;            /* skip initial '"' */
+    tail++;
+    char *tgt = tail;
+    while (*tail != '\0' && (*tail != '"' || *(tail + 1) == '"')) {
+      if (*tail == '"')
+        tail++;
+      if (tgt != tail)
+        *tgt = *tail;   /* move up characters, if doubled double-quotes were found */
+      tail++;
+      tgt++;
+    }
+    *tgt = '\0';
+    if (tail == tgt || *tail == '"')  /* if tail == tgt -> '"' was just overwritten by '\0' */
+      tail++;
+    while (*tail != '\0' && *tail != ',')
+      tail++;           /* ignore any text beyond the string, until the field separator */
+    if (*tail == ',')
+      tail++;           /* skip the field separator too */
+  } else {
+    while (*tail != '\0' && *tail != ',')
+      tail++;
+    char *sentinel = tail;
+    if (*tail == ',')
+      tail++;           /* skip the field separator */
+    while (sentinel > start && *(sentinel - 1) <= ' ')
+      sentinel--;       /* back up to just behind the last last letter/digit (non-white space) */
+    *sentinel = '\0';   /* zero terminate behind the end of the word */
+  }
+
+  *base = tail;
+
+  return start;
+}
+
+/* Loading a CSV file: the file is memory-mapped and split at line boundaries
+   into segments, which are parsed concurrently. Each worker collects the lines
+   of its segment in a private list (with a private text buffer); the lines are
+   then added to the store in file order. The calling thread parses the first
+   segment and adds it to the store while the workers are still busy with the
+   other segments. */
+#define LOAD_MAXLINE    65536         /* arbitrarily set max. line size to 64 KiB */
+#define LOAD_MINSEGMENT (1024*1024)   /* minimum size of a segment for a worker */
+
+typedef struct tagLOADLINE {
+  double timestamp;
+  size_t text;                  /* offset in the text buffer of the job */
+  unsigned short length;
+  unsigned char channel;
+  unsigned char severity;
+  bool bookmark;
+} LOADLINE;
+
+typedef struct tagLOADJOB {
+  const char *start, *end;      /* segment of the file */
+  LOADLINE *lines;
+  size_t numlines, maxlines;
+  char *text;
+  size_t textsize, textused;
+  char *names[NUM_CHANNELS];    /* first name found for each channel */
+  bool failed;                  /* memory allocation failed */
+} LOADJOB;
+
+/** load_parseline() parses a line of a CSV file, and adds it to the list of
+ *  the job. The line is modified in the process.
+ */
+static void load_parseline(LOADJOB *job, char *buffer)
+{
+  unsigned channel = 0;
+  unsigned severity = 0;
+  double timestamp = 0.0;
+  const char *name = NULL;
+  char *base = buffer;
+  char *ptr;
+  if ((ptr = getfield(&base)) != NULL)
+    channel = (unsigned)strtol(ptr, NULL, 10);
+  if ((ptr = getfield(&base)) != NULL)
+    name = ptr;
+  if ((ptr = getfield(&base)) != NULL) {
+    int level = ctf_severity_level(ptr);
+    severity = (level >= 0) ? (unsigned)level : 1;
+  }
+  if ((ptr = getfield(&base)) != NULL)
+    timestamp = strtod(ptr, NULL);
+  if ((ptr = getfield(&base)) == NULL || channel >= NUM_CHANNELS)
+    return;
+
+  size_t length = strlen(ptr);
+  if (length > USHRT_MAX)
+    length = USHRT_MAX;
+  if (job->numlines >= job->maxlines) {
+    size_t newsize = (job->maxlines == 0) ? 4096 : 2 * job->maxlines;
+    LOADLINE *list = realloc(job->lines, newsize * sizeof(LOADLINE));
+    if (list == NULL) {
+      job->failed = true;
+      return;
+    }
+    job->lines = list;
+    job->maxlines = newsize;
+  }
+  if (job->textused + length > job->textsize) {
+    size_t newsize = (job->textsize == 0) ? STORE_TEXTBLOCK : 2 * job->textsize;
+    while (job->textused + length > newsize)
+      newsize *= 2;
+    char *text = realloc(job->text, newsize);
+    if (text == NULL) {
+      job->failed = true;
+      return;
+    }
+    job->text = text;
+    job->textsize = newsize;
+  }
+  LOADLINE *line = &job->lines[job->numlines++];
+  line->timestamp = timestamp;
+  line->text = job->textused;
+  line->length = (unsigned short)length;
+  line->channel = (unsigned char)channel;
+  line->severity = (unsigned char)severity;
+  memcpy(job->text + job->textused, ptr, length);
+  job->textused += length;
+  /* the first name found for a channel is kept */
+  if (name != NULL && job->names[channel] == NULL)
+    job->names[channel] = strdup(name);
+  /* read optional bookmark */
+  line->bookmark = ((ptr = getfield(&base)) != NULL && *ptr == '#');
+}
+
+static int load_worker(void *arg)
+{
+  LOADJOB *job = (LOADJOB*)arg;
+  char *buffer = malloc((LOAD_MAXLINE + 1) * sizeof(char));
+  if (buffer == NULL) {
+    job->failed = true;
+    return 0;
+  }
+  const char *ptr = job->start;
+  while (ptr < job->end && !job->failed) {
+    const char *eol = memchr(ptr, '\n', job->end - ptr);
+    const char *next = (eol != NULL) ? eol + 1 : job->end;
+    size_t length = ((eol != NULL) ? eol : job->end) - ptr;
+    if (length > LOAD_MAXLINE)
+      length = LOAD_MAXLINE;
+    memcpy(buffer, ptr, length);  /* the mapped file is read-only */
+    buffer[length] = '\0';
+    load_parseline(job, buffer);
+    ptr = next;
+  }
+  free(buffer);
+  return 0;
+}
+
+/** load_commit() adds the lines that a worker collected to the store. It must
+ *  be called with the trace strings locked.
+ *
+ *  \return The number of lines added.
+ */
+static int load_commit(LOADJOB *job)
+{
+  int count = 0;
+  for (size_t idx = 0; idx < job->numlines; idx++) {
+    const LOADLINE *item = &job->lines[idx];
+    int line = store_newline(item->channel, item->severity, item->timestamp, TSFLAG_EOL);
+    if (line < 0) {
+      job->failed = true;
+      break;
+    }
+    if (line == 0 && tracestore.evicted == 0)
+      tracestore.starttime = 0.0; /* timestamps in the file are already relative */
+    store_appendtext(job->text + item->text, item->length);
+    if (item->bookmark)
+      store_togglebookmark(line);
+    count++;
+  }
+  for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+    if (job->names[chan] != NULL && tracestore.channelnames[chan] == NULL) {
+      tracestore.channelnames[chan] = job->names[chan]; /* move into the store */
+      job->names[chan] = NULL;
+    }
+  }
+  return count;
+}
+
+static void load_cleanup(LOADJOB *job)
+{
+  if (job->lines != NULL)
+    free(job->lines);
+  if (job->text != NULL)
+    free(job->text);
+  for (int chan = 0; chan < NUM_CHANNELS; chan++)
+    if (job->names[chan] != NULL)
+      free(job->names[chan]);
+  memset(job, 0, sizeof(LOADJOB));
+}
+
+/** tracestring_load() loads trace data from a file. It supports data saved
+ *  by BMTrace and BMDebug (SWO view), as well as from the BMDebug serial
+ *  monitor with CTF decoding.
+ *
+ *  \param filename   The full path to the file to load.
+ *  \param format     [out] Set to 0 for SWO trace format, or 1 for CTF decoded
+ *                    (from the serial monitor). This parameter may be NULL.
+ *
+ *  \return The number of lines loaded from the file, or zero on error.
+ *
+ *  \note A large file is parsed by several threads.
+ */
+int tracestring_load(const char *filename, int *format)
+{
+  if (format != NULL)
+    *format = 0;
+
+  size_t size;
+  const unsigned char *data = file_map(filename, &size, true);
+  if (data == NULL)
+    return 0;
+  const char *start = (const char*)data;
+  const char *end = start + size;
+
+  /* check header line */
+  const char *eol = memchr(start, '\n', size);
+  size_t length = ((eol != NULL) ? eol : end) - start;
+  char header[128];
+  if (length >= sizearray(header)) {
+    file_unmap(data, size);
+    return 0;
+  }
+  memcpy(header, start, length);
+  header[length] = '\0';
+  int fmt = 0;
+  bool ok = true;
+  char *base = header;
+  char *ptr = getfield(&base);
+  if (ptr == NULL || (strcmp(ptr, "Channel") != 0 && strcmp(ptr, "ID") != 0))
+    ok = false;
+  else if (strcmp(ptr, "ID") == 0)
+    fmt = 1;        /* this file is saved from the serial monitor */
+  if ((ptr = getfield(&base)) == NULL || (fmt == 0 && strcmp(ptr, "Name") != 0) || (fmt == 1 && strcmp(ptr, "Stream") != 0))
+    ok = false;
+  if ((ptr = getfield(&base)) == NULL || strcmp(ptr, "Severity") != 0)
+    ok = false;
+  if ((ptr = getfield(&base)) == NULL || strcmp(ptr, "Timestamp") != 0)
+    ok = false;
+  if ((ptr = getfield(&base)) == NULL || strcmp(ptr, "Text") != 0)
+    ok = false;
+  if (!ok || *base != '\0') {
+    file_unmap(data, size);
+    return 0;
+  }
+  if (format != NULL)
+    *format = fmt;
+
+  /* split the rest of the data in segments, at line boundaries */
+  start = (eol != NULL) ? eol + 1 : end;
+  size_t datasize = end - start;
+  int numjobs = worker_count();
+  if ((size_t)numjobs > datasize / LOAD_MINSEGMENT)
+    numjobs = (datasize >= 2 * LOAD_MINSEGMENT) ? (int)(datasize / LOAD_MINSEGMENT) : 1;
+  LOADJOB jobs[MAX_WORKERS];
+  memset(jobs, 0, sizeof jobs);
+  for (int idx = 0; idx < numjobs; idx++) {
+    jobs[idx].start = start;
+    if (idx == numjobs - 1) {
+      start = end;
+    } else {
+      const char *split = jobs[0].start + (datasize / numjobs) * (idx + 1);
+      if (split < start)
+        split = start;
+      eol = memchr(split, '\n', end - split);
+      start = (eol != NULL) ? eol + 1 : end;
+    }
+    jobs[idx].end = start;
+  }
+
+  /* parse the segments, and add the lines to the store in order */
+  thrd_t threads[MAX_WORKERS];
+  bool started[MAX_WORKERS];
+  for (int idx = 1; idx < numjobs; idx++)
+    started[idx] = (thrd_create(&threads[idx], load_worker, &jobs[idx]) == thrd_success);
+  load_worker(&jobs[0]);
+  int count = 0;
+  bool failed = false;
+  for (int idx = 0; idx < numjobs; idx++) {
+    if (idx > 0) {
+      if (started[idx])
+        thrd_join(threads[idx], NULL);
+      else if (!failed)
+        load_worker(&jobs[idx]);
+    }
+    if (!failed) {
+      tracestring_lock();
+      count += load_commit(&jobs[idx]);
+      tracestring_unlock();
+      failed = jobs[idx].failed;  /* stop at a gap in the data */
+    }
+    load_cleanup(&jobs[idx]);
+  }
+
+  file_unmap(data, size);
+  return count;
+}
+
+/* Saving a CSV file goes through a large buffer. The lines are formatted in
+   batches while the trace strings are locked, and the buffer is written to
+   the file with the lock released. This can run in a background thread, so
+   that the GUI stays responsive while a large log is saved. Only the lines
+   that are in the store when saving starts are saved. */
+typedef struct tagSAVEJOB {
+  FILE *fp;
+  char *buffer;
+  unsigned long long next;      /* absolute number of the next line to save */
+  unsigned long long last;      /* absolute number of the line to stop at */
+  unsigned generation;          /* generation of the store that is saved */
+  unsigned bookmarks;           /* number of bookmarks saved */
+  volatile size_t count;        /* number of lines saved */
+  volatile size_t done;         /* set when the save job is complete */
+  bool failed;
+} SAVEJOB;
+
+static SAVEJOB savejob;
+static thrd_t save_thread;
+static bool save_active = false;
+
+static bool save_init(SAVEJOB *job, const char *filename)
+{
+  memset(job, 0, sizeof(SAVEJOB));
+  job->buffer = malloc(STORE_WRITEBUF);
+  if (job->buffer == NULL)
+    return false;
+  job->fp = fopen(filename, "wt");
+  if (job->fp == NULL) {
+    free(job->buffer);
+    return false;
+  }
+  tracestring_lock();
+  job->next = tracestore.evicted;
+  job->last = tracestore.evicted + tracestore.count;
+  job->generation = store_generation;
+  tracestring_unlock();
+  return true;
+}
+
+static int save_worker(void *arg)
+{
+  SAVEJOB *job = (SAVEJOB*)arg;
+  size_t used = sprintf(job->buffer, "Channel,Name,Severity,Timestamp,Text\n");
+  size_t count = 0;
+  bool finished = false;
+  while (!finished) {
+    tracestring_lock();
+    if (job->generation != store_generation) {
+      tracestring_unlock();
+      job->failed = true;   /* store was cleared while saving */
+      break;
+    }
+    /* lines that were evicted while saving are skipped */
+    if (job->next < tracestore.evicted)
+      job->next = tracestore.evicted;
+    unsigned line = (unsigned)(job->next - tracestore.evicted);
+    unsigned last = (job->last > tracestore.evicted) ? (unsigned)(job->last - tracestore.evicted) : 0;
+    assert(last <= tracestore.count);
+    while (line < last) {
+      size_t len = store_formatline(job->buffer + used, STORE_WRITEBUF - used, line, tracestore.starttime, &job->bookmarks);
+      if (len == 0) {
+        if (used == 0)
+          line++;   /* line cannot be formatted at all, skip it */
+        break;
+      }
+      used += len;
+      line++;
+      count++;
+    }
+    job->next = tracestore.evicted + line;
+    finished = (line >= last);
+    tracestring_unlock();
+    if (used > 0 && fwrite(job->buffer, 1, used, job->fp) != used) {
+      job->failed = true;
+      break;
+    }
+    used = 0;
+    ATOMIC_STORE_RELEASE(&job->count, count);
+  }
+  if (fclose(job->fp) != 0)
+    job->failed = true;
+  job->fp = NULL;
+  free(job->buffer);
+  job->buffer = NULL;
+  ATOMIC_STORE_RELEASE(&job->done, 1);
+  return 0;
+}
+
+/** tracestring_save() saves the data in a file, in CSV format.
+ *
+ *  \param filename   The full path to the file to create.
+ *
+ *  \return The number of lines written to the file, or zero on error.
+ *
+ *  \note Only the retained lines are saved. The timestamps are relative to the
+ *        first line that was received, so the file continues where the spill
+ *        file of the retention limit ends; see tracestring_setretention().
+ */
+int tracestring_save(const char *filename)
+{
+  SAVEJOB job;
+  if (!save_init(&job, filename))
+    return 0;
+  save_worker(&job);
+  return job.failed ? 0 : (int)job.count;
+}
+
+/** tracestring_savestart() starts saving the data in a file (in CSV format)
+ *  in a background thread. See tracestring_save() for details.
+ *
+ *  \param filename   The full path to the file to create.
+ *
+ *  \return true on success, false if the file cannot be created, or if another
+ *          file is still being saved.
+ *
+ *  \note Call tracestring_savestatus() until it reports that the job is done.
+ */
+bool tracestring_savestart(const char *filename)
+{
+  if (save_active || !save_init(&savejob, filename))
+    return false;
+  if (thrd_create(&save_thread, save_worker, &savejob) != thrd_success) {
+    fclose(savejob.fp);
+    free(savejob.buffer);
+    return false;
+  }
+  save_active = true;
+  return true;
+}
+
+/** tracestring_savestatus() returns the progress of saving data in the
+ *  background.
+ *
+ *  \param done   [out] Set to true when the job is complete (or when no job was
+ *                started). This parameter may be NULL.
+ *
+ *  \return The number of lines written so far, or -1 on error. When the job
+ *          is complete, this is the total number of lines saved.
+ */
+int tracestring_savestatus(bool *done)
+{
+  if (done != NULL)
+    *done = !save_active;
+  if (!save_active)
+    return savejob.failed ? -1 : (int)savejob.count;
+  int count = (int)ATOMIC_LOAD_ACQUIRE(&savejob.count);
+  if (ATOMIC_LOAD_ACQUIRE(&savejob.done)) {
+    thrd_join(save_thread, NULL);
+    save_active = false;
+    if (done != NULL)
+      *done = true;
+    count = savejob.failed ? -1 : (int)savejob.count;
+  }
+  return count;
+}
+
+const char *trace_channelname(int id)
+{
+  if (id < 0 || id >= NUM_CHANNELS)
+    return NULL;
+  tracestring_lock();
+  const char *name = tracestore.channelnames[id];
+  tracestring_unlock();
+  return name;
+}
+
+/** trace_setdatasize() sets the data size in an ITM packet, in bytes. Valid
+ *  values are 1, 2 and 4. For automatic detection, set "size" to 0.
+ */
+void trace_setdatasize(short size)
+{
+  assert(size == 0 || size == 1 || size == 2 || size == 4);
+  itm_datasize = (size == 0) ? 1 : size;
+  itm_datasz_auto = (size == 0);
+  itm_packet_errors = 0;
+}
+
+/** trace_getdatasize() returns the datasize currently set. */
+short trace_getdatasize(void)
+{
+  return itm_datasize;
+}
+
+int trace_getpacketerrors(bool reset)
+{
+  int result = itm_packet_errors;
+  if (reset)
+    itm_packet_errors = 0;
+  return result;
+}
+
+/** trace_settimestampclock() sets the frequency of the local timestamp
+ *  counter of the ITM. This is the CPU clock divided by the timestamp
+ *  prescaler (or the TPIU clock, if the ITM is configured for it). When set,
+ *  and when the target sends local timestamp packets, the trace messages get
+ *  the (cycle-accurate) time of the target, instead of the time that the USB
+ *  packet arrived.
+ *
+ *  \param frequency  The timestamp clock in Hz, or 0 to use host timestamps.
+ */
+void trace_settimestampclock(unsigned long frequency)
+{
+  tracestring_lock();
+  itm_tsclock = frequency;
+  for (int idx = 0; idx < MAX_PROBES; idx++)
+    trace_probe(idx)->tsbase = -1.0;
+  tracestring_unlock();
+}
+
+/** tracestring_decodebuffer() decodes a buffer with raw SWO data into trace
+ *  messages directly, bypassing the packet queue (and the recording). This
+ *  is intended for benchmarks; the decoder thread must not be running.
+ *
+ *  \param data       The trace data.
+ *  \param length     The size of the trace data in bytes.
+ *  \param timestamp  The host timestamp for the data.
+ *
+ *  \return The number of times that trace messages were added.
+ */
+int tracestring_decodebuffer(const unsigned char *data, size_t length, double timestamp)
+{
+  assert(!decoder_active);
+  ITMTRACECTX ctx = { trace_probe(0), 0 };
+  tracestring_lock();
+  tracestring_decodeblock(&ctx, data, length, timestamp);
+  tracestring_unlock();
+  return ctx.count;
+}
+
+/** trace_setfastpath() enables or disables the vectorized paths (SSE2 or
+ *  NEON) for the decoding of plain text, for comparison in benchmarks. They
+ *  are enabled by default.
+ *
+ *  \return The previous setting.
+ */
+bool trace_setfastpath(bool enable)
+{
+  tracestring_lock();
+  bool prev = itm_fastpath;
+  itm_fastpath = enable;
+  tracestring_unlock();
+  return prev;
+}
+
+/** trace_setbitrate() sets the bitrate of the SWO line, in asynchronous mode.
+ *  The host timestamp is taken when a USB packet arrives; with the bitrate,
+ *  the arrival time of each byte in the packet is interpolated (assuming 8
+ *  data bits plus a start and a stop bit per byte).
+ *
+ *  \param bitrate  The bitrate, or 0 to disable interpolation (for example
+ *                  for Manchester encoding).
+ *
+ *  \note When a recording is replayed, the bitrate of the recording is used.
+ */
+void trace_setbitrate(unsigned long bitrate)
+{
+  tracestring_lock();
+  itm_bitrate = bitrate;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    TRACEPROBE *probe = trace_probe(idx);
+    if (!probe->loopback_active)
+      probe->decoder.bytetime = (bitrate > 0) ? 10.0 / bitrate : 0.0;
+  }
+  tracestring_unlock();
+}
+
+/** trace_itmstats() returns the number of ITM and DWT packets of each type
+ *  that were decoded (for all probes), plus the current local and global
+ *  timestamps (of the primary probe).
+ *
+ *  \param stats  [out] Filled with the statistics. This parameter may be NULL
+ *                (in which case only the reset is done).
+ *  \param reset  Whether to reset the counters.
+ */
+void trace_itmstats(TRACEITMSTATS *stats, bool reset)
+{
+  tracestring_lock();
+  if (stats != NULL) {
+    *stats = itm_stats;
+    stats->localtime = trace_probe(0)->decoder.ticks;
+    stats->globaltime = trace_probe(0)->decoder.globaltime;
+  }
+  if (reset)
+    memset(&itm_stats, 0, sizeof itm_stats);
+  tracestring_unlock();
+}
+
+/* trace_health() samples the counters of all stages of the pipeline: the
+   probe and the USB transfer, the packet queue, the ITM decoder and the CTF
+   decoder. Counters are turned into rates over the interval since the previous
+   sample. */
+static TRACEHEALTH health_prev;
+static unsigned long long health_inbytes = 0;
+static unsigned long long health_packets = 0;
+static double health_latency = 0.0;
+static double health_busy = 0.0;
+static unsigned long health_chanpackets[NUM_CHANNELS];
+static unsigned long long health_chanbytes[NUM_CHANNELS];
+
+/** trace_health() fills in the statistics of the capture and decoding
+ *  pipeline. The rates are over the interval since the previous call.
+ *
+ *  \param health  [out] The statistics. The fields for the GUI are set to
+ *                 zero.
+ */
+void trace_health(TRACEHEALTH *health)
+{
+  assert(health != NULL);
+  memset(health, 0, sizeof(TRACEHEALTH));
+  tracestring_lock();
+  health->timestamp = get_timestamp();
+  health->interval = (health_prev.timestamp > 0.0) ? health->timestamp - health_prev.timestamp : 0.0;
+  double interval = (health->interval > 0.0) ? health->interval : 1.0;
+
+  TRACEQUEUESTATS qstats;
+  trace_queuestats(&qstats, false);
+  if (qstats.bytes < health_inbytes)
+    health_inbytes = 0;   /* statistics were reset */
+  health->inputrate = (qstats.bytes - health_inbytes) / interval;
+  health_inbytes = qstats.bytes;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    health->captureerrors += trace_probe(idx)->errors;
+    health->reconnects += trace_probe(idx)->reconnects;
+  }
+  health->queuesize = qstats.size;
+  health->queuefill = qstats.fill;
+  health->queuepeak = qstats.highwater;
+  health->dropped = qstats.dropped;
+
+  health->itmoverflows = itm_stats.overflows;
+  health->invalid = itm_stats.invalid;
+  health->packeterrors = itm_packet_errors;
+
+  health->decodeload = (decode_busy - health_busy) / interval;
+  health_busy = decode_busy;
+  if (decode_packets > health_packets)
+    health->latency = (decode_latency - health_latency) / (decode_packets - health_packets);
+  health->maxlatency = decode_maxlatency;
+  health_packets = decode_packets;
+  health_latency = decode_latency;
+  decode_maxlatency = 0.0;
+
+  for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+    if (itm_stats.chanpackets[chan] < health_chanpackets[chan] || itm_stats.chanbytes[chan] < health_chanbytes[chan]) {
+      health_chanpackets[chan] = 0; /* statistics were reset */
+      health_chanbytes[chan] = 0;
+    }
+    health->packetrate[chan] = (itm_stats.chanpackets[chan] - health_chanpackets[chan]) / interval;
+    health->byterate[chan] = (itm_stats.chanbytes[chan] - health_chanbytes[chan]) / interval;
+    health_chanpackets[chan] = itm_stats.chanpackets[chan];
+    health_chanbytes[chan] = itm_stats.chanbytes[chan];
+    health->ctferrors[chan] = ctf_decode_errors(chan);
+  }
+  health_prev = *health;
+  tracestring_unlock();
+}
+
+/** trace_healthjson() writes the statistics as a JSON object on a single line
+ *  (so that periodic samples can be appended to a file).
+ *
+ *  \param fp      The file to write to.
+ *  \param health  The statistics, see trace_health().
+ *
+ *  \return true on success, false on a write error.
+ *
+ *  \note Only the channels that had any traffic (or CTF errors) are listed.
+ */
+bool trace_healthjson(FILE *fp, const TRACEHEALTH *health)
+{
+  assert(fp != NULL);
+  assert(health != NULL);
+  fprintf(fp, "{\"timestamp\":%.6f,\"interval\":%.6f,", health->timestamp, health->interval);
+  fprintf(fp, "\"capture\":{\"rate\":%.0f,\"errors\":%lu,\"reconnects\":%lu},",
+          health->inputrate, health->captureerrors, health->reconnects);
+  fprintf(fp, "\"queue\":{\"size\":%lu,\"fill\":%lu,\"peak\":%lu,\"dropped\":%lu},",
+          (unsigned long)health->queuesize, (unsigned long)health->queuefill,
+          (unsigned long)health->queuepeak, health->dropped);
+  fprintf(fp, "\"itm\":{\"overflows\":%lu,\"invalid\":%lu,\"packeterrors\":%d},",
+          health->itmoverflows, health->invalid, health->packeterrors);
+  fprintf(fp, "\"decoder\":{\"load\":%.4f,\"latency\":%.6f,\"maxlatency\":%.6f},",
+          health->decodeload, health->latency, health->maxlatency);
+  fprintf(fp, "\"frame\":{\"decode\":%.6f,\"render\":%.6f},", health->framedecode, health->framerender);
+  fprintf(fp, "\"channels\":[");
+  bool first = true;
+  for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+    if (health->packetrate[chan] <= 0.0 && health->ctferrors[chan] == 0)
+      continue;
+    fprintf(fp, "%s{\"channel\":%d,\"bytes\":%.0f,\"packets\":%.0f,\"ctferrors\":%lu}",
+            first ? "" : ",", chan, health->byterate[chan], health->packetrate[chan], health->ctferrors[chan]);
+    first = false;
+  }
+  fprintf(fp, "]}\n");
+  return fflush(fp) == 0 && !ferror(fp);
+}
+
+int trace_overflowerrors(bool reset)
+{
+  int result = 0;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    TRACEQUEUE *queue = &trace_probe(idx)->queue;
+    result += queue->overflow;
+    if (reset)
+      queue->overflow = 0;
+  }
+  return result;
+}
+
+/* The sample map holds a counter per (aligned) code address, but only for
+   the address ranges that were registered, and in each range, counters are
+   allocated per page on the first sample that falls in that page. This keeps
+   the memory footprint proportional to the code that actually runs, also for
+   code that is spread over Flash, RAM and external memory.
+   Optionally, samples are also attributed to "bins" (such as functions or
+   source lines) as they come in; there are several independent sets of
+   bins, so that samples can be attributed to functions and to source lines
+   at the same time. Each page has an entry in a jump table with
+   the first bin that could hold an address in that page, so that finding the
+   bin for a sample only needs a binary search in the bins of that page. */
+#define SAMPLEPAGE_SIZE   1024  /* number of counters per page */
+#define SAMPLEMAP_GROW    4     /* growth step of the segment table */
+
+typedef struct tagSAMPLEPAGE {
+  unsigned total;               /* sum of all counters in the page */
+  unsigned counts[SAMPLEPAGE_SIZE];
+} SAMPLEPAGE;
+
+typedef struct tagSAMPLESEGMENT {
+  uint32_t base;                /* first address in the range */
+  uint32_t top;                 /* address just beyond the range */
+  unsigned numpages;
+  SAMPLEPAGE **pages;           /* page directory, NULL for unused pages */
+  unsigned *firstbin[SAMPLEMAP_BINSETS]; /* jump tables into the bin lists, one entry per page */
+} SAMPLESEGMENT;
+
+typedef struct tagSAMPLEBINSET {
+  SAMPLEBIN *bins;              /* sorted on address, not overlapping */
+  unsigned numbins;
+  unsigned *counts;             /* counters, indexed on the bin id */
+  unsigned numids;
+  unsigned last;                /* bin of the most recent sample */
+  unsigned unbinned;            /* samples inside the ranges, but not in a bin */
+} SAMPLEBINSET;
+
+struct tagSAMPLEMAP {
+  SAMPLESEGMENT *segments;      /* sorted on base address, not overlapping */
+  unsigned numsegments;
+  unsigned maxsegments;
+  unsigned last;                /* segment of the most recent sample */
+  unsigned unknown;             /* samples outside all ranges */
+  unsigned total;               /* all samples, including the unknown ones */
+  SAMPLEBINSET binsets[SAMPLEMAP_BINSETS];
+};
+
+/** samplemap_create() allocates an empty sample map. Address ranges must
+ *  be added with samplemap_addrange() before samples can be collected.
+ *
+ *  \return A pointer to the new sample map, or NULL on a memory allocation
+ *          failure.
+ */
+SAMPLEMAP *samplemap_create(void)
+{
+  SAMPLEMAP *map = (SAMPLEMAP*)malloc(sizeof(SAMPLEMAP));
+  if (map != NULL)
+    memset(map, 0, sizeof(SAMPLEMAP));
+  return map;
+}
+
+static void samplemap_freepages(SAMPLESEGMENT *segment)
+{
+  assert(segment != NULL);
+  if (segment->pages != NULL) {
+    for (unsigned idx = 0; idx < segment->numpages; idx++)
+      if (segment->pages[idx] != NULL)
+        free((void*)segment->pages[idx]);
+    free((void*)segment->pages);
+    segment->pages = NULL;
+  }
+  for (int set = 0; set < SAMPLEMAP_BINSETS; set++) {
+    if (segment->firstbin[set] != NULL) {
+      free((void*)segment->firstbin[set]);
+      segment->firstbin[set] = NULL;
+    }
+  }
+}
+
+static void samplemap_freebins(SAMPLEMAP *map, int set)
+{
+  assert(map != NULL);
+  assert(set >= 0 && set < SAMPLEMAP_BINSETS);
+  for (unsigned idx = 0; idx < map->numsegments; idx++) {
+    if (map->segments[idx].firstbin[set] != NULL) {
+      free((void*)map->segments[idx].firstbin[set]);
+      map->segments[idx].firstbin[set] = NULL;
+    }
+  }
+  SAMPLEBINSET *binset = &map->binsets[set];
+  if (binset->bins != NULL)
+    free((void*)binset->bins);
+  if (binset->counts != NULL)
+    free((void*)binset->counts);
+  memset(binset, 0, sizeof(SAMPLEBINSET));
+}
+
+/* builds the jump table for a segment: for each page, the index of the first
+   bin that ends beyond the start of the page */
+static bool samplemap_jumptable(SAMPLEMAP *map, int set, SAMPLESEGMENT *segment)
+{
+  assert(map != NULL && segment != NULL);
+  assert(set >= 0 && set < SAMPLEMAP_BINSETS);
+  assert(segment->firstbin[set] == NULL);
+  unsigned *table = (unsigned*)malloc(segment->numpages * sizeof(unsigned));
+  if (table == NULL)
+    return false;
+  const SAMPLEBINSET *binset = &map->binsets[set];
+  unsigned bin = 0;
+  for (unsigned idx = 0; idx < segment->numpages; idx++) {
+    uint32_t address = Index2Address(idx * SAMPLEPAGE_SIZE, segment->base);
+    while (bin < binset->numbins && binset->bins[bin].high <= address)
+      bin++;
+    table[idx] = bin;
+  }
+  segment->firstbin[set] = table;
+  return true;
+}
+
+/* returns the index in the bin list for the address (at index "idx" in the
+   segment), or -1 if the address is not in any bin */
+static int samplemap_findbin(SAMPLEBINSET *binset, const SAMPLESEGMENT *segment, int set, unsigned idx, uint32_t address)
+{
+  assert(binset != NULL && binset->bins != NULL);
+  assert(segment != NULL && segment->firstbin[set] != NULL);
+  unsigned bin = binset->last;
+  if (bin < binset->numbins && binset->bins[bin].low <= address && address < binset->bins[bin].high)
+    return (int)bin;
+  /* the candidates run from the first bin of this page up to and including
+     the first bin of the next page (which may start inside this page) */
+  unsigned page = idx / SAMPLEPAGE_SIZE;
+  assert(page < segment->numpages);
+  unsigned low = segment->firstbin[set][page];
+  unsigned high = (page + 1 < segment->numpages) ? segment->firstbin[set][page + 1] + 1 : binset->numbins;
+  if (high > binset->numbins)
+    high = binset->numbins;
+  /* find the first bin that ends beyond the address */
+  while (low < high) {
+    unsigned mid = low + (high - low) / 2;
+    if (binset->bins[mid].high <= address)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low < binset->numbins && binset->bins[low].low <= address && address < binset->bins[low].high) {
+    binset->last = low;
+    return (int)low;
+  }
+  return -1;
+}
+
+/* adds the samples to the counters of the bins in all sets */
+static void samplemap_addbins(SAMPLEMAP *map, const SAMPLESEGMENT *segment, unsigned idx, uint32_t address, unsigned count)
+{
+  for (int set = 0; set < SAMPLEMAP_BINSETS; set++) {
+    SAMPLEBINSET *binset = &map->binsets[set];
+    if (binset->bins == NULL)
+      continue;
+    int bin = samplemap_findbin(binset, segment, set, idx, address);
+    if (bin >= 0)
+      binset->counts[binset->bins[bin].id] += count;
+    else
+      binset->unbinned += count;
+  }
+}
+
+/** samplemap_destroy() frees a sample map and all of its pages.
+ *
+ *  \param map      The sample map, may be NULL.
+ */
+void samplemap_destroy(SAMPLEMAP *map)
+{
+  if (map == NULL)
+    return;
+  for (int set = 0; set < SAMPLEMAP_BINSETS; set++)
+    samplemap_freebins(map, set);
+  for (unsigned idx = 0; idx < map->numsegments; idx++)
+    samplemap_freepages(&map->segments[idx]);
+  if (map->segments != NULL)
+    free((void*)map->segments);
+  free((void*)map);
+}
+
+/** samplemap_addrange() registers a code address range for the sample map.
+ *  Only the page directory is allocated; the pages with counters are
+ *  allocated on demand.
+ *
+ *  \param map      The sample map.
+ *  \param base     The low address of the range.
+ *  \param top      The address just beyond the range.
+ *
+ *  \return true on success, false on a memory allocation failure.
+ *
+ *  \note A range that overlaps (or touches) a range that was added earlier
+ *        is merged with it; the samples collected for that range so far are
+ *        dropped. Ranges should therefore be added before sampling starts.
+ */
+bool samplemap_addrange(SAMPLEMAP *map, uint32_t base, uint32_t top)
+{
+  assert(map != NULL);
+  if (top <= base)
+    return true;  /* nothing to add */
+
+  /* merge with any overlapping or adjacent ranges (these are consecutive,
+     because the segments are sorted) */
+  unsigned pos = 0;
+  while (pos < map->numsegments && map->segments[pos].top < base)
+    pos++;
+  unsigned end = pos;
+  while (end < map->numsegments && map->segments[end].base <= top) {
+    if (map->segments[end].base < base)
+      base = map->segments[end].base;
+    if (map->segments[end].top > top)
+      top = map->segments[end].top;
+    samplemap_freepages(&map->segments[end]);
+    end++;
+  }
+
+  unsigned count = ((top - base) / ADDRESS_ALIGN + SAMPLEPAGE_SIZE - 1) / SAMPLEPAGE_SIZE;
+  SAMPLEPAGE **pages = (SAMPLEPAGE**)calloc(count, sizeof(SAMPLEPAGE*));
+  if (pages == NULL) {
+    /* the merged ranges are gone, remove them from the table */
+    memmove(&map->segments[pos], &map->segments[end], (map->numsegments - end) * sizeof(SAMPLESEGMENT));
+    map->numsegments -= end - pos;
+    map->last = 0;
+    return false;
+  }
+
+  if (pos == end) {
+    /* no ranges were merged, insert a new segment */
+    if (map->numsegments >= map->maxsegments) {
+      unsigned newsize = map->maxsegments + SAMPLEMAP_GROW;
+      SAMPLESEGMENT *list = (SAMPLESEGMENT*)realloc(map->segments, newsize * sizeof(SAMPLESEGMENT));
+      if (list == NULL) {
+        free((void*)pages);
+        return false;
+      }
+      map->segments = list;
+      map->maxsegments = newsize;
+    }
+    memmove(&map->segments[pos + 1], &map->segments[pos], (map->numsegments - pos) * sizeof(SAMPLESEGMENT));
+    map->numsegments += 1;
+  } else if (end - pos > 1) {
+    /* several ranges were merged, collapse them into one */
+    memmove(&map->segments[pos + 1], &map->segments[end], (map->numsegments - end) * sizeof(SAMPLESEGMENT));
+    map->numsegments -= end - pos - 1;
+  }
+  map->segments[pos].base = base;
+  map->segments[pos].top = top;
+  map->segments[pos].numpages = count;
+  map->segments[pos].pages = pages;
+  memset(map->segments[pos].firstbin, 0, sizeof map->segments[pos].firstbin);
+  map->last = 0;
+  for (int set = 0; set < SAMPLEMAP_BINSETS; set++) {
+    if (map->binsets[set].bins != NULL && !samplemap_jumptable(map, set, &map->segments[pos])) {
+      samplemap_freebins(map, set);
+      return false;
+    }
+  }
+  return true;
+}
+
+/** samplemap_clear() resets all counters to zero. The pages that were
+ *  allocated are kept, as code that ran before is likely to run again.
+ *
+ *  \param map      The sample map, may be NULL.
+ */
+void samplemap_clear(SAMPLEMAP *map)
+{
+  if (map == NULL)
+    return;
+  for (unsigned seg = 0; seg < map->numsegments; seg++) {
+    SAMPLESEGMENT *segment = &map->segments[seg];
+    for (unsigned idx = 0; idx < segment->numpages; idx++) {
+      SAMPLEPAGE *page = segment->pages[idx];
+      if (page != NULL && page->total != 0)
+        memset(page, 0, sizeof(SAMPLEPAGE));
+    }
+  }
+  map->unknown = 0;
+  map->total = 0;
+  for (int set = 0; set < SAMPLEMAP_BINSETS; set++) {
+    SAMPLEBINSET *binset = &map->binsets[set];
+    if (binset->counts != NULL)
+      memset(binset->counts, 0, binset->numids * sizeof(unsigned));
+    binset->unbinned = 0;
+  }
+}
+
+/** samplemap_add() adds to the counter of an address. Addresses outside
+ *  all ranges are collected in a single "unknown" counter. If bins are set,
+ *  the counter of the bin that holds the address is incremented too (in
+ *  each set).
+ *
+ *  \param map      The sample map.
+ *  \param address  The code address.
+ *  \param count    The number to add to the counter.
+ */
+void samplemap_add(SAMPLEMAP *map, uint32_t address, unsigned count)
+{
+  assert(map != NULL);
+  map->total += count;
+  SAMPLESEGMENT *segment = NULL;
+  if (map->last < map->numsegments
+      && address >= map->segments[map->last].base && address < map->segments[map->last].top)
+  {
+    segment = &map->segments[map->last];
+  } else {
+    for (unsigned seg = 0; seg < map->numsegments; seg++) {
+      if (address >= map->segments[seg].base && address < map->segments[seg].top) {
+        segment = &map->segments[seg];
+        map->last = seg;
+        break;
+      }
+    }
+  }
+  if (segment == NULL) {
+    map->unknown += count;
+    return;
+  }
+
+  unsigned idx = Address2Index(address, segment->base);
+  SAMPLEPAGE *page = segment->pages[idx / SAMPLEPAGE_SIZE];
+  if (page == NULL) {
+    page = (SAMPLEPAGE*)calloc(1, sizeof(SAMPLEPAGE));
+    if (page == NULL) {
+      map->unknown += count;  /* out of memory, sample cannot be attributed */
+      return;
+    }
+    segment->pages[idx / SAMPLEPAGE_SIZE] = page;
+  }
+  page->counts[idx % SAMPLEPAGE_SIZE] += count;
+  page->total += count;
+  samplemap_addbins(map, segment, idx, address, count);
+}
+
+/** samplemap_unknown() returns the number of samples that fell outside all
+ *  address ranges.
+ */
+unsigned samplemap_unknown(const SAMPLEMAP *map)
+{
+  return (map != NULL) ? map->unknown : 0;
+}
+
+/** samplemap_total() returns the number of samples in the map, including
+ *  the samples that fell outside all address ranges.
+ */
+unsigned samplemap_total(const SAMPLEMAP *map)
+{
+  return (map != NULL) ? map->total : 0;
+}
+
+/** samplemap_setbins() sets the address ranges whose sample counts are
+ *  kept up to date while samples are added. The counts for the samples that
+ *  are already in the map are computed on this call (once).
+ *
+ *  \param map      The sample map.
+ *  \param set      The set of bins, 0 to SAMPLEMAP_BINSETS - 1.
+ *  \param bins     The list of address ranges, sorted on address and not
+ *                  overlapping. Several ranges may share the same id. This
+ *                  parameter may be NULL to remove the bins.
+ *  \param count    The number of entries in the list.
+ *  \param numids   The number of counters; all ids in the list must be below
+ *                  this value.
+ *
+ *  \return true on success, false on a memory allocation failure (in which
+ *          case no bins are set).
+ */
+bool samplemap_setbins(SAMPLEMAP *map, int set, const SAMPLEBIN *bins, unsigned count, unsigned numids)
+{
+  assert(map != NULL);
+  assert(set >= 0 && set < SAMPLEMAP_BINSETS);
+  samplemap_freebins(map, set);
+  if (bins == NULL || count == 0 || numids == 0)
+    return true;
+
+  SAMPLEBINSET *binset = &map->binsets[set];
+  binset->bins = (SAMPLEBIN*)malloc(count * sizeof(SAMPLEBIN));
+  binset->counts = (unsigned*)calloc(numids, sizeof(unsigned));
+  if (binset->bins == NULL || binset->counts == NULL) {
+    samplemap_freebins(map, set);
+    return false;
+  }
+  memcpy(binset->bins, bins, count * sizeof(SAMPLEBIN));
+  binset->numbins = count;
+  binset->numids = numids;
+  for (unsigned idx = 0; idx < count; idx++) {
+    assert(bins[idx].id < numids);
+    assert(bins[idx].low < bins[idx].high);
+    assert(idx == 0 || bins[idx - 1].high <= bins[idx].low);
+  }
+  for (unsigned seg = 0; seg < map->numsegments; seg++) {
+    if (!samplemap_jumptable(map, set, &map->segments[seg])) {
+      samplemap_freebins(map, set);
+      return false;
+    }
+  }
+
+  /* attribute the samples collected so far */
+  for (unsigned seg = 0; seg < map->numsegments; seg++) {
+    SAMPLESEGMENT *segment = &map->segments[seg];
+    for (unsigned pg = 0; pg < segment->numpages; pg++) {
+      const SAMPLEPAGE *page = segment->pages[pg];
+      if (page == NULL || page->total == 0)
+        continue;
+      for (unsigned slot = 0; slot < SAMPLEPAGE_SIZE; slot++) {
+        if (page->counts[slot] == 0)
+          continue;
+        unsigned idx = pg * SAMPLEPAGE_SIZE + slot;
+        int bin = samplemap_findbin(binset, segment, set, idx, Index2Address(idx, segment->base));
+        if (bin >= 0)
+          binset->counts[binset->bins[bin].id] += page->counts[slot];
+        else
+          binset->unbinned += page->counts[slot];
+      }
+    }
+  }
+  return true;
+}
+
+/** samplemap_bincounts() returns the counters of the bins in a set.
+ *
+ *  \param map      The sample map.
+ *  \param set      The set of bins, 0 to SAMPLEMAP_BINSETS - 1.
+ *  \param unbinned [out] The number of samples that fell inside the address
+ *                  ranges of the map, but outside all bins. This parameter
+ *                  may be NULL.
+ *
+ *  \return A pointer to the array with counters (indexed on the bin id), or
+ *          NULL if no bins are set.
+ */
+const unsigned *samplemap_bincounts(const SAMPLEMAP *map, int set, unsigned *unbinned)
+{
+  assert(set >= 0 && set < SAMPLEMAP_BINSETS);
+  if (unbinned != NULL)
+    *unbinned = (map != NULL) ? map->binsets[set].unbinned : 0;
+  return (map != NULL) ? map->binsets[set].counts : NULL;
+}
+
+/** samplemap_next() returns the next address with a non-zero count, in
+ *  ascending address order. Empty pages are skipped.
+ *
+ *  \param map      The sample map.
+ *  \param iter     The iterator; it must be cleared to zero before the first
+ *                  call.
+ *  \param address  [out] The code address.
+ *  \param count    [out] The number of samples at that address.
+ *
+ *  \return true if an address was found, false at the end of the map.
+ */
+bool samplemap_next(const SAMPLEMAP *map, SAMPLEITER *iter, uint32_t *address, unsigned *count)
+{
+  assert(iter != NULL);
+  assert(address != NULL && count != NULL);
+  if (map == NULL)
+    return false;
+  while (iter->segment < map->numsegments) {
+    const SAMPLESEGMENT *segment = &map->segments[iter->segment];
+    while (iter->index / SAMPLEPAGE_SIZE < segment->numpages) {
+      const SAMPLEPAGE *page = segment->pages[iter->index / SAMPLEPAGE_SIZE];
+      if (page == NULL || page->total == 0) {
+        iter->index = (iter->index / SAMPLEPAGE_SIZE + 1) * SAMPLEPAGE_SIZE;
+        continue;
+      }
+      unsigned slot = iter->index % SAMPLEPAGE_SIZE;
+      iter->index += 1;
+      if (page->counts[slot] != 0) {
+        *address = Index2Address(iter->index - 1, segment->base);
+        *count = page->counts[slot];
+        return true;
+      }
+    }
+    iter->segment += 1;
+    iter->index = 0;
+  }
+  return false;
+}
+
+typedef struct tagITMPROFILECTX {
+  SAMPLEMAP *map;
+  int samples;
+  unsigned overflows;
+} ITMPROFILECTX;
+
+static bool traceprofile_itmpacket(const ITMPACKET *packet, void *arg)
+{
+  ITMPROFILECTX *ctx = (ITMPROFILECTX*)arg;
+  assert(ctx != NULL);
+  if (packet->type == ITMPKT_PCSAMPLE && packet->size == 4) {
+    samplemap_add(ctx->map, (uint32_t)packet->value, 1);
+    ctx->samples += 1;
+  } else if (packet->type == ITMPKT_OVERFLOW) {
+    ctx->overflows += 1;
+  }
+  return true;  /* other packets (including sleep samples) are ignored */
+}
+
+int traceprofile_process(bool enabled, SAMPLEMAP *map, unsigned *overflow)
+{
+  ITMPROFILECTX ctx = { map, 0, 0 };
+  TRACEPROBE *probe = trace_probe(0);
+  if (probe->queue.buffer == NULL)
+    return 0;
+  const PACKET *pkt;
+  size_t mark = tracequeue_mark(&probe->queue);
+  while ((pkt = tracequeue_peek(&probe->queue, mark)) != NULL) {
+    record_packet(pkt);
+    if (enabled && map != NULL)
+      itm_decode(&probe->decoder, PKT_DATA(pkt), pkt->length, pkt->timestamp, traceprofile_itmpacket, &ctx);
+    tracequeue_pop(&probe->queue, pkt);
+  }
+
+  if (overflow != NULL)
+    *overflow = ctx.overflows;
+  return ctx.samples;
+}
+
+/** trace_readraw() takes the next packet from the queue of the primary probe,
+ *  without decoding it. This is for an application that passes the raw SWO
+ *  data on, such as a TCP server that stands in for a network probe.
+ *
+ *  \param buffer    The buffer for the packet data.
+ *  \param size      The size of the buffer in bytes; a larger packet is
+ *                    truncated.
+ *  \param timestamp [out] The host timestamp of the packet, may be NULL.
+ *
+ *  \return The number of bytes stored in the buffer, or 0 if the queue is
+ *          empty.
+ *
+ *  \note This function cannot be combined with decoding (neither the decoder
+ *        thread, nor tracestring_process() or traceprofile_process()).
+ */
+size_t trace_readraw(unsigned char *buffer, size_t size, double *timestamp)
+{
+  assert(buffer != NULL);
+  TRACEPROBE *probe = trace_probe(0);
+  if (probe->queue.buffer == NULL)
+    return 0;
+  const PACKET *pkt = tracequeue_peek(&probe->queue, tracequeue_mark(&probe->queue));
+  if (pkt == NULL)
+    return 0;
+  size_t length = (pkt->length < size) ? pkt->length : size;
+  memcpy(buffer, PKT_DATA(pkt), length);
+  if (timestamp != NULL)
+    *timestamp = pkt->timestamp;
+  tracequeue_pop(&probe->queue, pkt);
+  return length;
+}
+
+static int capture_transfers = 8;         /* number of outstanding USB transfers */
+static size_t capture_xfersize = 4096;    /* size of each USB transfer, in bytes */
+static size_t capture_reqsize = 4096;     /* transfer size set with trace_setcapture() */
+
+/* limits the transfer size, so that the data of a complete transfer always
+   fits in the packet queue (see tracequeue_hasroom()) */
+static void capture_clampsize(void)
+{
+  size_t xfersize = capture_reqsize;
+  if (xfersize > tracequeue_size / 8)
+    xfersize = tracequeue_size / 8;
+  capture_xfersize = xfersize;
+}
+
+/** trace_setcapture() sets the parameters for USB capture. The settings take
+ *  effect on the next call to trace_init().
+ *
+ *  \param transfers  The number of USB transfers that are kept outstanding
+ *                    (Linux only; on Microsoft Windows, reads are synchronous).
+ *  \param xfersize   The buffer size for each transfer, in bytes. This value
+ *                    is rounded up to a multiple of the USB packet size.
+ *
+ *  \note The transfer size is limited to 1/8 of the queue size; this limit is
+ *        re-applied when the queue size is changed with trace_setqueuesize().
+ */
+void trace_setcapture(int transfers, size_t xfersize)
+{
+  if (transfers < 1)
+    transfers = 1;
+  else if (transfers > 64)
+    transfers = 64;
+  capture_transfers = transfers;
+  xfersize = ((xfersize + PACKET_SIZE - 1) / PACKET_SIZE) * PACKET_SIZE;
+  if (xfersize < PACKET_SIZE)
+    xfersize = PACKET_SIZE;
+  capture_reqsize = xfersize;
+  capture_clampsize();
+}
+
+/* The loopback stand-in replays trace data from a file through the packet
+   queue (as if it came from the probe), for testing and benchmarking without
+   a debug probe. The file is either a recording (see trace_recordstart()), or
+   a file with raw SWO data. The file is memory-mapped, so that replay is not
+   limited by file I/O. Alternatively, the data is read from standard input.
+   Each capture context can replay a file, so that the merging of the data of
+   several probes can be tested without hardware too. */
+static void loopback_unmap(TRACEPROBE *probe)
+{
+  if (probe->loopback_data != NULL) {
+    file_unmap(probe->loopback_data, probe->loopback_size);
+    probe->loopback_data = NULL;
+    probe->loopback_size = 0;
+  }
+}
+
+static void loopback_delay(double delay)
+{
+  if (delay > 0.001) {
+    struct timespec ts = { (time_t)delay, (long)((delay - (time_t)delay) * 1e9) };
+    thrd_sleep(&ts, NULL);
+  }
+}
+
+static int loopback_read(void *arg)
+{
+  TRACEPROBE *probe = (TRACEPROBE*)arg;
+  size_t pos = 0;
+  unsigned long long total = 0;
+  double starttime = get_timestamp();
+  while (probe->loopback_active) {
+    size_t chunk = capture_xfersize;
+    if (chunk > probe->loopback_size - pos)
+      chunk = probe->loopback_size - pos;
+    if (probe->loopback_rate > 0) {
+      /* wait until the data would have arrived at the configured bitrate */
+      loopback_delay(starttime + (double)total / probe->loopback_rate - get_timestamp());
+      tracequeue_push(&probe->queue, probe->loopback_data + pos, chunk, get_timestamp());
+    } else {
+      /* at full speed, the decoder sets the pace: wait for space in the queue
+         rather than dropping packets */
+      while (probe->loopback_active && !tracequeue_hasroom(&probe->queue, chunk))
+        thrd_yield();
+      tracequeue_push(&probe->queue, probe->loopback_data + pos, chunk, get_timestamp());
+    }
+    total += chunk;
+    pos += chunk;
+    if (pos >= probe->loopback_size) {
+      if (!probe->loopback_repeat)
+        break;
+      pos = 0;                      /* loop back to the start of the data */
+    }
+  }
+  probe->loopback_done = 1;
+  return 0;
+}
+
+/** loopback_applyinfo() takes the settings of a recording for the timing:
+ *  the host timestamps in a recording are those of the recording session, so
+ *  the wall clock offset and the bitrate (for interpolation) must match that
+ *  session too. The settings are restored when the loopback is closed.
+ */
+static void loopback_applyinfo(TRACEPROBE *probe, const TRACERECORDING *info)
+{
+  if (probe == trace_probes)
+    wall_offset = info->walloffset;
+  if (info->bitrate > 0)
+    probe->decoder.bytetime = 10.0 / info->bitrate;
+}
+
+/** loopback_replay() is the thread function for replaying a recording. The
+ *  packets keep the timestamps with which they were recorded. The recording
+ *  is replayed once; the thread then exits, but the trace channel stays open.
+ */
+static int loopback_replay(void *arg)
+{
+  TRACEPROBE *probe = (TRACEPROBE*)arg;
+  size_t pos = (size_t)rec_getle(probe->loopback_data + 10, 2);
+  double starttime = get_timestamp();
+  double basetime = -1.0;
+  while (probe->loopback_active && pos + REC_PKTHDRSIZE <= probe->loopback_size) {
+    size_t length = (size_t)rec_getle(probe->loopback_data + pos, 4);
+    double timestamp = rec_getdouble(probe->loopback_data + pos + 8);
+    pos += REC_PKTHDRSIZE;
+    if (length == 0 || length > probe->loopback_size - pos)
+      break;                        /* invalid record or truncated file */
+    if (PKT_ALIGN(sizeof(PACKET) + length) > probe->queue.size / 2) {
+      pos += length;                /* packet does not fit in the queue, skip it */
+      continue;
+    }
+    if (probe->loopback_realtime) {
+      /* wait until the packet is due, relative to the first packet */
+      if (basetime < 0)
+        basetime = timestamp;
+      loopback_delay(starttime + (timestamp - basetime) - get_timestamp());
+      tracequeue_push(&probe->queue, probe->loopback_data + pos, length, timestamp);
+    } else {
+      while (probe->loopback_active && !tracequeue_hasroom(&probe->queue, length))
+        thrd_yield();
+      tracequeue_push(&probe->queue, probe->loopback_data + pos, length, timestamp);
+    }
+    pos += length;
+  }
+  probe->loopback_done = 1;
+  return 0;
 }
 
-/** tracestring_findbookmark() finds the next or previous bookmark.
- *
- *  \param action   BK_NEXT to move to the next bookmark; BK_PREV to move to
- *                  the previous bookmark; BK_CLEAR to remove the active
- *                  bookmark.
- *
- *  \return A line number for the next/prevous bookmark (which is now set
- *          active), or 1 if no bookmark could be set active.
+/** stream_read() reads from standard input. If "complete" is false, it
+ *  returns as soon as any data is available (so that data from a live source
+ *  is not held back); otherwise it waits until the buffer is filled.
  *
- *  \note The next/previous bookmark step wraps around from the end to the
- *        beginning (and vice versa).
+ *  \return The number of bytes read; this is less than requested only at the
+ *          end of the input.
  */
-int tracestring_findbookmark(int action)
+static size_t stream_read(unsigned char *buffer, size_t size, bool complete)
 {
-  int prevmark = -1, nextmark = -1, firstmark = -1, lastmark = -1;
-  bool pastactive = false;
-  int line = 0;
-  for (TRACESTRING *item = tracestring_root.next; item != NULL; item = item->next) {
-    if ((item->flags & TSFLAG_BOOKMARK) != 0) {
-      if (pastactive && nextmark < 0)
-        nextmark = line;  /* update next mark when past the active mark and next mark not yet set */
-      if ((item->flags & TSFLAG_ACTIVEMARK) != 0) {
-        pastactive = true;
-        item->flags &= ~TSFLAG_ACTIVEMARK;  /* clear active mark */
-      }
-      if (!pastactive)
-        prevmark = line;  /* update prev. mark up to (but not including) the active mark */
-      if (firstmark < 0)
-        firstmark = line; /* update firstmark only the first time */
-      lastmark = line;    /* always update last mark */
-    }
-    line += 1;
+  size_t total = 0;
+  while (total < size) {
+#   if defined WIN32 || defined _WIN32
+      int count = _read(_fileno(stdin), buffer + total, (unsigned)(size - total));
+#   else
+      ssize_t count = read(STDIN_FILENO, buffer + total, size - total);
+      if (count < 0 && errno == EINTR)
+        continue;
+#   endif
+    if (count <= 0)
+      break;
+    total += count;
+    if (!complete)
+      break;
   }
+  return total;
+}
 
-  int result = -1;
-  if (action == BK_NEXT)
-    result = (nextmark >= 0) ? nextmark : firstmark;  /* if next mark not set, wrap around to first mark */
-  else if (action == BK_PREV)
-    result = (prevmark >= 0) ? prevmark : lastmark;   /* if prev. mark not set, wrap around to last mark */
-
-  if (result >= 0) {
-    line = 0;
-    for (TRACESTRING *item = tracestring_root.next; item != NULL; item = item->next) {
-      if (line == result) {
-        item->flags |= TSFLAG_ACTIVEMARK;   /* set active mark */
-        break;  /* done, no use in moving further */
-      }
-      line += 1;
-    }
+/* The thread that reads standard input may be blocked on a read when the
+   capture context is closed, so it cannot be joined; it is detached instead.
+   It then only touches its own state: the capture context is unlinked from
+   that state (under its lock), so that the thread can no longer push into the
+   queue of the context (which may be reopened meanwhile). The state is freed
+   by whichever of the two releases it last. */
+typedef struct tagSTREAMREADER {
+  TRACEPROBE *probe;            /* NULL when the capture context was closed */
+  size_t queuesize;             /* size of the packet queue of the context */
+  mtx_t lock;
+  int refcount;                 /* the capture context and the thread each hold a reference */
+} STREAMREADER;
+
+static void stream_release(STREAMREADER *reader)
+{
+  mtx_lock(&reader->lock);
+  int refcount = --reader->refcount;
+  mtx_unlock(&reader->lock);
+  if (refcount == 0) {
+    mtx_destroy(&reader->lock);
+    free((void*)reader);
   }
+}
 
-  return result;
+/* flags the end of the data and drops the reference of the thread */
+static void stream_done(STREAMREADER *reader)
+{
+  mtx_lock(&reader->lock);
+  if (reader->probe != NULL)
+    reader->probe->loopback_done = 1;
+  mtx_unlock(&reader->lock);
+  stream_release(reader);
 }
 
-static char *getfield(char **base)
+/* waits for room in the queue and pushes the data; returns false if the
+   capture context was closed */
+static bool stream_push(STREAMREADER *reader, const unsigned char *data, size_t length, double timestamp)
 {
-  assert(base != NULL && *base != NULL);
-  char *start = *base;
-  while (*start != '\0' && *start <= ' ')
-    start++;            /* skip white space */
-  if (*start == '\0')
-    return NULL;
+  for ( ;; ) {
+    mtx_lock(&reader->lock);
+    TRACEPROBE *probe = reader->probe;
+    bool pushed = (probe != NULL && tracequeue_hasroom(&probe->queue, length));
+    if (pushed)
+      tracequeue_push(&probe->queue, data, length, timestamp);
+    mtx_unlock(&reader->lock);
+    if (probe == NULL)
+      return false;
+    if (pushed)
+      return true;
+    thrd_yield();
+  }
+}
 
-  char *tail = start;
-  if (*tail == '"') {
-    /* skip string, and possibly reduce doubled quotes */
-    start++;            /* skip initial '"' */
-    tail++;
-    char *tgt = tail;
-    while (*tail != '\0' && (*tail != '"' || *(tail + 1) == '"')) {
-      if (*tail == '"')
-        tail++;
-      if (tgt != tail)
-        *tgt = *tail;   /* move up characters, if doubled double-quotes were found */
-      tail++;
-      tgt++;
+/** loopback_stream() is the thread function for reading trace data from
+ *  standard input. The data may be a recording or raw SWO data; either way,
+ *  it is passed on as fast as the decoder can handle.
+ */
+static int loopback_stream(void *arg)
+{
+  STREAMREADER *reader = (STREAMREADER*)arg;
+  size_t bufsize = capture_xfersize;
+  assert(bufsize >= REC_HDRSIZE);
+  unsigned char *buffer = malloc(bufsize);
+  if (buffer == NULL) {
+    stream_done(reader);
+    return 0;
+  }
+  size_t count = stream_read(buffer, REC_HDRMIN, true);
+  if (rec_parseheader(buffer, count, NULL)) {
+    /* read the remainder of the header, but skip any extra fields (of a
+       later version) */
+    size_t hdrsize = (size_t)rec_getle(buffer + 10, 2);
+    size_t extra = ((hdrsize < REC_HDRSIZE) ? hdrsize : REC_HDRSIZE) - REC_HDRMIN;
+    count += stream_read(buffer + count, extra, true);
+    TRACERECORDING info;
+    rec_parseheader(buffer, count, &info);
+    mtx_lock(&reader->lock);
+    if (reader->probe != NULL)
+      loopback_applyinfo(reader->probe, &info);
+    mtx_unlock(&reader->lock);
+    size_t skip = hdrsize;
+    while (skip > count && stream_read(buffer + count, 1, true) == 1)
+      skip--;
+    unsigned char header[REC_PKTHDRSIZE];
+    while (stream_read(header, REC_PKTHDRSIZE, true) == REC_PKTHDRSIZE) {
+      size_t length = (size_t)rec_getle(header, 4);
+      if (length == 0 || PKT_ALIGN(sizeof(PACKET) + length) > reader->queuesize / 2)
+        break;                      /* invalid record (or it does not fit in the queue) */
+      if (length > bufsize) {
+        unsigned char *newbuf = realloc(buffer, length);
+        if (newbuf == NULL)
+          break;
+        buffer = newbuf;
+        bufsize = length;
+      }
+      if (stream_read(buffer, length, true) != length)
+        break;                      /* truncated */
+      if (!stream_push(reader, buffer, length, rec_getdouble(header + 8)))
+        break;                      /* capture context was closed */
     }
-    *tgt = '\0';
-    if (tail == tgt || *tail == '"')  /* if tail == tgt -> '"' was just overwritten by '\0' */
-      tail++;
-    while (*tail != '\0' && *tail != ',')
-      tail++;           /* ignore any text beyond the string, until the field separator */
-    if (*tail == ',')
-      tail++;           /* skip the field separator too */
   } else {
-    while (*tail != '\0' && *tail != ',')
-      tail++;
-    char *sentinel = tail;
-    if (*tail == ',')
-      tail++;           /* skip the field separator */
-    while (sentinel > start && *(sentinel - 1) <= ' ')
-      sentinel--;       /* back up to just behind the last last letter/digit (non-white space) */
-    *sentinel = '\0';   /* zero terminate behind the end of the word */
+    bool active = (count == 0 || stream_push(reader, buffer, count, get_timestamp()));
+    while (active && (count = stream_read(buffer, bufsize, false)) > 0)
+      active = stream_push(reader, buffer, count, get_timestamp());
   }
+  free(buffer);
+  stream_done(reader);
+  return 0;
+}
 
-  *base = tail;
-
-  return start;
+static void loopback_close(TRACEPROBE *probe)
+{
+  if (probe->loopback_active) {
+    probe->loopback_active = 0;
+    if (probe->loopback_stdin) {
+      /* the thread may be blocked on input, it quits on the next read; unlink
+         it from this context first */
+      STREAMREADER *reader = probe->loopback_reader;
+      assert(reader != NULL);
+      mtx_lock(&reader->lock);
+      reader->probe = NULL;
+      mtx_unlock(&reader->lock);
+      thrd_detach(probe->loopback_thread);
+      stream_release(reader);
+      probe->loopback_reader = NULL;
+    } else {
+      thrd_join(probe->loopback_thread, NULL);
+    }
+  }
+  loopback_unmap(probe);
+  probe->loopback_done = 0;
+  probe->loopback_stdin = false;
+  if (probe == trace_probes)
+    wall_offset = 0.0;
+  probe->decoder.bytetime = (itm_bitrate > 0) ? 10.0 / itm_bitrate : 0.0;
 }
 
-/** tracestring_load() loads trace data from a file. It supports data saved
- *  by BMTrace and BMDebug (SWO view), as well as from the BMDebug serial
- *  monitor with CTF decoding.
+/** trace_initprobeloopback() opens a "loopback" trace channel, which replays
+ *  trace data from a file, instead of capturing it from a debug probe.
  *
- *  \param filename   The full path to the file to load.
- *  \param format     [out] Set to 0 for SWO trace format, or 1 for CTF decoded
- *                    (from the serial monitor). This parameter may be NULL.
+ *  \param index      The index of the capture context, 0 for the primary
+ *                    probe.
+ *  \param filename   The file with the trace data. This is either a recording
+ *                    (see trace_recordstart()), or a file with raw SWO data
+ *                    (ITM packets). If the filename is "-", the data is read
+ *                    from standard input.
+ *  \param bitrate    For a file with raw SWO data, the bitrate at which to
+ *                    replay the data. For a recording, any non-zero value
+ *                    replays it with the recorded timing. Set to 0 to replay
+ *                    as fast as the decoder can handle. This parameter is
+ *                    ignored for standard input.
+ *  \param repeat     Whether to replay raw SWO data endlessly; a recording is
+ *                    always replayed once.
  *
- *  \return The number of lines loaded from the file, or zero on error.
+ *  \return TRACESTAT_OK on success, or an error code on failure.
+ *
+ *  \note Raw SWO data is split in blocks of the configured USB transfer size.
+ *        A recording is replayed in the packets as they were recorded.
  */
-int tracestring_load(const char *filename, int *format)
+int trace_initprobeloopback(int index, const char *filename, unsigned long bitrate, bool repeat)
 {
-  if (format != NULL)
-    *format = 0;
+  assert(filename != NULL);
+  if (index < 0 || index >= MAX_PROBES)
+    return TRACESTAT_NO_INTERFACE;
+  trace_closeprobe(index);
+  TRACEPROBE *probe = trace_probe(index);
+
+  if (strcmp(filename, "-") == 0) {
+    if (!tracequeue_alloc(&probe->queue))
+      return TRACESTAT_NO_MEMORY;
+#   if defined WIN32 || defined _WIN32
+      _setmode(_fileno(stdin), _O_BINARY);
+#   endif
+    STREAMREADER *reader = (STREAMREADER*)malloc(sizeof(STREAMREADER));
+    if (reader == NULL)
+      return TRACESTAT_NO_MEMORY;
+    if (mtx_init(&reader->lock, mtx_plain) != thrd_success) {
+      free((void*)reader);
+      return TRACESTAT_NO_THREAD;
+    }
+    reader->probe = probe;
+    reader->queuesize = probe->queue.size;
+    reader->refcount = 2;
+    probe->loopback_reader = reader;
+    probe->loopback_stdin = true;
+    probe->loopback_active = 1;
+    if (thrd_create(&probe->loopback_thread, loopback_stream, reader) != thrd_success) {
+      mtx_destroy(&reader->lock);
+      free((void*)reader);
+      probe->loopback_reader = NULL;
+      probe->loopback_active = 0;
+      loopback_close(probe);
+      return TRACESTAT_NO_THREAD;
+    }
+    trace_updatemerging();
+    return TRACESTAT_OK;
+  }
 
-  FILE *fp = fopen(filename, "rt");
+  FILE *fp = fopen(filename, "rb");
   if (fp == NULL)
-    return 0;
-
-  size_t bufsize = 65536; /* arbitrarily set max. line size to 64 KiB */
-  char *buffer = malloc((bufsize + 1) * sizeof(char));
-  if (buffer == NULL) {
-    fclose(fp);
-    return 0;
-  }
+    return TRACESTAT_NO_DEVPATH;
+  fclose(fp);
+  TRACERECORDING info;
+  bool recording = trace_recordinfo(filename, &info);
+  probe->loopback_data = file_map(filename, &probe->loopback_size, true);
+  if (probe->loopback_data == NULL)
+    return TRACESTAT_NO_ACCESS;
 
-  /* check header line */
-  if (fgets(buffer, bufsize, fp) == NULL) {
-    fclose(fp);
-    free(buffer);
-    return 0;
+  if (!tracequeue_alloc(&probe->queue)) {
+    loopback_close(probe);
+    return TRACESTAT_NO_MEMORY;
   }
-  int fmt = 0;
-  bool ok = true;
-  char *base = buffer;
-  char *ptr = getfield(&base);
-  if (ptr == NULL || (strcmp(ptr, "Channel") != 0 && strcmp(ptr, "ID") != 0))
-    ok = false;
-  else if (strcmp(ptr, "ID") == 0)
-    fmt = 1;        /* this file is saved from the serial monitor */
-  if ((ptr = getfield(&base)) == NULL || (fmt == 0 && strcmp(ptr, "Name") != 0) || (fmt == 1 && strcmp(ptr, "Stream") != 0))
-    ok = false;
-  if ((ptr = getfield(&base)) == NULL || strcmp(ptr, "Severity") != 0)
-    ok = false;
-  if ((ptr = getfield(&base)) == NULL || strcmp(ptr, "Timestamp") != 0)
-    ok = false;
-  if ((ptr = getfield(&base)) == NULL || strcmp(ptr, "Text") != 0)
-    ok = false;
-  if (!ok || *base != '\0') {
-    fclose(fp);
-    free(buffer);
-    return 0;
+  probe->loopback_rate = bitrate / 10; /* 8 data bits, plus start and stop bits */
+  probe->loopback_realtime = (bitrate > 0);
+  probe->loopback_repeat = repeat;
+  if (recording)
+    loopback_applyinfo(probe, &info);
+  probe->loopback_active = 1;
+  if (thrd_create(&probe->loopback_thread, recording ? loopback_replay : loopback_read, probe) != thrd_success) {
+    probe->loopback_active = 0;
+    loopback_close(probe);
+    return TRACESTAT_NO_THREAD;
   }
-  if (format != NULL)
-    *format = fmt;
+  trace_updatemerging();
+  return TRACESTAT_OK;
+}
 
-  /* read the rest of the data */
-  TRACESTRING *tracestring_tail = NULL;
-  int count = 0;
-  while (fgets(buffer, bufsize, fp) != NULL) {
-    TRACESTRING *item = malloc(sizeof(TRACESTRING));
-    if (item != NULL) {
-      memset(item, 0, sizeof(TRACESTRING));
-      base = buffer;
-      if ((ptr = getfield(&base)) != NULL)
-        item->channel_id = (unsigned char)strtol(ptr, NULL, 10);
-      if ((ptr = getfield(&base)) != NULL)
-        item->channelname = strdup(ptr);
-      if ((ptr = getfield(&base)) != NULL) {
-        int level = ctf_severity_level(ptr);
-        item->severity = (level >= 0) ? (unsigned char)level : 1;
-      }
-      if ((ptr = getfield(&base)) != NULL)
-        item->timestamp = strtod(ptr, NULL);
-      if ((ptr = getfield(&base)) != NULL)
-        item->text = strdup(ptr);
-      if (item->text != NULL) {
-        item->length = (unsigned short)strlen(item->text);
-        item->size = item->length + 1;
-        item->flags = TSFLAG_EOL;
-        /* create formatted timestamp */
-        snprintf(item->timefmt, sizearray(item->timefmt), "%.3f", item->timestamp);
-        item->timefmt_len = (unsigned short)strlen(item->timefmt);
-        /* read optional bookmark */
-        if ((ptr = getfield(&base)) != NULL && *ptr == '#')
-          item->flags |= TSFLAG_BOOKMARK;
-        /* append to tail */
-        if (tracestring_tail != NULL) {
-          tracestring_tail->next = item;
-        } else {
-          assert(tracestring_root.next == NULL);  /* this must then be the first string */
-          tracestring_root.next = item;
-        }
-        tracestring_tail = item;
-        count++;
-      } else {
-        free((void*)item);
-      }
+/** trace_initloopback() opens a "loopback" trace channel for the primary
+ *  probe; see trace_initprobeloopback().
+ */
+int trace_initloopback(const char *filename, unsigned long bitrate, bool repeat)
+{
+  return trace_initprobeloopback(0, filename, bitrate, repeat);
+}
+
+/** trace_endofdata() returns whether all data of a loopback channel has been
+ *  handled: the end of a recording (or of standard input) was reached, the
+ *  packet queue is empty and no decoded data is held back. It always returns
+ *  false for a debug probe. When several probes are open, all of these must
+ *  have reached the end.
+ */
+bool trace_endofdata(void)
+{
+  bool found = false;
+  for (int idx = 0; idx < MAX_PROBES; idx++) {
+    TRACEPROBE *probe = trace_probe(idx);
+    if (probe_isopen(probe)) {
+      if (!probe->loopback_active || !probe->loopback_done || !tracequeue_isempty(&probe->queue)
+          || probe->runcount > 0)
+        return false;
+      found = true;
     }
   }
-
-  fclose(fp);
-  free(buffer);
-  return count;
+  return found;
 }
 
-/** tracestring_save() saves the data in a file, in CSV format.
- *
- *  \param filename   The full path to the file to create.
+/* Network probes: a ctxLink probe, or any source that serves raw SWO data
+   on a TCP port. The socket is non-blocking; the reader waits for data with
+   poll() (select() on Windows) and then drains the socket, so that the small
+   TCP segments are coalesced into large queue entries. An entry is pushed
+   when it is full, when no more data arrives for a moment, or when its oldest
+   data is held too long. A dropped connection is re-established, with an
+   increasing delay between the attempts.
+   A capture daemon (see swodecode -p) sends the packets in the format of a
+   recording instead: a header, followed by the packets, each with its length
+   and host timestamp. These packets are queued as they are, with the
+   timestamps that the daemon assigned (the daemon runs on the same host, so
+   these are from the same clock). */
+#define NET_RCVBUF      (1024 * 1024) /* requested socket receive buffer */
+#define NET_BLOCKSIZE   (64 * 1024)   /* max. size of a queue entry */
+#define NET_IDLETIME    1             /* ms, push the data when no more arrives in this time */
+#define NET_MAXHOLD     0.01          /* s, max. time that data is held for coalescing */
+#define NET_POLLTIME    100           /* ms, max. wait (to check for a close request) */
+#define NET_TIMEOUT     2000          /* ms, connection timeout */
+#define NET_RETRY_MIN   0.1           /* s, delay before the first reconnection attempt */
+#define NET_RETRY_MAX   2.0           /* s, max. delay between reconnection attempts */
+
+#if (defined WIN32 || defined _WIN32) && !defined NO_GUI
+# define gui_wakeup()   PostMessage((HWND)guidriver_apphandle(), WM_USER, 0, 0L) /* just a flag to wake up the GUI */
+#else
+# define gui_wakeup()   ((void)0)
+#endif
+
+/** net_connect() creates a socket and connects it to the probe. The socket is
+ *  in non-blocking mode on return.
  *
- *  \return The number of lines written to the file, or zero on error.
+ *  \return The socket, or INVALID_SOCKET on failure.
  */
-int tracestring_save(const char *filename)
+static SOCKET net_connect(const char *ipaddress, unsigned short port)
 {
-  FILE *fp = fopen(filename, "wt");
-  if (fp == NULL)
-    return 0;
-
-  size_t bufsize = 0;
-  TRACESTRING *item = tracestring_root.next;
-  double starttime = (item != NULL) ? item->timestamp : 0.0;
-  for (item = tracestring_root.next; item != NULL; item = item->next)
-    if (item->length > bufsize)
-      bufsize = item->length;
-
-  char *buffer = malloc((bufsize + 1) * sizeof(char));
-  if (buffer == NULL) {
-    fclose(fp);
-    return 0;
+  SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET)
+    return INVALID_SOCKET;
+  /* the receive buffer must be set before connecting, for the TCP window
+     scaling to take it into account */
+  int size = NET_RCVBUF;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+  if (connect_timeout(sock, ipaddress, (short)port, NET_TIMEOUT) != 0) {
+    closesocket(sock);
+    return INVALID_SOCKET;
   }
-
-  int bookmarkcount = 0;
-  int count = 0;
-  fprintf(fp, "Channel,Name,Severity,Timestamp,Text\n");
-  for (item = tracestring_root.next; item != NULL; item = item->next) {
-    memcpy(buffer, item->text, item->length);
-    buffer[item->length] = '\0';
-    const char *severity = ctf_severity_name(item->severity);
-    if (severity == NULL)
-      severity = "(invalid)";
-    fprintf(fp, "%d,\"%s\",%s,%.6f,", item->channel_id, channels[item->channel_id].name,
-            severity, item->timestamp - starttime);
-    for (const char *ptr = buffer; *ptr != '\0'; ptr++) {
-      if (*ptr == '"')
-        fputc('"', fp);
-      fputc(*ptr, fp);
-    }
-    if ((item->flags & TSFLAG_BOOKMARK) != 0)
-      fprintf(fp, ",#%d", ++bookmarkcount);
-    fputc('\n', fp);
-    count += 1;
-  }
-
-  free((void*)buffer);
-  fclose(fp);
-  return count;
+  return sock;
 }
 
-const char *trace_channelname(int id)
+/** net_open() connects a capture context to a network probe (or to a capture
+ *  daemon, if "framed" is true), and allocates the buffer for the reader.
+ *
+ *  \return TRACESTAT_OK on success, or an error code.
+ */
+static int net_open(TRACEPROBE *probe, const char *ipaddress, unsigned short port, bool framed)
 {
-  for (TRACESTRING *item = tracestring_root.next; item != NULL; item = item->next)
-    if (item->channel_id == id)
-      return item->channelname;
-  return NULL;
+  assert(probe != NULL && ipaddress != NULL);
+  strlcpy(probe->netaddr, ipaddress, sizearray(probe->netaddr));
+  probe->netport = port;
+  probe->socket = net_connect(ipaddress, port);
+  if (probe->socket == INVALID_SOCKET)
+    return TRACESTAT_NO_PIPE;
+  if ((probe->netbuffer = malloc(NET_BLOCKSIZE + REC_PKTHDRSIZE)) == NULL)
+    return TRACESTAT_NO_MEMORY;
+  probe->network = true;
+  probe->framed = framed;
+  return TRACESTAT_OK;
 }
 
-/** trace_setdatasize() sets the data size in an ITM packet, in bytes. Valid
- *  values are 1, 2 and 4. For automatic detection, set "size" to 0.
+/** net_close() closes the socket of a network probe; the reader thread must
+ *  have been stopped.
  */
-void trace_setdatasize(short size)
+static void net_close(TRACEPROBE *probe)
 {
-  assert(size == 0 || size == 1 || size == 2 || size == 4);
-  itm_datasize = (size == 0) ? 1 : size;
-  itm_datasz_auto = (size == 0);
-  itm_packet_errors = 0;
+  if (probe->socket != INVALID_SOCKET) {
+    closesocket(probe->socket);
+    probe->socket = INVALID_SOCKET;
+  }
+  if (probe->netbuffer != NULL) {
+    free(probe->netbuffer);
+    probe->netbuffer = NULL;
+  }
+  probe->network = false;
+  probe->framed = false;
 }
 
-/** trace_getdatasize() returns the datasize currently set. */
-short trace_getdatasize(void)
+/** net_wait() waits until data is available on the socket, or until the
+ *  timeout (in milliseconds) expires.
+ *
+ *  \return A positive value if data is available (or if the connection was
+ *          closed), 0 on a timeout, or -1 on failure.
+ */
+static int net_wait(SOCKET sock, int timeout)
 {
-  return itm_datasize;
+# if defined WIN32 || defined _WIN32
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(sock, &fdset);
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    return select((int)sock + 1, &fdset, NULL, NULL, &tv);
+# else
+    struct pollfd fds = { sock, POLLIN, 0 };
+    int result = poll(&fds, 1, timeout);
+    if (result < 0 && errno == EINTR)
+      result = 0;
+    return result;
+# endif
 }
 
-int trace_getpacketerrors(bool reset)
+/** net_recv() reads the data that is available on the (non-blocking) socket.
+ *
+ *  \return The number of bytes read (0 if no data is available), or -1 if the
+ *          connection was closed or failed.
+ */
+static int net_recv(SOCKET sock, unsigned char *buffer, size_t size)
 {
-  int result = itm_packet_errors;
-  if (reset)
-    itm_packet_errors = 0;
-  return result;
+  int count = recv(sock, (char*)buffer, (int)size, 0);
+  if (count > 0)
+    return count;
+  if (count == 0)
+    return -1;                      /* connection closed by the peer */
+# if defined WIN32 || defined _WIN32
+    return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+# else
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+# endif
 }
 
-int trace_overflowerrors(bool reset)
+/** net_reconnect() waits for the retry delay, and then tries to re-establish
+ *  the connection to the probe. On failure, the retry delay is increased.
+ *
+ *  \return true on success, false on failure or if a close of the probe is
+ *          requested.
+ */
+static bool net_reconnect(TRACEPROBE *probe, double *retry)
 {
-  int result = tracequeue_overflow;
-  if (reset)
-    tracequeue_overflow = 0;
-  return result;
+  assert(retry != NULL);
+  double due = get_timestamp() + *retry;
+  while (!probe->force_exit && get_timestamp() < due) {
+    struct timespec ts = { 0, 10000000 };
+    thrd_sleep(&ts, NULL);
+  }
+  if (probe->force_exit)
+    return false;
+  probe->socket = net_connect(probe->netaddr, probe->netport);
+  if (probe->socket == INVALID_SOCKET) {
+    *retry = (2 * *retry < NET_RETRY_MAX) ? 2 * *retry : NET_RETRY_MAX;
+    return false;
+  }
+  probe->reconnects += 1;
+  *retry = NET_RETRY_MIN;
+  return true;
 }
 
-static void addsample(uint32_t pc, unsigned *sample_map, uint32_t code_base, uint32_t code_top)
+/** net_readframed() is the reader for a capture daemon, see net_read(). */
+static void net_readframed(TRACEPROBE *probe)
 {
-  assert(sample_map != NULL);
-  if (pc < code_base || pc >= code_top)
-    pc = code_top;
-  unsigned idx = Address2Index(pc, code_base);
-  sample_map[idx] += 1;
+  unsigned char *buffer = probe->netbuffer;
+  assert(buffer != NULL);
+  size_t size = NET_BLOCKSIZE + REC_PKTHDRSIZE;
+  size_t fill = 0;
+  bool synced = false;              /* set when the header was read */
+  double retry = NET_RETRY_MIN;
+
+  while (!probe->force_exit) {
+    if (probe->socket == INVALID_SOCKET) {
+      if (!net_reconnect(probe, &retry))
+        continue;
+      fill = 0;                     /* the daemon sends a new header */
+      synced = false;
+    }
+
+    int result = net_wait(probe->socket, NET_POLLTIME);
+    bool dropped = (result < 0);
+    if (result > 0 && fill < size) {
+      int count = net_recv(probe->socket, buffer + fill, size - fill);
+      if (count < 0)
+        dropped = true;
+      else
+        fill += count;
+    }
+    size_t pos = 0;
+    if (!synced && fill >= REC_HDRMIN) {
+      TRACERECORDING info;
+      size_t hdrsize = (size_t)rec_getle(buffer + 10, 2);
+      if (!rec_parseheader(buffer, fill, &info) || hdrsize > size) {
+        dropped = true;             /* not a capture daemon */
+      } else if (fill >= hdrsize) {
+        if (info.bitrate > 0)
+          probe->decoder.bytetime = 10.0 / info.bitrate;
+        pos = hdrsize;
+        synced = true;
+      }
+    }
+    while (synced && !dropped && fill - pos >= REC_PKTHDRSIZE) {
+      size_t length = (size_t)rec_getle(buffer + pos, 4);
+      if (length == 0 || length > size - REC_PKTHDRSIZE) {
+        dropped = true;             /* invalid record, the stream is out of sync */
+        break;
+      }
+      if (fill - pos < REC_PKTHDRSIZE + length)
+        break;                      /* record is incomplete */
+      if (tracequeue_push(&probe->queue, buffer + pos + REC_PKTHDRSIZE, length, rec_getdouble(buffer + pos + 8)))
+        gui_wakeup();
+      pos += REC_PKTHDRSIZE + length;
+    }
+    if (pos > 0) {
+      memmove(buffer, buffer + pos, fill - pos);
+      fill -= pos;
+    }
+    if (dropped) {
+      probe->errors += 1;
+      closesocket(probe->socket);
+      probe->socket = INVALID_SOCKET;
+    }
+  }
 }
 
-int traceprofile_process(bool enabled, unsigned *sample_map, uint32_t code_base, uint32_t code_top,
-                         unsigned *overflow)
+/** net_read() is the reader for a network probe; it runs until a close of the
+ *  probe is requested (via force_exit).
+ */
+static void net_read(TRACEPROBE *probe)
 {
-  int count = 0;
-  int overflow_count = 0;
-  while (tracequeue_head != tracequeue_tail) {
-    if (enabled && sample_map != NULL) {
-      const unsigned char *pktdata = trace_queue[tracequeue_head].data;
-      size_t pktlen = trace_queue[tracequeue_head].length;
-
-      /* first handle cached data (that crosses USB packets) */
-      if (itm_cachefilled > 0) {
-        unsigned char buffer[5];
-        memcpy(buffer, itm_cache, itm_cachefilled);
-        size_t needed = ITM_VALIDHDR(itm_cache[0]) ? ITM_LENGTH(itm_cache[0]) + 1 : 5;
-        assert(itm_cachefilled < needed);
-        needed -= itm_cachefilled;
-        if (needed > pktlen) {
-          /* cached data plus new data block *still* do not make a complete packet */
-          memcpy(itm_cache + itm_cachefilled, pktdata, pktlen);
-          itm_cachefilled += pktlen;
-          pktlen = 0; /* avoid dropping into the "while" below */
-        } else {
-          memcpy(buffer + itm_cachefilled, pktdata, needed);
-          pktdata += needed;
-          pktlen -= needed;
-          /* handling the packet is simpler now, because we know that we have
-             a full packet (plus: we don't care about unsupported packets,
-             because we can simply drop the cache, and we don't handle the
-             overflow packet because it is only one byte, so it can never
-             overflow */
-          if (buffer[0] == 0x17) {
-            uint32_t pc;
-            memcpy(&pc, buffer + 1, 4);
-            addsample(pc, sample_map, code_base, code_top);
-            count += 1;
-          }
-          itm_cachefilled = 0;
-        }
-      }
+  if (probe->framed) {
+    net_readframed(probe);
+    return;
+  }
 
-      while (pktlen > 0) {
-        if (*pktdata == 0x17) {
-          /* PC sample packet */
-          if (pktlen >= 5) {
-            uint32_t pc;
-            memcpy(&pc, pktdata + 1, 4);
-            addsample(pc, sample_map, code_base, code_top);
-            pktlen -= 5;
-            pktdata += 5;
-            count += 1;
-          } else {
-            memcpy(itm_cache, pktdata, pktlen);
-            itm_cachefilled = pktlen;
-            pktlen = 0;
-          }
-        } else if (*pktdata == 0x70) {
-          /* overflow packet */
-          pktlen -= 1;
-          pktdata += 1;
-          overflow_count += 1;
-        } else {
-          /* unknown/unsupported packet */
-          unsigned len = ITM_VALIDHDR(*pktdata) ? ITM_LENGTH(*pktdata) : 4;
-          len += 1; /* include packet header */
-          if (pktlen >= len) {
-            pktlen -= len;
-            pktdata += len;
-          } else {
-            memcpy(itm_cache, pktdata, pktlen);
-            itm_cachefilled = pktlen;
-            pktlen = 0;
-          }
+  unsigned char *buffer = probe->netbuffer;
+  assert(buffer != NULL);
+  size_t size = NET_BLOCKSIZE;
+  while (PKT_ALIGN(sizeof(PACKET) + size) > probe->queue.size / 4 && size > capture_xfersize)
+    size /= 2;                      /* keep room for several entries in the queue */
+  size_t fill = 0;
+  double first = 0.0, last = 0.0;   /* arrival times of the data in the buffer */
+  double retry = NET_RETRY_MIN;
+
+  while (!probe->force_exit) {
+    if (probe->socket == INVALID_SOCKET && !net_reconnect(probe, &retry))
+      continue;
+
+    int result = net_wait(probe->socket, (fill > 0) ? NET_IDLETIME : NET_POLLTIME);
+    bool dropped = (result < 0);
+    if (result > 0) {
+      /* drain the socket (up to the size of the buffer) */
+      while (fill < size) {
+        int count = net_recv(probe->socket, buffer + fill, size - fill);
+        if (count <= 0) {
+          dropped = (count < 0);
+          break;
         }
+        last = get_timestamp();
+        if (fill == 0)
+          first = last;
+        fill += count;
       }
     }
-    tracequeue_head = (tracequeue_head + 1) % PACKET_NUM;
+    /* a packet is stamped with the arrival time of its last byte, like a USB
+       transfer */
+    if (fill > 0 && (result == 0 || dropped || fill >= size || get_timestamp() - first >= NET_MAXHOLD)) {
+      if (tracequeue_push(&probe->queue, buffer, fill, last))
+        gui_wakeup();
+      fill = 0;
+    }
+    if (dropped) {
+      probe->errors += 1;
+      closesocket(probe->socket);
+      probe->socket = INVALID_SOCKET;
+    }
   }
-
-  if (overflow != NULL)
-    *overflow = overflow_count;
-  return count;
 }
 
 #if defined WIN32 || defined _WIN32
 
 static unsigned long win_errno = 0;
 static int loc_errno = 0;
-static HANDLE hThread = NULL;
-static HANDLE hUSBdev = INVALID_HANDLE_VALUE;
-static USB_INTERFACE_HANDLE hUSBiface = INVALID_HANDLE_VALUE;
 static KLST_DEVINFO *usbk_Device = NULL;
-static unsigned char usbTraceEP = BMP_EP_TRACE;
 static LARGE_INTEGER pcfreq;
 
+/** usb_shared() returns whether any probe has a USB interface open; the
+ *  WinUSB and libusbK libraries may only be unloaded when none has.
+ */
+static bool usb_shared(void)
+{
+  for (int idx = 0; idx < MAX_PROBES; idx++)
+    if (trace_probe(idx)->usbiface != INVALID_HANDLE_VALUE)
+      return true;
+  return false;
+}
 
 static BOOL MakeGUID(const char *label, GUID *guid)
 {
@@ -1090,8 +4921,9 @@ static BOOL usb_OpenDevice(const TCHAR *path, HANDLE *hdevUSB, USB_INTERFACE_HAN
       if (!result) {
         win_errno = GetLastError();
         CloseHandle(*hdevUSB);
-        WinUsb_Unload();
         *hdevUSB = *hifaceUSB = INVALID_HANDLE_VALUE;
+        if (!usb_shared())
+          WinUsb_Unload();
       }
     } else {
       win_errno = GetLastError();
@@ -1113,8 +4945,9 @@ static BOOL usb_OpenDevice(const TCHAR *path, HANDLE *hdevUSB, USB_INTERFACE_HAN
         if (!result) {
           win_errno = GetLastError();
           _LstK_Free(DeviceList);
-          UsbK_Unload();
           *hdevUSB = *hifaceUSB = INVALID_HANDLE_VALUE;
+          if (!usb_shared())
+            UsbK_Unload();
         }
       }
       _LstK_Free(DeviceList);
@@ -1132,7 +4965,6 @@ static BOOL usb_ConfigEndpoint(USB_INTERFACE_HANDLE hUSB, unsigned char endpoint
   USB_INTERFACE_DESCRIPTOR ifaceDescriptor;
 
   assert(hUSB != INVALID_HANDLE_VALUE);
-  usbTraceEP = endpoint;
 
   if (WinUsb_IsActive()) {
     loc_errno = 7;
@@ -1166,8 +4998,10 @@ static BOOL usb_ConfigEndpoint(USB_INTERFACE_HANDLE hUSB, unsigned char endpoint
   return FALSE;
 }
 
-/** get_timestamp() returns a precision timestamp; the returned value is in
- *  seconds, but the fractional part has a precision of at least a millisecond.
+/** get_timestamp() returns a precision timestamp from a monotonic clock; the
+ *  returned value is in seconds (with a precision of a microsecond or better),
+ *  relative to an unspecified epoch. See trace_walltime() to convert it to
+ *  the wall clock.
  */
 double get_timestamp(void)
 {
@@ -1179,70 +5013,50 @@ double get_timestamp(void)
   return (double)t.QuadPart / (double)pcfreq.QuadPart;
 }
 
-static DWORD __stdcall trace_read(LPVOID arg)
+/** get_realtime() returns the wall clock time in seconds since the epoch
+ *  (1 January 1970, UTC).
+ */
+static double get_realtime(void)
 {
-  unsigned char buffer[PACKET_SIZE];
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  ULARGE_INTEGER t;
+  t.LowPart = ft.dwLowDateTime;
+  t.HighPart = ft.dwHighDateTime;
+  return (double)(t.QuadPart - 116444736000000000uLL) / 1.0e7;  /* FILETIME counts 100 ns units since 1601 */
+}
 
-  (void)arg;
+static DWORD __stdcall trace_read(LPVOID arg)
+{
+  TRACEPROBE *probe = (TRACEPROBE*)arg;
+  unsigned char *buffer = probe->usbbuffer;
 
-  if (TraceSocket != INVALID_SOCKET) {
-    for ( ;; ) {
-      int result = recv(TraceSocket, (char*)buffer, sizearray(buffer), 0);
-      if (result > 0) {
-        int next = (tracequeue_tail + 1) % PACKET_NUM;
-        if (next != tracequeue_head) {
-          memcpy(trace_queue[tracequeue_tail].data, buffer, result);
-          trace_queue[tracequeue_tail].length = result;
-          trace_queue[tracequeue_tail].timestamp = get_timestamp();
-          tracequeue_tail = next;
-          PostMessage((HWND)guidriver_apphandle(), WM_USER, 0, 0L); /* just a flag to wake up the GUI */
-        } else {
-          tracequeue_overflow += 1; /* notify packet queue overflow */
-        }
-      } else if (result < 0) {
-        break;
-      }
-    }
+  if (probe->network) {
+    net_read(probe);
   } else if (WinUsb_IsActive()) {
+    assert(buffer != NULL);
     for ( ;; ) {
       uint32_t numread = 0;
       double tstamp = get_timestamp();
-      if (_WinUsb_ReadPipe(hUSBiface, usbTraceEP, buffer, sizearray(buffer), &numread, NULL)) {
+      if (_WinUsb_ReadPipe(probe->usbiface, probe->endpoint, buffer, (uint32_t)capture_xfersize, &numread, NULL)) {
         /* add the packet to the queue */
-        if (numread > 0) {
-          int next = (tracequeue_tail + 1) % PACKET_NUM;
-          if (next != tracequeue_head) {
-            memcpy(trace_queue[tracequeue_tail].data, buffer, numread);
-            trace_queue[tracequeue_tail].length = numread;
-            trace_queue[tracequeue_tail].timestamp = tstamp;//get_timestamp();
-            tracequeue_tail = next;
-            PostMessage((HWND)guidriver_apphandle(), WM_USER, 0, 0L); /* just a flag to wake up the GUI */
-          } else {
-            tracequeue_overflow += 1; /* notify packet queue overflow */
-          }
-        }
+        if (numread > 0 && tracequeue_push(&probe->queue, buffer, numread, tstamp))
+          gui_wakeup();
       } else {
+        probe->errors += 1;
         Sleep(50);
       }
     }
   } else if (UsbK_IsActive()) {
+    assert(buffer != NULL);
     for ( ;; ) {
       uint32_t numread = 0;
-      if (_UsbK_ReadPipe(hUSBiface, usbTraceEP, buffer, sizearray(buffer), &numread, NULL)) {
+      if (_UsbK_ReadPipe(probe->usbiface, probe->endpoint, buffer, (uint32_t)capture_xfersize, &numread, NULL)) {
         /* add the packet to the queue */
-        if (numread > 0) {
-          int next = (tracequeue_tail + 1) % PACKET_NUM;
-          if (next != tracequeue_head) {
-            memcpy(trace_queue[tracequeue_tail].data, buffer, numread);
-            trace_queue[tracequeue_tail].length = numread;
-            trace_queue[tracequeue_tail].timestamp = get_timestamp();
-            tracequeue_tail = next;
-            PostMessage((HWND)guidriver_apphandle(), WM_USER, 0, 0L); /* just a flag to wake up the GUI */
-          } else {
-            tracequeue_overflow += 1; /* notify packet queue overflow */
-          }
-        }
+        if (numread > 0 && tracequeue_push(&probe->queue, buffer, numread, get_timestamp()))
+          gui_wakeup();
       } else {
+        probe->errors += 1;
         Sleep(50);
       }
     }
@@ -1251,90 +5065,98 @@ static DWORD __stdcall trace_read(LPVOID arg)
   return 0;
 }
 
-/** trace_init() opens the SWO tracing channel. If ipaddress is NULL, the USB
- *  channel is opened and endpoint is the USB endpoint. If ipaddress is a valid
- *  IP address, endpoint is the port number.
+static void probe_close(TRACEPROBE *probe);
+
+/** probe_open() opens the SWO tracing channel of a capture context. If
+ *  ipaddress is NULL, the USB channel of the probe with sequence number
+ *  "seqnr" is opened and endpoint is the USB endpoint. If ipaddress is a valid
+ *  IP address, endpoint is the port number; "framed" is set for a capture
+ *  daemon.
  */
-int trace_init(unsigned short endpoint, const char *ipaddress)
+static int probe_open(TRACEPROBE *probe, int seqnr, unsigned short endpoint, const char *ipaddress, bool framed)
 {
   loc_errno = 0;
   win_errno = 0;
-  tracequeue_overflow = 0;
-  if (hThread != NULL && hUSBiface != INVALID_HANDLE_VALUE)
+  probe->queue.overflow = 0;
+  if (probe->thread != NULL && (probe->usbiface != INVALID_HANDLE_VALUE || probe->network))
     return TRACESTAT_OK;            /* double initialization */
 
   /* if a previous initialization did not succeed completely, clean up before
      retrying */
-  trace_close();
+  probe_close(probe);
 
   if (ipaddress != NULL) {
-    struct sockaddr_in server;
-    if ((TraceSocket = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
-      win_errno = WSAGetLastError();
-      return TRACESTAT_NO_INTERFACE;
-    }
-    server.sin_addr.s_addr = inet_addr(ipaddress);
-    server.sin_family = AF_INET;
-    server.sin_port = htons(endpoint);
-    if (connect(TraceSocket, (struct sockaddr*)&server, sizeof(server)) != 0) {
+    int result = net_open(probe, ipaddress, endpoint, framed);
+    if (result != TRACESTAT_OK) {
       win_errno = WSAGetLastError();
-      closesocket(TraceSocket);
-      TraceSocket = INVALID_SOCKET;
-      return TRACESTAT_NO_PIPE;
+      return result;
     }
   } else {
     TCHAR guid[100], path[_MAX_PATH];
-    if (!find_bmp(0, BMP_IF_TRACE, guid, sizearray(guid)))
+    if (!find_bmp(seqnr, BMP_IF_TRACE, guid, sizearray(guid)))
       return TRACESTAT_NO_INTERFACE;  /* Black Magic Probe not found (trace interface not found) */
     if (!usb_GetDevicePath(guid, path, sizearray(path)))
       return TRACESTAT_NO_DEVPATH;    /* device path to trace interface not found (should not occur) */
 
-    if (!usb_OpenDevice(path, &hUSBdev, &hUSBiface))
+    if (!usb_OpenDevice(path, &probe->usbdev, &probe->usbiface))
       return TRACESTAT_NO_ACCESS;     /* failure opening the device interface */
-    if (!usb_ConfigEndpoint(hUSBiface, endpoint))
+    if (!usb_ConfigEndpoint(probe->usbiface, (unsigned char)endpoint))
       return TRACESTAT_NO_PIPE;       /* endpoint pipe could not be found -> not a Black Magic Probe? */
+    probe->endpoint = (unsigned char)endpoint;
   }
 
-  hThread = CreateThread(NULL, 0, trace_read, NULL, 0, NULL);
-  if (hThread == NULL) {
+  if (!tracequeue_alloc(&probe->queue))
+    return TRACESTAT_NO_MEMORY;
+  if (!probe->network && (probe->usbbuffer = malloc(capture_xfersize)) == NULL)
+    return TRACESTAT_NO_MEMORY;
+  probe->force_exit = 0;
+  probe->thread = CreateThread(NULL, 0, trace_read, probe, 0, NULL);
+  if (probe->thread == NULL) {
     loc_errno = 11;
     win_errno = GetLastError();
     return TRACESTAT_NO_THREAD;
   }
-  SetThreadPriority(hThread, THREAD_PRIORITY_HIGHEST);
+  SetThreadPriority(probe->thread, THREAD_PRIORITY_HIGHEST);
 
   return TRACESTAT_OK;
 }
 
-void trace_close(void)
+static void probe_close(TRACEPROBE *probe)
 {
   loc_errno = 0;
   win_errno = 0;
-  if (hThread != NULL) {
-    TerminateThread(hThread, 0);
-    hThread = NULL;
+  loopback_close(probe);
+  if (probe->thread != NULL) {
+    TerminateThread(probe->thread, 0);
+    probe->thread = NULL;
   }
-  if (hUSBiface != INVALID_HANDLE_VALUE) {
-    assert(hUSBdev != INVALID_HANDLE_VALUE);  /* if hUSBiface is valid, hUSBdev must be too */
+  if (probe->usbbuffer != NULL) {
+    free(probe->usbbuffer);
+    probe->usbbuffer = NULL;
+  }
+  if (probe->usbiface != INVALID_HANDLE_VALUE) {
+    assert(probe->usbdev != INVALID_HANDLE_VALUE);  /* if usbiface is valid, usbdev must be too */
+    USB_INTERFACE_HANDLE usbiface = probe->usbiface;
+    probe->usbiface = INVALID_HANDLE_VALUE;
     if (WinUsb_IsActive()) {
-      CloseHandle(hUSBdev);
-      _WinUsb_Free(hUSBiface);
-      WinUsb_Unload();
+      CloseHandle(probe->usbdev);
+      _WinUsb_Free(usbiface);
+      if (!usb_shared())
+        WinUsb_Unload();
     } else if (UsbK_IsActive()) {
-      _UsbK_Free(hUSBiface);
-      UsbK_Unload();
+      _UsbK_Free(usbiface);
+      if (!usb_shared())
+        UsbK_Unload();
     }
-    hUSBdev = hUSBiface = INVALID_HANDLE_VALUE;
-  }
-  if (TraceSocket != INVALID_SOCKET) {
-    closesocket(TraceSocket);
-    TraceSocket = INVALID_SOCKET;
+    probe->usbdev = INVALID_HANDLE_VALUE;
   }
+  net_close(probe);
 }
 
-bool trace_isopen(void)
+static bool probe_isopen(const TRACEPROBE *probe)
 {
-  return (hThread != NULL && hUSBiface != INVALID_HANDLE_VALUE);
+  return probe->loopback_active
+         || (probe->thread != NULL && (probe->usbiface != INVALID_HANDLE_VALUE || probe->network));
 }
 
 unsigned long trace_errno(int *loc)
@@ -1346,48 +5168,173 @@ unsigned long trace_errno(int *loc)
 
 #else
 
-static pthread_t hThread;
-static libusb_device_handle *hUSBiface;
-static unsigned char usbTraceEP = BMP_EP_TRACE;
-static volatile int force_exit;
-
-/** get_timestamp() returns a precision timestamp; the returned value is in
- *  seconds, but the fractional part has a precision of at least milliseconds.
+/** get_timestamp() returns a precision timestamp from a monotonic clock; the
+ *  returned value is in seconds (with a precision of a microsecond or better),
+ *  relative to an unspecified epoch. The raw clock is not slewed by NTP, so
+ *  that intervals are accurate. See trace_walltime() to convert it to the
+ *  wall clock.
  */
 double get_timestamp(void)
 {
-  struct timeval tv;
-  gettimeofday(&tv,NULL);
-  return tv.tv_sec + tv.tv_usec / 1000000.0;
+  struct timespec ts;
+# if defined CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+# else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+# endif
+  return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+/** get_realtime() returns the wall clock time in seconds since the epoch
+ *  (1 January 1970, UTC).
+ */
+static double get_realtime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+/* The state of the asynchronous transfers of a capture run. */
+typedef struct tagUSBSESSION {
+  TRACEPROBE *probe;
+  struct libusb_transfer **transfers;
+  struct libusb_transfer **idle;  /* transfers that must be (re-)submitted */
+  int numidle;
+  int pending;                    /* number of transfers in flight */
+  bool halted;                    /* endpoint stalled, halt must be cleared */
+} USBSESSION;
+
+static void LIBUSB_CALL usb_transfer_done(struct libusb_transfer *transfer)
+{
+  USBSESSION *session = (USBSESSION*)transfer->user_data;
+  assert(session != NULL && session->probe != NULL);
+  TRACEPROBE *probe = session->probe;
+  double tstamp = get_timestamp();
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length > 0)
+    tracequeue_push(&probe->queue, transfer->buffer, transfer->actual_length, tstamp);
+  else if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_TIMED_OUT
+           && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+    probe->errors += 1;
+  if (transfer->status == LIBUSB_TRANSFER_CANCELLED || probe->force_exit) {
+    session->pending -= 1;
+    return;
+  }
+  if ((transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+      && libusb_submit_transfer(transfer) == 0)
+    return; /* transfer re-submitted, so it is still pending */
+  /* on a stall, the halt must be cleared first, which is a synchronous call
+     that is not allowed in a callback; on other errors, resubmitting right
+     away could spin; so the transfer is handed back to trace_read() */
+  if (transfer->status == LIBUSB_TRANSFER_STALL)
+    session->halted = true;
+  session->pending -= 1;
+  session->idle[session->numidle++] = transfer;
 }
 
+/** trace_read() keeps a number of asynchronous bulk transfers outstanding on
+ *  the trace endpoint, so that the endpoint is serviced while the data of a
+ *  completed transfer is being stored in the queue. The completion callbacks
+ *  run in the context of this thread. Transfers that ended with an error are
+ *  re-submitted periodically, so that a transient error does not reduce the
+ *  number of outstanding transfers. The thread runs until force_exit is set.
+ *
+ *  \note The capture context has its own libusb context, so that the event
+ *        handling of this thread only runs the callbacks of its own transfers.
+ */
 static void *trace_read(void *arg)
 {
-  unsigned char buffer[PACKET_SIZE];
-  int numread = 0;
+  TRACEPROBE *probe = (TRACEPROBE*)arg;
+  assert(probe != NULL);
+  if (probe->network)
+    net_read(probe);
+  if (probe->usbiface == NULL)
+    return 0;
 
-  (void)arg;
-  while (!force_exit && hThread != 0 && hUSBiface != NULL) {
-    if (libusb_bulk_transfer(hUSBiface, usbTraceEP, buffer, sizeof(buffer), &numread, 0) == 0) {
-      /* add the packet to the queue */
-      if (numread > 0) {
-        int next = (tracequeue_tail + 1) % PACKET_NUM;
-        if (next != tracequeue_head) {
-          memcpy(trace_queue[tracequeue_tail].data, buffer, numread);
-          trace_queue[tracequeue_tail].length = numread;
-          trace_queue[tracequeue_tail].timestamp = get_timestamp();
-          tracequeue_tail = next;
-        } else {
-          tracequeue_overflow += 1; /* notify packet queue overflow */
-        }
+  USBSESSION sessiondata;
+  USBSESSION *session = &sessiondata;
+  memset(session, 0, sizeof(USBSESSION));
+  session->probe = probe;
+  session->transfers = malloc(capture_transfers * sizeof(struct libusb_transfer*));
+  session->idle = malloc(capture_transfers * sizeof(struct libusb_transfer*));
+  if (session->transfers == NULL || session->idle == NULL) {
+    if (session->transfers != NULL)
+      free(session->transfers);
+    if (session->idle != NULL)
+      free(session->idle);
+    while (!probe->force_exit)
+      usleep(10*1000);
+    return 0;
+  }
+
+  memset(session->transfers, 0, capture_transfers * sizeof(struct libusb_transfer*));
+  for (int idx = 0; idx < capture_transfers; idx++) {
+    unsigned char *buffer = malloc(capture_xfersize);
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    if (buffer == NULL || transfer == NULL) {
+      if (buffer != NULL)
+        free(buffer);
+      if (transfer != NULL)
+        libusb_free_transfer(transfer);
+      break;
+    }
+    libusb_fill_bulk_transfer(transfer, probe->usbiface, probe->endpoint, buffer, (int)capture_xfersize,
+                              usb_transfer_done, session, 0);
+    session->transfers[idx] = transfer;
+    session->idle[session->numidle++] = transfer;
+  }
+
+  double resubmit_tstamp = 0.0;
+  while (!probe->force_exit) {
+    if (session->numidle > 0 && get_timestamp() - resubmit_tstamp >= 0.1) {
+      /* (re-)submit the transfers that are not in flight, at most once per
+         100 ms, so that a persistent error does not make the loop spin */
+      resubmit_tstamp = get_timestamp();
+      if (session->halted) {
+        libusb_clear_halt(probe->usbiface, probe->endpoint);
+        session->halted = false;
       }
+      int count = session->numidle;
+      session->numidle = 0;
+      for (int idx = 0; idx < count; idx++) {
+        struct libusb_transfer *transfer = session->idle[idx];
+        if (libusb_submit_transfer(transfer) == 0)
+          session->pending += 1;
+        else
+          session->idle[session->numidle++] = transfer;
+      }
+    }
+    if (session->pending > 0) {
+      struct timeval tv = { 0, 100000 };
+      libusb_handle_events_timeout_completed(probe->usbctx, &tv, NULL);
+    } else {
+      usleep(10*1000);
+    }
+  }
+
+  /* cancel the pending transfers and wait for their callbacks to arrive,
+     before freeing the transfers; libusb always completes a cancelled
+     transfer (also when the device is unplugged), so this wait ends, and
+     when the thread exits, no transfer is in flight on the device handle */
+  for (int idx = 0; idx < capture_transfers; idx++)
+    if (session->transfers[idx] != NULL)
+      libusb_cancel_transfer(session->transfers[idx]);
+  while (session->pending > 0) {
+    struct timeval tv = { 0, 100000 };
+    libusb_handle_events_timeout_completed(probe->usbctx, &tv, NULL);
+  }
+  for (int idx = 0; idx < capture_transfers; idx++) {
+    if (session->transfers[idx] != NULL) {
+      free(session->transfers[idx]->buffer);
+      libusb_free_transfer(session->transfers[idx]);
     }
   }
-  force_exit = 0;
+  free(session->transfers);
+  free(session->idle);
   return 0;
 }
 
-static int usb_OpenDevice(libusb_device_handle **hUSB, const char *path)
+static int usb_OpenDevice(libusb_context *ctx, libusb_device_handle **hUSB, const char *path)
 {
   libusb_device **devs;
   libusb_device_handle *handle;
@@ -1395,7 +5342,7 @@ static int usb_OpenDevice(libusb_device_handle **hUSB, const char *path)
   int devidx, i, res;
 
   /* get list of all devices */
-  cnt = libusb_get_device_list(0, &devs);
+  cnt = libusb_get_device_list(ctx, &devs);
   if (cnt < 0)
     return TRACESTAT_INIT_FAILED;
 
@@ -1437,67 +5384,83 @@ static int usb_OpenDevice(libusb_device_handle **hUSB, const char *path)
   return TRACESTAT_OK;
 }
 
-int trace_init(unsigned short endpoint, const char *ipaddress)
+static void probe_close(TRACEPROBE *probe);
+
+/** probe_open() opens the SWO tracing channel of a capture context. If
+ *  ipaddress is NULL, the USB channel of the probe with sequence number
+ *  "seqnr" is opened and endpoint is the USB endpoint. If ipaddress is a valid
+ *  IP address, endpoint is the port number; "framed" is set for a capture
+ *  daemon.
+ */
+static int probe_open(TRACEPROBE *probe, int seqnr, unsigned short endpoint, const char *ipaddress, bool framed)
 {
   int result;
 
-  tracequeue_overflow = 0;
-  usbTraceEP = endpoint;
+  probe->queue.overflow = 0;
+  probe->endpoint = (unsigned char)endpoint;
 
-  if (hThread != 0 && hUSBiface != NULL)
+  if (probe->thread != 0 && (probe->usbiface != NULL || probe->network))
     return TRACESTAT_OK;            /* double initialization */
 
   /* if a previous initialization did not succeed completely, clean up before
      retrying */
-  trace_close();
+  probe_close(probe);
 
   if (ipaddress != NULL) {
-    struct sockaddr_in server;
-    if ((TraceSocket = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
-      return TRACESTAT_NO_INTERFACE;
-
-    server.sin_addr.s_addr = inet_addr(ipaddress);
-    server.sin_family = AF_INET;
-    server.sin_port = htons(endpoint);
-    if (connect(TraceSocket, (struct sockaddr*)&server, sizeof(server)) != 0) {
-      close(TraceSocket);
-      TraceSocket = INVALID_SOCKET;
-      return TRACESTAT_NO_PIPE;
-    }
+    result = net_open(probe, ipaddress, endpoint, framed);
+    if (result != TRACESTAT_OK)
+      return result;
   } else {
     char dev_id[50];
-    if (!find_bmp(0, BMP_IF_TRACE, dev_id, sizearray(dev_id)))
+    if (!find_bmp(seqnr, BMP_IF_TRACE, dev_id, sizearray(dev_id)))
       return TRACESTAT_NO_INTERFACE;  /* Black Magic Probe not found (trace interface not found) */
 
-    result = libusb_init(0);
-    if (result < 0)
+    result = libusb_init(&probe->usbctx);
+    if (result < 0) {
+      probe->usbctx = NULL;
       return TRACESTAT_INIT_FAILED;
+    }
 
-    result = usb_OpenDevice(&hUSBiface, dev_id);
+    result = usb_OpenDevice(probe->usbctx, &probe->usbiface, dev_id);
     if (result != TRACESTAT_OK)
       return result;
   }
 
-  force_exit = 0;
-  result = pthread_create(&hThread, NULL, trace_read, NULL);
-  if (result != 0)
+  if (!tracequeue_alloc(&probe->queue))
+    return TRACESTAT_NO_MEMORY;
+  probe->force_exit = 0;
+  result = pthread_create(&probe->thread, NULL, trace_read, probe);
+  if (result != 0) {
+    probe->thread = 0;
     return TRACESTAT_NO_THREAD;
+  }
 
   return TRACESTAT_OK;
 }
 
-void trace_close(void)
+static void probe_close(TRACEPROBE *probe)
 {
-  if (hThread != 0) {
-    force_exit = 1;
-    while (force_exit)
-      usleep(10*1000);
-    hThread = 0;
+  loopback_close(probe);
+  if (probe->thread != 0) {
+    probe->force_exit = 1;
+    pthread_join(probe->thread, NULL);
+    probe->thread = 0;
+    probe->force_exit = 0;
+  }
+  if (probe->usbiface != NULL) {
+    libusb_close(probe->usbiface);
+    probe->usbiface = NULL;
   }
-  if (hUSBiface != NULL) {
-    libusb_close(hUSBiface);
-    hUSBiface = NULL;
+  if (probe->usbctx != NULL) {
+    libusb_exit(probe->usbctx);
+    probe->usbctx = NULL;
   }
+  net_close(probe);
+}
+
+static bool probe_isopen(const TRACEPROBE *probe)
+{
+  return probe->loopback_active || (probe->thread != 0 && (probe->usbiface != NULL || probe->network));
 }
 
 unsigned long trace_errno(int *loc)
@@ -1507,24 +5470,126 @@ unsigned long trace_errno(int *loc)
 }
 #endif
 
-static TRACESTRING statusmessage_root = { NULL, NULL };
+/** trace_initprobe() opens the SWO tracing channel of a probe and attaches it
+ *  to the capture context "index". Multiple probes can be captured at the same
+ *  time; their packets are merged on the host timestamp.
+ *
+ *  \param index     The capture context, in the range 0..TRACE_MAXPROBES-1.
+ *  \param seqnr     The sequence number of the probe (for USB capture), in
+ *                    case multiple probes are connected.
+ *  \param endpoint  The USB endpoint, or the port number for TCP/IP.
+ *  \param ipaddress The IP address of the probe, or NULL for USB capture.
+ *
+ *  \return TRACESTAT_OK on success, or an error code.
+ */
+int trace_initprobe(int index, int seqnr, unsigned short endpoint, const char *ipaddress)
+{
+  if (index < 0 || index >= MAX_PROBES)
+    return TRACESTAT_NO_INTERFACE;
+  int result = probe_open(trace_probe(index), seqnr, endpoint, ipaddress, false);
+  trace_updatemerging();
+  return result;
+}
+
+/** trace_initprobedaemon() attaches the capture context "index" to a capture
+ *  daemon (see swodecode -p) on the local host, instead of to a probe. The
+ *  daemon owns the probe and passes the packets on to all connected clients,
+ *  with the timestamps at which it received them; in this way, several tools
+ *  can capture from the same probe.
+ *
+ *  \param index     The capture context, in the range 0..TRACE_MAXPROBES-1.
+ *  \param port      The TCP port of the daemon, e.g. TRACE_DAEMON_PORT.
+ *
+ *  \return TRACESTAT_OK on success, or an error code.
+ */
+int trace_initprobedaemon(int index, unsigned short port)
+{
+  if (index < 0 || index >= MAX_PROBES)
+    return TRACESTAT_NO_INTERFACE;
+  int result = probe_open(trace_probe(index), 0, port, "127.0.0.1", true);
+  trace_updatemerging();
+  return result;
+}
+
+/** trace_initdaemon() attaches the primary capture context to a capture
+ *  daemon; see trace_initprobedaemon().
+ */
+int trace_initdaemon(unsigned short port)
+{
+  return trace_initprobedaemon(0, port);
+}
+
+/** trace_init() opens the SWO tracing channel of the first probe, in capture
+ *  context 0.
+ *
+ *  \param endpoint  The USB endpoint, or the port number for TCP/IP.
+ *  \param ipaddress The IP address of the probe, or NULL for USB capture.
+ *
+ *  \return TRACESTAT_OK on success, or an error code.
+ */
+int trace_init(unsigned short endpoint, const char *ipaddress)
+{
+  return trace_initprobe(0, 0, endpoint, ipaddress);
+}
+
+/** trace_closeprobe() closes the capture context "index" (either a probe or
+ *  a loopback source).
+ */
+void trace_closeprobe(int index)
+{
+  if (index >= 0 && index < MAX_PROBES) {
+    probe_close(trace_probe(index));
+    trace_updatemerging();
+  }
+}
+
+void trace_close(void)
+{
+  for (int idx = 0; idx < MAX_PROBES; idx++)
+    probe_close(trace_probe(idx));
+  trace_updatemerging();
+}
+
+bool trace_isopen(void)
+{
+  for (int idx = 0; idx < MAX_PROBES; idx++)
+    if (probe_isopen(trace_probe(idx)))
+      return true;
+  return false;
+}
+
+/** trace_setprobechannels() sets the channel offset for the capture context
+ *  "index": ITM stimulus port "n" of this probe is displayed on channel
+ *  "chanbase + n" (modulo the number of channels).
+ */
+void trace_setprobechannels(int index, int chanbase)
+{
+  if (index >= 0 && index < MAX_PROBES)
+    trace_probe(index)->chanbase = chanbase;
+}
+
+typedef struct tagSTATUSMSG {
+  struct tagSTATUSMSG *next;
+  char *text;
+  int type;                     /* TRACESTATMSG_BMP or TRACESTATMSG_CTF */
+  int code;                     /* status code (negative for errors) */
+} STATUSMSG;
+
+static STATUSMSG statusmessage_root = { NULL, NULL };
 
 void tracelog_statusmsg(int type, const char *msg, int code)
 {
-  TRACESTRING *item, *tail;
+  STATUSMSG *item, *tail;
 
   assert(type == TRACESTATMSG_BMP || type == TRACESTATMSG_CTF);
   assert(msg != NULL);
-  item = malloc(sizeof(TRACESTRING));
+  item = malloc(sizeof(STATUSMSG));
   if (item != NULL) {
-    memset(item, 0, sizeof(TRACESTRING));
-    item->length = (unsigned short)strlen(msg);
-    item->size = item->length + 1;
-    item->text = malloc(item->size * sizeof(unsigned char));
+    memset(item, 0, sizeof(STATUSMSG));
+    item->text = strdup(msg);
     if (item->text != NULL) {
-      strcpy(item->text, msg);
-      item->channel_id = (unsigned char)type;
-      item->flags = (short)code;
+      item->type = type;
+      item->code = code;
       /* append to tail */
       for (tail = &statusmessage_root; tail->next != NULL; tail = tail->next)
         {}
@@ -1537,25 +5602,26 @@ void tracelog_statusmsg(int type, const char *msg, int code)
 
 void tracelog_statusclear(void)
 {
-  TRACESTRING *item;
+  STATUSMSG *item;
   while (statusmessage_root.next != NULL) {
     item = statusmessage_root.next;
     statusmessage_root.next = item->next;
     assert(item->text != NULL);
     free(item->text);
-    assert(item->channelname == NULL);
     free(item);
   }
 }
 
 const char *tracelog_getstatusmsg(int idx)
 {
-  for (TRACESTRING *item = statusmessage_root.next; item != NULL; item = item->next)
+  for (STATUSMSG *item = statusmessage_root.next; item != NULL; item = item->next)
     if (idx-- == 0)
       return item->text;
   return NULL;
 }
 
+#if !defined NO_GUI
+
 float tracelog_labelwidth(float rowheight)
 {
   size_t labelwidth = 0;
@@ -1567,6 +5633,325 @@ float tracelog_labelwidth(float rowheight)
   return (float)labelwidth * (rowheight / 2);
 }
 
+/* The filters are compiled into a filter set when they change. The result of
+   the filter set for each line is cached in a bitmap, together with a running
+   count of the set bits before each 64-bit word of the bitmap; this allows a
+   quick lookup of the n-th line that passes the filters. The bitmap is
+   extended as lines arrive; it is only rebuilt when the filters (or the
+   severity level) change, or when the store is cleared. A rebuild of a large
+   bitmap is split over several threads. */
+typedef struct tagFILTERSET {
+  STRPATTERN *patterns;         /* include patterns first, then exclude patterns */
+  int numinclude, numexclude;
+  int severity;
+  char *strings;                /* copies of the filter expressions (zero-terminated) */
+  char *signature;              /* filters & severity that the set was compiled for */
+} FILTERSET;
+
+typedef struct tagMATCHMAP {
+  uint64_t *bits;               /* bit set for each line that passes the filters */
+  unsigned *rank;               /* number of set bits before each word */
+  unsigned words, size;         /* number of words in use & allocated */
+  unsigned scanned;             /* number of lines that were evaluated */
+  unsigned count;               /* total number of set bits */
+  unsigned generation;          /* generation of the store that the bitmap refers to */
+  unsigned long long evicted;   /* lines evicted from the store when last updated */
+} MATCHMAP;
+
+static FILTERSET tracelog_filterset = { NULL, 0, 0, 0, NULL, NULL };
+static MATCHMAP tracelog_matchmap = { NULL, NULL, 0, 0, 0, 0, 0 };
+
+/** filterset_compile() compiles the filters into the filter set, if the
+ *  filters (or the severity level) changed since the previous call.
+ *
+ *  \return true if the filter set was (re-)compiled, false if it is unchanged.
+ */
+static bool filterset_compile(FILTERSET *set, const TRACEFILTER *filters, int severity)
+{
+  /* build the signature of the filters, to check whether these changed */
+  size_t siglen = 16;
+  int count = 0;
+  if (filters != NULL) {
+    for (int idx = 0; filters[idx].expr != NULL; idx++) {
+      siglen += strlen(filters[idx].expr) + 3;
+      count++;
+    }
+  }
+  char *signature = alloca(siglen * sizeof(char));
+  int pos = sprintf(signature, "%d", severity);
+  for (int idx = 0; idx < count; idx++)
+    pos += sprintf(signature + pos, "\n%d%s", filters[idx].enabled ? 1 : 0, filters[idx].expr);
+  if (set->signature != NULL && strcmp(set->signature, signature) == 0)
+    return false;
+
+  if (set->signature != NULL)
+    free(set->signature);
+  if (set->strings != NULL)
+    free(set->strings);
+  if (set->patterns != NULL)
+    free(set->patterns);
+  memset(set, 0, sizeof(FILTERSET));
+  set->signature = strdup(signature);
+  set->severity = severity;
+  if (count == 0)
+    return true;
+  set->strings = malloc(siglen * sizeof(char));
+  set->patterns = malloc(count * sizeof(STRPATTERN));
+  if (set->strings == NULL || set->patterns == NULL)
+    return true;  /* on memory failure, the filters are ignored */
+
+  /* the patterns are split in include and exclude patterns; an exclude
+     pattern starts with ~ or U+00AC (the "not sign") */
+  char *ptr = set->strings;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int idx = 0; idx < count; idx++) {
+      if (!filters[idx].enabled)
+        continue;
+      const char *expr = filters[idx].expr;
+      int csize = 0;
+      if (expr[0] == '~')
+        csize = 1;
+      else if (utf8_char(expr, &csize, NULL) != 0xac)
+        csize = 0;
+      if ((pass == 0) != (csize == 0))
+        continue; /* include patterns on the first pass, exclude patterns on the second */
+      strcpy(ptr, expr + csize);
+      if (strpattern_compile(&set->patterns[set->numinclude + set->numexclude], ptr)) {
+        if (pass == 0)
+          set->numinclude += 1;
+        else
+          set->numexclude += 1;
+      }
+      ptr += strlen(ptr) + 1;
+    }
+  }
+  return true;
+}
+
+/** filterset_match() checks whether a line passes the severity level and the
+ *  filters: it must match one of the include patterns (if there are any), and
+ *  it may not match any of the exclude patterns.
+ */
+static bool filterset_match(const FILTERSET *set, unsigned line)
+{
+  const LINECHUNK *chunk = LINE_CHUNK(line);
+  unsigned ci = LINE_INDEX(line);
+  if (chunk->severity[ci] < set->severity)
+    return false;
+  const char *text = chunk->text[ci];
+  int idx;
+  bool match = (set->numinclude == 0);
+  for (idx = 0; idx < set->numinclude && !match; idx++)
+    match = (strpattern_match(&set->patterns[idx], text, NULL) != NULL);
+  for ( ; idx < set->numinclude + set->numexclude && match; idx++)
+    match = (strpattern_match(&set->patterns[idx], text, NULL) == NULL);
+  return match;
+}
+
+static bool matchmap_grow(MATCHMAP *map, unsigned words)
+{
+  if (words <= map->size)
+    return true;
+  unsigned newsize = (map->size == 0) ? 256 : map->size;
+  while (newsize < words)
+    newsize *= 2;
+  uint64_t *bits = realloc(map->bits, newsize * sizeof(uint64_t));
+  if (bits == NULL)
+    return false;
+  map->bits = bits;
+  unsigned *rank = realloc(map->rank, newsize * sizeof(unsigned));
+  if (rank == NULL)
+    return false;
+  map->rank = rank;
+  map->size = newsize;
+  return true;
+}
+
+typedef struct tagMATCHJOB {
+  const FILTERSET *set;
+  MATCHMAP *map;
+  unsigned firstword, lastword; /* range of words to fill */
+  unsigned lines;               /* total number of lines to evaluate */
+} MATCHJOB;
+
+static int matchmap_worker(void *arg)
+{
+  MATCHJOB *job = (MATCHJOB*)arg;
+  for (unsigned word = job->firstword; word < job->lastword; word++) {
+    uint64_t bits = 0;
+    unsigned line = word << 6;
+    for (unsigned bit = 0; bit < 64 && line < job->lines; bit++, line++)
+      if (filterset_match(job->set, line))
+        bits |= (uint64_t)1 << bit;
+    job->map->bits[word] = bits;
+  }
+  return 0;
+}
+
+/** matchmap_rebuild() evaluates the filter set for the first "lines" lines in
+ *  the store. For a large store, the work is split over several threads.
+ */
+static void matchmap_rebuild(MATCHMAP *map, const FILTERSET *set, unsigned lines)
+{
+  map->words = map->scanned = map->count = 0;
+  unsigned words = (lines + 63) / 64;
+  if (!matchmap_grow(map, words))
+    return;
+
+  MATCHJOB jobs[MAX_WORKERS];
+  thrd_t threads[MAX_WORKERS];
+  int numjobs = (lines >= 65536) ? worker_count() : 1;
+  unsigned step = (words + numjobs - 1) / numjobs;
+  for (int idx = 0; idx < numjobs; idx++) {
+    jobs[idx].set = set;
+    jobs[idx].map = map;
+    jobs[idx].firstword = idx * step;
+    jobs[idx].lastword = (idx + 1) * step;
+    if (jobs[idx].lastword > words)
+      jobs[idx].lastword = words;
+    jobs[idx].lines = lines;
+  }
+  /* run the first job in this thread, run the remaining jobs in worker
+     threads (or in this thread too, if a thread cannot be created) */
+  bool started[MAX_WORKERS];
+  for (int idx = 1; idx < numjobs; idx++)
+    started[idx] = (thrd_create(&threads[idx], matchmap_worker, &jobs[idx]) == thrd_success);
+  matchmap_worker(&jobs[0]);
+  for (int idx = 1; idx < numjobs; idx++) {
+    if (started[idx])
+      thrd_join(threads[idx], NULL);
+    else
+      matchmap_worker(&jobs[idx]);
+  }
+
+  /* calculate the running count */
+  unsigned count = 0;
+  for (unsigned word = 0; word < words; word++) {
+    map->rank[word] = count;
+    count += POPCOUNT64(map->bits[word]);
+  }
+  map->words = words;
+  map->count = count;
+  map->scanned = lines;
+}
+
+/** matchmap_append() evaluates the filter set on the next line and adds the
+ *  result to the bitmap.
+ */
+static bool matchmap_append(MATCHMAP *map, const FILTERSET *set)
+{
+  unsigned line = map->scanned;
+  unsigned word = line >> 6;
+  if (word >= map->words) {
+    if (!matchmap_grow(map, word + 1))
+      return false;
+    map->bits[word] = 0;
+    map->rank[word] = map->count;
+    map->words = word + 1;
+  }
+  if (filterset_match(set, line)) {
+    map->bits[word] |= (uint64_t)1 << (line & 63);
+    map->count += 1;
+  }
+  map->scanned = line + 1;
+  return true;
+}
+
+/** matchmap_shift() drops the bits for lines that were evicted from the store.
+ *  Since lines are evicted in whole chunks, this drops whole words.
+ */
+static bool matchmap_shift(MATCHMAP *map, unsigned long long lines)
+{
+  if ((lines & 63) != 0 || lines > map->scanned)
+    return false;
+  unsigned drop = (unsigned)(lines >> 6);
+  unsigned base = (drop < map->words) ? map->rank[drop] : map->count;
+  map->words -= drop;
+  memmove(map->bits, map->bits + drop, map->words * sizeof(uint64_t));
+  for (unsigned word = 0; word < map->words; word++)
+    map->rank[word] = map->rank[word + drop] - base;
+  map->count -= base;
+  map->scanned -= (unsigned)lines;
+  return true;
+}
+
+/** tracelog_updatefilter() brings the filter set and the bitmap of the lines
+ *  that pass the filters up to date. It must be called with the trace strings
+ *  locked.
+ *
+ *  \return The number of rows to display. This may be one more than the count
+ *          in the bitmap, because the last line in the store may still be
+ *          incomplete; it is checked separately on each call.
+ */
+static unsigned tracelog_updatefilter(const TRACEFILTER *filters, int severity)
+{
+  FILTERSET *set = &tracelog_filterset;
+  MATCHMAP *map = &tracelog_matchmap;
+
+  /* the last line is only added to the bitmap when it is complete (which is
+     when it has the EOL flag, or when it is followed by another line) */
+  unsigned complete = tracestore.count;
+  if (complete > 0 && (LINE_CHUNK(complete - 1)->flags[LINE_INDEX(complete - 1)] & TSFLAG_EOL) == 0)
+    complete -= 1;
+
+  bool rebuild = filterset_compile(set, filters, severity) || map->generation != store_generation;
+  if (!rebuild && map->evicted != tracestore.evicted)
+    rebuild = !matchmap_shift(map, tracestore.evicted - map->evicted);
+  if (rebuild || map->scanned > complete) {
+    map->generation = store_generation;
+    matchmap_rebuild(map, set, complete);
+  }
+  map->evicted = tracestore.evicted;
+  while (map->scanned < complete)
+    if (!matchmap_append(map, set))
+      break;  /* try again on the next call */
+
+  unsigned rows = map->count;
+  if (map->scanned == complete && complete < tracestore.count && filterset_match(set, complete))
+    rows += 1;
+  return rows;
+}
+
+/** tracelog_rowline() returns the line number in the store for a row in the
+ *  list of lines that pass the filters.
+ */
+static unsigned tracelog_rowline(unsigned row)
+{
+  const MATCHMAP *map = &tracelog_matchmap;
+  if (row >= map->count)
+    return tracestore.count - 1;  /* the incomplete last line */
+  /* find the last word with a running count that is less or equal to the row */
+  unsigned low = 0, high = map->words;
+  while (high - low > 1) {
+    unsigned mid = (low + high) / 2;
+    if (map->rank[mid] <= row)
+      low = mid;
+    else
+      high = mid;
+  }
+  /* find the set bit in the word */
+  uint64_t bits = map->bits[low];
+  for (unsigned skip = row - map->rank[low]; skip > 0; skip--)
+    bits &= bits - 1;   /* clear lowest set bit */
+  assert(bits != 0);
+  return (low << 6) + CTZ64(bits);
+}
+
+/** tracelog_linerow() returns the row for a line in the store, or -1 if that
+ *  line does not pass the filters.
+ */
+static int tracelog_linerow(unsigned line, unsigned rowcount)
+{
+  const MATCHMAP *map = &tracelog_matchmap;
+  if (line >= map->scanned)
+    return (line == tracestore.count - 1 && rowcount > map->count) ? (int)map->count : -1;
+  unsigned word = line >> 6;
+  uint64_t mask = (uint64_t)1 << (line & 63);
+  if ((map->bits[word] & mask) == 0)
+    return -1;
+  return (int)(map->rank[word] + POPCOUNT64(map->bits[word] & (mask - 1)));
+}
+
 /** tracelog_widget() draws the text in the log window and scrolls to the last
  *  line if new text was added.
  *
@@ -1583,6 +5968,9 @@ float tracelog_labelwidth(float rowheight)
  *  \param severity     The severity level to filter at; only messages with
  *                      equal of higher severity pass through.
  *  \param widget_flags Additional flags, such as NK_WINDOW_BORDER.
+ *
+ *  \note Only the rows that are inside the viewport are laid out; the rows
+ *        above and below it are replaced by empty space.
  */
 void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, int limitlines,
                      int markline, const TRACEFILTER *filters, int severity, nk_flags widget_flags)
@@ -1599,92 +5987,109 @@ void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, in
 
   /* check the length of the longest channel name, and the longest timestamp */
   int labelwidth = (int)tracelog_labelwidth(rowheight) + 10;
-  int tstampwidth = 0;
-  TRACESTRING *item;
-  for (item = tracestring_root.next; item != NULL; item = item->next)
-    if (tstampwidth < item->timefmt_len)
-      tstampwidth = item->timefmt_len;
-  tstampwidth = (int)((tstampwidth * rowheight) / 2) + 10;
+  tracestring_lock();
+  int tstampwidth = (int)((store_timewidth() * rowheight) / 2) + 10;
+
+  /* get the rows to display: these are the lines that pass the filters, and
+     optionally only the last "limitlines" rows of these are shown */
+  unsigned rowcount = tracelog_updatefilter(filters, severity);
+  unsigned firstrow = 0;
+  if (limitlines > 0 && rowcount > (unsigned)limitlines)
+    firstrow = rowcount - limitlines;
+  int lines = (int)(rowcount - firstrow);
+
+  /* find the row of the active bookmark (if any) */
+  int bkmarkline = -1;
+  if (tracestore.activemark >= 0) {
+    int row = tracelog_linerow((unsigned)tracestore.activemark, rowcount);
+    if (row >= (int)firstrow)
+      bkmarkline = row - (int)firstrow;
+  }
+
+  /* calculate scrolling
+     1) if number of lines change, scroll to the last line
+     2) if line to mark is different than last time (and valid) make that
+        line visible */
+  static int recent_markline = -1;
+  static int scrollpos = 0;
+  static int linecount = 0;
+  float lineheight = rowheight + stwin->spacing.y;
+  int ypos = scrollpos;
+  int widgetlines = (int)((rcwidget.h - 2 * stwin->padding.y) / lineheight);
+  if (lines != linecount) {
+    linecount = lines;
+    ypos = (int)((lines - widgetlines + 1) * lineheight);
+  } else if (markline > 0 && markline != recent_markline) {
+    recent_markline = markline;
+    ypos = markline - widgetlines / 2;
+    if (ypos > lines - widgetlines + 1)
+      ypos = lines - widgetlines + 1;
+    ypos = (int)(ypos * lineheight);
+  } else if (bkmarkline >= 0 && bkmarkline != recent_markline) {
+    recent_markline = bkmarkline;
+    ypos = bkmarkline - widgetlines / 2;
+    if (ypos > lines - widgetlines + 1)
+      ypos = lines - widgetlines + 1;
+    ypos = (int)(ypos * lineheight);
+  }
+  if (ypos < 0)
+    ypos = 0;
+  if (ypos != scrollpos) {
+    nk_group_set_scroll(ctx, id, 0, ypos);
+    scrollpos = ypos;
+  }
+  if (bkmarkline < 0 && markline < 0)
+    recent_markline = -1;
+
+  /* get the range of rows that are visible */
+  nk_uint xscroll, yscroll;
+  nk_group_get_scroll(ctx, id, &xscroll, &yscroll);
+  int toprow = (int)(yscroll / lineheight);
+  if (toprow > lines)
+    toprow = lines;
+  int bottomrow = toprow + widgetlines + 2;
+  if (bottomrow > lines)
+    bottomrow = lines;
 
   /* (near) black background on group */
   nk_style_push_color(ctx, &stwin->fixed_background.data.color, COLOUR_BG0);
   if (nk_group_begin(ctx, id, widget_flags)) {
-    static int recent_markline = -1;
-    static int scrollpos = 0;
-    static int linecount = 0;
-    static int skiplines = 0;
-    if (limitlines < 0)
-      skiplines = 0;
-    int skip = skiplines;
-    int bkmarkline = -1;
-    int lines = 0;
-    float lineheight = 0;
-    for (item = tracestring_root.next; item != NULL; item = item->next) {
-      assert(item->text != NULL);
-      if (skip > 0) {
-        skip -= 1;
-        continue;
-      }
-      if (item->severity < severity)
-        continue;
-      if (filters != NULL && filters[0].expr != NULL && filters[0].enabled) {
-        /* check filters (first count how many there are) */
-        int idx, count_enabled;
-        bool match = true;  /* preset to "match all except inverted filters" */
-        for (idx = count_enabled = 0; filters[idx].expr != NULL; idx++) {
-          if (filters[idx].enabled) {
-            count_enabled += 1;
-            if (!(filters[idx].expr[0] == '~' || utf8_char(filters[idx].expr, NULL, NULL) == '\xac')) // U+00AC = "not sign"
-              match = false;  /* valid non-inverted filter, switch to "match only filters" */
-          }
-        }
-        /* check normal filters */
-        if (!match) {
-          for (idx = 0; filters[idx].expr != NULL && !match; idx++)
-            if (filters[idx].enabled && !(filters[idx].expr[0] == '~' || utf8_char(filters[idx].expr, NULL, NULL) == '\xac'))
-              match = (strmatch(filters[idx].expr, item->text, NULL) != NULL);
-        }
-        /* check inverted filters */
-        if (match) {
-          for (idx = 0; filters[idx].expr != NULL && match; idx++) {
-            int csize = 1;
-            if (filters[idx].enabled && (filters[idx].expr[0] == '~' || utf8_char(filters[idx].expr, &csize, NULL) == '\xac'))
-              match = (strmatch(filters[idx].expr + csize, item->text, NULL) == NULL);
-          }
-        }
-        if (!match)
-          continue; /* text matches none of the normal filters, or matches one of the inverted filters -> skip it */
-      }
+    if (toprow > 0) {
+      nk_layout_row_dynamic(ctx, toprow * lineheight - stwin->spacing.y, 1);
+      nk_spacing(ctx, 1);
+    }
+    for (int row = toprow; row < bottomrow; row++) {
+      unsigned line = tracelog_rowline(firstrow + row);
+      LINECHUNK *chunk = LINE_CHUNK(line);
+      unsigned ci = LINE_INDEX(line);
+      const char *text = chunk->text[ci];
+      unsigned char linesev = chunk->severity[ci];
+      unsigned char channel = chunk->channel[ci];
       nk_layout_row_begin(ctx, NK_STATIC, rowheight, 4);
-      if (lineheight <= 0.1) {
-        struct nk_rect rcline = nk_layout_widget_bounds(ctx);
-        lineheight = rcline.h;
-      }
       struct nk_color clrtxt = COLOUR_TEXT;
-      if (item->severity != 1) {
-        struct nk_color bkgnd = severity_bkgnd(item->severity);
+      if (linesev != 1) {
+        struct nk_color bkgnd = severity_bkgnd(linesev);
         clrtxt = CONTRAST_COLOUR(bkgnd);
         nk_layout_row_background(ctx, bkgnd);
       }
       /* marker & bookmark symbols */
       nk_layout_row_push(ctx, rowheight); /* width is same as height*/
-      if (lines == markline) {
+      if (row == markline) {
         stbtn.normal.data.color = stbtn.hover.data.color
           = stbtn.active.data.color = stbtn.text_background
           = COLOUR_BG0;
         stbtn.text_normal = stbtn.text_active = stbtn.text_hover = COLOUR_FG_YELLOW;
         nk_button_symbol_styled(ctx, &stbtn, NK_SYMBOL_TRIANGLE_RIGHT);
-        if (item->severity == 1)
+        if (linesev == 1)
           clrtxt = COLOUR_FG_YELLOW;
       } else {
         enum nk_symbol_type sym;
         struct nk_color fgnd;
-        if ((item->flags & TSFLAG_BOOKMARK) != 0) {
+        if ((chunk->flags[ci] & TSFLAG_BOOKMARK) != 0) {
           sym = NK_SYMBOL_LINK;
-          if ((item->flags & TSFLAG_ACTIVEMARK) != 0) {
-            bkmarkline = lines;
+          if (row == bkmarkline) {
             fgnd = COLOUR_FG_YELLOW;
-            if (item->severity == 1)
+            if (linesev == 1)
               clrtxt = COLOUR_FG_YELLOW;
           } else {
             fgnd = COLOUR_FG_PURPLE;
@@ -1698,94 +6103,80 @@ void tracelog_widget(struct nk_context *ctx, const char *id, float rowheight, in
           = COLOUR_BG0;
         stbtn.text_normal = stbtn.text_active = stbtn.text_hover = fgnd;
         if (nk_button_symbol_styled(ctx, &stbtn, sym))
-          item->flags ^= TSFLAG_BOOKMARK;
+          store_togglebookmark(line);
       }
       /* channel label */
-      assert(item->channel_id < NUM_CHANNELS);
+      assert(channel < NUM_CHANNELS);
       stbtn.normal.data.color = stbtn.hover.data.color
         = stbtn.active.data.color = stbtn.text_background
-        = channels[item->channel_id].color;
+        = channels[channel].color;
       stbtn.text_normal = stbtn.text_active = stbtn.text_hover
-        = CONTRAST_COLOUR(channels[item->channel_id].color);
+        = CONTRAST_COLOUR(channels[channel].color);
       nk_layout_row_push(ctx, (float)labelwidth);
-      nk_button_label_styled(ctx, &stbtn, channels[item->channel_id].name);
+      nk_button_label_styled(ctx, &stbtn, channels[channel].name);
       /* timestamp (relative time since previous trace) */
       nk_layout_row_push(ctx, (float)tstampwidth);
       struct nk_rect tstamp_bounds = nk_widget_bounds(ctx);
       nk_fill_rect(&ctx->current->buffer, tstamp_bounds, 0, COLOUR_BG0);
-      nk_label_colored(ctx, item->timefmt, NK_TEXT_RIGHT, COLOUR_FG_AQUA);
+      nk_label_colored(ctx, store_timefmt(line), NK_TEXT_RIGHT, COLOUR_FG_AQUA);
       /* calculate size of the text */
       assert(font != NULL && font->width != NULL);
-      int textwidth = (int)font->width(font->userdata, font->height, item->text, item->length) + 10;
+      int textwidth = (int)font->width(font->userdata, font->height, text, chunk->length[ci]) + 10;
       nk_layout_row_push(ctx, (float)textwidth);
-      nk_text_colored(ctx, item->text, item->length, NK_TEXT_LEFT, clrtxt);
+      nk_text_colored(ctx, text, chunk->length[ci], NK_TEXT_LEFT, clrtxt);
       nk_layout_row_end(ctx);
-      lines++;
     }
-    if (limitlines > 0)
-      skiplines = (lines > limitlines) ? lines - limitlines : 0;
+    if (bottomrow < lines) {
+      nk_layout_row_dynamic(ctx, (lines - bottomrow) * lineheight - stwin->spacing.y, 1);
+      nk_spacing(ctx, 1);
+    }
     if (lines == 0 && statusmessage_root.next != NULL) {
-      for (item = statusmessage_root.next; item != NULL; item = item->next) {
+      for (STATUSMSG *item = statusmessage_root.next; item != NULL; item = item->next) {
         struct nk_color clr;
-        if (item->flags < 0)
+        if (item->code < 0)
           clr = COLOUR_FG_RED;
-        else if (item->channel_id == TRACESTATMSG_CTF)
+        else if (item->type == TRACESTATMSG_CTF)
           clr = COLOUR_FG_AQUA;
         else
           clr = COLOUR_FG_YELLOW;
         nk_layout_row_dynamic(ctx, rowheight, 1);
         nk_label_colored(ctx, item->text, NK_TEXT_LEFT, clr);
-        lines++;
       }
     } else {
       nk_layout_row_dynamic(ctx, rowheight, 1);
       nk_spacing(ctx, 1);
     }
     nk_group_end(ctx);
-    /* calculate scrolling
-       1) if number of lines change, scroll to the last line
-       2) if line to mark is different than last time (and valid) make that
-          line visible */
-    if (lineheight < 0.1)
-      lineheight = 1; /* only to avoid a division by zero (for the special case of 0 text lines */
-    int ypos = scrollpos;
-    int widgetlines = (int)((rcwidget.h - 2 * stwin->padding.y) / lineheight);
-    if (lines != linecount) {
-      linecount = lines;
-      ypos = (int)((lines - widgetlines + 1) * lineheight);
-    } else if (markline > 0 && markline != recent_markline) {
-      recent_markline = markline;
-      ypos = markline - widgetlines / 2;
-      if (ypos > lines - widgetlines + 1)
-        ypos = lines - widgetlines + 1;
-      ypos = (int)(ypos * lineheight);
-    } else if (bkmarkline >= 0 && bkmarkline != recent_markline) {
-      recent_markline = bkmarkline;
-      ypos = bkmarkline - widgetlines / 2;
-      if (ypos > lines - widgetlines + 1)
-        ypos = lines - widgetlines + 1;
-      ypos = (int)(ypos * lineheight);
-    }
-    if (ypos < 0)
-      ypos = 0;
-    if (ypos != scrollpos) {
-      nk_group_set_scroll(ctx, id, 0, ypos);
-      scrollpos = ypos;
-    }
-    if (bkmarkline < 0 && markline < 0)
-      recent_markline = -1;
   }
+  tracestring_unlock();
   nk_style_pop_color(ctx);
 }
 
 
-typedef struct tagTLMARK {
-  float pos;
-  int count;
-} TLMARK;
+/* The timeline keeps a pyramid of bucketed counts per channel. At each level
+   of the pyramid, the time axis is divided in buckets of a power-of-two width
+   (in seconds), and each non-empty bucket holds the count of messages and the
+   earliest and latest timestamp in it. A new message is added to all levels in
+   one go, so no rebuild is needed when messages arrive. The widget draws from
+   the level that matches the zoom factor, and only for the visible part of the
+   timeline. When zoomed in beyond the finest level, the widget draws from the
+   trace messages directly (which is fast, because few messages fall inside the
+   visible range at such zoom factors). */
+#define TL_MINLEVEL   (-14)     /* finest level: 2^-14 s = 61 us */
+#define TL_LEVELS     32        /* coarsest level: 2^17 s = 36 hours */
+
+typedef struct tagTLBUCKET {
+  double tmin;                  /* earliest timestamp in the bucket (relative to timeoffset) */
+  float span;                   /* latest timestamp minus earliest timestamp */
+  unsigned count;               /* number of messages in the bucket */
+} TLBUCKET;
+typedef struct tagTLLEVEL {
+  TLBUCKET *buckets;
+  size_t length, size;          /* number of entries & max. number of entries */
+  unsigned maxcount;            /* highest count of all buckets in this level */
+} TLLEVEL;
 typedef struct tagTIMELINE {
-  TLMARK *marks;
-  size_t length, size;  /* number of entries & max. number of entries */
+  TLLEVEL level[TL_LEVELS];
 } TIMELINE;
 
 #define EPSILON     0.001
@@ -1795,11 +6186,15 @@ typedef struct tagTIMELINE {
 static float mark_spacing = 100.0;              /* spacing between two mark_deltatime positions */
 static unsigned long mark_scale = MARK_SECOND;  /* 1 -> us, 1000 -> ms, 1000000 -> s, 60000000 -> min, etc. */
 static unsigned long mark_deltatime = 1;        /* in seconds / mark_scale */
-static TRACESTRING *tracestring_tail_prev = NULL;
+static unsigned tracestring_count_prev = 0;     /* number of trace lines at the last rebuild */
 static TIMELINE timeline[NUM_CHANNELS];
+static double timeline_bucketwidth[TL_LEVELS]; /* width of a bucket at each level, in seconds */
+static unsigned timeline_scanned = 0;           /* number of trace lines added to the timeline */
+static unsigned long long timeline_evicted = 0; /* lines evicted from the store when last updated */
+static unsigned timeline_generation = 0;        /* generation of the trace store */
+static double timeline_tmax = 0.0;              /* latest timestamp (relative to timeoffset) */
 static float timeline_maxpos = 0.0;             /* width of the timeline canvas */
 static double timeoffset = 0.0;                 /* timestamp of the first message */
-static int timeline_maxcount = 1;               /* count of traces that collapse on the same marker line on the timeline */
 static bool timeline_zoomfit = false;
 
 void timeline_getconfig(double *spacing, unsigned long *scale, unsigned long *delta)
@@ -1821,102 +6216,293 @@ void timeline_setconfig(double spacing, unsigned long scale, unsigned long delta
   }
 }
 
-/** timeline_rebuild() builds the data structure for the timeline from the
- *  trace messages.
- *
- *  \param limitlines   When set, consider only the final `limitlines` trace
- *                      messages. When -1, there is no limit.
- *
- *  \note Updates variables `timeline_maxpos`, `timeoffset` and
- *        `timeline_maxcount`.
+/** timeline_pixeltime() returns the time span of a pixel on the timeline, in
+ *  seconds.
  */
-void timeline_rebuild(int limitlines, bool zoomfit)
+static double timeline_pixeltime(void)
 {
-  static int skiplines = 0;
-  if (limitlines < 0)
-    skiplines = 0;
+  return (double)(mark_scale * mark_deltatime) / (mark_spacing * MARK_SECOND);
+}
 
-  timeline_maxpos = 0.0;  /* this variable is recalculated */
+static void timeline_clear(void)
+{
+  for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+    for (int lvl = 0; lvl < TL_LEVELS; lvl++) {
+      TLLEVEL *level = &timeline[chan].level[lvl];
+      if (level->buckets != NULL)
+        free((void*)level->buckets);
+      memset(level, 0, sizeof(TLLEVEL));
+    }
+  }
+  timeline_scanned = 0;
+  timeline_tmax = 0.0;
   timeoffset = 0.0;
-  timeline_maxcount = 1;
-  timeline_zoomfit = zoomfit;
+}
 
-  /* marks only get added, until the list is cleared completely */
-  if (tracestring_root.next == NULL) {
-    for (int chan = 0; chan < NUM_CHANNELS; chan++) {
-      if (timeline[chan].marks != NULL) {
-        free((void*)timeline[chan].marks);
-        timeline[chan].marks = NULL;
-        timeline[chan].length = timeline[chan].size = 0;
+/** timeline_addmark() adds a message at relative time "t" to all levels of
+ *  the pyramid of a channel. Messages normally arrive in chronological order,
+ *  and then they are either added to the last bucket of a level, or a new
+ *  bucket is appended.
+ */
+static void timeline_addmark(TIMELINE *tl, double t)
+{
+  for (int lvl = 0; lvl < TL_LEVELS; lvl++) {
+    TLLEVEL *level = &tl->level[lvl];
+    /* make sure array is big enough for another bucket */
+    assert(level->length <= level->size);
+    if (level->length == level->size) {
+      size_t newsize = (level->size == 0) ? 32 : 2 * level->size;
+      TLBUCKET *list = realloc(level->buckets, newsize * sizeof(TLBUCKET));
+      if (list != NULL) {
+        level->buckets = list;
+        level->size = newsize;
       }
     }
-    skiplines = 0;
-  } else {
-    assert(tracestring_root.next != NULL);
-    timeoffset = tracestring_root.next->timestamp;
-    int chan;
-    for (chan = 0; chan < NUM_CHANNELS; chan++)
-      timeline[chan].length = 0;
-    int skip = skiplines;
-    for (TRACESTRING *item = tracestring_root.next; item != NULL; item = item->next) {
-      int idx;
-      float pos;
-      chan = item->channel_id;
-      assert(chan >= 0 && chan < NUM_CHANNELS);
-      if (!channels[chan].enabled)
-        continue;
-      if (skip > 0) {
-        skip--;
+    double width = timeline_bucketwidth[lvl];
+    unsigned long long bucket = (unsigned long long)(t / width);
+    size_t pos = level->length;
+    if (pos > 0) {
+      unsigned long long last = (unsigned long long)(level->buckets[pos - 1].tmin / width);
+      if (last == bucket) {
+        pos -= 1;
+      } else if (last > bucket) {
+        /* out-of-order timestamp, find the bucket (or insertion point) */
+        size_t low = 0, high = level->length;
+        while (low < high) {
+          size_t mid = (low + high) / 2;
+          if ((unsigned long long)(level->buckets[mid].tmin / width) < bucket)
+            low = mid + 1;
+          else
+            high = mid;
+        }
+        pos = low;
+        assert(pos < level->length);
+        if ((unsigned long long)(level->buckets[pos].tmin / width) != bucket) {
+          if (level->length == level->size)
+            continue; /* no space for another bucket (growing the array failed) */
+          memmove(level->buckets + pos + 1, level->buckets + pos, (level->length - pos) * sizeof(TLBUCKET));
+          level->length += 1;
+          level->buckets[pos].tmin = t;
+          level->buckets[pos].span = 0.0f;
+          level->buckets[pos].count = 0;
+        }
+      }
+    }
+    if (pos == level->length) {
+      if (level->length == level->size)
+        continue; /* no space for another bucket (growing the array failed) */
+      level->buckets[pos].tmin = t;
+      level->buckets[pos].span = 0.0f;
+      level->buckets[pos].count = 0;
+      level->length = pos + 1;
+    }
+    TLBUCKET *item = &level->buckets[pos];
+    if (t < item->tmin) {
+      item->span += (float)(item->tmin - t);
+      item->tmin = t;
+    } else if (t - item->tmin > item->span) {
+      item->span = (float)(t - item->tmin);
+    }
+    item->count += 1;
+    if (item->count > level->maxcount)
+      level->maxcount = item->count;
+  }
+}
+
+/** timeline_trim() removes the buckets before relative time "t" from all
+ *  levels of all channels, so that the memory of the timeline stays bounded
+ *  when the oldest lines are evicted from the store. The bucket that holds
+ *  time "t" is kept.
+ */
+static void timeline_trim(double t)
+{
+  for (int chan = 0; chan < NUM_CHANNELS; chan++) {
+    for (int lvl = 0; lvl < TL_LEVELS; lvl++) {
+      TLLEVEL *level = &timeline[chan].level[lvl];
+      if (level->length == 0)
         continue;
+      double width = timeline_bucketwidth[lvl];
+      unsigned long long bucket = (unsigned long long)(t / width);
+      size_t low = 0, high = level->length;
+      while (low < high) {
+        size_t mid = (low + high) / 2;
+        if ((unsigned long long)(level->buckets[mid].tmin / width) < bucket)
+          low = mid + 1;
+        else
+          high = mid;
       }
-      /* make sure array is big enough for another mark */
-      assert(timeline[chan].length <= timeline[chan].size);
-      if (timeline[chan].length == timeline[chan].size) {
-        size_t newsize;
-        if (timeline[chan].marks == NULL) {
-          assert(timeline[chan].size == 0);
-          newsize = 32;
-          timeline[chan].marks = malloc(newsize * sizeof(TLMARK));
-          if (timeline[chan].marks != NULL)
-            timeline[chan].size = newsize;
-        } else {
-          TLMARK *curptr = timeline[chan].marks; /* save, for special case of realloc fail */
-          newsize = timeline[chan].size * 2;
-          timeline[chan].marks = realloc(timeline[chan].marks, newsize * sizeof(TLMARK));
-          if (timeline[chan].marks != NULL)
-            timeline[chan].size = newsize;
-          else
-            timeline[chan].marks = curptr;  /* restore old pointer on realloc fail */
+      if (low == 0)
+        continue;
+      level->length -= low;
+      memmove(level->buckets, level->buckets + low, level->length * sizeof(TLBUCKET));
+      level->maxcount = 0;
+      for (size_t idx = 0; idx < level->length; idx++)
+        if (level->buckets[idx].count > level->maxcount)
+          level->maxcount = level->buckets[idx].count;
+      /* give memory back after a burst */
+      if (level->size > 32 && level->length < level->size / 4) {
+        size_t newsize = level->size / 2;
+        TLBUCKET *list = realloc(level->buckets, newsize * sizeof(TLBUCKET));
+        if (list != NULL) {
+          level->buckets = list;
+          level->size = newsize;
         }
       }
-      if (timeline[chan].length == timeline[chan].size)
-        continue; /* no space for another mark (growing the array failed) */
-      /* convert timestamp to position */
-      pos = (item->timestamp - timeoffset) * mark_spacing * MARK_SECOND / (mark_scale * mark_deltatime);
-      idx = timeline[chan].length;
-      /* check collapsing marks */
-      assert(idx == 0 || pos >= timeline[chan].marks[idx - 1].pos);
-      if (idx > 0 && (pos - timeline[chan].marks[idx - 1].pos) < 0.5) {
-        idx -= 1;
-        timeline[chan].marks[idx].count += 1;
-        if (timeline[chan].marks[idx].count > timeline_maxcount)
-          timeline_maxcount = timeline[chan].marks[idx].count;
-      } else {
-        timeline[chan].marks[idx].pos = pos;
-        timeline[chan].marks[idx].count = 1;
-        timeline[chan].length = idx + 1;
+    }
+  }
+}
+
+/** timeline_update() adds the trace messages that arrived since the previous
+ *  call to the timeline. It must be called with the trace strings locked.
+ */
+static void timeline_update(void)
+{
+  if (timeline_bucketwidth[0] <= 0.0) {
+    double width = 1.0;
+    for (int lvl = 0; lvl > TL_MINLEVEL; lvl--)
+      width /= 2.0;
+    for (int lvl = 0; lvl < TL_LEVELS; lvl++) {
+      timeline_bucketwidth[lvl] = width;
+      width *= 2.0;
+    }
+  }
+
+  /* marks get added until the list is cleared completely; when lines are
+     evicted from the store (on a retention limit), the buckets before the
+     oldest remaining line are dropped */
+  if (timeline_generation != store_generation) {
+    timeline_clear();
+    timeline_generation = store_generation;
+    timeline_evicted = tracestore.evicted;
+  } else if (timeline_evicted != tracestore.evicted) {
+    unsigned long long shift = tracestore.evicted - timeline_evicted;
+    timeline_scanned = (timeline_scanned > shift) ? timeline_scanned - (unsigned)shift : 0;
+    timeline_evicted = tracestore.evicted;
+    if (tracestore.count > 0)
+      timeline_trim(LINE_CHUNK(0)->timestamp[LINE_INDEX(0)] - timeoffset);
+  }
+  if (timeline_scanned > tracestore.count)
+    timeline_clear();
+  if (timeline_scanned == 0 && tracestore.count > 0)
+    timeoffset = tracestore.starttime;
+  while (timeline_scanned < tracestore.count) {
+    unsigned line = timeline_scanned++;
+    const LINECHUNK *chunk = LINE_CHUNK(line);
+    unsigned idx = LINE_INDEX(line);
+    int chan = chunk->channel[idx];
+    assert(chan >= 0 && chan < NUM_CHANNELS);
+    double t = chunk->timestamp[idx] - timeoffset;
+    if (t < 0.0)
+      t = 0.0;
+    timeline_addmark(&timeline[chan], t);
+    if (t > timeline_tmax)
+      timeline_tmax = t;
+  }
+}
+
+/** timeline_rebuild() updates the data structure for the timeline from the
+ *  trace messages, and recalculates the size of the timeline canvas (after a
+ *  change in the zoom factor).
+ *
+ *  \param limitlines   When set, consider only the final `limitlines` trace
+ *                      messages. When -1, there is no limit. (The limit is
+ *                      applied when drawing the timeline.)
+ *  \param zoomfit      Adjust the zoom factor so that the full timeline fits
+ *                      the widget.
+ *
+ *  \note Updates variables `timeline_maxpos` and `timeoffset`.
+ */
+void timeline_rebuild(int limitlines, bool zoomfit)
+{
+  (void)limitlines;
+  timeline_zoomfit = zoomfit;
+
+  tracestring_lock();
+  tracestring_count_prev = tracestore.count;
+  timeline_update();
+  timeline_maxpos = (float)(timeline_tmax / timeline_pixeltime());
+  tracestring_unlock();
+}
+
+/** timeline_drawchannel() draws the marks for a channel in the visible range
+ *  of the timeline. It must be called with the trace strings locked.
+ *
+ *  \param buffer     The command buffer of the Nuklear window.
+ *  \param chan       The channel.
+ *  \param lvl        The level in the pyramid to draw from, or -1 to draw
+ *                    from the trace messages directly.
+ *  \param tfirst     The start of the time range to draw (relative time).
+ *  \param tlast      The end of the time range to draw (relative time).
+ *  \param rc         The bounding box of the row of the channel.
+ *  \param xbase      The horizontal offset for relative time 0.
+ *  \param rowheight  The height of a row.
+ *  \param maxcount   The count at which a mark has full height.
+ */
+static void timeline_drawchannel(struct nk_command_buffer *buffer, int chan, int lvl,
+                                 double tfirst, double tlast, struct nk_rect rc,
+                                 float xbase, float rowheight, unsigned maxcount)
+{
+  double pixeltime = timeline_pixeltime();
+  long curpixel = -1;
+  unsigned count = 0;
+  size_t idx;
+
+# define FLUSH_MARK()                                                       \
+    if (count > 0) {                                                        \
+      float x = curpixel + xbase;                                           \
+      float y = (count >= maxcount) ? 0.0f                                  \
+                : 0.75f * rowheight * (1 - (float)count / (float)maxcount); \
+      nk_stroke_line(buffer, x, rc.y + y, x, rc.y + rowheight, 1, COLOUR_TEXT); \
+    }
+
+  if (lvl >= 0) {
+    const TLLEVEL *level = &timeline[chan].level[lvl];
+    /* binary search for the first bucket that ends at or after tfirst */
+    size_t low = 0, high = level->length;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (level->buckets[mid].tmin + level->buckets[mid].span < tfirst)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    for (idx = low; idx < level->length && level->buckets[idx].tmin <= tlast; idx++) {
+      long pixel = (long)(level->buckets[idx].tmin / pixeltime);
+      if (pixel != curpixel) {
+        FLUSH_MARK();
+        curpixel = pixel;
+        count = 0;
       }
-      if (pos > timeline_maxpos)
-        timeline_maxpos = pos;
+      count += level->buckets[idx].count;
     }
-    if (limitlines > 0) {
-      /* count all marks, increase the number of traces to skip, if needed */
-      size_t total = 0;
-      for (int chan = 0; chan < NUM_CHANNELS; chan++)
-        total += timeline[chan].length;
-      skiplines = (total > limitlines) ? total - limitlines : 0;
+  } else {
+    /* binary search for the first trace message at or after tfirst */
+    unsigned low = 0, high = timeline_scanned;
+    while (low < high) {
+      unsigned mid = (low + high) / 2;
+      if (LINE_CHUNK(mid)->timestamp[LINE_INDEX(mid)] - timeoffset < tfirst)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    for (unsigned line = low; line < timeline_scanned; line++) {
+      const LINECHUNK *chunk = LINE_CHUNK(line);
+      double t = chunk->timestamp[LINE_INDEX(line)] - timeoffset;
+      if (t > tlast)
+        break;
+      if (chunk->channel[LINE_INDEX(line)] != chan)
+        continue;
+      long pixel = (long)(t / pixeltime);
+      if (pixel != curpixel) {
+        FLUSH_MARK();
+        curpixel = pixel;
+        count = 0;
+      }
+      count += 1;
     }
   }
+  FLUSH_MARK();
+# undef FLUSH_MARK
 }
 
 /** timeline_zoom() recalculates the timeline zoom variables.
@@ -1958,10 +6544,11 @@ double timeline_widget(struct nk_context *ctx, const char *id, float rowheight,
   if (ctx == NULL || ctx->current == NULL || ctx->current->layout == NULL)
     return click_time;
 
-  if (tracestring_tail != tracestring_tail_prev) {
+  tracestring_lock();
+  bool rebuild = (tracestore.count != tracestring_count_prev || store_generation != timeline_generation);
+  tracestring_unlock();
+  if (rebuild)
     timeline_rebuild(limitlines, false); /* new data arrived, rebuild the "trace marks" data */
-    tracestring_tail_prev = tracestring_tail;
-  }
 
   /* preset common parts of the new button style */
   struct nk_style_button stbtn = ctx->style.button;
@@ -2091,10 +6678,28 @@ double timeline_widget(struct nk_context *ctx, const char *id, float rowheight,
     nk_layout_row_push(ctx, rcwidget.w - labelwidth - HORPADDING);
     sprintf(valstr, "%s_graph", id);
     if (nk_group_begin(ctx, valstr, 0)) {
-      /* graphs */
+      /* graphs: select the level in the pyramid where a bucket is at most one
+         pixel wide, and get the visible time range */
+      double pixeltime = timeline_pixeltime();
+      int lvl;
+      for (lvl = TL_LEVELS - 1; lvl >= 0 && timeline_bucketwidth[lvl] > pixeltime; lvl--)
+        {}
+      tracestring_lock();
+      timeline_update();
+      unsigned maxcount = 1;
+      for (int chan = 0; chan < NUM_CHANNELS; chan++)
+        if (channels[chan].enabled && timeline[chan].level[(lvl >= 0) ? lvl : 0].maxcount > maxcount)
+          maxcount = timeline[chan].level[(lvl >= 0) ? lvl : 0].maxcount;
+      double tfirst = (xscroll - 2 * HORPADDING) * pixeltime;
+      double tlast = (xscroll + rcwidget.w) * pixeltime;
+      if (limitlines > 0 && tracestore.count > (unsigned)limitlines) {
+        unsigned line = tracestore.count - limitlines;
+        double tlimit = LINE_CHUNK(line)->timestamp[LINE_INDEX(line)] - timeoffset;
+        if (tfirst < tlimit)
+          tfirst = tlimit;
+      }
       int row = 0;
       for (int chan = 0; chan < NUM_CHANNELS; chan++) {
-        int idx;
         if (!channels[chan].enabled)
           continue; /* only draw enabled channels */
         nk_layout_row_begin(ctx, NK_STATIC, rowheight + VERPADDING, 2);
@@ -2105,11 +6710,8 @@ double timeline_widget(struct nk_context *ctx, const char *id, float rowheight,
           nk_fill_rect(&win->buffer, rc, 0.0f, COLOUR_BG0_S);
         row++;
         /* draw marks for each active channel */
-        for (idx = 0; idx < (int)timeline[chan].length; idx++) {
-          float x = timeline[chan].marks[idx].pos + labelwidth + 2 * HORPADDING - xscroll;
-          float y = 0.75f * rowheight * (1 - (float)timeline[chan].marks[idx].count / (float)timeline_maxcount);
-          nk_stroke_line(&win->buffer, x, rc.y + y, x, rc.y + rowheight, 1, COLOUR_TEXT);
-        }
+        timeline_drawchannel(&win->buffer, chan, lvl, tfirst, tlast, rc,
+                             (float)labelwidth + 2 * HORPADDING - xscroll, rowheight, maxcount);
         nk_spacing(ctx, 1);
         nk_layout_row_end(ctx);
         /* handle mouse click in timeline, to scroll the trace view */
@@ -2120,9 +6722,10 @@ double timeline_widget(struct nk_context *ctx, const char *id, float rowheight,
           assert(NK_INBOX(mouse->pos.x, mouse->pos.y, rc.x, rc.y, rc.w, rc.h));
           pos = mouse->pos.x - labelwidth - 2 * HORPADDING + xscroll;
           if (pos >= 0.0)
-            click_time = pos * (mark_scale * mark_deltatime) / (mark_spacing * MARK_SECOND) + timeoffset;
+            click_time = pos * pixeltime + timeoffset;
         }
       }
+      tracestring_unlock();
       nk_group_end(ctx);
     }
     nk_layout_row_end(ctx);
@@ -2155,3 +6758,4 @@ double timeline_widget(struct nk_context *ctx, const char *id, float rowheight,
   return click_time;
 }
 
+#endif /* NO_GUI */
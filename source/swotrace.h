@@ -19,9 +19,12 @@
 #define _SWOTRACE_H
 
 #include <stdbool.h>
+#include <stdio.h>
 #include "nuklear.h"
 
 #define NUM_CHANNELS  32  /* number of SWO channels */
+#define TRACE_MAXPROBES 4 /* max. number of simultaneously captured probes */
+#define TRACE_DAEMON_PORT 2170  /* default TCP port of the capture daemon (local host) */
 
 enum {
   TRACESTAT_OK = 0,
@@ -34,6 +37,7 @@ enum {
   TRACESTAT_INIT_FAILED,  /* WunUSB / libusb initialization failed */
   TRACESTAT_NO_CONNECT,   /* Failed to connect to Black Magic Probe */
   TRACESTAT_NOT_INIT,     /* not yet initialized */
+  TRACESTAT_NO_MEMORY,    /* insufficient memory for the packet queue */
 };
 
 enum {
@@ -41,6 +45,88 @@ enum {
   TRACESTATMSG_CTF,
 };
 
+typedef struct tagTRACEQUEUESTATS {
+  size_t size;                  /* size of the packet queue, in bytes */
+  size_t fill;                  /* current fill level of the queue, in bytes */
+  size_t highwater;             /* maximum fill level, in bytes */
+  unsigned long packets;        /* number of packets stored in the queue */
+  unsigned long long bytes;     /* number of data bytes stored in the queue */
+  unsigned long dropped;        /* number of packets dropped (queue full) */
+  unsigned long long dropped_bytes; /* number of data bytes dropped */
+} TRACEQUEUESTATS;
+
+typedef struct tagTRACERECORDING {
+  unsigned long bitrate;        /* SWO bitrate at the time of recording (0 = unknown) */
+  short datasize;               /* ITM data size in bytes (0 = auto) */
+  unsigned long tsdlhash;       /* hash of the TSDL file (0 = none), see trace_tsdlhash() */
+  unsigned long long created;   /* time of recording, in seconds since the epoch */
+  double walloffset;            /* wall clock time minus host timestamp (0 = unknown) */
+} TRACERECORDING;
+
+typedef struct tagTRACEITMSTATS {
+  unsigned long syncs;          /* synchronization packets */
+  unsigned long overflows;      /* ITM overflow packets */
+  unsigned long timestamps;     /* local timestamp packets */
+  unsigned long delayed;        /* local timestamps that are not synchronous to the data */
+  unsigned long globalstamps;   /* global timestamp packets (GTS1 and GTS2) */
+  unsigned long swit;           /* instrumentation packets */
+  unsigned long exceptions;     /* exception trace packets */
+  unsigned long pcsamples;      /* periodic PC samples (including sleep samples) */
+  unsigned long datatrace;      /* data trace packets (PC, address and value) */
+  unsigned long other;          /* extension packets and unknown hardware sources */
+  unsigned long invalid;        /* reserved headers (out of sync) */
+  unsigned long eventwraps[6];  /* DWT counter wrap-arounds: CPI, Exc, Sleep, LSU, Fold, Cyc */
+  unsigned long long localtime; /* accumulated local timestamp, in timestamp clock ticks */
+  unsigned long long globaltime;/* most recent global timestamp */
+  unsigned long chanpackets[NUM_CHANNELS];    /* number of software trace packets per channel */
+  unsigned long long chanbytes[NUM_CHANNELS]; /* number of payload bytes per channel */
+} TRACEITMSTATS;
+
+typedef struct tagTRACEHEALTH {
+  double timestamp;             /* host time of the sample */
+  double interval;              /* time since the previous sample, in seconds */
+  /* probe & USB */
+  double inputrate;             /* bytes per second received from the probe */
+  unsigned long captureerrors;  /* failed reads from the probe */
+  unsigned long reconnects;     /* connections to a network probe that were re-established */
+  /* packet queue */
+  size_t queuesize;             /* size of the packet queue, in bytes */
+  size_t queuefill;             /* current fill level, in bytes */
+  size_t queuepeak;             /* maximum fill level (since the queue statistics were reset) */
+  unsigned long dropped;        /* packets dropped because the queue was full */
+  /* ITM stream */
+  unsigned long itmoverflows;   /* overflow packets: the target dropped data */
+  unsigned long invalid;        /* invalid ITM headers (the stream was out of sync) */
+  int packeterrors;             /* packets with an unexpected size, see trace_getpacketerrors() */
+  /* decoder */
+  double decodeload;            /* fraction of the time spent decoding */
+  double latency;               /* average time between capture and decoding, in seconds */
+  double maxlatency;            /* maximum time between capture and decoding, in seconds */
+  /* per ITM channel */
+  double byterate[NUM_CHANNELS];  /* payload bytes per second */
+  double packetrate[NUM_CHANNELS];/* software trace packets per second */
+  unsigned long ctferrors[NUM_CHANNELS]; /* CTF decoding errors per stream */
+  /* GUI (filled in by the application, zero if not used) */
+  double framedecode;           /* time per frame spent in decoding, in seconds */
+  double framerender;           /* time per frame spent in rendering, in seconds */
+} TRACEHEALTH;
+
+typedef struct tagTRACESTORESTATS {
+  unsigned lines;               /* number of lines in the store */
+  size_t memsize;               /* memory allocated for the lines, in bytes */
+  unsigned long long evicted;   /* number of lines removed by the retention limit */
+  unsigned long long spilled;   /* number of evicted lines written to the spill file */
+} TRACESTORESTATS;
+
+typedef struct tagTRACELINE {
+  const char *text;             /* zero-terminated */
+  unsigned length;              /* text length in bytes */
+  double timestamp;             /* in seconds */
+  int channel;                  /* channel number (or CTF stream id) */
+  int severity;                 /* CTF severity level (0 for plain text) */
+  bool complete;                /* false if text may still be appended to the line */
+} TRACELINE;
+
 typedef struct tagTRACEFILTER {
   char *expr;
   int enabled;
@@ -50,6 +136,19 @@ typedef struct tagTRACEFILTER {
 #define Address2Index(address, base)  (((address) - (base)) / ADDRESS_ALIGN)
 #define Index2Address(index, base)    ((index) * ADDRESS_ALIGN + (base))
 
+#define SAMPLEMAP_BINSETS 2     /* number of independent sets of bins in a sample map */
+
+typedef struct tagSAMPLEMAP SAMPLEMAP;
+typedef struct tagSAMPLEITER {
+  unsigned segment;
+  unsigned index;
+} SAMPLEITER;
+typedef struct tagSAMPLEBIN {
+  uint32_t low;                 /* first address of the range */
+  uint32_t high;                /* address just beyond the range */
+  unsigned id;                  /* index of the counter for this range */
+} SAMPLEBIN;
+
 void channel_set(int index, bool enabled, const char *name, struct nk_color color);
 bool channel_getenabled(int index);
 void channel_setenabled(int index, bool enabled);
@@ -59,23 +158,60 @@ struct nk_color channel_getcolor(int index);
 void channel_setcolor(int index, struct nk_color color);
 
 int  trace_init(unsigned short endpoint, const char *ipaddress);
+int  trace_initloopback(const char *filename, unsigned long bitrate, bool repeat);
+int  trace_initprobe(int index, int seqnr, unsigned short endpoint, const char *ipaddress);
+int  trace_initprobeloopback(int index, const char *filename, unsigned long bitrate, bool repeat);
+int  trace_initdaemon(unsigned short port);
+int  trace_initprobedaemon(int index, unsigned short port);
+void trace_setprobechannels(int index, int chanbase);
+void trace_setcapture(int transfers, size_t xfersize);
 void trace_close(void);
+void trace_closeprobe(int index);
 bool trace_isopen(void);
+bool trace_endofdata(void);
 unsigned long trace_errno(int *loc);
 int  trace_overflowerrors(bool reset);
+bool trace_setqueuesize(size_t size);
+void trace_queuestats(TRACEQUEUESTATS *stats, bool reset);
+
+bool trace_recordstart(const char *filename, const TRACERECORDING *info);
+unsigned long trace_recordstop(void);
+bool trace_recordactive(void);
+bool trace_recordinfo(const char *filename, TRACERECORDING *info);
+size_t trace_recordheader(unsigned char *buffer, size_t size, const TRACERECORDING *info);
+size_t trace_recordframe(unsigned char *buffer, size_t size, size_t length, double timestamp);
+unsigned long trace_tsdlhash(const char *filename);
 
 void trace_setdatasize(short size);
 short trace_getdatasize();
 int  trace_getpacketerrors(bool reset);
+void trace_settimestampclock(unsigned long frequency);
+void trace_setbitrate(unsigned long bitrate);
+void trace_itmstats(TRACEITMSTATS *stats, bool reset);
+bool trace_setfastpath(bool enable);
+void trace_health(TRACEHEALTH *health);
+bool trace_healthjson(FILE *fp, const TRACEHEALTH *health);
+
+void tracestring_lock(void);
+void tracestring_unlock(void);
+bool trace_decodethread(bool start);
 
 void tracestring_clear(void);
 bool tracestring_isempty(void);
 unsigned tracestring_count(void);
+bool tracestring_getline(unsigned line, TRACELINE *info);
+void tracestring_purge(void);
+bool tracestring_setretention(unsigned maxlines, size_t maxbytes, const char *spillfile);
+void tracestring_storestats(TRACESTORESTATS *stats);
 int  tracestring_process(bool enabled);
+int  tracestring_decodebuffer(const unsigned char *data, size_t length, double timestamp);
 int  tracestring_load(const char *filename, int *format);
 int  tracestring_save(const char *filename);
+bool tracestring_savestart(const char *filename);
+int  tracestring_savestatus(bool *done);
 const char *trace_channelname(int id);
 int  tracestring_find(const char *text, int curline);
+int  tracestring_findcount(bool *complete);
 int  tracestring_findtimestamp(double timestamp);
 
 int  tracestring_findbookmark(int action);
@@ -85,7 +221,19 @@ enum {
   BK_CLEAR,
 };
 
-int  traceprofile_process(bool enabled, unsigned *sample_map, uint32_t code_base, uint32_t code_top, unsigned *overflow);
+SAMPLEMAP *samplemap_create(void);
+void samplemap_destroy(SAMPLEMAP *map);
+bool samplemap_addrange(SAMPLEMAP *map, uint32_t base, uint32_t top);
+void samplemap_clear(SAMPLEMAP *map);
+void samplemap_add(SAMPLEMAP *map, uint32_t address, unsigned count);
+unsigned samplemap_unknown(const SAMPLEMAP *map);
+unsigned samplemap_total(const SAMPLEMAP *map);
+bool samplemap_setbins(SAMPLEMAP *map, int set, const SAMPLEBIN *bins, unsigned count, unsigned numids);
+const unsigned *samplemap_bincounts(const SAMPLEMAP *map, int set, unsigned *unbinned);
+bool samplemap_next(const SAMPLEMAP *map, SAMPLEITER *iter, uint32_t *address, unsigned *count);
+
+int  traceprofile_process(bool enabled, SAMPLEMAP *map, unsigned *overflow);
+size_t trace_readraw(unsigned char *buffer, size_t size, double *timestamp);
 
 void tracelog_statusmsg(int type, const char *msg, int code);
 void tracelog_statusclear(void);
@@ -101,5 +249,6 @@ double timeline_widget(struct nk_context *ctx, const char *id, float rowheight,
                        int limitlines, nk_flags widget_flags);
 
 double get_timestamp(void);
+double trace_walltime(double timestamp);
 
 #endif /* _SWOTRACE_H */
@@ -0,0 +1,21 @@
+/*
+ * The SWO trace support without the GUI widgets (trace view and timeline),
+ * for command-line utilities. It is the same source file as for bmtrace and
+ * bmdebug, compiled with NO_GUI defined.
+ *
+ * Copyright 2024 CompuPhase
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define NO_GUI
+#include "swotrace.c"